@@ -0,0 +1,801 @@
+#ifndef KM_ARROW_H
+#define KM_ARROW_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/types.h>
+
+#include "km_kernels.h"
+
+// Apache Arrow IPC output (--format arrow|arrow-stream) and input (detected) of
+// k-mer matrices, without the Arrow library: the flatbuffers of the messages
+// are built and read by hand.
+//
+// A matrix is a table with a non-nullable uint64 column "kmer" holding the k-mer
+// packed by km_pack (k <= 32), and one uint32 column per sample ("sample_1",
+// ...). The schema metadata gives "ksize" and "order" (lexicographic or kmtricks),
+// so that the k-mers can be unpacked. Each record batch holds a block of rows:
+// a chunk for the chunk engine, about KM_ARROW_BATCH_BYTES of text otherwise.
+//
+// Input in Arrow format, as a file or a stream, is converted back to text lines
+// by a thread writing to a pipe, which the tools read as any text matrix. The
+// k-mer column may also be a string column and counts any integer column.
+
+#define KM_OPT_FORMAT 258
+#define KM_ARROW_BATCH_BYTES (4UL<<20)
+
+typedef enum { KM_FORMAT_TEXT, KM_FORMAT_ARROW, KM_FORMAT_ARROW_STREAM } km_format_t;
+
+// Parses the argument of --format, returns -1 on unknown format.
+static inline int km_format(const char *arg) {
+  if(strcmp(arg,"text") == 0) { return KM_FORMAT_TEXT; }
+  if(strcmp(arg,"arrow") == 0) { return KM_FORMAT_ARROW; }
+  if(strcmp(arg,"arrow-stream") == 0) { return KM_FORMAT_ARROW_STREAM; }
+  return -1;
+}
+
+// Arrow format constants (Schema.fbs, Message.fbs)
+#define KM_ARROW_V5 4
+#define KM_ARROW_SCHEMA 1
+#define KM_ARROW_DICTIONARY_BATCH 2
+#define KM_ARROW_RECORD_BATCH 3
+#define KM_ARROW_TYPE_INT 2
+#define KM_ARROW_TYPE_BINARY 4
+#define KM_ARROW_TYPE_UTF8 5
+#define KM_ARROW_CONTINUATION 0xFFFFFFFFU
+
+static const char km_arrow_magic[8] = { 'A', 'R', 'R', 'O', 'W', '1', 0, 0 };
+
+static inline size_t km_arrow_pad8(size_t n) { return (n + 7) & ~(size_t)7; }
+
+// --- flatbuffer builder, front to back: a table precedes its children, which
+// are written afterwards and patched into its offset fields
+
+typedef struct {
+  char *buf;
+  size_t len, cap;
+} km_fb_t;
+
+static void km_fb_put(km_fb_t *fb, const void *p, size_t n) {
+  if(fb->len + n > fb->cap) {
+    fb->cap = fb->len + n > 2*fb->cap ? fb->len + n : 2*fb->cap;
+    fb->buf = (char *)realloc(fb->buf, fb->cap);
+  }
+  if(p) { memcpy(fb->buf + fb->len, p, n); } else { memset(fb->buf + fb->len, 0, n); }
+  fb->len += n;
+}
+
+static size_t km_fb_align(km_fb_t *fb, size_t align) {
+  if(fb->len % align) { km_fb_put(fb, NULL, align - fb->len % align); }
+  return fb->len;
+}
+
+// Points the offset field at pos to target, which follows it.
+static void km_fb_patch(km_fb_t *fb, size_t pos, size_t target) {
+  uint32_t off = target - pos;
+  memcpy(fb->buf + pos, &off, 4);
+}
+
+// field of a table: id in the schema, size of a scalar or struct, NULL val for
+// an offset (4 bytes, its position is returned in pos)
+typedef struct {
+  int id;
+  size_t size;
+  const void *val;
+} km_fb_field_t;
+
+// Writes the vtable and a table with n fields (largest first), returns the
+// position of the table.
+static size_t km_fb_table(km_fb_t *fb, int n_ids, const km_fb_field_t *f, int n, size_t *pos) {
+  km_fb_align(fb, 2);
+  size_t vt = fb->len;
+  uint16_t vt_size = 4 + 2*n_ids;
+  km_fb_put(fb, &vt_size, 2);
+  km_fb_put(fb, NULL, 2 + 2*n_ids);
+  size_t tbl = km_fb_align(fb, 4);
+  int32_t soff = tbl - vt;
+  km_fb_put(fb, &soff, 4);
+  for(int i=0; i<n; ++i) {
+    size_t size = f[i].val ? f[i].size : 4;
+    km_fb_align(fb, size < 8 ? size : 8);
+    uint16_t off = fb->len - tbl;
+    memcpy(fb->buf + vt + 4 + 2*f[i].id, &off, 2);
+    if(!f[i].val) { pos[i] = fb->len; }
+    km_fb_put(fb, f[i].val, size);
+  }
+  uint16_t tbl_size = fb->len - tbl;
+  memcpy(fb->buf + vt + 2, &tbl_size, 2);
+  return tbl;
+}
+
+// Writes a vector of n elements (zeros if data is NULL), returns its position.
+static size_t km_fb_vector(km_fb_t *fb, size_t elem_size, size_t n, const void *data) {
+  size_t align = elem_size > 4 ? 8 : 4;
+  while((fb->len + 4) % align) { km_fb_put(fb, NULL, 1); }
+  size_t vec = fb->len;
+  uint32_t len = n;
+  km_fb_put(fb, &len, 4);
+  km_fb_put(fb, data, elem_size*n);
+  return vec;
+}
+
+static size_t km_fb_string(km_fb_t *fb, const char *s) {
+  size_t pos = km_fb_vector(fb, 1, strlen(s), s);
+  km_fb_put(fb, NULL, 1);
+  return pos;
+}
+
+// --- writer
+
+typedef struct {
+  int64_t offset;
+  int32_t meta_len;
+  int32_t pad;
+  int64_t body_len;
+} km_arrow_block_t;
+
+typedef struct {
+  km_format_t format;
+  int ksize;
+  const uint8_t *code;
+  bool kmtricks;
+  size_t n_samples;
+  bool started;             // schema written
+  off_t off;                // bytes written
+  km_arrow_block_t *blocks; // record batches, for the footer of the file format
+  size_t n_blocks, cap;
+} km_arrow_writer_t;
+
+static void km_arrow_writer_init(km_arrow_writer_t *w, km_format_t format, int ksize, bool kmtricks) {
+  memset(w, 0, sizeof(*w));
+  w->format = format;
+  w->ksize = ksize;
+  w->kmtricks = kmtricks;
+  w->code = kmtricks ? nt2bits_kt : nt2bits;
+}
+
+static void km_arrow_writer_free(km_arrow_writer_t *w) {
+  free(w->blocks);
+}
+
+static void km_arrow_schema(km_fb_t *fb, size_t at, const km_arrow_writer_t *w) {
+  size_t pos[3];
+  km_fb_field_t schema[] = { { 1, 0, NULL }, { 2, 0, NULL } };
+  size_t tbl = km_fb_table(fb, 4, schema, 2, pos);
+  km_fb_patch(fb, at, tbl);
+  size_t fields_pos = pos[0], meta_pos = pos[1];
+
+  size_t n_fields = 1 + w->n_samples;
+  size_t fields = km_fb_vector(fb, 4, n_fields, NULL);
+  km_fb_patch(fb, fields_pos, fields);
+  for(size_t i=0; i<n_fields; ++i) {
+    uint8_t type_type = KM_ARROW_TYPE_INT, nullable = 0;
+    km_fb_field_t field[] = { { 0, 0, NULL }, { 3, 0, NULL }, { 5, 0, NULL }, { 1, 1, &nullable }, { 2, 1, &type_type } };
+    size_t tpos[3];
+    size_t ftbl = km_fb_table(fb, 7, field, 5, tpos);
+    km_fb_patch(fb, fields + 4 + 4*i, ftbl);
+    char name[32];
+    if(i == 0) { strcpy(name, "kmer"); } else { snprintf(name, sizeof(name), "sample_%zu", i); }
+    km_fb_patch(fb, tpos[0], km_fb_string(fb, name));
+    int32_t bit_width = i == 0 ? 64 : 32;
+    uint8_t is_signed = 0;
+    km_fb_field_t type[] = { { 0, 4, &bit_width }, { 1, 1, &is_signed } };
+    km_fb_patch(fb, tpos[1], km_fb_table(fb, 2, type, 2, NULL));
+    km_fb_patch(fb, tpos[2], km_fb_vector(fb, 4, 0, NULL));
+  }
+
+  size_t meta = km_fb_vector(fb, 4, 2, NULL);
+  km_fb_patch(fb, meta_pos, meta);
+  char ksize[16];
+  snprintf(ksize, sizeof(ksize), "%d", w->ksize);
+  const char *kv[2][2] = { { "ksize", ksize }, { "order", w->kmtricks ? "kmtricks" : "lexicographic" } };
+  for(int i=0; i<2; ++i) {
+    km_fb_field_t pair[] = { { 0, 0, NULL }, { 1, 0, NULL } };
+    size_t ppos[2];
+    km_fb_patch(fb, meta + 4 + 4*i, km_fb_table(fb, 2, pair, 2, ppos));
+    km_fb_patch(fb, ppos[0], km_fb_string(fb, kv[i][0]));
+    km_fb_patch(fb, ppos[1], km_fb_string(fb, kv[i][1]));
+  }
+}
+
+// Starts an encapsulated message: continuation, metadata size (patched by
+// km_arrow_message_end) and the root offset of the flatbuffer.
+static void km_arrow_message_begin(km_fb_t *fb, uint8_t header_type, int64_t body_len, size_t *header_pos) {
+  size_t start = fb->len;
+  uint32_t cont = KM_ARROW_CONTINUATION;
+  km_fb_put(fb, &cont, 4);
+  km_fb_put(fb, NULL, 4);
+  km_fb_put(fb, NULL, 4); // root offset, the flatbuffer starts after the prefix
+  int16_t version = KM_ARROW_V5;
+  km_fb_field_t msg[] = { { 3, 8, &body_len }, { 2, 0, NULL }, { 0, 2, &version }, { 1, 1, &header_type } };
+  size_t pos[4];
+  size_t tbl = km_fb_table(fb, 5, msg, 4, pos);
+  km_fb_patch(fb, start + 8, tbl);
+  *header_pos = pos[1];
+}
+
+// Pads the metadata so that the body is 8-byte aligned, returns the metadata
+// length including the prefix.
+static size_t km_arrow_message_end(km_fb_t *fb, size_t start) {
+  km_fb_align(fb, 8);
+  int32_t meta_size = fb->len - start - 8;
+  memcpy(fb->buf + start + 4, &meta_size, 4);
+  return fb->len - start;
+}
+
+// Writes the magic (file format) and the schema message. Returns false on
+// write error.
+static bool km_arrow_start(km_arrow_writer_t *w, FILE *out) {
+  km_fb_t fb = { NULL, 0, 0 };
+  if(w->format == KM_FORMAT_ARROW) { km_fb_put(&fb, km_arrow_magic, 8); }
+  size_t start = fb.len, header_pos;
+  km_arrow_message_begin(&fb, KM_ARROW_SCHEMA, 0, &header_pos);
+  km_arrow_schema(&fb, header_pos, w);
+  km_arrow_message_end(&fb, start);
+  bool ok = fwrite(fb.buf, 1, fb.len, out) == fb.len;
+  w->off += fb.len;
+  w->started = true;
+  free(fb.buf);
+  return ok;
+}
+
+// Parses a text row into its key and counts. Returns false if the k-mer cannot
+// be packed or the row does not have n_samples non-negative integer counts.
+static inline bool km_arrow_parse_row(const km_arrow_writer_t *w, const char *line, const char *end, uint64_t *key, uint32_t *counts, size_t stride) {
+  if(end - line < w->ksize || !km_pack(line, w->ksize, w->code, key)) { return false; }
+  const char *p = line + w->ksize;
+  if(p < end && !km_isblank(*p)) { return false; }
+  size_t n = 0;
+  while(p < end) {
+    while(p < end && km_isblank(*p)) { ++p; }
+    if(p == end) { break; }
+    uint64_t val = 0;
+    const char *beg = p;
+    while(p < end && (unsigned char)(*p - '0') < 10) { val = val*10 + (*p - '0'); ++p; }
+    if(p == beg || (p < end && !km_isblank(*p)) || val > UINT32_MAX || n == w->n_samples) { return false; }
+    counts[n*stride] = val;
+    ++n;
+  }
+  return n == w->n_samples;
+}
+
+static inline bool km_arrow_next_row(const char **p, const char *end, const char **line, const char **line_end) {
+  while(*p < end) {
+    const char *nl = (const char *)memchr(*p, '\n', end - *p);
+    const char *e = nl ? nl : end;
+    *line = *p;
+    *line_end = e;
+    *p = nl ? nl+1 : end;
+    if(e > *line) { return true; }
+  }
+  return false;
+}
+
+// Encodes the text rows in [text,end) as a record batch message into out
+// (replacing its content). Returns the metadata length of the message, or 0 if
+// a row is invalid, in which case *bad is its index among the rows.
+static size_t km_arrow_encode(const km_arrow_writer_t *w, const char *text, const char *end, km_fb_t *out, size_t *bad) {
+  size_t n_rows = 0;
+  const char *p = text, *line, *line_end;
+  while(km_arrow_next_row(&p, end, &line, &line_end)) { ++n_rows; }
+
+  size_t n_cols = 1 + w->n_samples;
+  size_t key_bytes = km_arrow_pad8(n_rows*8), count_bytes = km_arrow_pad8(n_rows*4);
+  int64_t body_len = key_bytes + w->n_samples*count_bytes;
+
+  out->len = 0;
+  size_t header_pos;
+  km_arrow_message_begin(out, KM_ARROW_RECORD_BATCH, body_len, &header_pos);
+  int64_t length = n_rows;
+  km_fb_field_t batch[] = { { 0, 8, &length }, { 1, 0, NULL }, { 2, 0, NULL } };
+  size_t pos[3];
+  km_fb_patch(out, header_pos, km_fb_table(out, 5, batch, 3, pos));
+  size_t nodes = km_fb_vector(out, 16, n_cols, NULL);
+  km_fb_patch(out, pos[1], nodes);
+  for(size_t c=0; c<n_cols; ++c) {
+    int64_t node[2] = { (int64_t)n_rows, 0 };
+    memcpy(out->buf + nodes + 4 + 16*c, node, 16);
+  }
+  size_t buffers = km_fb_vector(out, 16, 2*n_cols, NULL);
+  km_fb_patch(out, pos[2], buffers);
+  for(size_t c=0; c<n_cols; ++c) {
+    int64_t data_off = c == 0 ? 0 : (int64_t)(key_bytes + (c-1)*count_bytes);
+    int64_t buf[4] = { data_off, 0, data_off, (int64_t)(c == 0 ? n_rows*8 : n_rows*4) };
+    memcpy(out->buf + buffers + 4 + 32*c, buf, 32);
+  }
+  size_t meta_len = km_arrow_message_end(out, 0);
+
+  // the body, parsed in place
+  size_t body = out->len;
+  km_fb_put(out, NULL, body_len);
+  uint64_t *keys = (uint64_t *)(out->buf + body);
+  uint32_t *counts = (uint32_t *)(out->buf + body + key_bytes);
+  size_t stride = count_bytes / 4, r = 0;
+  p = text;
+  while(km_arrow_next_row(&p, end, &line, &line_end)) {
+    if(!km_arrow_parse_row(w, line, line_end, &keys[r], &counts[r], stride)) {
+      *bad = r;
+      return 0;
+    }
+    ++r;
+  }
+  return meta_len;
+}
+
+// Records a record batch message of len bytes written at w->off.
+static void km_arrow_add_block(km_arrow_writer_t *w, size_t meta_len, size_t len) {
+  if(w->n_blocks == w->cap) {
+    w->cap = w->cap ? 2*w->cap : 64;
+    w->blocks = (km_arrow_block_t *)realloc(w->blocks, w->cap*sizeof(km_arrow_block_t));
+  }
+  w->blocks[w->n_blocks++] = (km_arrow_block_t){ w->off, (int32_t)meta_len, 0, (int64_t)(len - meta_len) };
+  w->off += len;
+}
+
+// Writes the end-of-stream marker and, for the file format, the footer.
+static bool km_arrow_finish(km_arrow_writer_t *w, FILE *out) {
+  km_fb_t fb = { NULL, 0, 0 };
+  uint32_t eos[2] = { KM_ARROW_CONTINUATION, 0 };
+  km_fb_put(&fb, eos, 8);
+  if(w->format == KM_FORMAT_ARROW) {
+    size_t start = fb.len;
+    km_fb_put(&fb, NULL, 4); // root offset
+    int16_t version = KM_ARROW_V5;
+    km_fb_field_t footer[] = { { 1, 0, NULL }, { 3, 0, NULL }, { 0, 2, &version } };
+    size_t pos[3];
+    // offsets of the flatbuffer are relative, it can start anywhere 8-aligned
+    size_t tbl = km_fb_table(&fb, 5, footer, 3, pos);
+    km_fb_patch(&fb, start, tbl);
+    size_t blocks = km_fb_vector(&fb, sizeof(km_arrow_block_t), w->n_blocks, w->blocks);
+    km_fb_patch(&fb, pos[1], blocks);
+    km_arrow_schema(&fb, pos[0], w);
+    int32_t footer_len = fb.len - start;
+    km_fb_put(&fb, &footer_len, 4);
+    km_fb_put(&fb, km_arrow_magic, 6);
+  }
+  bool ok = fwrite(fb.buf, 1, fb.len, out) == fb.len && fflush(out) == 0;
+  w->off += fb.len;
+  free(fb.buf);
+  return ok;
+}
+
+// --- text to Arrow through a pipe, for the tools writing text with stdio
+
+typedef struct {
+  km_arrow_writer_t w;
+  FILE *out;      // Arrow output
+  FILE *text;     // text input of the tool, write end of the pipe
+  int fd;         // read end of the pipe
+  pthread_t thread;
+  int status;     // 0, 1 on write error, 2 on invalid row
+} km_arrow_out_t;
+
+// A converter thread may write to a pipe whose reader is gone (the tool closed
+// its input early, the output is piped to head): SIGPIPE is ignored in the
+// whole process, writes fail with EPIPE and the thread stops, the tool then
+// reports the write error.
+static void km_arrow_ignore_sigpipe() {
+  signal(SIGPIPE, SIG_IGN);
+}
+
+static void *km_arrow_out_thread(void *arg) {
+  km_arrow_out_t *ao = (km_arrow_out_t *)arg;
+  km_arrow_writer_t *w = &ao->w;
+  char *buf = (char *)malloc(KM_ARROW_BATCH_BYTES);
+  size_t len = 0, n_rows = 0;
+  km_fb_t msg = { NULL, 0, 0 };
+  bool eof = false;
+  while(!eof && ao->status == 0) {
+    ssize_t r = read(ao->fd, buf + len, KM_ARROW_BATCH_BYTES - len);
+    if(r < 0 && errno == EINTR) { continue; }
+    if(r <= 0) { eof = true; } else { len += r; }
+    if(!eof && len < KM_ARROW_BATCH_BYTES) { continue; }
+
+    // encode the complete lines, keep the last partial one
+    size_t cut = len;
+    if(!eof) {
+      while(cut > 0 && buf[cut-1] != '\n') { --cut; }
+      if(cut == 0) { // a line longer than the buffer
+        fprintf(stderr, "[error] line too long for Arrow output\n");
+        ao->status = 2;
+        break;
+      }
+    }
+    if(!w->started) {
+      // the number of samples is given by the first row
+      const char *p = buf, *line, *line_end;
+      if(km_arrow_next_row(&p, buf + cut, &line, &line_end)) {
+        km_row_stats_t st = {0,0,0};
+        km_row_stats(km_skip_kmer(line, line_end), line_end, 1, &st);
+        w->n_samples = st.n_values;
+      }
+      if(!km_arrow_start(w, ao->out)) { ao->status = 1; break; }
+    }
+    size_t bad = 0;
+    size_t meta_len = km_arrow_encode(w, buf, buf + cut, &msg, &bad);
+    if(meta_len == 0) {
+      fprintf(stderr, "[error] cannot write row %zu in Arrow format (k-mer of %d nucleotides and %zu counts expected)\n", n_rows + bad + 1, w->ksize, w->n_samples);
+      ao->status = 2;
+      break;
+    }
+    if(msg.len > meta_len) { // rows in the batch
+      if(fwrite(msg.buf, 1, msg.len, ao->out) != msg.len) { ao->status = 1; break; }
+      km_arrow_add_block(w, meta_len, msg.len);
+    }
+    const char *p = buf, *line, *line_end;
+    while(km_arrow_next_row(&p, buf + cut, &line, &line_end)) { ++n_rows; }
+    memmove(buf, buf + cut, len - cut);
+    len -= cut;
+  }
+  // after an error, closing the pipe makes the writes of the tool fail
+  if(ao->status == 0 && !w->started && !km_arrow_start(w, ao->out)) { ao->status = 1; }
+  if(ao->status == 0 && !km_arrow_finish(w, ao->out)) { ao->status = 1; }
+  free(msg.buf);
+  free(buf);
+  close(ao->fd);
+  return NULL;
+}
+
+// Returns the stream the tool writes its text output to: out itself for the
+// text format, else a pipe converted to Arrow into out by a thread.
+static FILE *km_arrow_out_open(km_arrow_out_t *ao, FILE *out, km_format_t format, int ksize, bool kmtricks) {
+  memset(ao, 0, sizeof(*ao));
+  ao->out = out;
+  ao->text = out;
+  if(format == KM_FORMAT_TEXT) { return out; }
+  km_arrow_writer_init(&ao->w, format, ksize, kmtricks);
+  int fds[2];
+  if(pipe(fds) != 0) { return NULL; }
+  km_arrow_ignore_sigpipe();
+  ao->fd = fds[0];
+  ao->text = fdopen(fds[1], "w");
+  pthread_create(&ao->thread, NULL, km_arrow_out_thread, ao);
+  return ao->text;
+}
+
+// Flushes the text output and, for Arrow, waits for its conversion. Returns 0
+// on success, 1 on write error and 2 on a row that cannot be converted.
+static int km_arrow_out_close(km_arrow_out_t *ao) {
+  if(ao->text == ao->out) { return fflush(ao->out) || ferror(ao->out) ? 1 : 0; }
+  int text_err = ferror(ao->text) != 0;
+  text_err |= fclose(ao->text) != 0;
+  pthread_join(ao->thread, NULL);
+  km_arrow_writer_free(&ao->w);
+  return ao->status ? ao->status : text_err;
+}
+
+// --- Arrow to text
+
+// flatbuffer of a message, read with bound checks
+typedef struct {
+  const uint8_t *buf;
+  size_t len;
+} km_fbr_t;
+
+// Returns the position of the table referenced by the offset at pos, 0 if invalid.
+static size_t km_fbr_deref(const km_fbr_t *fb, size_t pos) {
+  if(pos == 0 || pos + 4 > fb->len) { return 0; }
+  uint32_t off;
+  memcpy(&off, fb->buf + pos, 4);
+  size_t target = pos + off;
+  return off && target + 4 <= fb->len ? target : 0;
+}
+
+// Returns the position of field id of the table at tbl, 0 if absent.
+static size_t km_fbr_field(const km_fbr_t *fb, size_t tbl, int id) {
+  if(tbl == 0) { return 0; }
+  int32_t soff;
+  memcpy(&soff, fb->buf + tbl, 4);
+  int64_t vt = (int64_t)tbl - soff;
+  if(vt < 0 || (size_t)vt + 4 > fb->len) { return 0; }
+  uint16_t vt_size, off;
+  memcpy(&vt_size, fb->buf + vt, 2);
+  if(4 + 2*(size_t)id + 2 > vt_size || (size_t)vt + vt_size > fb->len) { return 0; }
+  memcpy(&off, fb->buf + vt + 4 + 2*id, 2);
+  return off && tbl + off < fb->len ? tbl + off : 0;
+}
+
+static int64_t km_fbr_scalar(const km_fbr_t *fb, size_t tbl, int id, size_t size, int64_t def) {
+  size_t pos = km_fbr_field(fb, tbl, id);
+  if(pos == 0 || pos + size > fb->len) { return def; }
+  int64_t v = 0;
+  if(size == 1) { v = fb->buf[pos]; }
+  else if(size == 2) { int16_t x; memcpy(&x, fb->buf + pos, 2); v = x; }
+  else if(size == 4) { int32_t x; memcpy(&x, fb->buf + pos, 4); v = x; }
+  else { memcpy(&v, fb->buf + pos, 8); }
+  return v;
+}
+
+// Returns the position of the first element of the vector of field id and its
+// length in *n, 0 if absent or invalid.
+static size_t km_fbr_vector(const km_fbr_t *fb, size_t tbl, int id, size_t elem_size, size_t *n) {
+  size_t vec = km_fbr_deref(fb, km_fbr_field(fb, tbl, id));
+  *n = 0;
+  if(vec == 0) { return 0; }
+  uint32_t len;
+  memcpy(&len, fb->buf + vec, 4);
+  if(vec + 4 + (size_t)len*elem_size > fb->len) { return 0; }
+  *n = len;
+  return vec + 4;
+}
+
+static bool km_fbr_string_eq(const km_fbr_t *fb, size_t tbl, int id, const char *s, char *copy, size_t copy_size) {
+  size_t n, pos = km_fbr_vector(fb, tbl, id, 1, &n);
+  if(pos == 0) { return false; }
+  if(copy) {
+    size_t l = n < copy_size-1 ? n : copy_size-1;
+    memcpy(copy, fb->buf + pos, l);
+    copy[l] = '\0';
+  }
+  return s == NULL || (n == strlen(s) && memcmp(fb->buf + pos, s, n) == 0);
+}
+
+typedef struct {
+  int type;        // KM_ARROW_TYPE_INT, _UTF8 or _BINARY
+  int bit_width;
+  bool is_signed;
+} km_arrow_column_t;
+
+typedef struct {
+  int fd;
+  uint8_t pre[8];          // bytes read to detect the format
+  size_t pre_len, pre_pos;
+  FILE *text;              // write end of the pipe
+  const char *name;
+  int ksize;
+  bool kmtricks;
+  km_arrow_column_t *cols;
+  size_t n_cols;
+} km_arrow_in_t;
+
+static bool km_arrow_read(km_arrow_in_t *in, void *buf, size_t n) {
+  uint8_t *p = (uint8_t *)buf;
+  while(n && in->pre_pos < in->pre_len) { *p++ = in->pre[in->pre_pos++]; --n; }
+  while(n) {
+    ssize_t r = read(in->fd, p, n);
+    if(r < 0 && errno == EINTR) { continue; }
+    if(r <= 0) { return false; }
+    p += r;
+    n -= r;
+  }
+  return true;
+}
+
+static void km_arrow_in_fail(km_arrow_in_t *in, const char *why) {
+  fprintf(stderr, "[error] invalid Arrow input \"%s\": %s\n", in->name, why);
+  exit(1);
+}
+
+static void km_arrow_in_schema(km_arrow_in_t *in, const km_fbr_t *fb, size_t schema) {
+  size_t n_fields, fields = km_fbr_vector(fb, schema, 1, 4, &n_fields);
+  if(fields == 0 || n_fields == 0) { km_arrow_in_fail(in, "schema without fields"); }
+  in->cols = (km_arrow_column_t *)calloc(n_fields, sizeof(km_arrow_column_t));
+  in->n_cols = n_fields;
+  for(size_t i=0; i<n_fields; ++i) {
+    size_t field = km_fbr_deref(fb, fields + 4*i);
+    int type_type = km_fbr_scalar(fb, field, 2, 1, 0);
+    size_t type = km_fbr_deref(fb, km_fbr_field(fb, field, 3));
+    km_arrow_column_t *col = &in->cols[i];
+    col->type = type_type;
+    col->bit_width = km_fbr_scalar(fb, type, 0, 4, 0);
+    col->is_signed = km_fbr_scalar(fb, type, 1, 1, 0);
+    bool ok = type_type == KM_ARROW_TYPE_INT && (col->bit_width == 8 || col->bit_width == 16 || col->bit_width == 32 || col->bit_width == 64);
+    if(i == 0) { ok = (ok && col->bit_width == 64) || type_type == KM_ARROW_TYPE_UTF8 || type_type == KM_ARROW_TYPE_BINARY; }
+    if(!ok) { km_arrow_in_fail(in, i == 0 ? "the k-mer column must be uint64 or string" : "count columns must be integers"); }
+  }
+  size_t n_meta, meta = km_fbr_vector(fb, schema, 2, 4, &n_meta);
+  for(size_t i=0; i<n_meta; ++i) {
+    size_t kv = km_fbr_deref(fb, meta + 4*i);
+    char value[32];
+    if(km_fbr_string_eq(fb, kv, 0, "ksize", NULL, 0) && km_fbr_string_eq(fb, kv, 1, NULL, value, sizeof(value))) {
+      int ksize = strtol(value, NULL, 10);
+      if(in->ksize && ksize != in->ksize) {
+        fprintf(stderr, "[error] Arrow input \"%s\" has k-mers of size %d, not %d (see -k)\n", in->name, ksize, in->ksize);
+        exit(1);
+      }
+      in->ksize = ksize;
+    }
+    if(km_fbr_string_eq(fb, kv, 0, "order", NULL, 0) && km_fbr_string_eq(fb, kv, 1, NULL, value, sizeof(value))) {
+      in->kmtricks = strcmp(value, "kmtricks") == 0;
+    }
+  }
+  if(in->cols[0].type == KM_ARROW_TYPE_INT && in->ksize == 0) {
+    km_arrow_in_fail(in, "packed k-mers without \"ksize\" in the schema metadata");
+  }
+  if(in->cols[0].type == KM_ARROW_TYPE_INT && (in->ksize < 0 || in->ksize > 32)) {
+    km_arrow_in_fail(in, "packed k-mers require 1 <= k <= 32");
+  }
+}
+
+static inline bool km_arrow_valid(const uint8_t *validity, size_t i) {
+  return validity == NULL || (validity[i/8] >> (i%8)) & 1;
+}
+
+static inline char *km_arrow_utoa(char *p, uint64_t v) {
+  char tmp[24];
+  int n = 0;
+  do { tmp[n++] = '0' + v % 10; v /= 10; } while(v);
+  while(n) { *p++ = tmp[--n]; }
+  return p;
+}
+
+// Writes the rows of a record batch as text lines. Returns false if the
+// reader is gone.
+static bool km_arrow_in_batch(km_arrow_in_t *in, const km_fbr_t *fb, size_t batch, const uint8_t *body, size_t body_len) {
+  if(km_fbr_field(fb, batch, 3)) { km_arrow_in_fail(in, "compressed record batches are not supported"); }
+  int64_t n_rows = km_fbr_scalar(fb, batch, 0, 8, 0);
+  size_t n_nodes, nodes = km_fbr_vector(fb, batch, 1, 16, &n_nodes);
+  size_t n_bufs, bufs = km_fbr_vector(fb, batch, 2, 16, &n_bufs);
+  if(n_nodes != in->n_cols || n_rows < 0) { km_arrow_in_fail(in, "record batch does not match the schema"); }
+
+  // validity and data buffers of each column, plus offsets for strings
+  const uint8_t *validity[in->n_cols], *data[in->n_cols], *offsets[in->n_cols];
+  size_t b = 0;
+  for(size_t c=0; c<in->n_cols; ++c) {
+    int64_t node[2];
+    memcpy(node, fb->buf + nodes + 16*c, 16);
+    size_t n_col_bufs = in->cols[c].type == KM_ARROW_TYPE_INT ? 2 : 3;
+    if(b + n_col_bufs > n_bufs || node[0] != n_rows) { km_arrow_in_fail(in, "record batch does not match the schema"); }
+    const uint8_t *ptr[3];
+    for(size_t k=0; k<n_col_bufs; ++k, ++b) {
+      int64_t buf[2];
+      memcpy(buf, fb->buf + bufs + 16*b, 16);
+      if(buf[0] < 0 || buf[1] < 0 || (size_t)(buf[0] + buf[1]) > body_len) { km_arrow_in_fail(in, "buffer out of the message body"); }
+      ptr[k] = buf[1] ? body + buf[0] : NULL;
+    }
+    validity[c] = node[1] ? ptr[0] : NULL;
+    offsets[c] = n_col_bufs == 3 ? ptr[1] : NULL;
+    data[c] = ptr[n_col_bufs-1];
+    if(n_rows && (data[c] == NULL || (n_col_bufs == 3 && offsets[c] == NULL))) { km_arrow_in_fail(in, "missing buffer"); }
+  }
+
+  const char *nuc = in->kmtricks ? "ACTG" : "ACGT";
+  size_t line_cap = 64 + 21*in->n_cols;
+  char *line = (char *)malloc(line_cap);
+  for(int64_t r=0; r<n_rows; ++r) {
+    char *p = line;
+    if(in->cols[0].type == KM_ARROW_TYPE_INT) {
+      uint64_t key;
+      memcpy(&key, data[0] + 8*r, 8);
+      for(int i=in->ksize-1; i>=0; --i) { p[i] = nuc[key & 3]; key >>= 2; }
+      p += in->ksize;
+    } else {
+      int32_t o[2];
+      memcpy(o, offsets[0] + 4*r, 8);
+      if(o[0] < 0 || o[1] < o[0]) { km_arrow_in_fail(in, "invalid string offsets"); }
+      size_t len = o[1] - o[0];
+      if(len + 21*in->n_cols + 2 > line_cap) { line_cap = len + 21*in->n_cols + 2; line = (char *)realloc(line, line_cap); p = line; }
+      memcpy(p, data[0] + o[0], len);
+      p += len;
+    }
+    for(size_t c=1; c<in->n_cols; ++c) {
+      *p++ = ' ';
+      if(!km_arrow_valid(validity[c], r)) { *p++ = '0'; continue; }
+      const km_arrow_column_t *col = &in->cols[c];
+      int64_t v;
+      switch(col->bit_width) {
+        case 8:  v = col->is_signed ? (int64_t)((const int8_t *)data[c])[r] : (int64_t)data[c][r]; break;
+        case 16: { uint16_t x; memcpy(&x, data[c] + 2*r, 2); v = col->is_signed ? (int16_t)x : x; break; }
+        case 32: { uint32_t x; memcpy(&x, data[c] + 4*r, 4); v = col->is_signed ? (int32_t)x : x; break; }
+        default: { memcpy(&v, data[c] + 8*r, 8); break; }
+      }
+      if(col->is_signed && v < 0) { *p++ = '-'; v = -v; }
+      p = km_arrow_utoa(p, (uint64_t)v);
+    }
+    *p++ = '\n';
+    if(fwrite(line, 1, p - line, in->text) != (size_t)(p - line)) { free(line); return false; }
+  }
+  free(line);
+  return true;
+}
+
+static void *km_arrow_in_thread(void *arg) {
+  km_arrow_in_t *in = (km_arrow_in_t *)arg;
+  uint8_t magic[8];
+  if(in->pre_len >= 6 && memcmp(in->pre, km_arrow_magic, 6) == 0) { km_arrow_read(in, magic, 8); }
+  uint8_t *meta = NULL, *body = NULL;
+  size_t meta_cap = 0, body_cap = 0;
+  bool has_schema = false;
+  while(true) {
+    uint32_t cont;
+    int32_t meta_len;
+    if(!km_arrow_read(in, &cont, 4) || cont != KM_ARROW_CONTINUATION) { break; } // end of stream or footer
+    if(!km_arrow_read(in, &meta_len, 4)) { km_arrow_in_fail(in, "truncated message"); }
+    if(meta_len == 0) { break; } // end-of-stream marker
+    if(meta_len < 0) { km_arrow_in_fail(in, "invalid message length"); }
+    if((size_t)meta_len > meta_cap) { meta_cap = meta_len; meta = (uint8_t *)realloc(meta, meta_cap); }
+    if(!km_arrow_read(in, meta, meta_len)) { km_arrow_in_fail(in, "truncated message"); }
+    km_fbr_t fb = { meta, (size_t)meta_len };
+    uint32_t root;
+    memcpy(&root, meta, meta_len >= 4 ? 4 : 0);
+    size_t msg = meta_len >= 4 && root + 4 <= fb.len ? root : 0;
+    int header_type = km_fbr_scalar(&fb, msg, 1, 1, 0);
+    int64_t body_len = km_fbr_scalar(&fb, msg, 3, 8, 0);
+    size_t header = km_fbr_deref(&fb, km_fbr_field(&fb, msg, 2));
+    if(msg == 0 || header == 0 || body_len < 0) { km_arrow_in_fail(in, "invalid message"); }
+    if((size_t)body_len > body_cap) { body_cap = body_len; body = (uint8_t *)realloc(body, body_cap); }
+    if(!km_arrow_read(in, body, body_len)) { km_arrow_in_fail(in, "truncated message body"); }
+    if(header_type == KM_ARROW_SCHEMA) {
+      km_arrow_in_schema(in, &fb, header);
+      has_schema = true;
+    } else if(header_type == KM_ARROW_RECORD_BATCH) {
+      if(!has_schema) { km_arrow_in_fail(in, "record batch before the schema"); }
+      if(!km_arrow_in_batch(in, &fb, header, body, body_len)) { break; } // reader gone
+    } else if(header_type == KM_ARROW_DICTIONARY_BATCH) {
+      km_arrow_in_fail(in, "dictionaries are not supported");
+    }
+  }
+  free(meta);
+  free(body);
+  free(in->cols);
+  fclose(in->text);
+  close(in->fd);
+  free(in);
+  return NULL;
+}
+
+// Copies text whose first bytes were read to detect the format.
+static void *km_arrow_copy_thread(void *arg) {
+  km_arrow_in_t *in = (km_arrow_in_t *)arg;
+  char buf[1<<16];
+  bool ok = fwrite(in->pre, 1, in->pre_len, in->text) == in->pre_len;
+  ssize_t r;
+  while(ok && (r = read(in->fd, buf, sizeof(buf))) > 0) {
+    ok = fwrite(buf, 1, r, in->text) == (size_t)r;
+  }
+  fclose(in->text);
+  close(in->fd);
+  free(in);
+  return NULL;
+}
+
+// Opens a matrix for reading as text ("-" for stdin). An Arrow file or stream
+// is converted to text lines by a thread; ksize and kmtricks are used when its
+// schema does not give them, and the tool exits with an error if the schema
+// gives another ksize. Tools that do not depend on k pass 0 to accept the
+// ksize of the schema. Returns NULL if the file cannot be opened.
+static FILE *km_arrow_fopen(const char *path, int ksize, bool kmtricks) {
+  bool is_stdin = strcmp(path, "-") == 0;
+  FILE *fp = is_stdin ? stdin : fopen(path, "r");
+  if(fp == NULL) { return NULL; }
+  int fd = fileno(fp);
+  uint8_t pre[8];
+  size_t pre_len = 0;
+  while(pre_len < 8) {
+    ssize_t r = read(fd, pre + pre_len, 8 - pre_len);
+    if(r < 0 && errno == EINTR) { continue; }
+    if(r <= 0) { break; }
+    pre_len += r;
+  }
+  uint32_t cont = KM_ARROW_CONTINUATION;
+  bool arrow = (pre_len >= 6 && memcmp(pre, km_arrow_magic, 6) == 0) || (pre_len == 8 && memcmp(pre, &cont, 4) == 0);
+  if(!arrow && lseek(fd, 0, SEEK_SET) == 0) { return fp; }
+
+  // Arrow, or text from a pipe whose first bytes are already read: convert
+  // (or copy) through a pipe
+  int fds[2];
+  if(pipe(fds) != 0) { return NULL; }
+  km_arrow_ignore_sigpipe();
+  km_arrow_in_t *in = (km_arrow_in_t *)calloc(1, sizeof(km_arrow_in_t));
+  in->fd = dup(fd);
+  memcpy(in->pre, pre, pre_len);
+  in->pre_len = pre_len;
+  in->name = path;
+  in->ksize = ksize;
+  in->kmtricks = kmtricks;
+  in->text = fdopen(fds[1], "w");
+  if(!is_stdin) { fclose(fp); }
+  pthread_t thread;
+  pthread_create(&thread, NULL, arrow ? km_arrow_in_thread : km_arrow_copy_thread, in);
+  pthread_detach(thread);
+  return fdopen(fds[0], "r");
+}
+
+#endif
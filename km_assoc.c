@@ -0,0 +1,536 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <stdbool.h>
+#include <string.h>
+#include <math.h>
+#include <stdatomic.h>
+
+#include "km_kernels.h"
+#include "km_chunk.h"
+
+// Association of the presence of each k-mer with a binary phenotype. A row is
+// turned into a presence bitmask over the samples (count >= min_abund), and
+// its 2x2 table against the labels comes from two popcounts: cases where the
+// k-mer is present, and labeled samples where it is present. As the margins of
+// the labels are fixed, a table only depends on (present cases, present
+// samples): Fisher p-values are computed once per number of present samples,
+// from a table of log-factorials, and looked up afterwards.
+
+#define ASSOC_CACHE_MAX (1UL<<25)  // p-values cached at most (256 MiB)
+#define ASSOC_REL_TOL 1e-7         // tables as likely as the observed one, for the two-sided test
+
+typedef enum { TEST_FISHER, TEST_CHI2, N_TEST } test_t;
+static const char *test_names[N_TEST] = { "fisher", "chi2" };
+
+typedef struct {
+  size_t words;            // 64-bit words of the masks
+  uint64_t *case_mask, *label_mask;
+  uint32_t n_case, n_ctrl;
+  uint32_t max_sample;     // 1-based, columns needed
+} labels_t;
+
+typedef struct {
+  double p;
+  uint64_t row;            // row number, to break ties in input order
+  uint32_t a, c;           // present cases and controls
+  char *kmer;
+} hit_t;
+
+typedef struct {
+  hit_t *hits;
+  size_t n, cap;
+} heap_t;
+
+typedef struct {
+  const labels_t *labels;
+  test_t test;
+  uint32_t min_abund;
+  double max_p;
+  size_t top;              // 0: all rows with p <= max_p, in input order
+  size_t n_samples;        // columns of the matrix
+  double *lf;              // log-factorials up to n_case + n_ctrl
+  _Atomic(double *) *cache; // per number of present samples, Fisher p-values by present cases
+  heap_t best;
+  uint64_t n_tests;
+} assoc_job_t;
+
+// --- labels
+
+// Reads the labels: one "SAMPLE LABEL" pair per line, SAMPLE being a 1-based
+// column or a range FIRST:LAST and LABEL 1 or case, 0 or control. Unlabeled
+// samples are left out of the tests. Returns 0, or the line number of the
+// first invalid line.
+size_t read_labels(FILE *fp, labels_t *lb) {
+  memset(lb, 0, sizeof(*lb));
+  uint8_t *label = NULL;  // 0 unlabeled, 1 control, 2 case
+  size_t n_label = 0;
+  char *line = NULL;
+  size_t line_size = 0, line_num = 0, bad = 0;
+  while(bad == 0 && getline(&line, &line_size, fp) >= 0) {
+    ++line_num;
+    char *p = line;
+    while(*p == ' ' || *p == '\t') { ++p; }
+    if(*p == '\n' || *p == '\0' || *p == '#') { continue; }
+    char *end;
+    long first = strtol(p, &end, 10), last = first;
+    if(*end == ':') { last = strtol(end + 1, &end, 10); }
+    char *name = end;
+    while(*name == ' ' || *name == '\t') { ++name; }
+    size_t name_len = strcspn(name, " \t\r\n");
+    name[name_len] = '\0';
+    int value = -1;
+    if(strcmp(name, "1") == 0 || strcmp(name, "case") == 0) { value = 2; }
+    else if(strcmp(name, "0") == 0 || strcmp(name, "control") == 0) { value = 1; }
+    if(end == p || name == end || value < 0 || first < 1 || last < first || last > UINT32_MAX) { bad = line_num; break; }
+    if((size_t)last > n_label) {
+      label = (uint8_t *)realloc(label, last);
+      memset(label + n_label, 0, last - n_label);
+      n_label = last;
+    }
+    memset(label + first - 1, value, last - first + 1);
+  }
+  free(line);
+  if(bad) { free(label); return bad; }
+
+  lb->max_sample = n_label;
+  lb->words = (n_label + 63) / 64;
+  lb->case_mask = (uint64_t *)calloc(lb->words ? lb->words : 1, sizeof(uint64_t));
+  lb->label_mask = (uint64_t *)calloc(lb->words ? lb->words : 1, sizeof(uint64_t));
+  for(size_t s=0; s<n_label; ++s) {
+    if(label[s]) { lb->label_mask[s/64] |= 1ULL << (s%64); }
+    if(label[s] == 2) { lb->case_mask[s/64] |= 1ULL << (s%64); ++lb->n_case; }
+    else if(label[s] == 1) { ++lb->n_ctrl; }
+  }
+  free(label);
+  return 0;
+}
+
+void free_labels(labels_t *lb) {
+  free(lb->case_mask);
+  free(lb->label_mask);
+}
+
+// --- tests
+
+// log of the hypergeometric probability of a present cases out of k present
+// samples, with n1 cases and n2 controls
+static inline double hyper_log(const double *lf, uint32_t n1, uint32_t n2, uint32_t k, uint32_t a) {
+  return lf[n1] - lf[a] - lf[n1 - a] + lf[n2] - lf[k - a] - lf[n2 - k + a] - lf[n1 + n2] + lf[k] + lf[n1 + n2 - k];
+}
+
+// Two-sided Fisher p-value of a present cases out of k present samples: the
+// probability of the tables at most as likely as the observed one. The
+// distribution is unimodal, so these are its two tails.
+double fisher_p(const double *lf, uint32_t n1, uint32_t n2, uint32_t k, uint32_t a) {
+  int64_t lo = k > n2 ? k - n2 : 0, hi = k < n1 ? k : n1;
+  double thr = exp(hyper_log(lf, n1, n2, k, a)) * (1 + ASSOC_REL_TOL);
+  double sum = 0, q;
+  int64_t l = lo, r = hi;
+  while(l <= r && (q = exp(hyper_log(lf, n1, n2, k, l))) <= thr) { sum += q; ++l; }
+  while(r >= l && (q = exp(hyper_log(lf, n1, n2, k, r))) <= thr) { sum += q; --r; }
+  return sum < 1 ? sum : 1;
+}
+
+// Fisher p-values of all the tables with k present samples, indexed by the
+// present cases minus their minimum. The probabilities are visited in
+// increasing order by merging the two sides of the mode.
+double *fisher_table(const double *lf, uint32_t n1, uint32_t n2, uint32_t k) {
+  uint32_t lo = k > n2 ? k - n2 : 0, hi = k < n1 ? k : n1;
+  size_t r = hi - lo + 1;
+  double *prob = (double *)malloc(r*sizeof(double));
+  double *pv = (double *)malloc(r*sizeof(double));
+  uint32_t *ord = (uint32_t *)malloc(r*sizeof(uint32_t));
+  double *cum = (double *)malloc((r + 1)*sizeof(double));
+  for(size_t i=0; i<r; ++i) { prob[i] = exp(hyper_log(lf, n1, n2, k, lo + i)); }
+  size_t i = 0, j = r;
+  cum[0] = 0;
+  for(size_t n=0; n<r; ++n) {
+    ord[n] = prob[i] <= prob[j-1] ? i++ : --j;
+    cum[n+1] = cum[n] + prob[ord[n]];
+  }
+  for(size_t n=0, m=0; n<r; ++n) {
+    double thr = prob[ord[n]] * (1 + ASSOC_REL_TOL);
+    if(m < n + 1) { m = n + 1; }
+    while(m < r && prob[ord[m]] <= thr) { ++m; }
+    pv[ord[n]] = cum[m] < 1 ? cum[m] : 1;
+  }
+  free(prob);
+  free(ord);
+  free(cum);
+  return pv;
+}
+
+// Pearson chi-square test (1 degree of freedom, no continuity correction).
+static inline double chi2_p(uint32_t n1, uint32_t n2, uint32_t k, uint32_t a) {
+  double n = (double)n1 + n2, b = n1 - a, c = k - a, d = n2 - c;
+  double den = (double)n1 * n2 * k * (n - k);
+  if(den == 0) { return 1; }
+  double x = a*d - b*c;
+  return erfc(sqrt(n * x / den * x / 2));
+}
+
+double assoc_p(assoc_job_t *job, uint32_t k, uint32_t a) {
+  uint32_t n1 = job->labels->n_case, n2 = job->labels->n_ctrl;
+  if(job->test == TEST_CHI2) { return chi2_p(n1, n2, k, a); }
+  if(!job->cache) { return fisher_p(job->lf, n1, n2, k, a); }
+  double *pv = atomic_load_explicit(&job->cache[k], memory_order_acquire);
+  if(pv == NULL) {
+    double *mine = fisher_table(job->lf, n1, n2, k);
+    if(atomic_compare_exchange_strong(&job->cache[k], &pv, mine)) { pv = mine; }
+    else { free(mine); } // another thread filled it
+  }
+  return pv[a - (k > n2 ? k - n2 : 0)];
+}
+
+// --- top hits (max-heap on the p-value, then on the row)
+
+static inline bool hit_worse(const hit_t *x, const hit_t *y) {
+  return x->p > y->p || (x->p == y->p && x->row > y->row);
+}
+
+void heap_sift_down(heap_t *h, size_t i) {
+  for(;;) {
+    size_t m = i, l = 2*i + 1, r = l + 1;
+    if(l < h->n && hit_worse(&h->hits[l], &h->hits[m])) { m = l; }
+    if(r < h->n && hit_worse(&h->hits[r], &h->hits[m])) { m = r; }
+    if(m == i) { return; }
+    hit_t t = h->hits[i]; h->hits[i] = h->hits[m]; h->hits[m] = t;
+    i = m;
+  }
+}
+
+// Keeps the top best hits. Returns false if hit did not enter the heap (its
+// k-mer is left to the caller).
+bool heap_push(heap_t *h, size_t top, hit_t *hit) {
+  if(h->n < top) {
+    if(h->n == h->cap) {
+      h->cap = h->cap ? 2*h->cap : 64;
+      h->hits = (hit_t *)realloc(h->hits, h->cap*sizeof(hit_t));
+    }
+    size_t i = h->n++;
+    h->hits[i] = *hit;
+    while(i > 0 && hit_worse(&h->hits[i], &h->hits[(i-1)/2])) {
+      hit_t t = h->hits[i]; h->hits[i] = h->hits[(i-1)/2]; h->hits[(i-1)/2] = t;
+      i = (i-1)/2;
+    }
+    return true;
+  }
+  if(!hit_worse(&h->hits[0], hit)) { return false; }
+  free(h->hits[0].kmer);
+  h->hits[0] = *hit;
+  heap_sift_down(h, 0);
+  return true;
+}
+
+int cmp_hit(const void *x, const void *y) {
+  const hit_t *hx = (const hit_t *)x, *hy = (const hit_t *)y;
+  return hit_worse(hx, hy) - hit_worse(hy, hx);
+}
+
+char *write_hit(char *o, const char *kmer, size_t kmer_len, uint32_t a, uint32_t c, double p) {
+  memcpy(o, kmer, kmer_len);
+  o += kmer_len;
+  *o++ = '\t';
+  o = km_arrow_utoa(o, a);
+  *o++ = '\t';
+  o = km_arrow_utoa(o, c);
+  o += sprintf(o, "\t%.4e\n", p);
+  return o;
+}
+
+// --- chunks
+
+void assoc_chunk(km_chunk_t *chunk, void *arg) {
+  assoc_job_t *job = (assoc_job_t *)arg;
+  const labels_t *lb = job->labels;
+  heap_t *best = (heap_t *)chunk->state;
+  if(best) {
+    for(size_t i=0; i<best->n; ++i) { free(best->hits[i].kmer); }
+    best->n = 0;
+  }
+  size_t n_cols = lb->words*64;
+  uint32_t *counts = (uint32_t *)malloc((n_cols ? n_cols : 1)*sizeof(uint32_t));
+  uint64_t row = 0;
+  size_t pos = 0, len;
+  char *line;
+  while(km_chunk_next_line(chunk, &pos, &line, &len)) {
+    const char *end = line + len;
+    const char *p = km_skip_kmer(line, end);
+    if(p == line || km_isblank(p[-1])) { continue; } // skip empty lines
+    ++chunk->n_records;
+    km_parse_counts(p, end, counts, n_cols);
+
+    // 2x2 table from the presence bits
+    uint32_t k = 0, a = 0;
+    for(size_t w=0; w<lb->words; ++w) {
+      const uint32_t *cw = counts + 64*w;
+      uint64_t bits = 0;
+      for(int j=0; j<64; ++j) { bits |= (uint64_t)(cw[j] >= job->min_abund) << j; }
+      k += __builtin_popcountll(bits & lb->label_mask[w]);
+      a += __builtin_popcountll(bits & lb->case_mask[w]);
+    }
+    double pval = assoc_p(job, k, a);
+    ++row;
+    if(pval > job->max_p) { continue; }
+
+    size_t kmer_len = p - line;
+    while(kmer_len > 0 && km_isblank(line[kmer_len-1])) { --kmer_len; }
+    if(best) {
+      hit_t hit = { pval, row - 1, a, k - a, NULL };
+      if(best->n < job->top || hit_worse(&best->hits[0], &hit)) {
+        hit.kmer = strndup(line, kmer_len);
+        heap_push(best, job->top, &hit);
+      }
+      continue;
+    }
+    km_chunk_reserve(&chunk->out, &chunk->out_cap, chunk->out_len + kmer_len + 48);
+    chunk->out_len = write_hit(chunk->out + chunk->out_len, line, kmer_len, a, k - a, pval) - chunk->out;
+    ++chunk->n_kept;
+  }
+  free(counts);
+}
+
+// merges the best hits of a chunk, numbering its rows in input order
+void collect_chunk(km_chunk_t *chunk, void *arg) {
+  assoc_job_t *job = (assoc_job_t *)arg;
+  job->n_tests += chunk->n_records;
+  heap_t *best = (heap_t *)chunk->state;
+  if(!best) { return; }
+  for(size_t i=0; i<best->n; ++i) {
+    hit_t hit = best->hits[i];
+    hit.row += job->n_tests - chunk->n_records;
+    if(!heap_push(&job->best, job->top, &hit)) { free(hit.kmer); }
+  }
+  best->n = 0;
+}
+
+
+int main(int argc, char **argv) {
+
+  int n_threads = 1;
+  int numa_policy = KM_NUMA_NONE;
+  long min_abund = 10, top = 0;
+  double max_p = 1e-5;
+  int test = TEST_FISHER;
+  char *out_fname = NULL, *metrics_fname = NULL, *trace_fname = NULL;
+  bool max_p_opt = false, verbose_opt = false, help_opt = false;
+
+  static struct option long_opts[] = {
+    {"metrics", required_argument, NULL, KM_OPT_METRICS},
+    {"trace", required_argument, NULL, KM_OPT_TRACE},
+    {NULL, 0, NULL, 0}
+  };
+
+  int c;
+  while ((c = getopt_long(argc, argv, "a:m:n:o:p:P:t:vh", long_opts, NULL)) != -1) {
+    switch (c) {
+      case 'a':
+        min_abund = strtol(optarg, NULL, 10);
+        break;
+      case 'm':
+        for(test = 0; test < N_TEST && strcmp(optarg, test_names[test]); ++test) {}
+        if(test == N_TEST) {
+          fprintf(stderr, "Unknown test \"%s\"\n", optarg);
+          return 1;
+        }
+        break;
+      case 'n':
+        top = strtol(optarg, NULL, 10);
+        break;
+      case 'o':
+        out_fname = optarg;
+        break;
+      case 'p':
+        max_p = strtod(optarg, NULL);
+        max_p_opt = true;
+        break;
+      case 'P':
+        numa_policy = km_numa_policy(optarg);
+        if(numa_policy < 0) {
+          fprintf(stderr, "Unknown NUMA placement \"%s\"\n", optarg);
+          return 1;
+        }
+        break;
+      case 't':
+        n_threads = km_pool_threads(optarg);
+        break;
+      case 'v':
+        verbose_opt = true;
+        break;
+      case 'h':
+        help_opt = true;
+        break;
+      case KM_OPT_METRICS:
+        metrics_fname = optarg;
+        break;
+      case KM_OPT_TRACE:
+        trace_fname = optarg;
+        break;
+      case '?':
+        return 1;
+      default:
+        abort();
+    }
+  }
+
+  if(min_abund < 0 || min_abund > UINT32_MAX) {
+    fprintf(stderr, "Invalid min abundance: %ld\n", min_abund);
+    return 1;
+  }
+  if(!(max_p >= 0 && max_p <= 1)) {
+    fprintf(stderr, "-p must be in the [0,1] interval\n");
+    return 1;
+  }
+  if(top < 0) {
+    fprintf(stderr, "-n must be positive\n");
+    return 1;
+  }
+  // with -n, the p-value threshold only applies when given
+  if(top && !max_p_opt) { max_p = 1; }
+
+  if(argc-optind != 2 || help_opt) {
+    fprintf(stdout, "Usage: km_assoc [options] <matrix> <labels>\n\n");
+    fprintf(stdout, "Test the association of the presence of each k-mer (count >= -a) with a\n");
+    fprintf(stdout, "binary phenotype. <labels> gives one \"SAMPLE LABEL\" pair per line, SAMPLE\n");
+    fprintf(stdout, "being a 1-based column or a range FIRST:LAST and LABEL 1 or case, 0 or\n");
+    fprintf(stdout, "control; unlabeled samples are left out. Output lines are the k-mer, the\n");
+    fprintf(stdout, "cases and the controls where it is present, and the p-value (tab-separated),\n");
+    fprintf(stdout, "in input order, or by increasing p-value with -n. The matrix may be text or\n");
+    fprintf(stdout, "Arrow IPC (detected).\n\n");
+    fprintf(stdout, "Options:\n");
+    fprintf(stdout, "  -m STR   test: fisher (exact, two-sided), chi2 (Pearson) [fisher]\n");
+    fprintf(stdout, "  -a INT   min abundance to define a k-mer as present in a sample [10]\n");
+    fprintf(stdout, "  -p FLOAT output k-mers with a p-value <= FLOAT [1e-5, 1 with -n]\n");
+    fprintf(stdout, "  -n INT   output the INT k-mers with the lowest p-values instead\n");
+    fprintf(stdout, "  -o FILE  write output to FILE [stdout]\n");
+    fprintf(stdout, "  -P STR   NUMA placement of threads and buffers: none, local, interleave [none]\n");
+    fprintf(stdout, "  -t INT   number of threads, 0 for all CPUs [1]\n");
+    fprintf(stdout, "  -v       verbose output\n");
+    fprintf(stdout, "      --metrics FILE  write run metrics (stage times, CPU counters) as JSON to FILE\n");
+    fprintf(stdout, "      --trace FILE    write a timeline of the threads in Chrome trace format to FILE\n");
+    fprintf(stdout, "  -h       print this help message\n");
+    return 0;
+  }
+
+  FILE *labelfile = fopen(argv[optind+1],"r");
+  if(labelfile == NULL) {
+    fprintf(stderr,"Cannot open file \"%s\"\n",argv[optind+1]);
+    return 1;
+  }
+  labels_t labels;
+  size_t bad = read_labels(labelfile, &labels);
+  fclose(labelfile);
+  if(bad || labels.n_case == 0 || labels.n_ctrl == 0) {
+    if(bad) { fprintf(stderr,"Invalid line %lu of \"%s\", expected SAMPLE LABEL\n",bad,argv[optind+1]); }
+    else { fprintf(stderr,"\"%s\" needs both cases and controls\n",argv[optind+1]); }
+    free_labels(&labels);
+    return 1;
+  }
+
+  FILE *matfile = km_arrow_fopen(argv[optind], 0, false);
+  if(matfile == NULL) {
+    fprintf(stderr,"Cannot open file \"%s\"\n",argv[optind]);
+    free_labels(&labels);
+    return 1;
+  }
+
+  FILE *outfile = out_fname ? fopen(out_fname,"w") : stdout;
+  if(outfile != stdout && outfile == NULL) {
+    fprintf(stderr,"Cannot open output file \"%s\"\n",out_fname);
+    fclose(matfile);
+    free_labels(&labels);
+    return 1;
+  }
+
+  if(metrics_fname) { km_metrics_init("km_assoc"); }
+  if(trace_fname) { km_trace_init(); }
+
+  assoc_job_t job = { .labels = &labels, .test = (test_t)test, .min_abund = (uint32_t)min_abund, .max_p = max_p, .top = (size_t)top };
+  uint32_t n = labels.n_case + labels.n_ctrl;
+  job.lf = (double *)malloc((n + 1)*sizeof(double));
+  job.lf[0] = 0;
+  for(uint32_t i=1; i<=n; ++i) { job.lf[i] = job.lf[i-1] + log((double)i); }
+  if(test == TEST_FISHER && (uint64_t)(labels.n_case + 1)*(labels.n_ctrl + 1) <= ASSOC_CACHE_MAX) {
+    job.cache = (_Atomic(double *) *)malloc((n + 1)*sizeof(*job.cache));
+    for(uint32_t k=0; k<=n; ++k) { atomic_init(&job.cache[k], NULL); }
+  }
+
+  km_numa_t *numa = n_threads > 1 ? km_numa_init(numa_policy) : NULL;
+  km_pool_t *pool = n_threads > 1 ? km_pool_create(n_threads, numa) : NULL;
+  km_chunk_engine_t eng = { .pool = pool, .format = assoc_chunk, .collect = collect_chunk, .arg = &job };
+  km_chunk_engine_init(&eng, fileno(matfile), outfile);
+  heap_t *chunk_best = NULL;
+  if(top) {
+    chunk_best = (heap_t *)calloc(eng.n_chunks, sizeof(heap_t));
+    for(size_t i=0; i<eng.n_chunks; ++i) { eng.chunks[i].state = &chunk_best[i]; }
+  }
+
+  // the number of samples is given by the first row
+  size_t first_len;
+  const char *first = km_chunk_peek_line(&eng, &first_len);
+  km_row_stats_t first_st = {0,0,0};
+  km_row_stats(km_skip_kmer(first, first + first_len), first + first_len, 1, &first_st);
+  job.n_samples = first_st.n_values;
+  if(labels.max_sample > job.n_samples) {
+    fprintf(stderr, "[warning] the labels refer to sample %u, the matrix has %lu samples (missing counts read as 0)\n", labels.max_sample, job.n_samples);
+  }
+
+  int ret = km_chunk_run(&eng, outfile, verbose_opt);
+  if(ret == 0 && top) {
+    qsort(job.best.hits, job.best.n, sizeof(hit_t), cmp_hit);
+    char *buf = NULL;
+    size_t buf_cap = 0;
+    for(size_t i=0; i<job.best.n && ret == 0; ++i) {
+      hit_t *h = &job.best.hits[i];
+      size_t kmer_len = strlen(h->kmer);
+      km_chunk_reserve(&buf, &buf_cap, kmer_len + 48);
+      size_t len = write_hit(buf, h->kmer, kmer_len, h->a, h->c, h->p) - buf;
+      if(fwrite(buf, 1, len, outfile) != len) { ret = 1; }
+    }
+    free(buf);
+    eng.n_kept = job.best.n;
+  }
+  if(ret) {
+    fprintf(stderr,"Cannot write output\n");
+  }
+
+  fprintf(stderr, "[info] %u\tcases\n", labels.n_case);
+  fprintf(stderr, "[info] %u\tcontrols\n", labels.n_ctrl);
+  fprintf(stderr, "[info] %lu\tk-mers tested\n", job.n_tests);
+  fprintf(stderr, "[info] %lu\tk-mers output\n", eng.n_kept);
+
+  if(km_metrics_write(metrics_fname, pool ? km_pool_json : NULL, pool)) {
+    fprintf(stderr,"Cannot write metrics file \"%s\"\n",metrics_fname);
+  }
+  if(km_trace_write(trace_fname, "km_assoc")) {
+    fprintf(stderr,"Cannot write trace file \"%s\"\n",trace_fname);
+  }
+  if(chunk_best) {
+    for(size_t i=0; i<eng.n_chunks; ++i) {
+      for(size_t j=0; j<chunk_best[i].n; ++j) { free(chunk_best[i].hits[j].kmer); }
+      free(chunk_best[i].hits);
+    }
+    free(chunk_best);
+  }
+  km_chunk_engine_free(&eng);
+  if(pool) {
+    if(verbose_opt || metrics_fname) { km_pool_report(pool, stderr); }
+    km_pool_destroy(pool);
+  }
+  km_numa_free(numa);
+  for(size_t i=0; i<job.best.n; ++i) { free(job.best.hits[i].kmer); }
+  free(job.best.hits);
+  if(job.cache) {
+    for(uint32_t k=0; k<=n; ++k) { free(atomic_load(&job.cache[k])); }
+    free(job.cache);
+  }
+  free(job.lf);
+  free_labels(&labels);
+  if(matfile != stdin){ fclose(matfile); }
+  if(outfile != stdout){ fclose(outfile); }
+
+  return ret;
+}
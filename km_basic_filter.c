@@ -6,18 +6,178 @@
 #include <stdbool.h>
 #include <string.h>
 
+#include "km_kernels.h"
+#include "km_chunk.h"
+#include "km_estimate.h"
+
+// rows longer than this are split in column segments counted by different threads
+#define WIDE_ROW_BYTES (1<<16)
+
+// column segment of a wide row, counted by a task of the pool
+typedef struct {
+  const char *beg, *end;
+  long min_abund;
+  km_row_stats_t st;
+} row_segment_t;
+
+void row_segment_task(void *arg) {
+  row_segment_t *seg = (row_segment_t *)arg;
+  seg->st = (km_row_stats_t){0,0,0};
+  km_row_stats(seg->beg, seg->end, seg->min_abund, &seg->st);
+}
+
+void row_stats_split(km_pool_t *pool, const char *beg, const char *end, long min_abund, km_row_stats_t *st) {
+  int n_seg = pool->n_threads;
+  const char *bounds[n_seg+1];
+  row_segment_t seg[n_seg];
+  km_row_split(beg, end, n_seg, bounds);
+  km_group_t group;
+  km_group_init(&group);
+  for(int i=0; i<n_seg; ++i) {
+    seg[i] = (row_segment_t){ bounds[i], bounds[i+1], min_abund, {0,0,0} };
+    km_pool_submit(pool, &group, row_segment_task, &seg[i]);
+  }
+  km_pool_wait(pool, &group);
+  for(int i=0; i<n_seg; ++i) {
+    st->n_values += seg[i].st.n_values;
+    st->n_zeros += seg[i].st.n_zeros;
+    st->n_present += seg[i].st.n_present;
+  }
+}
+
+typedef struct {
+  int min_zeros, min_nz;
+  long min_abund;
+  double min_zero_frac, min_nz_frac;
+  bool min_zero_frac_opt, min_nz_frac_opt;
+  size_t n_samples;
+  km_pool_t *pool;
+  const km_arrow_writer_t *arrow;
+} filter_t;
+
+bool keep_row(const filter_t *flt, const km_row_stats_t *st) {
+  size_t n_zeros = st->n_zeros, n_present = st->n_present, n_samples = flt->n_samples;
+  bool enough_zeros = (flt->min_zero_frac_opt && n_zeros >= flt->min_zero_frac*n_samples) || (!flt->min_zero_frac_opt && n_zeros >= flt->min_zeros);
+  bool enough_nz = (flt->min_nz_frac_opt && n_present >= flt->min_nz_frac*n_samples) || (!flt->min_nz_frac_opt && n_present >= flt->min_nz);
+  return enough_zeros && enough_nz;
+}
+
+void filter_chunk(km_chunk_t *chunk, void *arg) {
+  const filter_t *flt = (const filter_t *)arg;
+  size_t pos = 0, len, line_num = 0;
+  char *line;
+  while(km_chunk_next_line(chunk, &pos, &line, &len)) {
+    ++line_num;
+    const char *end = line + len;
+    const char *counts = km_skip_kmer(line, end);
+    if(counts == line || km_isblank(counts[-1])) { continue; } // skip empty lines
+    ++chunk->n_records;
+
+    km_row_stats_t st = {0,0,0};
+    if(flt->pool && end - counts >= WIDE_ROW_BYTES) {
+      row_stats_split(flt->pool, counts, end, flt->min_abund, &st);
+    } else {
+      km_row_stats(counts, end, flt->min_abund, &st);
+    }
+    if(keep_row(flt, &st)) {
+      uint64_t key;
+      if(flt->arrow && (counts - line != flt->arrow->ksize || !km_pack(line, flt->arrow->ksize, flt->arrow->code, &key) || st.n_values != flt->n_samples)) {
+        km_chunk_error(chunk, "[error] cannot write line %zu in Arrow format: %.*s\n", line_num, line, len);
+        return;
+      }
+      ++chunk->n_kept;
+      km_chunk_write(chunk, line, len + (end < chunk->data + chunk->len)); // with its newline if any
+    }
+  }
+}
+
+// --estimate: total and retained k-mers, output size and runtime of the filter
+// from a sample of blocks of the matrix, without filtering it.
+int estimate_filter(const char *path, filter_t *flt, long n_blocks) {
+  uint64_t size;
+  const char *err;
+  int fd = km_estimate_open(path, &size, &err);
+  if(fd < 0) {
+    fprintf(stderr,"[error] cannot estimate from \"%s\": %s\n",path,err);
+    return 1;
+  }
+  km_preader_t rd;
+  km_preader_init(&rd, fd, size);
+  const char *line;
+  size_t len;
+  uint64_t line_off;
+  if(km_preader_line(&rd, &line, &len, &line_off)) { // the number of samples is given by the first row
+    km_row_stats_t st = {0,0,0};
+    km_row_stats(km_skip_kmer(line, line + len), line + len, flt->min_abund, &st);
+    flt->n_samples = st.n_values;
+  }
+
+  uint64_t B = KM_ESTIMATE_BLOCK_BYTES, N = (size + B - 1)/B, b;
+  km_sampling_t smp;
+  km_sampling_init(&smp, N, n_blocks, 0x6b6d5f66696c7472ULL);
+  km_est_t rows = {0}, kept = {0}, bytes = {0}, ns = {0};
+  uint64_t read_bytes = 0;
+  while(km_sampling_next(&smp, &b)) {
+    uint64_t t0 = km_estimate_now_ns();
+    uint64_t block_end = (b+1)*B < size ? (b+1)*B : size;
+    size_t n_rows = 0, n_kept = 0, n_bytes = 0;
+    km_preader_seek(&rd, km_preader_line_start(&rd, b*B));
+    while(rd.off < block_end && km_preader_line(&rd, &line, &len, &line_off)) {
+      const char *end = line + len;
+      const char *counts = km_skip_kmer(line, end);
+      if(counts == line || km_isblank(counts[-1])) { continue; }
+      ++n_rows;
+      km_row_stats_t st = {0,0,0};
+      km_row_stats(counts, end, flt->min_abund, &st);
+      if(keep_row(flt, &st)) { ++n_kept; n_bytes += len + (rd.off > line_off + len); }
+    }
+    double x = block_end - b*B;
+    read_bytes += x;
+    km_est_add(&rows, n_rows, x);
+    km_est_add(&kept, n_kept, x);
+    km_est_add(&bytes, n_bytes, x);
+    km_est_add(&ns, km_estimate_now_ns() - t0, x);
+  }
+  km_preader_free(&rd);
+  close(fd);
+
+  double half, total;
+  fprintf(stderr, "[info] estimate: %lu of %lu blocks of %lu bytes read (%.1f%% of the matrix)\n", smp.n, N, B, size ? 100.0*read_bytes/size : 100.0);
+  fprintf(stderr, "[info] %lu\tsamples\n", flt->n_samples);
+  total = km_est_total(&rows, smp.n, N, size, &half);
+  km_est_print(stderr, "total k-mers", total, half, 0);
+  total = km_est_total(&kept, smp.n, N, size, &half);
+  km_est_print(stderr, "retained k-mers", total, half, 0);
+  total = km_est_total(&bytes, smp.n, N, size, &half);
+  km_est_print(stderr, "output bytes (text)", total, half, 0);
+  total = km_est_total(&ns, smp.n, N, size, &half);
+  km_est_print(stderr, "seconds (1 thread)", total*1e-9, half*1e-9, 2);
+  return 0;
+}
+
 
 int main(int argc, char **argv) {
 
-  int min_zeros=10, min_nz=10, min_abund=10;
+  int min_zeros=10, min_nz=10, min_abund=10, n_threads=1;
+  int numa_policy = KM_NUMA_NONE;
+  int format = KM_FORMAT_TEXT;
+  long estimate_blocks = 0;
   double min_zero_frac=0.5, min_nz_frac=0.1;
-  char *out_fname = NULL;
+  char *out_fname = NULL, *metrics_fname = NULL, *trace_fname = NULL;
   bool verbose_opt=false, help_opt=false;
   
   bool min_zero_frac_opt=false, min_nz_frac_opt=false;
 
+  static struct option long_opts[] = {
+    {"metrics", required_argument, NULL, KM_OPT_METRICS},
+    {"trace", required_argument, NULL, KM_OPT_TRACE},
+    {"format", required_argument, NULL, KM_OPT_FORMAT},
+    {"estimate", optional_argument, NULL, KM_OPT_ESTIMATE},
+    {NULL, 0, NULL, 0}
+  };
+
   int c;
-  while ((c = getopt(argc, argv, "a:f:F:n:N:o:vh")) != -1) {
+  while ((c = getopt_long(argc, argv, "a:f:F:n:N:o:P:t:vh", long_opts, NULL)) != -1) {
     switch (c) {
       case 'a':
         min_abund = strtol(optarg, NULL, 10);
@@ -39,12 +199,42 @@ int main(int argc, char **argv) {
         min_nz_frac_opt = true;
         min_nz_frac = atof(optarg);
         break;
+      case 'P':
+        numa_policy = km_numa_policy(optarg);
+        if(numa_policy < 0) {
+          fprintf(stderr, "[error] unknown NUMA placement \"%s\".\n", optarg);
+          return 1;
+        }
+        break;
+      case 't':
+        n_threads = km_pool_threads(optarg);
+        break;
       case 'v':
         verbose_opt = true;
         break;
       case 'h':
         help_opt = true;
         break;
+      case KM_OPT_METRICS:
+        metrics_fname = optarg;
+        break;
+      case KM_OPT_TRACE:
+        trace_fname = optarg;
+        break;
+      case KM_OPT_FORMAT:
+        format = km_format(optarg);
+        if(format < 0) {
+          fprintf(stderr, "[error] unknown output format \"%s\".\n", optarg);
+          return 1;
+        }
+        break;
+      case KM_OPT_ESTIMATE:
+        estimate_blocks = optarg ? strtol(optarg, NULL, 10) : KM_ESTIMATE_BLOCKS;
+        if(estimate_blocks <= 0) {
+          fprintf(stderr, "[error] --estimate needs a positive number of blocks.\n");
+          return 1;
+        }
+        break;
       case '?':
         return 1;
       default:
@@ -64,7 +254,8 @@ int main(int argc, char **argv) {
   if(argc-optind != 1 || help_opt) {
     fprintf(stdout, "Usage: km_basic_filter [options] <in.mat>\n\n");
 
-    fprintf(stdout, "Filter a matrix by selecting k-mers that are potentially differential.\n\n");
+    fprintf(stdout, "Filter a matrix by selecting k-mers that are potentially differential.\n");
+    fprintf(stdout, "The input matrix may be text or an Arrow IPC file or stream (detected).\n\n");
     
     fprintf(stdout, "Options:\n");
     fprintf(stdout, "  -a INT    min abundance to define a k-mer as present in a sample [10]\n");
@@ -73,12 +264,28 @@ int main(int argc, char **argv) {
     fprintf(stdout, "  -N INT    min number of samples for which a k-mer should be present [10]\n");
     fprintf(stdout, "  -F FLOAT  fraction of samples for which a k-mer should be present (overrides -N)\n");
     fprintf(stdout, "  -o FILE   output filtered matrix to FILE [stdout]\n");
+    fprintf(stdout, "  -P STR    NUMA placement of threads and buffers: none, local, interleave [none]\n");
+    fprintf(stdout, "  -t INT    number of threads, 0 for all CPUs [1]\n");
     fprintf(stdout, "  -v        verbose output\n");
+    fprintf(stdout, "      --format STR    output format: text, arrow (IPC file), arrow-stream (IPC stream) [text]\n");
+    fprintf(stdout, "      --estimate[=INT] only estimate the retained k-mers, output size and runtime\n");
+    fprintf(stdout, "                      (95%% intervals) from INT sampled blocks of 64 KiB [256]\n");
+    fprintf(stdout, "      --metrics FILE  write run metrics (stage times, CPU counters) as JSON to FILE\n");
+    fprintf(stdout, "      --trace FILE    write a timeline of the threads in Chrome trace format to FILE\n");
     fprintf(stdout, "  -h        print this help message\n");
     return 0;
   }
 
-  FILE *matfile = strcmp(argv[optind],"-") ? fopen(argv[optind],"r") : stdin;
+  if(estimate_blocks) {
+    filter_t flt = {
+      .min_zeros = min_zeros, .min_nz = min_nz, .min_abund = min_abund,
+      .min_zero_frac = min_zero_frac, .min_nz_frac = min_nz_frac,
+      .min_zero_frac_opt = min_zero_frac_opt, .min_nz_frac_opt = min_nz_frac_opt
+    };
+    return estimate_filter(argv[optind], &flt, estimate_blocks);
+  }
+
+  FILE *matfile = km_arrow_fopen(argv[optind], 0, false);
   if(matfile == NULL) { 
     fprintf(stderr,"[error] cannot open file \"%s\"\n",argv[optind]);
     return 1;
@@ -91,52 +298,75 @@ int main(int argc, char **argv) {
     return 1;
   }
 
-  size_t n_samples = 0, n_kmers = 0, n_retrieved = 0;
-
-  char *line = NULL, *line_cpy = NULL;
-  size_t line_size = 0, line_cpy_size = 0;
-  ssize_t ch_read = getline(&line, &line_size, matfile);
-  while(ch_read >= 0) {
+  if(metrics_fname) { km_metrics_init("km_basic_filter"); }
+  if(trace_fname) { km_trace_init(); }
 
-    if(line_cpy_size < line_size) {
-      line_cpy_size = line_size;
-      line_cpy = (char*)realloc(line_cpy,line_cpy_size);
-    }
-    line_cpy = strcpy(line_cpy,line);
+  // rows are filtered by chunks, each wide row being further split in column segments
+  km_numa_t *numa = n_threads > 1 ? km_numa_init(numa_policy) : NULL;
+  km_pool_t *pool = n_threads > 1 ? km_pool_create(n_threads, numa) : NULL;
+  filter_t flt = {
+    .min_zeros = min_zeros, .min_nz = min_nz, .min_abund = min_abund,
+    .min_zero_frac = min_zero_frac, .min_nz_frac = min_nz_frac,
+    .min_zero_frac_opt = min_zero_frac_opt, .min_nz_frac_opt = min_nz_frac_opt,
+    .pool = pool
+  };
+  km_chunk_engine_t eng = { .pool = pool, .format = filter_chunk, .arg = &flt };
+  km_chunk_engine_init(&eng, fileno(matfile), outfile);
 
-    char *elem = strtok(line," \t\n");
-    if(elem == NULL){ continue; } // skip empty lines
-    ++n_kmers;
+  // the number of samples is given by the first row
+  size_t first_len;
+  const char *first = km_chunk_peek_line(&eng, &first_len);
+  km_row_stats_t first_st = {0,0,0};
+  km_row_stats(km_skip_kmer(first, first + first_len), first + first_len, min_abund, &first_st);
+  flt.n_samples = first_st.n_values;
 
-    size_t n_zeros = 0, n_present = 0;
-    while((elem = strtok(NULL," \t\n")) != NULL) {
-      if(n_kmers == 1){ 
-        ++n_samples; 
-      }
-      long val = strtol(elem,NULL,10);
-      if(val == 0){ ++n_zeros; } else if(val >= min_abund){ ++n_present; }
+  // Arrow output: k-mers of the size of the first one, packed on 64 bits
+  int ret = 0;
+  km_arrow_writer_t arrow;
+  if(format != KM_FORMAT_TEXT) {
+    const char *first_kmer = first;
+    while(first_kmer < first + first_len && km_isblank(*first_kmer)) { ++first_kmer; }
+    int ksize = km_skip_kmer(first, first + first_len) - first_kmer;
+    km_arrow_writer_init(&arrow, format, ksize > 0 && ksize <= 32 ? ksize : 31, false);
+    arrow.n_samples = flt.n_samples;
+    flt.arrow = &arrow;
+    if(ksize > 32) {
+      fprintf(stderr, "[error] Arrow output requires k <= 32.\n");
+      ret = 1;
+    } else if(!km_chunk_arrow_start(&eng, &arrow, outfile)) {
+      fprintf(stderr,"[error] cannot write output\n");
+      ret = 1;
     }
+  }
 
-    bool enough_zeros = (min_zero_frac_opt && n_zeros >= min_zero_frac*n_samples) || (!min_zero_frac_opt && n_zeros >= min_zeros);
-    bool enough_nz = (min_nz_frac_opt && n_present >= min_nz_frac*n_samples) || (!min_nz_frac_opt && n_present >= min_nz);
-    if(enough_zeros && enough_nz) {
-      ++n_retrieved;
-      fputs(line_cpy, outfile);
+  if(ret == 0) {
+    ret = km_chunk_run(&eng, outfile, verbose_opt);
+    if(ret == 0 && eng.arrow && !km_arrow_finish(&arrow, outfile)) { ret = 1; }
+    if(ret) {
+      fprintf(stderr,"[error] cannot write output\n");
     }
+    size_t n_samples = flt.n_samples, n_kmers = eng.n_records, n_retrieved = eng.n_kept;
 
-    if(verbose_opt && (n_kmers & ((1U<<20)-1)) == 0) {
-      fprintf(stderr, "%lu k-mers processed, %lu retrieved\n", n_kmers, n_retrieved);
-    }
-    ch_read = getline(&line, &line_size, matfile);
+    fprintf(stderr, "[info] %lu\tsamples\n", n_samples);
+    fprintf(stderr, "[info] %lu\ttotal k-mers\n", n_kmers);
+    fprintf(stderr, "[info] %lu\tretained k-mers\n", n_retrieved);
   }
 
-  fprintf(stderr, "[info] %lu\tsamples\n", n_samples);
-  fprintf(stderr, "[info] %lu\ttotal k-mers\n", n_kmers);
-  fprintf(stderr, "[info] %lu\tretained k-mers\n", n_retrieved);
-
-  free(line); free(line_cpy);
+  if(km_metrics_write(metrics_fname, pool ? km_pool_json : NULL, pool)) {
+    fprintf(stderr,"[error] cannot write metrics file \"%s\"\n",metrics_fname);
+  }
+  if(km_trace_write(trace_fname, "km_basic_filter")) {
+    fprintf(stderr,"[error] cannot write trace file \"%s\"\n",trace_fname);
+  }
+  km_chunk_engine_free(&eng);
+  if(pool) {
+    if(verbose_opt || metrics_fname) { km_pool_report(pool, stderr); }
+    km_pool_destroy(pool);
+  }
+  km_numa_free(numa);
+  if(flt.arrow) { km_arrow_writer_free(&arrow); }
   if(matfile != stdin){ fclose(matfile); }
   if(outfile != stdout){ fclose(outfile); }
 
-  return 0;
+  return ret;
 }
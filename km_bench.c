@@ -0,0 +1,527 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#include "km_kernels.h"
+#include "km_stree.h"
+
+// Microbenchmarks of the hot kernels of the tools on synthetic data. Each kernel
+// is timed in its reference (scalar, as in the original tools) and fast
+// variants, reporting ns per element and input bytes per cycle, and every fast
+// variant is checked to give the same result as the reference.
+
+static const int isnuc[256] = {
+      0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,
+      0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,
+      0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,
+      0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,
+      0,   1,   0,   1,   0,   0,   0,   1,   0,   0,   0,   0,   0,   0,   1,   0,
+      0,   0,   0,   0,   1,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,
+      0,   1,   0,   1,   0,   0,   0,   1,   0,   0,   0,   0,   0,   0,   1,   0,
+      0,   0,   0,   0,   1,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,
+      0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,
+      0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,
+      0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,
+      0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,
+      0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,
+      0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,
+      0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,
+      0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0
+};
+
+static const unsigned char rctable[256] = {
+      0,   1,   2,   3,   4,   5,   6,   7,   8,   9,  10,  11,  12,  13,  14,  15,
+     16,  17,  18,  19,  20,  21,  22,  23,  24,  25,  26,  27,  28,  29,  30,  31,
+     32,  33,  34,  35,  36,  37,  38,  39,  40,  41,  42,  43,  44,  45,  46,  47,
+     48,  49,  50,  51,  52,  53,  54,  55,  56,  57,  58,  59,  60,  61,  62,  63,
+     64, 'T',  66, 'G',  68,  69,  70, 'C',  72,  73,  74,  75,  76,  77, 'N',  79,
+     80,  81,  82,  83, 'A',  85,  86,  87,  88,  89,  90,  91,  92,  93,  94,  95,
+     96, 't',  98, 'g', 100, 101, 102, 'c', 104, 105, 106, 107, 108, 109, 'n', 111,
+    112, 113, 114, 115, 'a', 117, 118, 119, 120, 121, 122, 123, 124, 125, 126, 127,
+    128, 129, 130, 131, 132, 133, 134, 135, 136, 137, 138, 139, 140, 141, 142, 143,
+    144, 145, 146, 147, 148, 149, 150, 151, 152, 153, 154, 155, 156, 157, 158, 159,
+    160, 161, 162, 163, 164, 165, 166, 167, 168, 169, 170, 171, 172, 173, 174, 175,
+    176, 177, 178, 179, 180, 181, 182, 183, 184, 185, 186, 187, 188, 189, 190, 191,
+    192, 193, 194, 195, 196, 197, 198, 199, 200, 201, 202, 203, 204, 205, 206, 207,
+    208, 209, 210, 211, 212, 213, 214, 215, 216, 217, 218, 219, 220, 221, 222, 223,
+    224, 225, 226, 227, 228, 229, 230, 231, 232, 233, 234, 235, 236, 237, 238, 239,
+    240, 241, 242, 243, 244, 245, 246, 247, 248, 249, 250, 251, 252, 253, 254, 255
+};
+
+const int n2kt[256] = {
+  1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+  1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+  1, 0, 1, 1, 1, 1, 1, 3, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 2, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+  1, 0, 1, 1, 1, 1, 1, 3, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 2, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+  1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+  1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+  1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+  1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1
+};
+
+int ktcmp(const char *k1, const char *k2) {
+  while(*k1 && (*k1 == *k2)){ k1++; k2++; }
+  return n2kt[*(const unsigned char *)k1] - n2kt[*(const unsigned char *)k2];
+}
+
+static bool is_acgt(const char *s, int k) {
+  for(int i=0; i<k; ++i) {
+    if(s[i] != 'A' && s[i] != 'C' && s[i] != 'G' && s[i] != 'T') { return false; }
+  }
+  return true;
+}
+
+static inline int sign(long x) { return (x > 0) - (x < 0); }
+
+static uint64_t rng_state = 0x9e3779b97f4a7c15ULL;
+static inline uint64_t rng() { // splitmix64
+  uint64_t z = (rng_state += 0x9e3779b97f4a7c15ULL);
+  z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+  return z ^ (z >> 31);
+}
+
+static inline uint64_t now_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec*1000000000ULL + ts.tv_nsec;
+}
+
+static inline uint64_t cycles() {
+#if defined(__x86_64__) || defined(__i386__)
+  return __rdtsc();
+#else
+  return 0;
+#endif
+}
+
+// benchmark parameters and results shared by the kernels
+typedef struct {
+  int ksize, repeats;
+  size_t n;             // elements per run
+  char *kmers;          // n k-mers of ksize characters, packed without separator
+  char *kmers_b;        // n other k-mers sharing a prefix with kmers
+  uint64_t *packed[2], *packed_b[2]; // keys of kmers and kmers_b, lexicographic and kmtricks codes (0 if invalid)
+  char *rows;           // n matrix rows of counts, newline-terminated
+  size_t *row_off;      // n+1 offsets of the rows
+  int n_samples;
+  uint64_t *keys;       // sorted packed keys
+  size_t n_keys;
+  bool all_ok;
+} bench_t;
+
+typedef uint64_t (*kernel_fn)(bench_t *b, void *out);
+
+// Times fn over the best of b->repeats runs and prints one report line.
+static uint64_t run(bench_t *b, const char *kernel, const char *variant, kernel_fn fn, void *out, size_t bytes) {
+  uint64_t best_ns = UINT64_MAX, best_cyc = UINT64_MAX, res = 0;
+  for(int r=0; r<b->repeats; ++r) {
+    uint64_t t0 = now_ns(), c0 = cycles();
+    res = fn(b, out);
+    uint64_t c1 = cycles(), t1 = now_ns();
+    if(t1-t0 < best_ns) { best_ns = t1-t0; best_cyc = c1-c0; }
+  }
+  fprintf(stdout, "%-10s %-16s %9.2f ns/elem", kernel, variant, (double)best_ns/b->n);
+  if(best_cyc) {
+    fprintf(stdout, " %8.3f B/cycle\n", (double)bytes/best_cyc);
+  } else {
+    fprintf(stdout, "        n/a B/cycle\n");
+  }
+  return res;
+}
+
+static void check(bench_t *b, const char *kernel, const char *variant, bool ok) {
+  fprintf(stdout, "%-10s %-16s equivalence %s\n", kernel, variant, ok ? "OK" : "FAILED");
+  if(!ok) { b->all_ok = false; }
+}
+
+// --- k-mer comparison: strcmp and ktcmp on strings, packed keys compared as
+// integers (packed before the runs, as the tools pack a k-mer once and then
+// compare it)
+
+static uint64_t cmp_strcmp(bench_t *b, void *out) {
+  int8_t *res = (int8_t *)out;
+  char x[64], y[64];
+  uint64_t sum = 0;
+  x[b->ksize] = y[b->ksize] = '\0';
+  for(size_t i=0; i<b->n; ++i) {
+    memcpy(x, b->kmers + i*b->ksize, b->ksize);
+    memcpy(y, b->kmers_b + i*b->ksize, b->ksize);
+    res[i] = sign(strcmp(x, y));
+    sum += res[i];
+  }
+  return sum;
+}
+
+static uint64_t cmp_ktcmp(bench_t *b, void *out) {
+  int8_t *res = (int8_t *)out;
+  char x[64], y[64];
+  uint64_t sum = 0;
+  x[b->ksize] = y[b->ksize] = '\0';
+  for(size_t i=0; i<b->n; ++i) {
+    memcpy(x, b->kmers + i*b->ksize, b->ksize);
+    memcpy(y, b->kmers_b + i*b->ksize, b->ksize);
+    res[i] = sign(ktcmp(x, y));
+    sum += res[i];
+  }
+  return sum;
+}
+
+static uint64_t cmp_packed(bench_t *b, int code, int8_t *res) {
+  const uint64_t *x = b->packed[code], *y = b->packed_b[code];
+  uint64_t sum = 0;
+  for(size_t i=0; i<b->n; ++i) {
+    res[i] = (x[i] > y[i]) - (x[i] < y[i]);
+    sum += res[i];
+  }
+  return sum;
+}
+static uint64_t cmp_packed_lex(bench_t *b, void *out) { return cmp_packed(b, 0, (int8_t *)out); }
+static uint64_t cmp_packed_kt(bench_t *b, void *out) { return cmp_packed(b, 1, (int8_t *)out); }
+
+// --- row parsing: strtok+strtol as the original km_basic_filter, km_row_stats
+
+static uint64_t parse_strtok(bench_t *b, void *out) {
+  km_row_stats_t *st = (km_row_stats_t *)out;
+  memset(st, 0, sizeof(*st));
+  size_t max_len = 0;
+  for(size_t i=0; i<b->n; ++i) {
+    size_t len = b->row_off[i+1] - b->row_off[i];
+    if(len > max_len) { max_len = len; }
+  }
+  char *line = (char *)malloc(max_len+1);
+  for(size_t i=0; i<b->n; ++i) {
+    size_t len = b->row_off[i+1] - b->row_off[i];
+    memcpy(line, b->rows + b->row_off[i], len);
+    line[len] = '\0';
+    char *elem = strtok(line," \t\n");
+    while((elem = strtok(NULL," \t\n")) != NULL) {
+      long val = strtol(elem,NULL,10);
+      ++st->n_values;
+      if(val == 0) { ++st->n_zeros; } else if(val >= 2) { ++st->n_present; }
+    }
+  }
+  free(line);
+  return st->n_values;
+}
+
+static uint64_t parse_row_stats(bench_t *b, void *out) {
+  km_row_stats_t *st = (km_row_stats_t *)out;
+  memset(st, 0, sizeof(*st));
+  for(size_t i=0; i<b->n; ++i) {
+    const char *beg = b->rows + b->row_off[i], *end = b->rows + b->row_off[i+1];
+    km_row_stats(km_skip_kmer(beg, end), end, 2, st);
+  }
+  return st->n_values;
+}
+
+// --- reverse complement: rctable swaps as km_reverse, SWAR km_revcomp
+
+static uint64_t rc_table(bench_t *b, void *out) {
+  char *s = (char *)out;
+  int k = b->ksize;
+  memcpy(s, b->kmers_b, b->n*k);
+  for(size_t i=0; i<b->n; ++i) {
+    char *line = s + i*k;
+    for(int j=0; j<(k+1)/2; ++j) {
+      unsigned char first = line[j];
+      line[j] = rctable[(int)line[k-j-1]];
+      line[k-j-1] = rctable[first];
+    }
+  }
+  return (unsigned char)s[0];
+}
+
+static uint64_t rc_swar(bench_t *b, void *out) {
+  char *s = (char *)out;
+  int k = b->ksize;
+  memcpy(s, b->kmers_b, b->n*k);
+  for(size_t i=0; i<b->n; ++i) { km_revcomp(s + i*k, k); }
+  return (unsigned char)s[0];
+}
+
+// --- k-mer validation: isnuc loop, SWAR km_is_kmer
+
+static uint64_t valid_isnuc(bench_t *b, void *out) {
+  uint8_t *res = (uint8_t *)out;
+  uint64_t n_valid = 0;
+  for(size_t i=0; i<b->n; ++i) {
+    const char *s = b->kmers_b + i*b->ksize;
+    int j = 0;
+    while(j < b->ksize && isnuc[(unsigned char)s[j]]) { ++j; }
+    res[i] = j == b->ksize;
+    n_valid += res[i];
+  }
+  return n_valid;
+}
+
+static uint64_t valid_swar(bench_t *b, void *out) {
+  uint8_t *res = (uint8_t *)out;
+  uint64_t n_valid = 0;
+  for(size_t i=0; i<b->n; ++i) {
+    res[i] = km_is_kmer(b->kmers_b + i*b->ksize, b->ksize);
+    n_valid += res[i];
+  }
+  return n_valid;
+}
+
+// --- membership of packed keys: binary search in the sorted keys, open
+// addressing hash table with linear probing, static search tree (one lookup
+// at a time, or batched)
+
+typedef struct {
+  uint64_t *slots;
+  size_t mask;
+} key_table_t;
+
+static key_table_t table;
+static const uint64_t EMPTY = UINT64_MAX;
+
+static inline uint64_t mix(uint64_t x) {
+  x ^= x >> 33;
+  x *= 0xff51afd7ed558ccdULL;
+  return x ^ (x >> 33);
+}
+
+static void table_build(bench_t *b) {
+  size_t size = 1;
+  while(size < 2*b->n_keys) { size <<= 1; }
+  table.slots = (uint64_t *)malloc(size*sizeof(uint64_t));
+  memset(table.slots, 0xff, size*sizeof(uint64_t));
+  table.mask = size-1;
+  for(size_t i=0; i<b->n_keys; ++i) {
+    size_t h = mix(b->keys[i]) & table.mask;
+    while(table.slots[h] != EMPTY && table.slots[h] != b->keys[i]) { h = (h+1) & table.mask; }
+    table.slots[h] = b->keys[i];
+  }
+}
+
+static uint64_t probe_bsearch(bench_t *b, void *out) {
+  uint8_t *res = (uint8_t *)out;
+  uint64_t found = 0, key = 0;
+  for(size_t i=0; i<b->n; ++i) {
+    km_pack(b->kmers + i*b->ksize, b->ksize, nt2bits, &key);
+    size_t lo = 0, hi = b->n_keys;
+    while(lo < hi) {
+      size_t mid = lo + (hi-lo)/2;
+      if(b->keys[mid] < key) { lo = mid+1; } else { hi = mid; }
+    }
+    res[i] = lo < b->n_keys && b->keys[lo] == key;
+    found += res[i];
+  }
+  return found;
+}
+
+static uint64_t probe_hash(bench_t *b, void *out) {
+  uint8_t *res = (uint8_t *)out;
+  uint64_t found = 0, key = 0;
+  for(size_t i=0; i<b->n; ++i) {
+    km_pack(b->kmers + i*b->ksize, b->ksize, nt2bits, &key);
+    size_t h = mix(key) & table.mask;
+    while(table.slots[h] != EMPTY && table.slots[h] != key) { h = (h+1) & table.mask; }
+    res[i] = table.slots[h] == key;
+    found += res[i];
+  }
+  return found;
+}
+
+static km_stree_t stree;
+
+static uint64_t probe_stree(bench_t *b, void *out) {
+  uint8_t *res = (uint8_t *)out;
+  uint64_t found = 0, key = 0;
+  for(size_t i=0; i<b->n; ++i) {
+    km_pack(b->kmers + i*b->ksize, b->ksize, nt2bits, &key);
+    res[i] = km_stree_has(&stree, key);
+    found += res[i];
+  }
+  return found;
+}
+
+static uint64_t probe_stree_batch(bench_t *b, void *out) {
+  uint8_t *res = (uint8_t *)out;
+  uint64_t found = 0, keys[256];
+  size_t rank[256];
+  for(size_t beg=0; beg<b->n; beg += 256) {
+    size_t n = b->n - beg < 256 ? b->n - beg : 256;
+    for(size_t i=0; i<n; ++i) { km_pack(b->kmers + (beg+i)*b->ksize, b->ksize, nt2bits, &keys[i]); }
+    km_stree_find_batch(&stree, keys, n, rank);
+    for(size_t i=0; i<n; ++i) {
+      res[beg+i] = rank[i] != SIZE_MAX;
+      found += res[beg+i];
+    }
+  }
+  return found;
+}
+
+static int cmp_keys(const void *x, const void *y) {
+  uint64_t a = *(const uint64_t *)x, b = *(const uint64_t *)y;
+  return (a > b) - (a < b);
+}
+
+static void generate(bench_t *b) {
+  static const char nuc[4] = { 'A', 'C', 'G', 'T' };
+  int k = b->ksize;
+  b->kmers = (char *)malloc(b->n*k);
+  b->kmers_b = (char *)malloc(b->n*k);
+  for(size_t i=0; i<b->n; ++i) {
+    char *x = b->kmers + i*k, *y = b->kmers_b + i*k;
+    for(int j=0; j<k; ++j) { x[j] = nuc[rng() & 3]; }
+    // y shares a random prefix of x, as consecutive k-mers of a sorted matrix
+    int common = rng() % (k+1);
+    memcpy(y, x, common);
+    for(int j=common; j<k; ++j) { y[j] = nuc[rng() & 3]; }
+    // a few soft-masked, ambiguous or invalid characters
+    if(rng() % 16 == 0) { y[rng() % k] = "acgtNn-X"[rng() % 8]; }
+  }
+  for(int c=0; c<2; ++c) {
+    const uint8_t *code = c ? nt2bits_kt : nt2bits;
+    b->packed[c] = (uint64_t *)malloc(b->n*sizeof(uint64_t));
+    b->packed_b[c] = (uint64_t *)malloc(b->n*sizeof(uint64_t));
+    for(size_t i=0; i<b->n; ++i) {
+      if(!km_pack(b->kmers + i*k, k, code, &b->packed[c][i])) { b->packed[c][i] = 0; }
+      if(!km_pack(b->kmers_b + i*k, k, code, &b->packed_b[c][i])) { b->packed_b[c][i] = 0; }
+    }
+  }
+
+  b->row_off = (size_t *)malloc((b->n+1)*sizeof(size_t));
+  size_t cap = b->n*(k + 4*b->n_samples + 1), len = 0;
+  b->rows = (char *)malloc(cap);
+  for(size_t i=0; i<b->n; ++i) {
+    b->row_off[i] = len;
+    memcpy(b->rows + len, b->kmers + i*k, k);
+    len += k;
+    for(int s=0; s<b->n_samples; ++s) {
+      unsigned v = rng() % 4 == 0 ? 0 : rng() % 200;
+      len += snprintf(b->rows + len, cap - len, " %u", v);
+    }
+    b->rows[len++] = '\n';
+  }
+  b->row_off[b->n] = len;
+
+  // half of the probed k-mers are present
+  b->n_keys = 0;
+  b->keys = (uint64_t *)malloc(b->n*sizeof(uint64_t));
+  for(size_t i=0; i<b->n; i += 2) {
+    km_pack(b->kmers + i*k, k, nt2bits, &b->keys[b->n_keys++]);
+  }
+  qsort(b->keys, b->n_keys, sizeof(uint64_t), cmp_keys);
+}
+
+
+int main(int argc, char **argv) {
+
+  bench_t b = { .ksize = 31, .repeats = 5, .n = 1000000, .n_samples = 16, .all_ok = true };
+  bool help_opt = false;
+
+  int c;
+  while ((c = getopt(argc, argv, "k:n:r:s:h")) != -1) {
+    switch (c) {
+      case 'k':
+        b.ksize = strtol(optarg, NULL, 10);
+        break;
+      case 'n':
+        b.n = strtoul(optarg, NULL, 10);
+        break;
+      case 'r':
+        b.repeats = strtol(optarg, NULL, 10);
+        break;
+      case 's':
+        b.n_samples = strtol(optarg, NULL, 10);
+        break;
+      case 'h':
+        help_opt = true;
+        break;
+      case '?':
+        return 1;
+      default:
+        abort();
+    }
+  }
+
+  if(help_opt) {
+    fprintf(stdout, "Usage: km_bench [options]\n\n");
+    fprintf(stdout, "Time the reference and fast variants of the kernels of the tools on synthetic\n");
+    fprintf(stdout, "data, and check that the fast variants give the same results.\n");
+    fprintf(stdout, "Bytes per cycle are input bytes per time-stamp counter tick (x86 only).\n\n");
+    fprintf(stdout, "Options:\n");
+    fprintf(stdout, "  -k INT   size of k-mers, at most 32 [31]\n");
+    fprintf(stdout, "  -n INT   number of elements (k-mers, rows) per run [1000000]\n");
+    fprintf(stdout, "  -r INT   runs of each kernel, the best one is reported [5]\n");
+    fprintf(stdout, "  -s INT   samples per matrix row [16]\n");
+    fprintf(stdout, "  -h       print this help message\n");
+    return 0;
+  }
+
+  if(b.ksize <= 0 || b.ksize > 32) {
+    fprintf(stderr, "Invalid value of k: %d\n", b.ksize);
+    return 1;
+  }
+  if(b.n == 0 || b.repeats <= 0 || b.n_samples <= 0) {
+    fprintf(stderr, "Invalid number of elements, runs or samples\n");
+    return 1;
+  }
+
+  generate(&b);
+  size_t kbytes = b.n*b.ksize;
+  int8_t *r1 = (int8_t *)malloc(b.n), *r2 = (int8_t *)malloc(b.n);
+  char *s1 = (char *)malloc(kbytes), *s2 = (char *)malloc(kbytes);
+  km_row_stats_t st1, st2;
+
+  fprintf(stdout, "%-10s %-16s %s\n", "kernel", "variant", "time and throughput (best of runs)");
+
+  // the variants agree on upper case k-mers, packing rejects or folds the others
+  run(&b, "compare", "strcmp", cmp_strcmp, r1, 2*kbytes);
+  run(&b, "compare", "packed", cmp_packed_lex, r2, 2*b.n*sizeof(uint64_t));
+  bool ok = true;
+  for(size_t i=0; i<b.n; ++i) { ok &= !is_acgt(b.kmers_b + i*b.ksize, b.ksize) || r1[i] == r2[i]; }
+  check(&b, "compare", "packed", ok);
+  run(&b, "compare", "ktcmp", cmp_ktcmp, r1, 2*kbytes);
+  run(&b, "compare", "packed -z", cmp_packed_kt, r2, 2*b.n*sizeof(uint64_t));
+  ok = true;
+  for(size_t i=0; i<b.n; ++i) { ok &= !is_acgt(b.kmers_b + i*b.ksize, b.ksize) || r1[i] == r2[i]; }
+  check(&b, "compare", "packed -z", ok);
+
+  size_t row_bytes = b.row_off[b.n];
+  run(&b, "parse", "strtok+strtol", parse_strtok, &st1, row_bytes);
+  run(&b, "parse", "km_row_stats", parse_row_stats, &st2, row_bytes);
+  check(&b, "parse", "km_row_stats", st1.n_values == st2.n_values && st1.n_zeros == st2.n_zeros && st1.n_present == st2.n_present);
+
+  run(&b, "revcomp", "rctable", rc_table, s1, kbytes);
+  run(&b, "revcomp", "km_revcomp", rc_swar, s2, kbytes);
+  ok = true; // km_revcomp requires nucleotides, as validated by km_reverse
+  for(size_t i=0; i<b.n; ++i) {
+    size_t off = i*b.ksize;
+    ok &= !km_is_kmer(b.kmers_b + off, b.ksize) || memcmp(s1 + off, s2 + off, b.ksize) == 0;
+  }
+  check(&b, "revcomp", "km_revcomp", ok);
+
+  run(&b, "validate", "isnuc", valid_isnuc, r1, kbytes);
+  run(&b, "validate", "km_is_kmer", valid_swar, r2, kbytes);
+  check(&b, "validate", "km_is_kmer", memcmp(r1, r2, b.n) == 0);
+
+  table_build(&b);
+  run(&b, "probe", "binary search", probe_bsearch, r1, kbytes);
+  run(&b, "probe", "hash table", probe_hash, r2, kbytes);
+  check(&b, "probe", "hash table", memcmp(r1, r2, b.n) == 0);
+  km_stree_build(&stree, b.keys, b.n_keys);
+  run(&b, "probe", "S-tree", probe_stree, r2, kbytes);
+  check(&b, "probe", "S-tree", memcmp(r1, r2, b.n) == 0);
+  run(&b, "probe", "S-tree batched", probe_stree_batch, r2, kbytes);
+  check(&b, "probe", "S-tree batched", memcmp(r1, r2, b.n) == 0);
+
+  free(table.slots);
+  km_stree_free(&stree);
+  free(r1); free(r2); free(s1); free(s2);
+  free(b.kmers); free(b.kmers_b); free(b.rows); free(b.row_off); free(b.keys);
+  for(int c=0; c<2; ++c) { free(b.packed[c]); free(b.packed_b[c]); }
+  return b.all_ok ? 0 : 1;
+}
@@ -0,0 +1,588 @@
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "km_kernels.h"
+#include "km_chunk.h"
+#include "km_index.h"
+#include "km_roaring.h"
+
+// Secondary index of a matrix with one compressed bitmap of row IDs per sample
+// (the rows where the sample has a count >= min_abund), saved as <matrix>.kmb.
+// It also keeps the offset of every ROW_STRIDE-th row, to resolve row IDs to
+// lines of the matrix.
+
+#define BITMAP_EXT ".kmb"
+#define ROW_STRIDE 64
+
+static const char bitmap_magic[8] = { 'K', 'M', 'B', 'M', 'P', '0', '1', 0 };
+
+typedef struct {
+  char magic[8];
+  uint32_t min_abund;
+  uint32_t row_stride;
+  uint64_t n_samples;
+  uint64_t n_rows;
+  uint64_t n_offsets;
+  uint64_t mat_size;     // size of the matrix indexed
+  int64_t mat_mtime_ns;  // and its modification time
+} bitmap_header_t;
+
+typedef struct {
+  bitmap_header_t h;
+  uint64_t *offsets;     // of rows 0, ROW_STRIDE, 2*ROW_STRIDE, ...
+  km_roaring_t *samples;
+  char *file;            // loaded index, holding the borrowed containers
+} bitmap_index_t;
+
+// --- build, one parallel pass of the chunk engine
+
+// row IDs of each sample in a chunk, gathered in order by collect_chunk
+typedef struct {
+  uint32_t **ids;
+  size_t *n_ids, *cap;
+  uint64_t *offsets;     // in the chunk, of the rows whose ID is a multiple of ROW_STRIDE
+  size_t n_offsets, offsets_cap;
+  bool too_many;         // IDs of the chunk beyond 32 bits, nothing listed
+} chunk_ids_t;
+
+typedef struct {
+  bitmap_index_t *idx;
+  long min_abund;
+  chunk_ids_t *chunks;   // state of each chunk of the engine
+  size_t offsets_cap;
+  uint64_t mat_off;      // bytes of the chunks collected
+  bool too_many;         // more rows than 32-bit IDs allow
+} build_t;
+
+static inline bool is_row(const char *line, size_t len) {
+  const char *counts = km_skip_kmer(line, line + len);
+  return counts != line && !km_isblank(counts[-1]);
+}
+
+void count_rows(km_chunk_t *chunk, void *arg) {
+  size_t pos = 0, len;
+  char *line;
+  while(km_chunk_next_line(chunk, &pos, &line, &len)) {
+    if(is_row(line, len)) { ++chunk->n_records; }
+  }
+}
+
+void index_chunk(km_chunk_t *chunk, void *arg) {
+  build_t *b = (build_t *)arg;
+  size_t n_samples = b->idx->h.n_samples;
+  chunk_ids_t *st = (chunk_ids_t *)chunk->state;
+  for(size_t s=0; s<n_samples; ++s) { st->n_ids[s] = 0; }
+  st->n_offsets = 0;
+  // IDs are checked before any is assigned, so that they cannot wrap
+  st->too_many = chunk->first_record + chunk->n_records > UINT32_MAX;
+  if(st->too_many) { return; }
+  uint32_t id = chunk->first_record;
+  size_t pos = 0, len;
+  char *line;
+  while(km_chunk_next_line(chunk, &pos, &line, &len)) {
+    if(!is_row(line, len)) { continue; }
+    if(id % ROW_STRIDE == 0) {
+      if(st->n_offsets == st->offsets_cap) {
+        st->offsets_cap = st->offsets_cap ? 2*st->offsets_cap : 256;
+        st->offsets = (uint64_t *)realloc(st->offsets, st->offsets_cap*sizeof(uint64_t));
+      }
+      st->offsets[st->n_offsets++] = line - chunk->data;
+    }
+    const char *p = km_skip_kmer(line, line + len), *end = line + len;
+    for(size_t s=0; s<n_samples; ++s) {
+      while(p < end && km_isblank(*p)) { ++p; }
+      if(p == end) { break; }
+      long val = 0;
+      while(p < end && (unsigned char)(*p - '0') < 10) { val = val*10 + (*p - '0'); ++p; }
+      while(p < end && !km_isblank(*p)) { ++p; }
+      if(val >= b->min_abund) {
+        if(st->n_ids[s] == st->cap[s]) {
+          st->cap[s] = st->cap[s] ? 2*st->cap[s] : 1024;
+          st->ids[s] = (uint32_t *)realloc(st->ids[s], st->cap[s]*sizeof(uint32_t));
+        }
+        st->ids[s][st->n_ids[s]++] = id;
+      }
+    }
+    ++id;
+  }
+}
+
+// appends the IDs of the chunk to the bitmaps, in input order
+void collect_chunk(km_chunk_t *chunk, void *arg) {
+  build_t *b = (build_t *)arg;
+  bitmap_index_t *idx = b->idx;
+  chunk_ids_t *st = (chunk_ids_t *)chunk->state;
+  if(st->too_many) { b->too_many = true; }
+  if(b->too_many) { return; }
+  for(size_t s=0; s<idx->h.n_samples; ++s) {
+    for(size_t i=0; i<st->n_ids[s]; ++i) { km_roaring_append(&idx->samples[s], st->ids[s][i]); }
+  }
+  for(size_t i=0; i<st->n_offsets; ++i) {
+    if(idx->h.n_offsets == b->offsets_cap) {
+      b->offsets_cap = b->offsets_cap ? 2*b->offsets_cap : 1024;
+      idx->offsets = (uint64_t *)realloc(idx->offsets, b->offsets_cap*sizeof(uint64_t));
+    }
+    idx->offsets[idx->h.n_offsets++] = b->mat_off + st->offsets[i];
+  }
+  b->mat_off += chunk->len;
+}
+
+// Builds the bitmaps of the matrix open on fd. Returns false if it has more
+// rows than 32-bit IDs allow.
+bool build_index(bitmap_index_t *idx, int fd, long min_abund, km_pool_t *pool) {
+  build_t b = { idx, min_abund, NULL, 0, 0, false };
+  km_chunk_engine_t eng = { .pool = pool, .count = count_rows, .format = index_chunk, .collect = collect_chunk, .arg = &b };
+  km_chunk_engine_init(&eng, fd, NULL);
+
+  // the number of samples is given by the first row
+  size_t first_len;
+  const char *first = km_chunk_peek_line(&eng, &first_len);
+  km_row_stats_t first_st = {0,0,0};
+  km_row_stats(km_skip_kmer(first, first + first_len), first + first_len, 1, &first_st);
+  size_t n_samples = first_st.n_values;
+  idx->h.n_samples = n_samples;
+  idx->samples = (km_roaring_t *)malloc((n_samples ? n_samples : 1)*sizeof(km_roaring_t));
+  for(size_t s=0; s<n_samples; ++s) { km_roaring_init(&idx->samples[s]); }
+
+  b.chunks = (chunk_ids_t *)calloc(eng.n_chunks, sizeof(chunk_ids_t));
+  for(size_t i=0; i<eng.n_chunks; ++i) {
+    chunk_ids_t *st = &b.chunks[i];
+    st->ids = (uint32_t **)calloc(n_samples + 1, sizeof(uint32_t *));
+    st->n_ids = (size_t *)calloc(n_samples + 1, sizeof(size_t));
+    st->cap = (size_t *)calloc(n_samples + 1, sizeof(size_t));
+    eng.chunks[i].state = st;
+  }
+
+  km_chunk_run(&eng, NULL, false);
+  idx->h.n_rows = eng.n_records;
+  idx->h.mat_size = b.mat_off;
+
+  for(size_t i=0; i<eng.n_chunks; ++i) {
+    for(size_t s=0; s<n_samples; ++s) { free(b.chunks[i].ids[s]); }
+    free(b.chunks[i].ids);
+    free(b.chunks[i].n_ids);
+    free(b.chunks[i].cap);
+    free(b.chunks[i].offsets);
+  }
+  free(b.chunks);
+  km_chunk_engine_free(&eng);
+  return !b.too_many;
+}
+
+// --- file
+
+static bool write_pad(FILE *fp, size_t len) {
+  static const char zeros[8] = {0};
+  return len % 8 == 0 || fwrite(zeros, 1, 8 - len % 8, fp) == 8 - len % 8;
+}
+
+bool write_index(const bitmap_index_t *idx, const char *path) {
+  FILE *fp = fopen(path, "wb");
+  if(fp == NULL) { return false; }
+  bool ok = fwrite(&idx->h, sizeof(idx->h), 1, fp) == 1
+    && fwrite(idx->offsets, sizeof(uint64_t), idx->h.n_offsets, fp) == idx->h.n_offsets;
+  for(size_t s=0; ok && s<idx->h.n_samples; ++s) {
+    const km_roaring_t *r = &idx->samples[s];
+    uint64_t n = r->n;
+    ok &= fwrite(&n, sizeof(n), 1, fp) == 1;
+    for(size_t i=0; ok && i<r->n; ++i) {
+      uint16_t kt[2] = { r->c[i].key, r->c[i].type };
+      ok &= fwrite(kt, sizeof(kt), 1, fp) == 1 && fwrite(&r->c[i].card, sizeof(uint32_t), 1, fp) == 1;
+    }
+    for(size_t i=0; ok && i<r->n; ++i) {
+      size_t len = km_container_bytes(&r->c[i]);
+      ok &= fwrite(r->c[i].data, 1, len, fp) == len && write_pad(fp, len);
+    }
+  }
+  ok &= fclose(fp) == 0;
+  if(!ok) { unlink(path); }
+  return ok;
+}
+
+// Loads the index at path if it matches the matrix (st) and min_abund. The
+// containers point into the loaded file.
+bool read_index(bitmap_index_t *idx, const char *path, const struct stat *st, long min_abund) {
+  FILE *fp = fopen(path, "rb");
+  if(fp == NULL) { return false; }
+  struct stat fst;
+  char *file = NULL;
+  bool ok = fstat(fileno(fp), &fst) == 0 && (size_t)fst.st_size >= sizeof(bitmap_header_t);
+  if(ok) {
+    file = (char *)malloc(fst.st_size);
+    ok = fread(file, 1, fst.st_size, fp) == (size_t)fst.st_size;
+  }
+  fclose(fp);
+  bitmap_header_t *h = (bitmap_header_t *)file;
+  ok = ok && memcmp(h->magic, bitmap_magic, 8) == 0 && h->min_abund == min_abund && h->row_stride == ROW_STRIDE
+    && h->mat_size == (uint64_t)st->st_size && h->mat_mtime_ns == km_index_mtime(st);
+  if(!ok) { free(file); return false; }
+
+  // bounds-checked walk of the sections
+  size_t pos = sizeof(bitmap_header_t), size = fst.st_size;
+  if(h->n_offsets > (size - pos)/sizeof(uint64_t)) { free(file); return false; }
+  idx->h = *h;
+  idx->file = file;
+  idx->offsets = (uint64_t *)(file + pos);
+  pos += h->n_offsets*sizeof(uint64_t);
+  idx->samples = (km_roaring_t *)calloc(h->n_samples ? h->n_samples : 1, sizeof(km_roaring_t));
+  for(size_t s=0; ok && s<h->n_samples; ++s) {
+    uint64_t n;
+    if(pos + sizeof(n) > size) { ok = false; break; }
+    memcpy(&n, file + pos, sizeof(n));
+    pos += sizeof(n);
+    if(n > (size - pos)/8) { ok = false; break; }
+    const char *hdr = file + pos;
+    pos += n*8;
+    km_roaring_t *r = &idx->samples[s];
+    r->c = (km_container_t *)malloc((n ? n : 1)*sizeof(km_container_t));
+    r->n = r->cap = n;
+    r->owned = false;
+    for(size_t i=0; i<n; ++i) {
+      km_container_t *c = &r->c[i];
+      memcpy(&c->key, hdr + 8*i, 2);
+      memcpy(&c->type, hdr + 8*i + 2, 2);
+      memcpy(&c->card, hdr + 8*i + 4, 4);
+      size_t len = km_container_bytes(c);
+      if(pos + len > size) { ok = false; r->n = i; break; }
+      c->data = file + pos;
+      pos += (len + 7) & ~(size_t)7;
+    }
+  }
+  return ok;
+}
+
+void free_index(bitmap_index_t *idx) {
+  for(size_t s=0; s<idx->h.n_samples; ++s) { km_roaring_free(&idx->samples[s]); }
+  free(idx->samples);
+  if(idx->file) { free(idx->file); } else { free(idx->offsets); }
+}
+
+// --- expressions over samples
+
+// value of an expression: a sample's bitmap is borrowed from the index
+typedef struct {
+  km_roaring_t r;
+  bool borrowed;
+} value_t;
+
+typedef struct {
+  const char *s, *p;
+  const bitmap_index_t *idx;
+  const char *err;
+} parser_t;
+
+static void value_free(value_t *v) { if(!v->borrowed) { km_roaring_free(&v->r); } }
+
+static value_t value_op(value_t *a, value_t *b, km_roaring_op_t op) {
+  value_t v = { .borrowed = false };
+  km_roaring_op(&v.r, &a->r, &b->r, op);
+  value_free(a);
+  value_free(b);
+  return v;
+}
+
+static void skip_spaces(parser_t *ps) { while(isspace((unsigned char)*ps->p)) { ++ps->p; } }
+
+static bool parse_sample(parser_t *ps, long *s) {
+  skip_spaces(ps);
+  char *end;
+  *s = strtol(ps->p, &end, 10);
+  if(end == ps->p || *s < 1 || (size_t)*s > ps->idx->h.n_samples) {
+    ps->err = end == ps->p ? "sample number expected" : "sample number out of range";
+    return false;
+  }
+  ps->p = end;
+  return true;
+}
+
+static value_t parse_expr(parser_t *ps);
+
+// any(LIST) or all(LIST), LIST being samples and ranges FIRST:LAST separated by commas
+static value_t parse_group(parser_t *ps, km_roaring_op_t op) {
+  value_t acc = { .borrowed = true };
+  bool first = true;
+  while(true) {
+    long lo, hi;
+    if(!parse_sample(ps, &lo)) { break; }
+    hi = lo;
+    skip_spaces(ps);
+    if(*ps->p == ':') {
+      ++ps->p;
+      if(!parse_sample(ps, &hi)) { break; }
+      if(hi < lo) { ps->err = "empty sample range"; break; }
+    }
+    for(long s=lo; s<=hi; ++s) {
+      value_t v = { ps->idx->samples[s-1], true };
+      if(first) { acc = v; first = false; } else { acc = value_op(&acc, &v, op); }
+    }
+    skip_spaces(ps);
+    if(*ps->p != ',') { break; }
+    ++ps->p;
+  }
+  if(ps->err == NULL && *ps->p != ')') { ps->err = "')' expected"; }
+  if(ps->err) { if(!first) { value_free(&acc); } return (value_t){ .borrowed = true }; }
+  ++ps->p;
+  return acc;
+}
+
+static value_t parse_factor(parser_t *ps) {
+  skip_spaces(ps);
+  if(*ps->p == '(') {
+    ++ps->p;
+    value_t v = parse_expr(ps);
+    skip_spaces(ps);
+    if(ps->err == NULL && *ps->p != ')') { ps->err = "')' expected"; }
+    if(ps->err) { value_free(&v); return (value_t){ .borrowed = true }; }
+    ++ps->p;
+    return v;
+  }
+  if(strncmp(ps->p, "any(", 4) == 0) { ps->p += 4; return parse_group(ps, KM_ROARING_OR); }
+  if(strncmp(ps->p, "all(", 4) == 0) { ps->p += 4; return parse_group(ps, KM_ROARING_AND); }
+  long s;
+  if(!parse_sample(ps, &s)) { return (value_t){ .borrowed = true }; }
+  return (value_t){ ps->idx->samples[s-1], true };
+}
+
+// binary operators, & and - (and not) binding tighter than | and ^
+static value_t parse_term(parser_t *ps) {
+  value_t v = parse_factor(ps);
+  while(ps->err == NULL) {
+    skip_spaces(ps);
+    km_roaring_op_t op;
+    if(*ps->p == '&') { op = KM_ROARING_AND; } else if(*ps->p == '-') { op = KM_ROARING_ANDNOT; } else { break; }
+    ++ps->p;
+    value_t w = parse_factor(ps);
+    if(ps->err) { value_free(&w); break; }
+    v = value_op(&v, &w, op);
+  }
+  return v;
+}
+
+static value_t parse_expr(parser_t *ps) {
+  value_t v = parse_term(ps);
+  while(ps->err == NULL) {
+    skip_spaces(ps);
+    km_roaring_op_t op;
+    if(*ps->p == '|') { op = KM_ROARING_OR; } else if(*ps->p == '^') { op = KM_ROARING_XOR; } else { break; }
+    ++ps->p;
+    value_t w = parse_term(ps);
+    if(ps->err) { value_free(&w); break; }
+    v = value_op(&v, &w, op);
+  }
+  return v;
+}
+
+// --- resolution of row IDs to lines
+
+typedef struct {
+  const bitmap_index_t *idx;
+  int fd;
+  FILE *outfile;
+  bool whole_line;
+  char *buf;
+  size_t buf_cap;
+  const char **lines;    // starts of the rows of the block in buf
+  size_t n_lines;
+  uint64_t block;        // in buf, UINT64_MAX if none
+  bool failed;
+} resolver_t;
+
+static bool load_rows(resolver_t *res, uint64_t block) {
+  const bitmap_index_t *idx = res->idx;
+  uint64_t beg = idx->offsets[block], end = block+1 < idx->h.n_offsets ? idx->offsets[block+1] : idx->h.mat_size;
+  size_t len = end - beg;
+  km_chunk_reserve(&res->buf, &res->buf_cap, len + 1);
+  for(size_t done = 0; done < len; ) {
+    ssize_t r = pread(res->fd, res->buf + done, len - done, beg + done);
+    if(r < 0 && errno == EINTR) { continue; }
+    if(r <= 0) { return false; }
+    done += r;
+  }
+  res->buf[len] = '\n';
+  res->n_lines = 0;
+  for(const char *p = res->buf, *e = res->buf + len; p < e; ) {
+    const char *nl = (const char *)memchr(p, '\n', e - p + 1);
+    if(is_row(p, nl - p)) { res->lines[res->n_lines++] = p; }
+    p = nl + 1;
+  }
+  res->block = block;
+  return true;
+}
+
+void print_row(uint32_t id, void *arg) {
+  resolver_t *res = (resolver_t *)arg;
+  if(res->failed) { return; }
+  uint64_t block = id / ROW_STRIDE;
+  if(block != res->block && !load_rows(res, block)) { res->failed = true; return; }
+  if(id % ROW_STRIDE >= res->n_lines) { res->failed = true; return; }
+  const char *line = res->lines[id % ROW_STRIDE];
+  const char *end = res->whole_line ? (const char *)memchr(line, '\n', res->buf + res->buf_cap - line) : km_skip_kmer(line, line + strcspn(line, "\n"));
+  while(!res->whole_line && km_isblank(*line)) { ++line; }
+  fwrite(line, 1, end - line, res->outfile);
+  fputc('\n', res->outfile);
+}
+
+
+int main(int argc, char **argv) {
+
+  int n_threads = 1;
+  long min_abund = 1;
+  char *out_fname = NULL, *index_fname = NULL;
+  bool count_opt = false, whole_line = false, help_opt = false;
+
+  int c;
+  while ((c = getopt(argc, argv, "a:ci:lo:t:h")) != -1) {
+    switch (c) {
+      case 'a':
+        min_abund = strtol(optarg, NULL, 10);
+        break;
+      case 'c':
+        count_opt = true;
+        break;
+      case 'i':
+        index_fname = optarg;
+        break;
+      case 'l':
+        whole_line = true;
+        break;
+      case 'o':
+        out_fname = optarg;
+        break;
+      case 't':
+        n_threads = km_pool_threads(optarg);
+        break;
+      case 'h':
+        help_opt = true;
+        break;
+      case '?':
+        return 1;
+      default:
+        abort();
+    }
+  }
+
+  if(argc-optind < 1 || argc-optind > 2 || help_opt) {
+    fprintf(stdout, "Usage: km_bitmap [options] <matrix> [<expression>]\n\n");
+    fprintf(stdout, "Answer set queries over the samples of a matrix with one compressed bitmap\n");
+    fprintf(stdout, "of rows per sample (a k-mer is in a sample if its count is >= -a), built in\n");
+    fprintf(stdout, "one pass on first use and saved to <matrix>.kmb.\n");
+    fprintf(stdout, "Without expression, print the number of k-mers and the size of each bitmap.\n");
+    fprintf(stdout, "With an expression, print the k-mers of the resulting set. Expressions combine\n");
+    fprintf(stdout, "samples (1-based) and groups any(LIST), all(LIST) of samples and ranges FIRST:LAST\n");
+    fprintf(stdout, "with & (and), - (and not), | (or), ^ (xor) and parentheses.\n");
+    fprintf(stdout, "& and - bind tighter than | and ^, and operators of equal precedence apply\n");
+    fprintf(stdout, "left to right: \"1 | 2 & 3\" is \"1 | (2 & 3)\", \"1 - 2 - 3\" is \"(1 - 2) - 3\".\n");
+    fprintf(stdout, "e.g. \"1 - 2\", \"1 & any(3:10)\", \"all(1,2) - any(5:8,11)\".\n\n");
+    fprintf(stdout, "Options:\n");
+    fprintf(stdout, "  -a INT   min abundance to define a k-mer as present in a sample [1]\n");
+    fprintf(stdout, "  -c       print the number of k-mers of the set instead of the k-mers\n");
+    fprintf(stdout, "  -l       print the whole lines of the matrix instead of the k-mers\n");
+    fprintf(stdout, "  -i FILE  bitmap index of the matrix [<matrix>.kmb]\n");
+    fprintf(stdout, "  -o FILE  write output to FILE [stdout]\n");
+    fprintf(stdout, "  -t INT   number of threads to build the index, 0 for all CPUs [1]\n");
+    fprintf(stdout, "  -h       print this help message\n");
+    return 0;
+  }
+
+  const char *mat_fname = argv[optind];
+  int fd = open(mat_fname, O_RDONLY);
+  struct stat st;
+  if(fd < 0 || fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+    fprintf(stderr,"Cannot open file \"%s\" (the matrix must be a regular file)\n",mat_fname);
+    if(fd >= 0) { close(fd); }
+    return 1;
+  }
+
+  char *path = NULL;
+  if(index_fname == NULL) {
+    path = (char *)malloc(strlen(mat_fname) + sizeof(BITMAP_EXT));
+    sprintf(path, "%s%s", mat_fname, BITMAP_EXT);
+    index_fname = path;
+  }
+  bitmap_index_t idx;
+  memset(&idx, 0, sizeof(idx));
+  bool built = false;
+  if(!read_index(&idx, index_fname, &st, min_abund)) {
+    if(idx.file) { free_index(&idx); }
+    memset(&idx, 0, sizeof(idx));
+    memcpy(idx.h.magic, bitmap_magic, 8);
+    idx.h.min_abund = min_abund;
+    idx.h.row_stride = ROW_STRIDE;
+    idx.h.mat_mtime_ns = km_index_mtime(&st);
+    km_pool_t *pool = n_threads > 1 ? km_pool_create(n_threads, NULL) : NULL;
+    bool ok = build_index(&idx, fd, min_abund, pool);
+    if(pool) { km_pool_destroy(pool); }
+    if(!ok) {
+      fprintf(stderr,"Cannot index matrix \"%s\": more than 2^32 rows\n",mat_fname);
+      free_index(&idx);
+      free(path);
+      close(fd);
+      return 1;
+    }
+    if(!write_index(&idx, index_fname)) {
+      fprintf(stderr,"[info] cannot save the index to \"%s\"\n",index_fname);
+    }
+    built = true;
+  }
+  free(path);
+  size_t bytes = 0;
+  for(size_t s=0; s<idx.h.n_samples; ++s) {
+    for(size_t i=0; i<idx.samples[s].n; ++i) { bytes += 8 + km_container_bytes(&idx.samples[s].c[i]); }
+  }
+  fprintf(stderr, "[info] %s index: %lu rows, %lu samples, %lu bytes of bitmaps\n", built ? "built" : "loaded", idx.h.n_rows, idx.h.n_samples, bytes);
+
+  FILE *outfile = out_fname ? fopen(out_fname,"w") : stdout;
+  if(outfile != stdout && outfile == NULL) {
+    fprintf(stderr,"Cannot open output file \"%s\"\n",out_fname);
+    free_index(&idx);
+    close(fd);
+    return 1;
+  }
+
+  int ret = 0;
+  if(argc-optind == 1) {
+    fprintf(outfile, "sample\tk-mers\tcontainers\tbytes\n");
+    for(size_t s=0; s<idx.h.n_samples; ++s) {
+      size_t sample_bytes = 0;
+      for(size_t i=0; i<idx.samples[s].n; ++i) { sample_bytes += 8 + km_container_bytes(&idx.samples[s].c[i]); }
+      fprintf(outfile, "%zu\t%lu\t%zu\t%zu\n", s+1, km_roaring_card(&idx.samples[s]), idx.samples[s].n, sample_bytes);
+    }
+  } else {
+    parser_t ps = { argv[optind+1], argv[optind+1], &idx, NULL };
+    value_t v = parse_expr(&ps);
+    skip_spaces(&ps);
+    if(ps.err == NULL && *ps.p) { ps.err = "unexpected character"; }
+    if(ps.err) {
+      fprintf(stderr,"Invalid expression \"%s\": %s at position %ld\n",ps.s,ps.err,(long)(ps.p - ps.s) + 1);
+      ret = 1;
+    } else if(count_opt) {
+      fprintf(outfile, "%lu\n", km_roaring_card(&v.r));
+    } else {
+      resolver_t res = { &idx, fd, outfile, whole_line, NULL, 0, NULL, 0, UINT64_MAX, false };
+      res.lines = (const char **)malloc(ROW_STRIDE*sizeof(const char *));
+      km_roaring_foreach(&v.r, print_row, &res);
+      if(res.failed) {
+        fprintf(stderr,"Cannot read the rows of \"%s\"\n",mat_fname);
+        ret = 1;
+      }
+      free(res.lines);
+      free(res.buf);
+    }
+    if(ps.err == NULL) {
+      fprintf(stderr, "[info] %lu\tk-mers in the set\n", km_roaring_card(&v.r));
+    }
+    value_free(&v);
+  }
+
+  free_index(&idx);
+  close(fd);
+  if(outfile != stdout){ fclose(outfile); }
+
+  return ret;
+}
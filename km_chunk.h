@@ -0,0 +1,444 @@
+#ifndef KM_CHUNK_H
+#define KM_CHUNK_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "km_pool.h"
+#include "km_metrics.h"
+#include "km_trace.h"
+#include "km_arrow.h"
+
+// Newline-aligned chunks of a line-based file processed by several threads.
+//
+// Each batch of chunks is read sequentially, then every chunk is formatted by a
+// task of the pool into its own output buffer. The output sizes are prefix-summed to give
+// each chunk its final offset in the output file, where the workers pwrite it
+// directly (the range of the batch being preallocated with posix_fallocate).
+// Without pool, the chunks are processed by the calling thread.
+//
+// With a NUMA placement, chunk i lives on node i % n_nodes: its input buffer is
+// allocated there and its tasks are queued on workers of that node, whose
+// output buffers are thus first touched on the same node.
+// When the output is not a regular file (pipe, terminal), chunks are written in
+// order by the calling thread instead.
+//
+// With an Arrow writer, the text output of each chunk is encoded by its format
+// task into one record batch, which is then written like the text.
+
+#define KM_CHUNK_SIZE (4UL<<20)
+#define KM_CHUNKS_PER_THREAD 4
+
+// message reported to stderr once the chunk's first line is known, fmt is a
+// printf format taking the line number (size_t) and the text (int len, char *)
+typedef struct {
+  const char *fmt;
+  size_t line, off, len; // line in chunk (1-based) and position of its text in data
+} km_chunk_msg_t;
+
+struct km_chunk_engine_s;
+
+typedef struct {
+  struct km_chunk_engine_s *eng;
+  int node;
+  size_t seq;         // index of the chunk in the input
+  char *data;         // input lines, the last one possibly without newline
+  size_t len, cap;
+  char *out;          // formatted output
+  size_t out_len, out_cap;
+  off_t out_off;      // offset of out in the output file
+  size_t n_lines;     // lines in data
+  size_t first_line;  // lines in the previous chunks
+  size_t n_records;   // records counted by the count pass (or by format without it)
+  size_t first_record;// records counted in the previous chunks
+  size_t n_kept;      // records written by the format pass
+  km_chunk_msg_t *warn;
+  size_t n_warn, warn_cap;
+  km_chunk_msg_t err; // fatal error, err.line == 0 if none
+  bool write_failed;
+  km_fb_t batch;      // Arrow record batch of out, swapped with out once encoded
+  size_t meta_len;    // metadata length of the record batch
+  void *state;        // results of format kept in memory, for collect
+} km_chunk_t;
+
+typedef struct km_chunk_engine_s {
+  km_pool_t *pool;
+  size_t chunk_size;
+  // optional pass counting the records of each chunk, so that format knows
+  // chunk->first_record (e.g. to number records as a serial run would)
+  void (*count)(km_chunk_t *chunk, void *arg);
+  // formats chunk->data into chunk->out
+  void (*format)(km_chunk_t *chunk, void *arg);
+  // optional, called by the calling thread on the chunks of a batch in input
+  // order after format, to gather results that are not output
+  void (*collect)(km_chunk_t *chunk, void *arg);
+  void *arg;
+  // Arrow output, started (schema written) before the run
+  km_arrow_writer_t *arrow;
+
+  // input state
+  int in_fd;
+  char *carry;
+  size_t carry_len, carry_cap;
+  bool eof;
+  size_t n_read;      // chunks read so far
+
+  // output state
+  int out_fd;
+  bool use_pwrite;
+  off_t out_off;
+
+  // batch state
+  km_chunk_t *chunks;
+  size_t n_chunks;
+  km_numa_t *numa;    // of the pool at init, kept to free the chunks after the pool
+  int pass;
+  size_t n_lines, n_records, n_kept;
+} km_chunk_engine_t;
+
+static inline void km_chunk_reserve(char **buf, size_t *cap, size_t size) {
+  if(*cap < size) {
+    *cap = size > 2*(*cap) ? size : 2*(*cap);
+    *buf = (char *)realloc(*buf, *cap);
+  }
+}
+
+// Appends len bytes to the output of chunk.
+static inline void km_chunk_write(km_chunk_t *chunk, const char *s, size_t len) {
+  km_chunk_reserve(&chunk->out, &chunk->out_cap, chunk->out_len + len);
+  memcpy(chunk->out + chunk->out_len, s, len);
+  chunk->out_len += len;
+}
+
+static inline void km_chunk_warn(km_chunk_t *chunk, const char *fmt, size_t line, const char *text, size_t len) {
+  if(chunk->n_warn == chunk->warn_cap) {
+    chunk->warn_cap = chunk->warn_cap ? 2*chunk->warn_cap : 16;
+    chunk->warn = (km_chunk_msg_t *)realloc(chunk->warn, chunk->warn_cap*sizeof(km_chunk_msg_t));
+  }
+  chunk->warn[chunk->n_warn++] = (km_chunk_msg_t){ fmt, line, text - chunk->data, len };
+}
+
+// Reports a fatal error: format must stop at it, the run stops after the chunk's
+// output is written.
+static inline void km_chunk_error(km_chunk_t *chunk, const char *fmt, size_t line, const char *text, size_t len) {
+  chunk->err = (km_chunk_msg_t){ fmt, line, text - chunk->data, len };
+}
+
+// Iterates over the lines of a chunk: sets *line and *len (newline excluded) and
+// returns false at the end of the chunk.
+static inline bool km_chunk_next_line(km_chunk_t *chunk, size_t *pos, char **line, size_t *len) {
+  if(*pos >= chunk->len) { return false; }
+  char *beg = chunk->data + *pos;
+  char *nl = (char *)memchr(beg, '\n', chunk->len - *pos);
+  size_t l = nl ? (size_t)(nl - beg) : chunk->len - *pos;
+  *line = beg;
+  *len = l;
+  *pos += l + (nl ? 1 : 0);
+  return true;
+}
+
+// Chunks are written in parallel at their own offsets only to a regular file
+// that nothing else writes: not opened in append mode (the offsets would be
+// ignored) and not shared with stderr (messages would be overwritten).
+static bool km_chunk_can_pwrite(int fd) {
+  struct stat st, err_st;
+  if(fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) { return false; }
+  int flags = fcntl(fd, F_GETFL);
+  if(flags < 0 || (flags & O_APPEND)) { return false; }
+  if(fstat(STDERR_FILENO, &err_st) == 0 && err_st.st_dev == st.st_dev && err_st.st_ino == st.st_ino) { return false; }
+  return true;
+}
+
+// Prepares the engine to read in_fd and write outfile, which may be NULL for
+// a pass that collects its results without writing chunks.
+static void km_chunk_engine_init(km_chunk_engine_t *eng, int in_fd, FILE *outfile) {
+  if(eng->chunk_size == 0) { eng->chunk_size = KM_CHUNK_SIZE; }
+  eng->in_fd = in_fd;
+  eng->carry = NULL;
+  eng->carry_len = eng->carry_cap = 0;
+  eng->eof = false;
+  eng->n_read = 0;
+
+  if(outfile) { fflush(outfile); }
+  eng->out_fd = outfile ? fileno(outfile) : -1;
+  eng->use_pwrite = outfile && km_chunk_can_pwrite(eng->out_fd);
+  eng->out_off = eng->use_pwrite ? lseek(eng->out_fd, 0, SEEK_CUR) : 0;
+  if(eng->out_off < 0) { eng->use_pwrite = false; eng->out_off = 0; }
+
+  eng->n_chunks = (size_t)(eng->pool ? eng->pool->n_threads : 1) * KM_CHUNKS_PER_THREAD;
+  eng->chunks = (km_chunk_t *)calloc(eng->n_chunks, sizeof(km_chunk_t));
+  km_numa_t *numa = eng->numa = eng->pool ? eng->pool->numa : NULL;
+  for(size_t i=0; i<eng->n_chunks; ++i) {
+    eng->chunks[i].eng = eng;
+    eng->chunks[i].node = numa ? i % numa->n_nodes : 0;
+  }
+  eng->n_lines = eng->n_records = eng->n_kept = 0;
+}
+
+static void km_chunk_engine_free(km_chunk_engine_t *eng) {
+  km_numa_t *numa = eng->numa;
+  for(size_t i=0; i<eng->n_chunks; ++i) {
+    if(numa) { km_numa_release(eng->chunks[i].data, eng->chunks[i].cap); } else { free(eng->chunks[i].data); }
+    free(eng->chunks[i].out);
+    free(eng->chunks[i].warn);
+    free(eng->chunks[i].batch.buf);
+  }
+  free(eng->chunks);
+  free(eng->carry);
+}
+
+// Reads into eng->carry until it holds at least one full line (or the whole
+// input). Used to peek at the first line of the input before running.
+static const char *km_chunk_peek_line(km_chunk_engine_t *eng, size_t *len) {
+  while(!eng->eof && (eng->carry_len == 0 || memchr(eng->carry, '\n', eng->carry_len) == NULL)) {
+    km_chunk_reserve(&eng->carry, &eng->carry_cap, eng->carry_len + (1<<16));
+    ssize_t r = read(eng->in_fd, eng->carry + eng->carry_len, eng->carry_cap - eng->carry_len);
+    if(r < 0 && errno == EINTR) { continue; }
+    if(r < 0) {
+      fprintf(stderr, "[error] cannot read input: %s\n", strerror(errno));
+      exit(1);
+    }
+    if(r == 0) { eng->eof = true; break; }
+    eng->carry_len += r;
+  }
+  char *nl = eng->carry_len ? (char *)memchr(eng->carry, '\n', eng->carry_len) : NULL;
+  *len = nl ? (size_t)(nl - eng->carry) : eng->carry_len;
+  return eng->carry;
+}
+
+// Writes the magic and schema of an Arrow output before the chunks, which are
+// then encoded by w. Returns false on write error.
+static bool km_chunk_arrow_start(km_chunk_engine_t *eng, km_arrow_writer_t *w, FILE *outfile) {
+  if(!km_arrow_start(w, outfile) || fflush(outfile) != 0) { return false; }
+  if(eng->use_pwrite) { eng->out_off = lseek(eng->out_fd, 0, SEEK_CUR); }
+  eng->arrow = w;
+  return true;
+}
+
+// Grows the input buffer of chunk, on the chunk's node.
+static void km_chunk_reserve_data(km_chunk_engine_t *eng, km_chunk_t *chunk, size_t size) {
+  if(chunk->cap < size) {
+    size_t cap = size > 2*chunk->cap ? size : 2*chunk->cap;
+    char *data = (char *)km_numa_realloc(eng->numa, chunk->data, chunk->cap, cap, chunk->node);
+    if(data == NULL) {
+      fprintf(stderr, "Cannot allocate a chunk of %zu bytes\n", cap);
+      exit(1);
+    }
+    chunk->data = data;
+    chunk->cap = cap;
+  }
+}
+
+// Fills chunk with the bytes carried from the previous chunk followed by about
+// chunk_size bytes of input, up to the last newline. Returns false on empty chunk.
+static bool km_chunk_read(km_chunk_engine_t *eng, km_chunk_t *chunk) {
+  uint64_t trace = km_trace_begin();
+  km_chunk_reserve_data(eng, chunk, eng->chunk_size > eng->carry_len ? eng->chunk_size : eng->carry_len);
+  if(eng->carry_len) { memcpy(chunk->data, eng->carry, eng->carry_len); } // carry is NULL before the first read
+  chunk->len = eng->carry_len;
+  eng->carry_len = 0;
+
+  while(true) {
+    while(!eng->eof && chunk->len < chunk->cap) {
+      ssize_t r = read(eng->in_fd, chunk->data + chunk->len, chunk->cap - chunk->len);
+      if(r < 0 && errno == EINTR) { continue; }
+      if(r < 0) {
+        fprintf(stderr, "[error] cannot read input: %s\n", strerror(errno));
+        exit(1);
+      }
+      if(r == 0) { eng->eof = true; break; }
+      chunk->len += r;
+    }
+    if(eng->eof) { break; }
+    char *nl = chunk->data + chunk->len;
+    while(nl > chunk->data && nl[-1] != '\n') { --nl; }
+    if(nl > chunk->data) {
+      --nl;
+      size_t tail = chunk->data + chunk->len - (nl+1);
+      km_chunk_reserve(&eng->carry, &eng->carry_cap, tail);
+      memcpy(eng->carry, nl+1, tail);
+      eng->carry_len = tail;
+      chunk->len -= tail;
+      break;
+    }
+    // a line longer than the chunk
+    km_chunk_reserve_data(eng, chunk, 2*chunk->cap);
+  }
+
+  chunk->out_len = 0;
+  chunk->meta_len = 0;
+  chunk->n_records = chunk->n_kept = 0;
+  chunk->n_warn = 0;
+  chunk->err.line = 0;
+  chunk->write_failed = false;
+  if(chunk->len == 0) { return false; }
+  chunk->seq = eng->n_read++;
+  km_trace_end("read", trace, chunk->seq);
+  return true;
+}
+
+typedef enum { KM_PASS_COUNT, KM_PASS_FORMAT, KM_PASS_WRITE } km_chunk_pass_t;
+
+// Replaces the text output of chunk by its Arrow record batch. format is
+// expected to write only rows the writer accepts (see km_arrow_parse_row),
+// otherwise the chunk produces no output and an error on its last line stops
+// the run.
+static void km_chunk_encode(km_chunk_engine_t *eng, km_chunk_t *chunk) {
+  uint64_t trace = km_trace_begin();
+  size_t bad = 0;
+  chunk->meta_len = km_arrow_encode(eng->arrow, chunk->out, chunk->out + chunk->out_len, &chunk->batch, &bad);
+  if(chunk->meta_len == 0) {
+    if(chunk->err.line == 0) {
+      km_chunk_error(chunk, "[error] a row up to line %zu cannot be written in Arrow format%.*s\n", chunk->n_lines, chunk->data, 0);
+    }
+    chunk->out_len = 0;
+  } else {
+    char *out = chunk->out;
+    size_t out_cap = chunk->out_cap;
+    chunk->out = chunk->batch.buf;
+    chunk->out_len = chunk->batch.len;
+    chunk->out_cap = chunk->batch.cap;
+    chunk->batch = (km_fb_t){ out, 0, out_cap };
+  }
+  km_trace_end("encode", trace, chunk->seq);
+}
+
+static void km_chunk_task(void *arg) {
+  km_chunk_t *chunk = (km_chunk_t *)arg;
+  km_chunk_engine_t *eng = chunk->eng;
+  km_stage_mark_t mark;
+  km_stage_begin(&mark);
+  uint64_t trace = km_trace_begin();
+  switch(eng->pass) {
+    case KM_PASS_COUNT:
+      eng->count(chunk, eng->arg);
+      km_stage_end(KM_STAGE_COUNT, &mark);
+      km_trace_end("count", trace, chunk->seq);
+      break;
+    case KM_PASS_FORMAT: {
+      size_t n_lines = 0;
+      for(const char *p = chunk->data, *end = p + chunk->len; p < end; ++n_lines) {
+        const char *nl = (const char *)memchr(p, '\n', end - p);
+        p = nl ? nl+1 : end;
+      }
+      chunk->n_lines = n_lines;
+      km_trace_end("parse", trace, chunk->seq);
+      trace = km_trace_begin();
+      eng->format(chunk, eng->arg);
+      km_stage_end(KM_STAGE_PROCESS, &mark);
+      km_trace_end("process", trace, chunk->seq);
+      if(eng->arrow && chunk->out_len) { km_chunk_encode(eng, chunk); }
+      break;
+    }
+    case KM_PASS_WRITE:
+      for(size_t done = 0; done < chunk->out_len; ) {
+        ssize_t w = pwrite(eng->out_fd, chunk->out + done, chunk->out_len - done, chunk->out_off + done);
+        if(w <= 0) { chunk->write_failed = true; break; }
+        done += w;
+      }
+      km_stage_end(KM_STAGE_WRITE, &mark);
+      km_trace_end("write", trace, chunk->seq);
+      break;
+  }
+}
+
+// Runs a pass over the first n_chunks chunks, one task per chunk.
+static int km_chunk_pass(km_chunk_engine_t *eng, km_chunk_pass_t pass, size_t n_chunks) {
+  eng->pass = pass;
+  if(eng->pool) {
+    km_group_t group;
+    km_group_init(&group);
+    for(size_t i=0; i<n_chunks; ++i) { km_pool_submit_on(eng->pool, &group, eng->chunks[i].node, km_chunk_task, &eng->chunks[i]); }
+    km_pool_wait(eng->pool, &group);
+  } else {
+    for(size_t i=0; i<n_chunks; ++i) { km_chunk_task(&eng->chunks[i]); }
+  }
+  int status = 0;
+  for(size_t i=0; i<n_chunks; ++i) { status |= eng->chunks[i].write_failed; }
+  return status;
+}
+
+// Processes the whole input. Returns 0 on success, 1 on write error and 2 if
+// format reported an error (the output preceding the error is written).
+// With verbose, progress is reported after each batch.
+static int km_chunk_run(km_chunk_engine_t *eng, FILE *outfile, bool verbose) {
+  int ret = 0;
+  while(ret == 0) {
+    size_t n = 0;
+    km_stage_mark_t mark;
+    km_stage_begin(&mark);
+    while(n < eng->n_chunks && km_chunk_read(eng, &eng->chunks[n])) { ++n; }
+    km_stage_end(KM_STAGE_READ, &mark);
+    if(n == 0) { break; }
+
+    if(eng->count) {
+      km_chunk_pass(eng, KM_PASS_COUNT, n);
+      for(size_t i=0; i<n; ++i) {
+        eng->chunks[i].first_record = eng->n_records;
+        eng->n_records += eng->chunks[i].n_records;
+      }
+    }
+    km_chunk_pass(eng, KM_PASS_FORMAT, n);
+
+    // prefix sums of lines and output sizes, messages in input order
+    off_t batch_off = eng->out_off;
+    for(size_t i=0; i<n; ++i) {
+      km_chunk_t *chunk = &eng->chunks[i];
+      chunk->first_line = eng->n_lines;
+      eng->n_lines += chunk->n_lines;
+      if(!eng->count) { eng->n_records += chunk->n_records; }
+      chunk->out_off = eng->out_off;
+      eng->out_off += chunk->out_len;
+      if(eng->arrow && chunk->out_len) { km_arrow_add_block(eng->arrow, chunk->meta_len, chunk->out_len); }
+      eng->n_kept += chunk->n_kept;
+      for(size_t w=0; w<chunk->n_warn; ++w) {
+        km_chunk_msg_t *msg = &chunk->warn[w];
+        fprintf(stderr, msg->fmt, chunk->first_line + msg->line, (int)msg->len, chunk->data + msg->off);
+      }
+      if(eng->collect) { eng->collect(chunk, eng->arg); }
+      if(chunk->err.line) {
+        km_chunk_msg_t *msg = &chunk->err;
+        fprintf(stderr, msg->fmt, chunk->first_line + msg->line, (int)msg->len, chunk->data + msg->off);
+        eng->n_lines = chunk->first_line + chunk->err.line;
+        n = i+1;
+        ret = 2;
+        break;
+      }
+    }
+
+    if(verbose) {
+      fprintf(stderr, "%lu lines processed, %lu records written\n", eng->n_lines, eng->n_kept);
+    }
+
+    if(eng->use_pwrite) {
+      if(eng->out_off > batch_off) {
+        posix_fallocate(eng->out_fd, batch_off, eng->out_off - batch_off);
+      }
+      if(km_chunk_pass(eng, KM_PASS_WRITE, n)) { ret = 1; }
+    } else if(outfile) {
+      km_stage_begin(&mark);
+      for(size_t i=0; i<n; ++i) {
+        if(eng->chunks[i].out_len == 0) { continue; } // out may still be NULL
+        uint64_t trace = km_trace_begin();
+        if(fwrite(eng->chunks[i].out, 1, eng->chunks[i].out_len, outfile) != eng->chunks[i].out_len) { ret = 1; }
+        km_trace_end("write", trace, eng->chunks[i].seq);
+      }
+      // the batch ends with a complete line: messages on a stderr shared with
+      // the output do not land in the middle of a row
+      if(fflush(outfile) != 0) { ret = 1; }
+      km_stage_end(KM_STAGE_WRITE, &mark);
+    }
+  }
+  if(eng->use_pwrite) { lseek(eng->out_fd, eng->out_off, SEEK_SET); }
+  return ret;
+}
+
+#endif
@@ -0,0 +1,681 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <stdbool.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "km_kernels.h"
+#include "km_chunk.h"
+
+// Clustering of the k-mers by their presence profiles. In one pass over the
+// matrix, each row gets a MinHash signature of the set of samples where it is
+// present (bands x rows minima of random hashes of the samples), and each band
+// of the signature is hashed into a bucket key. Rows sharing a bucket key are
+// candidates (banded LSH); a candidate is joined to the first row of its bucket
+// when their signatures estimate a Jaccard similarity of at least -j, and
+// clusters are the connected components (union-find).
+//
+// The (key, row) pairs are spread over N_PARTS partitions by the top bits of
+// their key, kept in memory up to -M and spilled to temporary files beyond.
+// Partitions are then sorted and scanned in parallel, a few at a time, and
+// their joins applied in partition order. A partition larger than its share of
+// -M (per thread) is sorted in runs of that size, written to a temporary file
+// and merged while its buckets are scanned. Signatures and k-mers are kept in
+// temporary files too, so that memory is the union-find (4 bytes per row) and
+// the partitions being sorted.
+
+#define N_PARTS 256
+#define PART_SHIFT 56
+
+typedef struct {
+  uint64_t key;
+  uint32_t row;
+} pair_t;
+
+typedef struct {
+  uint32_t a, b;
+} join_t;
+
+typedef struct {
+  pair_t *buf;
+  size_t n, cap;
+  FILE *fp;             // spilled pairs
+  size_t n_file;
+} part_t;
+
+typedef struct {
+  // parameters
+  size_t n_samples;
+  uint32_t min_abund, min_samples;
+  size_t bands, rows, n_hash;
+  double min_jaccard;
+  const char *tmp_dir;
+  size_t mem_limit;     // bytes of pairs in memory
+  size_t sort_pairs;    // pairs sorted at once by a task, runs beyond
+  uint32_t *hash;       // n_samples x n_hash
+  // collected
+  part_t parts[N_PARTS];
+  size_t n_mem;         // pairs in memory
+  FILE *kmers, *sigs;
+  uint64_t n_rows, n_skipped;
+  bool spilled, failed, too_many;
+  const uint32_t *sig_map;
+  uint32_t *parent;
+  size_t parent_cap;
+} cluster_t;
+
+typedef struct {
+  uint32_t *sig;        // rows x n_hash
+  uint64_t *keys;       // rows x bands
+  const char **kmer;
+  size_t *kmer_len;
+  size_t n, cap;
+} chunk_rows_t;
+
+static inline uint64_t mix64(uint64_t z) {
+  z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL; // splitmix64 finalizer
+  z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+  return z ^ (z >> 31);
+}
+
+// Opens an anonymous temporary file in dir.
+FILE *temp_file(const char *dir) {
+  char path[4096];
+  snprintf(path, sizeof(path), "%s/km_cluster.XXXXXX", dir);
+  int fd = mkstemp(path);
+  if(fd < 0) { return NULL; }
+  unlink(path);
+  return fdopen(fd, "w+");
+}
+
+// --- union-find, the root of a set being its first row
+
+static inline uint32_t uf_find(uint32_t *parent, uint32_t x) {
+  while(parent[x] != x) {
+    parent[x] = parent[parent[x]];
+    x = parent[x];
+  }
+  return x;
+}
+
+static inline void uf_union(uint32_t *parent, uint32_t a, uint32_t b) {
+  a = uf_find(parent, a);
+  b = uf_find(parent, b);
+  if(a < b) { parent[b] = a; }
+  else if(b < a) { parent[a] = b; }
+}
+
+// --- signatures
+
+void signature_chunk(km_chunk_t *chunk, void *arg) {
+  const cluster_t *cl = (const cluster_t *)arg;
+  chunk_rows_t *st = (chunk_rows_t *)chunk->state;
+  size_t h = cl->n_hash, n = cl->n_samples;
+  st->n = 0;
+  uint32_t *counts = (uint32_t *)malloc((n ? n : 1)*sizeof(uint32_t));
+  size_t pos = 0, len;
+  char *line;
+  while(km_chunk_next_line(chunk, &pos, &line, &len)) {
+    const char *end = line + len;
+    const char *p = km_skip_kmer(line, end);
+    if(p == line || km_isblank(p[-1])) { continue; } // skip empty lines
+    ++chunk->n_records;
+    km_parse_counts(p, end, counts, n);
+    if(st->n == st->cap) {
+      st->cap = st->cap ? 2*st->cap : 1024;
+      st->sig = (uint32_t *)realloc(st->sig, st->cap*h*sizeof(uint32_t));
+      st->keys = (uint64_t *)realloc(st->keys, st->cap*cl->bands*sizeof(uint64_t));
+      st->kmer = (const char **)realloc(st->kmer, st->cap*sizeof(const char *));
+      st->kmer_len = (size_t *)realloc(st->kmer_len, st->cap*sizeof(size_t));
+    }
+    uint32_t *sig = st->sig + st->n*h;
+    for(size_t j=0; j<h; ++j) { sig[j] = UINT32_MAX; }
+    uint32_t present = 0;
+    for(size_t s=0; s<n; ++s) {
+      if(counts[s] < cl->min_abund) { continue; }
+      ++present;
+      const uint32_t *hs = cl->hash + s*h;
+      for(size_t j=0; j<h; ++j) { sig[j] = hs[j] < sig[j] ? hs[j] : sig[j]; }
+    }
+    if(present < cl->min_samples) { continue; }
+    uint64_t *keys = st->keys + st->n*cl->bands;
+    for(size_t b=0; b<cl->bands; ++b) {
+      uint64_t k = mix64(b + 1);
+      for(size_t r=0; r<cl->rows; ++r) { k = mix64(k ^ sig[b*cl->rows + r]); }
+      keys[b] = k;
+    }
+    st->kmer[st->n] = line;
+    st->kmer_len[st->n] = p - line;
+    ++st->n;
+  }
+  free(counts);
+}
+
+// Moves the pairs in memory to the partition files.
+bool spill(cluster_t *cl) {
+  for(size_t i=0; i<N_PARTS; ++i) {
+    part_t *pt = &cl->parts[i];
+    if(pt->n == 0) { continue; }
+    if(pt->fp == NULL && (pt->fp = temp_file(cl->tmp_dir)) == NULL) { return false; }
+    if(fwrite(pt->buf, sizeof(pair_t), pt->n, pt->fp) != pt->n) { return false; }
+    pt->n_file += pt->n;
+    pt->n = 0;
+  }
+  cl->n_mem = 0;
+  cl->spilled = true;
+  return true;
+}
+
+// numbers the rows of a chunk in input order and stores them
+void collect_chunk(km_chunk_t *chunk, void *arg) {
+  cluster_t *cl = (cluster_t *)arg;
+  chunk_rows_t *st = (chunk_rows_t *)chunk->state;
+  cl->n_skipped += chunk->n_records - st->n;
+  if(cl->failed) { return; }
+  if(cl->n_rows + st->n > UINT32_MAX) {
+    cl->failed = cl->too_many = true;
+    return;
+  }
+  if(cl->n_rows + st->n > cl->parent_cap) {
+    while(cl->n_rows + st->n > cl->parent_cap) { cl->parent_cap = cl->parent_cap ? 2*cl->parent_cap : 1<<16; }
+    cl->parent = (uint32_t *)realloc(cl->parent, cl->parent_cap*sizeof(uint32_t));
+  }
+  for(size_t i=0; i<st->n; ++i) {
+    uint32_t row = cl->n_rows++;
+    cl->parent[row] = row;
+    if(fwrite(st->kmer[i], 1, st->kmer_len[i], cl->kmers) != st->kmer_len[i] || putc('\n', cl->kmers) == EOF) { cl->failed = true; }
+    if(cl->sigs && fwrite(st->sig + i*cl->n_hash, sizeof(uint32_t), cl->n_hash, cl->sigs) != cl->n_hash) { cl->failed = true; }
+    for(size_t b=0; b<cl->bands; ++b) {
+      uint64_t key = st->keys[i*cl->bands + b];
+      part_t *pt = &cl->parts[key >> PART_SHIFT];
+      if(pt->n == pt->cap) {
+        pt->cap = pt->cap ? 2*pt->cap : 1024;
+        pt->buf = (pair_t *)realloc(pt->buf, pt->cap*sizeof(pair_t));
+      }
+      pt->buf[pt->n++] = (pair_t){ key, row };
+      ++cl->n_mem;
+    }
+  }
+  if(cl->n_mem*sizeof(pair_t) > cl->mem_limit && !spill(cl)) { cl->failed = true; }
+}
+
+// --- buckets
+
+typedef struct {
+  const cluster_t *cl;
+  part_t *part;
+  join_t *joins;
+  size_t n_joins, joins_cap;
+  uint64_t n_candidates;
+  bool failed;
+} part_task_t;
+
+// scan of the sorted pairs of a partition: current bucket, its first row and
+// the previous row
+typedef struct {
+  uint64_t key;
+  uint32_t first, prev;
+  bool started;
+} scan_t;
+
+// sorted run of pairs of a partition, read by blocks from the file of runs
+typedef struct {
+  pair_t *blk;
+  size_t i, n;          // next pair of the block, pairs in the block
+  size_t pos, end;      // next pair and end of the run in the file
+} run_t;
+
+int cmp_pair(const void *x, const void *y) {
+  const pair_t *px = (const pair_t *)x, *py = (const pair_t *)y;
+  if(px->key != py->key) { return px->key < py->key ? -1 : 1; }
+  return (px->row > py->row) - (px->row < py->row);
+}
+
+static inline double sig_jaccard(const uint32_t *x, const uint32_t *y, size_t h) {
+  size_t eq = 0;
+  for(size_t j=0; j<h; ++j) { eq += x[j] == y[j]; }
+  return (double)eq / h;
+}
+
+// Scans the next pair in sorted order: the rows of a bucket are candidates to
+// join its first row.
+static inline void scan_pair(part_task_t *t, scan_t *sc, pair_t p) {
+  if(!sc->started || p.key != sc->key) {
+    *sc = (scan_t){ p.key, p.row, p.row, true };
+    return;
+  }
+  if(p.row == sc->prev) { return; }
+  sc->prev = p.row;
+  ++t->n_candidates;
+  const cluster_t *cl = t->cl;
+  if(cl->sig_map && sig_jaccard(cl->sig_map + (size_t)sc->first*cl->n_hash, cl->sig_map + (size_t)p.row*cl->n_hash, cl->n_hash) < cl->min_jaccard) { return; }
+  if(t->n_joins == t->joins_cap) {
+    t->joins_cap = t->joins_cap ? 2*t->joins_cap : 1024;
+    t->joins = (join_t *)realloc(t->joins, t->joins_cap*sizeof(join_t));
+  }
+  t->joins[t->n_joins++] = (join_t){ sc->first, p.row };
+}
+
+// Makes the next pair of a run available, returns 0 at its end, -1 on a read
+// error.
+static int run_fill(run_t *r, int fd, size_t block) {
+  if(r->i < r->n) { return 1; }
+  if(r->pos == r->end) { return 0; }
+  size_t n = r->end - r->pos < block ? r->end - r->pos : block;
+  if(pread(fd, r->blk, n*sizeof(pair_t), r->pos*sizeof(pair_t)) != (ssize_t)(n*sizeof(pair_t))) { return -1; }
+  r->pos += n;
+  r->i = 0;
+  r->n = n;
+  return 1;
+}
+
+static inline bool run_less(const run_t *runs, size_t a, size_t b) {
+  return cmp_pair(&runs[a].blk[runs[a].i], &runs[b].blk[runs[b].i]) < 0;
+}
+
+static void heap_down(size_t *heap, size_t n, size_t i, const run_t *runs) {
+  while(2*i+1 < n) {
+    size_t c = 2*i+1;
+    if(c+1 < n && run_less(runs, heap[c+1], heap[c])) { ++c; }
+    if(!run_less(runs, heap[c], heap[i])) { break; }
+    size_t tmp = heap[i]; heap[i] = heap[c]; heap[c] = tmp;
+    i = c;
+  }
+}
+
+// Sorts a partition larger than cl->sort_pairs: the spilled pairs are sorted
+// in runs of that size written to a temporary file, then merged with the
+// pairs in memory while the buckets are scanned.
+static bool part_merge(part_task_t *t) {
+  const cluster_t *cl = t->cl;
+  part_t *pt = t->part;
+  size_t run = cl->sort_pairs;
+  size_t n_file_runs = (pt->n_file + run - 1) / run;
+  size_t n_runs = n_file_runs + (pt->n > 0);
+  FILE *runs_fp = temp_file(cl->tmp_dir);
+  pair_t *buf = (pair_t *)malloc(run*sizeof(pair_t));
+  bool ok = runs_fp && buf && (pt->fp == NULL || fflush(pt->fp) == 0);
+  for(size_t r=0; r<n_file_runs && ok; ++r) {
+    size_t beg = r*run, n = pt->n_file - beg < run ? pt->n_file - beg : run;
+    ok = pread(fileno(pt->fp), buf, n*sizeof(pair_t), beg*sizeof(pair_t)) == (ssize_t)(n*sizeof(pair_t));
+    if(!ok) { break; }
+    qsort(buf, n, sizeof(pair_t), cmp_pair);
+    ok = fwrite(buf, sizeof(pair_t), n, runs_fp) == n;
+  }
+  ok = ok && fflush(runs_fp) == 0;
+  free(buf);
+
+  // the runs are read by blocks sharing the memory of one run
+  size_t block = run / n_runs ? run / n_runs : 1;
+  run_t *runs = (run_t *)calloc(n_runs, sizeof(run_t));
+  size_t *heap = (size_t *)malloc(n_runs*sizeof(size_t));
+  buf = (pair_t *)malloc(n_file_runs*block*sizeof(pair_t) + 1);
+  size_t n_heap = 0;
+  for(size_t r=0; r<n_runs && ok; ++r) {
+    if(r < n_file_runs) {
+      size_t beg = r*run;
+      runs[r] = (run_t){ .blk = buf + r*block, .pos = beg, .end = beg + (pt->n_file - beg < run ? pt->n_file - beg : run) };
+    } else {
+      qsort(pt->buf, pt->n, sizeof(pair_t), cmp_pair);
+      runs[r] = (run_t){ .blk = pt->buf, .n = pt->n };
+    }
+    int got = run_fill(&runs[r], fileno(runs_fp), block);
+    if(got < 0) { ok = false; }
+    else if(got) { heap[n_heap++] = r; }
+  }
+  for(size_t i=n_heap/2; i-- > 0; ) { heap_down(heap, n_heap, i, runs); }
+  scan_t sc = { .started = false };
+  while(ok && n_heap > 0) {
+    run_t *r = &runs[heap[0]];
+    scan_pair(t, &sc, r->blk[r->i++]);
+    int got = run_fill(r, fileno(runs_fp), block);
+    if(got < 0) { ok = false; }
+    else if(got == 0) { heap[0] = heap[--n_heap]; }
+    heap_down(heap, n_heap, 0, runs);
+  }
+  free(buf);
+  free(heap);
+  free(runs);
+  if(runs_fp) { fclose(runs_fp); }
+  return ok;
+}
+
+// Sorts a partition and lists the joins of its buckets.
+void part_task(void *arg) {
+  part_task_t *t = (part_task_t *)arg;
+  part_t *pt = t->part;
+  size_t n = pt->n_file + pt->n;
+  if(n > t->cl->sort_pairs) {
+    t->failed = !part_merge(t);
+    return;
+  }
+  pair_t *pairs = (pair_t *)malloc((n ? n : 1)*sizeof(pair_t));
+  if(pt->n_file) {
+    if(fflush(pt->fp) != 0 || pread(fileno(pt->fp), pairs, pt->n_file*sizeof(pair_t), 0) != (ssize_t)(pt->n_file*sizeof(pair_t))) {
+      t->failed = true;
+      free(pairs);
+      return;
+    }
+  }
+  if(pt->n) { memcpy(pairs + pt->n_file, pt->buf, pt->n*sizeof(pair_t)); }
+  qsort(pairs, n, sizeof(pair_t), cmp_pair);
+  scan_t sc = { .started = false };
+  for(size_t i=0; i<n; ++i) { scan_pair(t, &sc, pairs[i]); }
+  free(pairs);
+}
+
+// Joins the candidates of all the partitions, n_threads partitions at a time.
+// Returns false on a read error.
+bool cluster_buckets(cluster_t *cl, km_pool_t *pool, uint64_t *n_candidates, uint64_t *n_joins) {
+  size_t wave = pool ? (size_t)pool->n_threads : 1;
+  part_task_t *tasks = (part_task_t *)calloc(wave, sizeof(part_task_t));
+  bool ok = true;
+  *n_candidates = *n_joins = 0;
+  for(size_t p0=0; p0<N_PARTS && ok; p0+=wave) {
+    size_t p1 = p0 + wave < N_PARTS ? p0 + wave : N_PARTS;
+    km_group_t group;
+    km_group_init(&group);
+    for(size_t p=p0; p<p1; ++p) {
+      tasks[p-p0] = (part_task_t){ .cl = cl, .part = &cl->parts[p] };
+      if(pool) { km_pool_submit(pool, &group, part_task, &tasks[p-p0]); }
+      else { part_task(&tasks[p-p0]); }
+    }
+    if(pool) { km_pool_wait(pool, &group); }
+    for(size_t p=p0; p<p1; ++p) {
+      part_task_t *t = &tasks[p-p0];
+      if(t->failed) { ok = false; }
+      for(size_t i=0; i<t->n_joins; ++i) { uf_union(cl->parent, t->joins[i].a, t->joins[i].b); }
+      *n_candidates += t->n_candidates;
+      *n_joins += t->n_joins;
+      free(t->joins);
+      free(cl->parts[p].buf);
+      cl->parts[p].buf = NULL;
+      cl->parts[p].n = 0;
+    }
+  }
+  free(tasks);
+  return ok;
+}
+
+
+int main(int argc, char **argv) {
+
+  int n_threads = 1;
+  int numa_policy = KM_NUMA_NONE;
+  long min_abund = 1, min_samples = 2, bands = 16, rows = 4, min_size = 2, mem_mb = 1024;
+  double min_jaccard = 0.7;
+  uint64_t seed = 42;
+  char *out_fname = NULL, *metrics_fname = NULL, *trace_fname = NULL;
+  const char *tmp_dir = getenv("TMPDIR") ? getenv("TMPDIR") : "/tmp";
+  bool verbose_opt = false, help_opt = false;
+
+  static struct option long_opts[] = {
+    {"metrics", required_argument, NULL, KM_OPT_METRICS},
+    {"trace", required_argument, NULL, KM_OPT_TRACE},
+    {NULL, 0, NULL, 0}
+  };
+
+  int c;
+  while ((c = getopt_long(argc, argv, "a:b:j:m:M:o:P:r:s:S:t:T:vh", long_opts, NULL)) != -1) {
+    switch (c) {
+      case 'a':
+        min_abund = strtol(optarg, NULL, 10);
+        break;
+      case 'b':
+        bands = strtol(optarg, NULL, 10);
+        break;
+      case 'j':
+        min_jaccard = strtod(optarg, NULL);
+        break;
+      case 'm':
+        min_samples = strtol(optarg, NULL, 10);
+        break;
+      case 'M':
+        mem_mb = strtol(optarg, NULL, 10);
+        break;
+      case 'o':
+        out_fname = optarg;
+        break;
+      case 'P':
+        numa_policy = km_numa_policy(optarg);
+        if(numa_policy < 0) {
+          fprintf(stderr, "Unknown NUMA placement \"%s\"\n", optarg);
+          return 1;
+        }
+        break;
+      case 'r':
+        rows = strtol(optarg, NULL, 10);
+        break;
+      case 's':
+        min_size = strtol(optarg, NULL, 10);
+        break;
+      case 'S':
+        seed = strtoull(optarg, NULL, 10);
+        break;
+      case 't':
+        n_threads = km_pool_threads(optarg);
+        break;
+      case 'T':
+        tmp_dir = optarg;
+        break;
+      case 'v':
+        verbose_opt = true;
+        break;
+      case 'h':
+        help_opt = true;
+        break;
+      case KM_OPT_METRICS:
+        metrics_fname = optarg;
+        break;
+      case KM_OPT_TRACE:
+        trace_fname = optarg;
+        break;
+      case '?':
+        return 1;
+      default:
+        abort();
+    }
+  }
+
+  if(min_abund < 0 || min_abund > UINT32_MAX) {
+    fprintf(stderr, "Invalid min abundance: %ld\n", min_abund);
+    return 1;
+  }
+  if(bands < 1 || rows < 1 || bands*rows > 1024) {
+    fprintf(stderr, "-b and -r must be positive, with at most 1024 hashes (-b x -r)\n");
+    return 1;
+  }
+  if(!(min_jaccard >= 0 && min_jaccard <= 1)) {
+    fprintf(stderr, "-j must be in the [0,1] interval\n");
+    return 1;
+  }
+  if(min_samples < 1 || min_samples > UINT32_MAX || min_size < 1 || mem_mb < 1) {
+    fprintf(stderr, "-m, -s and -M must be positive\n");
+    return 1;
+  }
+
+  if(argc-optind != 1 || help_opt) {
+    fprintf(stdout, "Usage: km_cluster [options] <matrix>\n\n");
+    fprintf(stdout, "Cluster the k-mers whose sets of samples (count >= -a) are similar, e.g. the\n");
+    fprintf(stdout, "k-mers of an accessory element. Rows are bucketed by MinHash signatures (-b\n");
+    fprintf(stdout, "bands of -r hashes); rows sharing a bucket and a similarity >= -j are joined,\n");
+    fprintf(stdout, "and clusters are the connected rows. Output lines are the k-mer and its\n");
+    fprintf(stdout, "cluster (numbered in order of first k-mer), in input order, for clusters of\n");
+    fprintf(stdout, "at least -s k-mers. Rows sharing a bucket have a Jaccard similarity of about\n");
+    fprintf(stdout, "(1/b)^(1/r) or more. The matrix may be text or Arrow IPC (detected).\n\n");
+    fprintf(stdout, "Options:\n");
+    fprintf(stdout, "  -a INT   min abundance to define a k-mer as present in a sample [1]\n");
+    fprintf(stdout, "  -m INT   min number of samples where a k-mer is present, to be clustered [2]\n");
+    fprintf(stdout, "  -b INT   number of bands [16]\n");
+    fprintf(stdout, "  -r INT   hashes per band [4]\n");
+    fprintf(stdout, "  -j FLOAT min Jaccard similarity estimated by the signatures, 0 to join all candidates [0.7]\n");
+    fprintf(stdout, "  -s INT   min cluster size to output [2]\n");
+    fprintf(stdout, "  -S INT   seed of the hash functions [42]\n");
+    fprintf(stdout, "  -M INT   memory for the buckets, in MB, beyond which they go to temporary files [1024]\n");
+    fprintf(stdout, "  -T DIR   directory of the temporary files [$TMPDIR or /tmp]\n");
+    fprintf(stdout, "  -o FILE  write output to FILE [stdout]\n");
+    fprintf(stdout, "  -P STR   NUMA placement of threads and buffers: none, local, interleave [none]\n");
+    fprintf(stdout, "  -t INT   number of threads, 0 for all CPUs [1]\n");
+    fprintf(stdout, "  -v       verbose output\n");
+    fprintf(stdout, "      --metrics FILE  write run metrics (stage times, CPU counters) as JSON to FILE\n");
+    fprintf(stdout, "      --trace FILE    write a timeline of the threads in Chrome trace format to FILE\n");
+    fprintf(stdout, "  -h       print this help message\n");
+    return 0;
+  }
+
+  FILE *matfile = km_arrow_fopen(argv[optind], 0, false);
+  if(matfile == NULL) {
+    fprintf(stderr,"Cannot open file \"%s\"\n",argv[optind]);
+    return 1;
+  }
+
+  cluster_t cl;
+  memset(&cl, 0, sizeof(cl));
+  cl.min_abund = min_abund;
+  cl.min_samples = min_samples;
+  cl.bands = bands;
+  cl.rows = rows;
+  cl.n_hash = bands*rows;
+  cl.min_jaccard = min_jaccard;
+  cl.tmp_dir = tmp_dir;
+  cl.mem_limit = (size_t)mem_mb << 20;
+  cl.kmers = temp_file(tmp_dir);
+  cl.sigs = min_jaccard > 0 ? temp_file(tmp_dir) : NULL;
+  if(cl.kmers == NULL || (min_jaccard > 0 && cl.sigs == NULL)) {
+    fprintf(stderr,"Cannot create temporary files in \"%s\"\n",tmp_dir);
+    if(cl.kmers) { fclose(cl.kmers); }
+    if(matfile != stdin){ fclose(matfile); }
+    return 1;
+  }
+
+  FILE *outfile = out_fname ? fopen(out_fname,"w") : stdout;
+  if(outfile != stdout && outfile == NULL) {
+    fprintf(stderr,"Cannot open output file \"%s\"\n",out_fname);
+    fclose(cl.kmers);
+    if(cl.sigs) { fclose(cl.sigs); }
+    fclose(matfile);
+    return 1;
+  }
+
+  if(metrics_fname) { km_metrics_init("km_cluster"); }
+  if(trace_fname) { km_trace_init(); }
+
+  km_numa_t *numa = n_threads > 1 ? km_numa_init(numa_policy) : NULL;
+  km_pool_t *pool = n_threads > 1 ? km_pool_create(n_threads, numa) : NULL;
+  cl.sort_pairs = cl.mem_limit / (pool ? pool->n_threads : 1) / sizeof(pair_t);
+  if(cl.sort_pairs < 1024) { cl.sort_pairs = 1024; }
+  km_chunk_engine_t eng = { .pool = pool, .format = signature_chunk, .collect = collect_chunk, .arg = &cl };
+  km_chunk_engine_init(&eng, fileno(matfile), NULL);
+  chunk_rows_t *chunk_rows = (chunk_rows_t *)calloc(eng.n_chunks, sizeof(chunk_rows_t));
+  for(size_t i=0; i<eng.n_chunks; ++i) { eng.chunks[i].state = &chunk_rows[i]; }
+
+  // the number of samples is given by the first row; the hash of sample s by
+  // function j is hash[s*n_hash + j]
+  size_t first_len;
+  const char *first = km_chunk_peek_line(&eng, &first_len);
+  km_row_stats_t first_st = {0,0,0};
+  km_row_stats(km_skip_kmer(first, first + first_len), first + first_len, 1, &first_st);
+  cl.n_samples = first_st.n_values;
+  cl.hash = (uint32_t *)malloc((cl.n_samples ? cl.n_samples : 1)*cl.n_hash*sizeof(uint32_t));
+  for(size_t i=0; i<cl.n_samples*cl.n_hash; ++i) { cl.hash[i] = mix64(seed + i) >> 32; }
+
+  int ret = km_chunk_run(&eng, NULL, verbose_opt);
+  for(size_t i=0; i<eng.n_chunks; ++i) {
+    free(chunk_rows[i].sig);
+    free(chunk_rows[i].keys);
+    free(chunk_rows[i].kmer);
+    free(chunk_rows[i].kmer_len);
+  }
+  free(chunk_rows);
+  if(cl.failed) {
+    if(cl.too_many) { fprintf(stderr,"Too many k-mers to cluster (at most %u)\n",UINT32_MAX); }
+    else { fprintf(stderr,"Cannot write temporary files in \"%s\"\n",tmp_dir); }
+    ret = 1;
+  }
+  if(cl.spilled) {
+    fprintf(stderr, "[info] buckets spilled to temporary files\n");
+  }
+
+  // signatures of the candidates, from their file
+  void *sig_map = NULL;
+  size_t sig_size = cl.n_rows*cl.n_hash*sizeof(uint32_t);
+  if(ret == 0 && cl.sigs && sig_size) {
+    if(fflush(cl.sigs) != 0 || (sig_map = mmap(NULL, sig_size, PROT_READ, MAP_SHARED, fileno(cl.sigs), 0)) == MAP_FAILED) {
+      fprintf(stderr,"Cannot read temporary files in \"%s\"\n",tmp_dir);
+      sig_map = NULL;
+      ret = 1;
+    }
+    cl.sig_map = (const uint32_t *)sig_map;
+  }
+
+  uint64_t n_candidates = 0, n_joins = 0, n_clusters = 0, n_clustered = 0;
+  if(ret == 0 && !cluster_buckets(&cl, pool, &n_candidates, &n_joins)) {
+    fprintf(stderr,"Cannot read temporary files in \"%s\"\n",tmp_dir);
+    ret = 1;
+  }
+
+  if(ret == 0) {
+    // cluster sizes, then numbers of the clusters kept in order of first row
+    uint32_t *size = (uint32_t *)calloc(cl.n_rows ? cl.n_rows : 1, sizeof(uint32_t));
+    for(uint64_t i=0; i<cl.n_rows; ++i) { ++size[uf_find(cl.parent, i)]; }
+    for(uint64_t i=0; i<cl.n_rows; ++i) {
+      if(cl.parent[i] == i && size[i] >= min_size) {
+        size[i] = ++n_clusters;
+      } else if(cl.parent[i] == i) {
+        size[i] = 0;
+      }
+    }
+    char *line = NULL;
+    size_t line_size = 0;
+    ssize_t len;
+    rewind(cl.kmers);
+    for(uint64_t i=0; i<cl.n_rows && ret == 0; ++i) {
+      if((len = getline(&line, &line_size, cl.kmers)) <= 0) { ret = 1; break; }
+      uint32_t id = size[uf_find(cl.parent, i)];
+      if(id == 0) { continue; }
+      ++n_clustered;
+      line[len-1] = '\0';
+      if(fprintf(outfile, "%s\t%u\n", line, id) < 0) { ret = 1; }
+    }
+    if(fflush(outfile) != 0) { ret = 1; }
+    if(ret) { fprintf(stderr,"Cannot write output\n"); }
+    free(line);
+    free(size);
+  }
+
+  fprintf(stderr, "[info] %lu\tk-mers\n", eng.n_records);
+  fprintf(stderr, "[info] %lu\tk-mers in fewer than %ld samples\n", cl.n_skipped, min_samples);
+  fprintf(stderr, "[info] %lu\tcandidate pairs\n", n_candidates);
+  fprintf(stderr, "[info] %lu\tjoins\n", n_joins);
+  fprintf(stderr, "[info] %lu\tclusters\n", n_clusters);
+  fprintf(stderr, "[info] %lu\tclustered k-mers\n", n_clustered);
+
+  if(km_metrics_write(metrics_fname, pool ? km_pool_json : NULL, pool)) {
+    fprintf(stderr,"Cannot write metrics file \"%s\"\n",metrics_fname);
+  }
+  if(km_trace_write(trace_fname, "km_cluster")) {
+    fprintf(stderr,"Cannot write trace file \"%s\"\n",trace_fname);
+  }
+  km_chunk_engine_free(&eng);
+  if(pool) {
+    if(verbose_opt || metrics_fname) { km_pool_report(pool, stderr); }
+    km_pool_destroy(pool);
+  }
+  km_numa_free(numa);
+  if(sig_map) { munmap(sig_map, sig_size); }
+  for(size_t i=0; i<N_PARTS; ++i) {
+    free(cl.parts[i].buf);
+    if(cl.parts[i].fp) { fclose(cl.parts[i].fp); }
+  }
+  free(cl.hash);
+  free(cl.parent);
+  fclose(cl.kmers);
+  if(cl.sigs) { fclose(cl.sigs); }
+  if(matfile != stdin){ fclose(matfile); }
+  if(outfile != stdout){ fclose(outfile); }
+
+  return ret;
+}
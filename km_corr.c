@@ -0,0 +1,441 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <stdbool.h>
+#include <string.h>
+#include <math.h>
+
+#include "km_kernels.h"
+#include "km_chunk.h"
+
+// Correlation of the counts of each k-mer with continuous traits. The traits
+// are centered and scaled to unit norm once; each row is normalized the same
+// way while it is parsed into a tile of TILE_ROWS rows, so that the
+// correlations of a tile with all the traits are one matrix product: tile
+// (rows x samples) times traits (samples x traits). The product is blocked
+// over TILE_SAMPLES samples, for which the traits stay in cache, and its inner
+// loop runs over the traits, which the compiler vectorizes. Spearman
+// correlations are the Pearson correlations of the ranks.
+
+#define TILE_ROWS 64
+#define TILE_SAMPLES 256
+#define TRAIT_PAD 8  // traits are padded to a multiple of the vector width
+
+typedef enum { CORR_PEARSON, CORR_SPEARMAN, N_CORR } corr_t;
+static const char *corr_names[N_CORR] = { "pearson", "spearman" };
+
+typedef struct {
+  char **names;
+  size_t n_traits, stride;  // stride: padded number of traits
+  size_t n_samples;         // samples with traits
+  uint32_t *idx;            // their 0-based columns, increasing
+  uint32_t max_sample;      // 1-based, columns needed
+  double *values;           // n_samples x n_traits, as read
+  float *y;                 // n_samples x stride, normalized
+  bool *varies;             // false for the constant traits
+} traits_t;
+
+typedef struct {
+  const traits_t *traits;
+  corr_t corr;
+  float min_r;
+} corr_job_t;
+
+// --- ranks
+
+typedef struct {
+  double v;
+  uint32_t i;
+} rank_t;
+
+int cmp_rank(const void *x, const void *y) {
+  const rank_t *rx = (const rank_t *)x, *ry = (const rank_t *)y;
+  return (rx->v > ry->v) - (rx->v < ry->v);
+}
+
+// Replaces the n values v[0], v[stride], ... by their ranks (ties get the mean
+// of their ranks). tmp holds n entries.
+void rank_values(double *v, size_t n, size_t stride, rank_t *tmp) {
+  for(size_t i=0; i<n; ++i) { tmp[i].v = v[i*stride]; tmp[i].i = i; }
+  qsort(tmp, n, sizeof(rank_t), cmp_rank);
+  for(size_t i=0; i<n; ) {
+    size_t j = i + 1;
+    while(j < n && tmp[j].v == tmp[i].v) { ++j; }
+    double r = (i + j + 1) / 2.0;
+    for(; i<j; ++i) { v[tmp[i].i*stride] = r; }
+  }
+}
+
+// Centers the n values (of stride) and scales them to unit norm into out.
+// Returns false if they are constant.
+bool normalize(const double *v, size_t n, size_t stride, float *out, size_t out_stride) {
+  double sum = 0, ss = 0;
+  for(size_t i=0; i<n; ++i) { sum += v[i*stride]; }
+  double mean = sum / n;
+  for(size_t i=0; i<n; ++i) { ss += (v[i*stride] - mean)*(v[i*stride] - mean); }
+  if(ss <= 0) {
+    for(size_t i=0; i<n; ++i) { out[i*out_stride] = 0; }
+    return false;
+  }
+  double inv = 1 / sqrt(ss);
+  for(size_t i=0; i<n; ++i) { out[i*out_stride] = (v[i*stride] - mean)*inv; }
+  return true;
+}
+
+// --- traits
+
+// Reads the traits: one "SAMPLE VALUE..." line per sample, SAMPLE being a
+// 1-based column, with the same number of values on each line. A first line
+// whose first field is not a number names the traits. Returns 0, or the line
+// number of the first invalid line.
+size_t read_traits(FILE *fp, traits_t *tr) {
+  memset(tr, 0, sizeof(*tr));
+  size_t cap = 0;
+  char *line = NULL;
+  size_t line_size = 0, line_num = 0, bad = 0;
+  bool first_line = true;
+  while(bad == 0 && getline(&line, &line_size, fp) >= 0) {
+    ++line_num;
+    char *p = line;
+    while(*p == ' ' || *p == '\t') { ++p; }
+    if(*p == '\n' || *p == '\0' || *p == '#') { continue; }
+    char *end;
+    long sample = strtol(p, &end, 10);
+    if(first_line && end == p) {
+      // header: skip the first field, the others name the traits
+      size_t n = 0;
+      for(char *tok = strtok(p, " \t\r\n"); tok; tok = strtok(NULL, " \t\r\n")) {
+        if(n++ == 0) { continue; }
+        tr->names = (char **)realloc(tr->names, n*sizeof(char *));
+        tr->names[n-2] = strdup(tok);
+      }
+      tr->n_traits = n > 0 ? n - 1 : 0;
+      if(tr->n_traits == 0) { bad = line_num; }
+      first_line = false;
+      continue;
+    }
+    first_line = false;
+    if(end == p || sample < 1 || sample > UINT32_MAX) { bad = line_num; break; }
+    double v[4096];
+    size_t n = 0;
+    for(p = end; n < 4096; ++n) {
+      double x = strtod(p, &end);
+      if(end == p) { break; }
+      v[n] = x;
+      p = end;
+    }
+    while(*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n') { ++p; }
+    if(tr->n_traits == 0) { tr->n_traits = n; }
+    if(n == 0 || n != tr->n_traits || *p != '\0' || (tr->n_samples && sample - 1 <= tr->idx[tr->n_samples-1])) { bad = line_num; break; }
+    for(size_t t=0; t<n; ++t) {
+      if(!isfinite(v[t])) { bad = line_num; }
+    }
+    if(bad) { break; }
+    if(tr->n_samples == cap) {
+      cap = cap ? 2*cap : 64;
+      tr->idx = (uint32_t *)realloc(tr->idx, cap*sizeof(uint32_t));
+      tr->values = (double *)realloc(tr->values, cap*tr->n_traits*sizeof(double));
+    }
+    tr->idx[tr->n_samples] = sample - 1;
+    memcpy(tr->values + tr->n_samples*tr->n_traits, v, n*sizeof(double));
+    ++tr->n_samples;
+    tr->max_sample = sample;
+  }
+  free(line);
+  if(bad) { return bad; }
+  if(tr->names == NULL && tr->n_traits) {
+    tr->names = (char **)malloc(tr->n_traits*sizeof(char *));
+    for(size_t t=0; t<tr->n_traits; ++t) {
+      char name[32];
+      snprintf(name, sizeof(name), "trait%lu", t+1);
+      tr->names[t] = strdup(name);
+    }
+  }
+  return 0;
+}
+
+// Normalizes the traits (their ranks for Spearman) into y. Returns the number
+// of constant traits, which are not correlated.
+size_t prepare_traits(traits_t *tr, corr_t corr) {
+  size_t n = tr->n_samples, T = tr->n_traits, constant = 0;
+  tr->stride = (T + TRAIT_PAD - 1) / TRAIT_PAD * TRAIT_PAD;
+  tr->y = (float *)calloc(n*tr->stride, sizeof(float));
+  tr->varies = (bool *)malloc(T*sizeof(bool));
+  rank_t *tmp = (rank_t *)malloc(n*sizeof(rank_t));
+  for(size_t t=0; t<T; ++t) {
+    if(corr == CORR_SPEARMAN) { rank_values(tr->values + t, n, T, tmp); }
+    tr->varies[t] = normalize(tr->values + t, n, T, tr->y + t, tr->stride);
+    if(!tr->varies[t]) { ++constant; }
+  }
+  free(tmp);
+  return constant;
+}
+
+void free_traits(traits_t *tr) {
+  for(size_t t=0; tr->names && t<tr->n_traits; ++t) { free(tr->names[t]); }
+  free(tr->names);
+  free(tr->idx);
+  free(tr->values);
+  free(tr->y);
+  free(tr->varies);
+}
+
+// --- kernel
+
+// r (rows x stride) = x (rows x n) * y (n x stride), blocked over the samples
+void tile_product(const float *restrict x, size_t rows, size_t n, const float *restrict y, size_t stride, float *restrict r) {
+  memset(r, 0, rows*stride*sizeof(float));
+  for(size_t s0=0; s0<n; s0+=TILE_SAMPLES) {
+    size_t s1 = s0 + TILE_SAMPLES < n ? s0 + TILE_SAMPLES : n;
+    for(size_t i=0; i<rows; ++i) {
+      const float *xi = x + i*n;
+      float *ri = r + i*stride;
+      for(size_t s=s0; s<s1; ++s) {
+        const float xs = xi[s];
+        const float *ys = y + s*stride;
+        for(size_t t=0; t<stride; ++t) { ri[t] += xs * ys[t]; }
+      }
+    }
+  }
+}
+
+// --- chunks
+
+typedef struct {
+  const char *kmer[TILE_ROWS];
+  size_t kmer_len[TILE_ROWS];
+  bool valid[TILE_ROWS];
+  size_t rows;
+  float *x, *r;
+} tile_t;
+
+void flush_tile(km_chunk_t *chunk, const corr_job_t *job, tile_t *tile) {
+  const traits_t *tr = job->traits;
+  tile_product(tile->x, tile->rows, tr->n_samples, tr->y, tr->stride, tile->r);
+  for(size_t i=0; i<tile->rows; ++i) {
+    if(!tile->valid[i]) { continue; }
+    const float *ri = tile->r + i*tr->stride;
+    for(size_t t=0; t<tr->n_traits; ++t) {
+      if(!tr->varies[t] || fabsf(ri[t]) < job->min_r) { continue; }
+      size_t name_len = strlen(tr->names[t]);
+      km_chunk_reserve(&chunk->out, &chunk->out_cap, chunk->out_len + tile->kmer_len[i] + name_len + 16);
+      char *o = chunk->out + chunk->out_len;
+      memcpy(o, tile->kmer[i], tile->kmer_len[i]);
+      o += tile->kmer_len[i];
+      *o++ = '\t';
+      memcpy(o, tr->names[t], name_len);
+      o += name_len;
+      float v = ri[t] > 1 ? 1 : ri[t] < -1 ? -1 : ri[t];
+      o += sprintf(o, "\t%.4f\n", v);
+      chunk->out_len = o - chunk->out;
+      ++chunk->n_kept;
+    }
+  }
+  tile->rows = 0;
+}
+
+void corr_chunk(km_chunk_t *chunk, void *arg) {
+  const corr_job_t *job = (const corr_job_t *)arg;
+  const traits_t *tr = job->traits;
+  size_t n = tr->n_samples;
+  uint32_t *counts = (uint32_t *)malloc(tr->max_sample*sizeof(uint32_t));
+  double *v = (double *)malloc(n*sizeof(double));
+  rank_t *tmp = job->corr == CORR_SPEARMAN ? (rank_t *)malloc(n*sizeof(rank_t)) : NULL;
+  tile_t tile;
+  tile.rows = 0;
+  tile.x = (float *)malloc(TILE_ROWS*n*sizeof(float));
+  tile.r = (float *)malloc(TILE_ROWS*tr->stride*sizeof(float));
+  size_t pos = 0, len;
+  char *line;
+  while(km_chunk_next_line(chunk, &pos, &line, &len)) {
+    const char *end = line + len;
+    const char *p = km_skip_kmer(line, end);
+    if(p == line || km_isblank(p[-1])) { continue; } // skip empty lines
+    ++chunk->n_records;
+    km_parse_counts(p, end, counts, tr->max_sample);
+    for(size_t s=0; s<n; ++s) { v[s] = counts[tr->idx[s]]; }
+    if(tmp) { rank_values(v, n, 1, tmp); }
+    size_t i = tile.rows++;
+    tile.kmer[i] = line;
+    tile.kmer_len[i] = p - line;
+    tile.valid[i] = normalize(v, n, 1, tile.x + i*n, 1);
+    if(tile.rows == TILE_ROWS) { flush_tile(chunk, job, &tile); }
+  }
+  if(tile.rows) { flush_tile(chunk, job, &tile); }
+  free(counts);
+  free(v);
+  free(tmp);
+  free(tile.x);
+  free(tile.r);
+}
+
+
+int main(int argc, char **argv) {
+
+  int n_threads = 1;
+  int numa_policy = KM_NUMA_NONE;
+  double min_r = 0.5;
+  int corr = CORR_PEARSON;
+  char *out_fname = NULL, *metrics_fname = NULL, *trace_fname = NULL;
+  bool verbose_opt = false, help_opt = false;
+
+  static struct option long_opts[] = {
+    {"metrics", required_argument, NULL, KM_OPT_METRICS},
+    {"trace", required_argument, NULL, KM_OPT_TRACE},
+    {NULL, 0, NULL, 0}
+  };
+
+  int c;
+  while ((c = getopt_long(argc, argv, "m:o:P:r:t:vh", long_opts, NULL)) != -1) {
+    switch (c) {
+      case 'm':
+        for(corr = 0; corr < N_CORR && strcmp(optarg, corr_names[corr]); ++corr) {}
+        if(corr == N_CORR) {
+          fprintf(stderr, "Unknown correlation \"%s\"\n", optarg);
+          return 1;
+        }
+        break;
+      case 'o':
+        out_fname = optarg;
+        break;
+      case 'P':
+        numa_policy = km_numa_policy(optarg);
+        if(numa_policy < 0) {
+          fprintf(stderr, "Unknown NUMA placement \"%s\"\n", optarg);
+          return 1;
+        }
+        break;
+      case 'r':
+        min_r = strtod(optarg, NULL);
+        break;
+      case 't':
+        n_threads = km_pool_threads(optarg);
+        break;
+      case 'v':
+        verbose_opt = true;
+        break;
+      case 'h':
+        help_opt = true;
+        break;
+      case KM_OPT_METRICS:
+        metrics_fname = optarg;
+        break;
+      case KM_OPT_TRACE:
+        trace_fname = optarg;
+        break;
+      case '?':
+        return 1;
+      default:
+        abort();
+    }
+  }
+
+  if(!(min_r >= 0 && min_r <= 1)) {
+    fprintf(stderr, "-r must be in the [0,1] interval\n");
+    return 1;
+  }
+
+  if(argc-optind != 2 || help_opt) {
+    fprintf(stdout, "Usage: km_corr [options] <matrix> <traits>\n\n");
+    fprintf(stdout, "Correlate the counts of each k-mer with continuous traits, all in one pass.\n");
+    fprintf(stdout, "<traits> gives one \"SAMPLE VALUE...\" line per sample, SAMPLE being a 1-based\n");
+    fprintf(stdout, "column and VALUE one value per trait; an optional first line \"SAMPLE NAME...\"\n");
+    fprintf(stdout, "names the traits. Samples without traits are left out. Output lines are the\n");
+    fprintf(stdout, "k-mer, the trait and the correlation (tab-separated), for |r| >= -r. Rows or\n");
+    fprintf(stdout, "traits with constant values are not correlated. The matrix may be text or\n");
+    fprintf(stdout, "Arrow IPC (detected).\n\n");
+    fprintf(stdout, "Options:\n");
+    fprintf(stdout, "  -m STR   correlation: pearson, spearman [pearson]\n");
+    fprintf(stdout, "  -r FLOAT min absolute correlation to output a k-mer and trait [0.5]\n");
+    fprintf(stdout, "  -o FILE  write output to FILE [stdout]\n");
+    fprintf(stdout, "  -P STR   NUMA placement of threads and buffers: none, local, interleave [none]\n");
+    fprintf(stdout, "  -t INT   number of threads, 0 for all CPUs [1]\n");
+    fprintf(stdout, "  -v       verbose output\n");
+    fprintf(stdout, "      --metrics FILE  write run metrics (stage times, CPU counters) as JSON to FILE\n");
+    fprintf(stdout, "      --trace FILE    write a timeline of the threads in Chrome trace format to FILE\n");
+    fprintf(stdout, "  -h       print this help message\n");
+    return 0;
+  }
+
+  FILE *traitfile = fopen(argv[optind+1],"r");
+  if(traitfile == NULL) {
+    fprintf(stderr,"Cannot open file \"%s\"\n",argv[optind+1]);
+    return 1;
+  }
+  traits_t traits;
+  size_t bad = read_traits(traitfile, &traits);
+  fclose(traitfile);
+  if(bad || traits.n_samples < 2) {
+    if(bad) { fprintf(stderr,"Invalid line %lu of \"%s\", expected SAMPLE VALUE... (increasing samples)\n",bad,argv[optind+1]); }
+    else { fprintf(stderr,"\"%s\" needs the traits of at least 2 samples\n",argv[optind+1]); }
+    free_traits(&traits);
+    return 1;
+  }
+  size_t constant = prepare_traits(&traits, (corr_t)corr);
+  if(constant) {
+    fprintf(stderr, "[warning] %lu traits are constant over the samples\n", constant);
+  }
+
+  FILE *matfile = km_arrow_fopen(argv[optind], 0, false);
+  if(matfile == NULL) {
+    fprintf(stderr,"Cannot open file \"%s\"\n",argv[optind]);
+    free_traits(&traits);
+    return 1;
+  }
+
+  FILE *outfile = out_fname ? fopen(out_fname,"w") : stdout;
+  if(outfile != stdout && outfile == NULL) {
+    fprintf(stderr,"Cannot open output file \"%s\"\n",out_fname);
+    fclose(matfile);
+    free_traits(&traits);
+    return 1;
+  }
+
+  if(metrics_fname) { km_metrics_init("km_corr"); }
+  if(trace_fname) { km_trace_init(); }
+
+  km_numa_t *numa = n_threads > 1 ? km_numa_init(numa_policy) : NULL;
+  km_pool_t *pool = n_threads > 1 ? km_pool_create(n_threads, numa) : NULL;
+  corr_job_t job = { .traits = &traits, .corr = (corr_t)corr, .min_r = (float)min_r };
+  km_chunk_engine_t eng = { .pool = pool, .format = corr_chunk, .arg = &job };
+  km_chunk_engine_init(&eng, fileno(matfile), outfile);
+
+  // the number of samples is given by the first row
+  size_t first_len;
+  const char *first = km_chunk_peek_line(&eng, &first_len);
+  km_row_stats_t first_st = {0,0,0};
+  km_row_stats(km_skip_kmer(first, first + first_len), first + first_len, 1, &first_st);
+  if(traits.max_sample > first_st.n_values) {
+    fprintf(stderr, "[warning] the traits refer to sample %u, the matrix has %lu samples (missing counts read as 0)\n", traits.max_sample, first_st.n_values);
+  }
+
+  int ret = km_chunk_run(&eng, outfile, verbose_opt);
+  if(ret) {
+    fprintf(stderr,"Cannot write output\n");
+  }
+
+  fprintf(stderr, "[info] %lu\tsamples\n", traits.n_samples);
+  fprintf(stderr, "[info] %lu\ttraits\n", traits.n_traits);
+  fprintf(stderr, "[info] %lu\tk-mers\n", eng.n_records);
+  fprintf(stderr, "[info] %lu\tcorrelations output\n", eng.n_kept);
+
+  if(km_metrics_write(metrics_fname, pool ? km_pool_json : NULL, pool)) {
+    fprintf(stderr,"Cannot write metrics file \"%s\"\n",metrics_fname);
+  }
+  if(km_trace_write(trace_fname, "km_corr")) {
+    fprintf(stderr,"Cannot write trace file \"%s\"\n",trace_fname);
+  }
+  km_chunk_engine_free(&eng);
+  if(pool) {
+    if(verbose_opt || metrics_fname) { km_pool_report(pool, stderr); }
+    km_pool_destroy(pool);
+  }
+  km_numa_free(numa);
+  free_traits(&traits);
+  if(matfile != stdin){ fclose(matfile); }
+  if(outfile != stdout){ fclose(outfile); }
+
+  return ret;
+}
@@ -6,6 +6,10 @@
 #include <stdbool.h>
 #include <string.h>
 
+#include "km_kernels.h"
+#include "km_arrow.h"
+#include "km_plan.h"
+
 static const int isnuc[256] = {
       0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,
       0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,
@@ -78,21 +82,52 @@ size_t samples_number(char *line) {
   return n_samples;
 }
 
+int cmp_key(const void *a, const void *b) {
+  uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+  return (x > y) - (x < y);
+}
+
 char * first_column(char *line) {
   while(*line && *line != ' ' && *line != '\t') { ++line; }
   while(*line && (*line == ' ' || *line == '\t')) { ++line; }
   return line;
 }
 
+// rows of <matrix_1> looked up at once in the search tree of <matrix_2>
+#define DIFF_BATCH 256
+
+// Loads the packed keys of <matrix_2>, decoded from its k-mer set, or read
+// from its rows, the first one being already in kmer if has_kmer.
+uint64_t *load_keys(const km_ef_t *set, FILE *mat, char *kmer, bool has_kmer, int ksize, const uint8_t *code, char **line, size_t *line_size, size_t *n_keys) {
+  if(set) { return km_ef_decode(set, n_keys); }
+  size_t n = 0, cap = 1<<16;
+  uint64_t *keys = (uint64_t *)malloc(cap*sizeof(uint64_t)), key;
+  for(; has_kmer && km_pack(kmer, ksize, code, &key); has_kmer = next_kmer_and_line(kmer, ksize, line, line_size, mat)) {
+    if(n == cap) {
+      cap *= 2;
+      keys = (uint64_t *)realloc(keys, cap*sizeof(uint64_t));
+    }
+    keys[n++] = key;
+  }
+  *n_keys = n;
+  return keys;
+}
+
 
 int main(int argc, char **argv) {
 
   int ksize = 31;
-  char *out_fname = NULL;
+  char *out_fname = NULL, *split_prefix = NULL;
   bool use_ktcmp = false, help_opt = false;
+  int plan_opt = KM_PLAN_AUTO;
+
+  static struct option long_opts[] = {
+    {"plan", required_argument, NULL, KM_OPT_PLAN},
+    {NULL, 0, NULL, 0}
+  };
 
   int c;
-  while ((c = getopt(argc, argv, "k:o:h")) != -1) {
+  while ((c = getopt_long(argc, argv, "k:o:s:zh", long_opts, NULL)) != -1) {
     switch (c) {
       case 'k':
         ksize = strtol(optarg, NULL, 10);
@@ -100,12 +135,22 @@ int main(int argc, char **argv) {
       case 'o':
         out_fname = optarg;
         break;
+      case 's':
+        split_prefix = optarg;
+        break;
       case 'z':
         use_ktcmp = true;
         break;
       case 'h':
         help_opt = true;
         break;
+      case KM_OPT_PLAN:
+        plan_opt = km_plan_strategy(optarg);
+        if(plan_opt < KM_PLAN_AUTO) {
+          fprintf(stderr, "Unknown plan \"%s\"\n", optarg);
+          return 1;
+        }
+        break;
       case '?':
         return 1;
       default:
@@ -118,37 +163,91 @@ int main(int argc, char **argv) {
     return 1;
   }
 
+  if(split_prefix && out_fname) {
+    fprintf(stderr, "-o and -s cannot be used together (-s writes STR_1.mat instead of the output)\n");
+    return 1;
+  }
+
   if(argc-optind != 2 || help_opt) {
     fprintf(stdout, "Usage: km_diff [options] <matrix_1> <matrix_2>\n\n");
     fprintf(stdout, "Difference between two sorted k-mer matrices.\n\n");
-    fprintf(stdout, "Removes from <matrix_1>, the k-mers in <matrix_2>.\n\n");
+    fprintf(stdout, "Removes from <matrix_1>, the k-mers in <matrix_2>.\n");
+    fprintf(stdout, "With -s, both matrices are split in a single pass into the k-mers only in\n");
+    fprintf(stdout, "<matrix_1> (STR_1.mat), only in <matrix_2> (STR_2.mat) and in both (STR_12.mat,\n");
+    fprintf(stdout, "columns of <matrix_1> followed by columns of <matrix_2>).\n");
+    fprintf(stdout, "Without -s, unsorted matrices (k <= 32) are handled with a hash set or a\n");
+    fprintf(stdout, "search tree of the k-mers of <matrix_2>, chosen from samples of the inputs,\n");
+    fprintf(stdout, "see --plan.\n");
+    fprintf(stdout, "Input matrices may be text or Arrow IPC files or streams (detected).\n");
+    fprintf(stdout, "<matrix_2> may also be a k-mer set built by km_set (detected), except with -s.\n\n");
     fprintf(stdout, "Options:\n");
     fprintf(stdout, "  -k INT   size of k-mers of input matrices [31]\n");
-    fprintf(stdout, "  -o FILE  write output matrix to FILE [stdout]\n");
+    fprintf(stdout, "  -o FILE  write output matrix to FILE [stdout], not with -s\n");
+    fprintf(stdout, "  -s STR   three-way split of the input matrices to files prefixed by STR\n");
     fprintf(stdout, "  -z       use kmtricks order of nucleotides: A<C<T<G\n");
+    fprintf(stdout, "      --plan STR  strategy: auto, merge, hash, bloom, tree [auto]\n");
     fprintf(stdout, "  -h       print this help message\n");
     return 0;
   }
 
-  FILE *mat_1 = fopen(argv[optind],"r");
+  FILE *mat_1 = km_arrow_fopen(argv[optind], ksize, use_ktcmp);
   if(mat_1 == NULL) {
     fprintf(stderr,"Cannot open file \"%s\"\n",argv[optind]);
     return 1;
   }
 
-  FILE *mat_2 = fopen(argv[optind+1],"r");
-  if(mat_2 == NULL) {
+  // <matrix_2> may be a k-mer set, mapped instead of read
+  km_ef_t set_2;
+  bool is_set = km_ef_is_set(argv[optind+1]);
+  FILE *mat_2 = NULL;
+  if(is_set) {
+    const char *err = NULL;
+    int ret = split_prefix ? 3 : km_ef_open(&set_2, argv[optind+1], &err);
+    if(ret == 0 && (err = km_ef_check(&set_2, ksize, use_ktcmp)) != NULL) {
+      km_ef_unmap(&set_2);
+      ret = 2;
+    }
+    if(ret) {
+      if(ret == 1) { fprintf(stderr,"Cannot open file \"%s\"\n",argv[optind+1]); }
+      if(ret == 2) { fprintf(stderr,"Cannot read set \"%s\": %s\n",argv[optind+1],err); }
+      if(ret == 3) { fprintf(stderr,"Cannot split with a k-mer set as <matrix_2>, see -s\n"); }
+      fclose(mat_1);
+      return 1;
+    }
+  } else if((mat_2 = km_arrow_fopen(argv[optind+1], ksize, use_ktcmp)) == NULL) {
     fprintf(stderr,"Cannot open file \"%s\"\n",argv[optind+1]);
     fclose(mat_1); 
     return 1;
   }
 
-  FILE *outfile = out_fname ? fopen(out_fname,"w") : stdout;
-  if(outfile != stdout && outfile == NULL) {
-    fprintf(stderr,"Cannot open output file \"%s\"\n",out_fname);
-    fclose(mat_1);
-    fclose(mat_2);
-    return 1;
+  FILE *outfile = NULL, *only_2_file = NULL, *both_file = NULL;
+  if(split_prefix) {
+    size_t fname_size = strlen(split_prefix) + 8;
+    char *fname = (char *)malloc(fname_size);
+    snprintf(fname, fname_size, "%s_1.mat", split_prefix);
+    outfile = fopen(fname,"w");
+    snprintf(fname, fname_size, "%s_2.mat", split_prefix);
+    only_2_file = outfile ? fopen(fname,"w") : NULL;
+    snprintf(fname, fname_size, "%s_12.mat", split_prefix);
+    both_file = only_2_file ? fopen(fname,"w") : NULL;
+    if(both_file == NULL) {
+      fprintf(stderr,"Cannot open output file \"%s\"\n",fname);
+      free(fname);
+      if(outfile){ fclose(outfile); }
+      if(only_2_file){ fclose(only_2_file); }
+      fclose(mat_1);
+      if(mat_2){ fclose(mat_2); } else { km_ef_unmap(&set_2); }
+      return 1;
+    }
+    free(fname);
+  } else {
+    outfile = out_fname ? fopen(out_fname,"w") : stdout;
+    if(outfile != stdout && outfile == NULL) {
+      fprintf(stderr,"Cannot open output file \"%s\"\n",out_fname);
+      fclose(mat_1);
+      if(mat_2){ fclose(mat_2); } else { km_ef_unmap(&set_2); }
+      return 1;
+    }
   }
 
   char *kmer_1 = (char *)calloc(ksize+1,1);
@@ -160,40 +259,175 @@ int main(int argc, char **argv) {
   size_t n_sample_1 = has_kmer_1 ? samples_number(line_1) : 0;
   fprintf(stderr,"[info] samples in 1st matrix: %lu\n", n_sample_1);
 
-  bool has_kmer_2 = next_kmer_and_line(kmer_2, ksize, &line_2, &line_2_size, mat_2);
-  size_t n_sample_2 = has_kmer_2 ? samples_number(line_2) : 0;
-  fprintf(stderr,"[info] samples in 2nd matrix: %lu\n", n_sample_2);
+  bool has_kmer_2 = false;
+  if(is_set) {
+    fprintf(stderr,"[info] k-mers in the set of the 2nd matrix: %lu\n", set_2.h.n);
+  } else {
+    has_kmer_2 = next_kmer_and_line(kmer_2, ksize, &line_2, &line_2_size, mat_2);
+    size_t n_sample_2 = has_kmer_2 ? samples_number(line_2) : 0;
+    fprintf(stderr,"[info] samples in 2nd matrix: %lu\n", n_sample_2);
+  }
+
+  // the three-way split needs the merge, the other strategies only remove k-mers
+  km_plan_input_t build, probe;
+  km_plan_stats(&build, argv[optind+1], ksize, use_ktcmp);
+  km_plan_stats(&probe, argv[optind], ksize, use_ktcmp);
+  km_plan_t plan;
+  km_plan_choose(&plan, &build, &probe, ksize, false, split_prefix != NULL, plan_opt);
+  km_plan_log(&plan, &build, &probe, stderr);
+
+  size_t only_1 = 0, only_2 = 0, shared = 0;
+  if(is_set && plan.strategy == KM_PLAN_MERGE) {
+    // packed merge, skipping to the key of each row in the set
+    const uint8_t *code = use_ktcmp ? nt2bits_kt : nt2bits;
+    km_ef_cursor_t cur;
+    bool has_key = km_ef_begin(&cur, &set_2);
+    uint64_t key, last_hit = UINT64_MAX;
+    for(; has_kmer_1 && km_pack(kmer_1, ksize, code, &key); has_kmer_1 = next_kmer_and_line(kmer_1, ksize, &line_1, &line_1_size, mat_1)) {
+      if(has_key && (has_key = km_ef_next_geq(&cur, key)) && cur.key == key) {
+        only_2 += cur.i != last_hit; // distinct k-mers of the set found
+        last_hit = cur.i;
+        ++shared;
+      } else {
+        fputs(line_1,outfile);
+        fputc('\n',outfile);
+        ++only_1;
+      }
+    }
+    only_2 = set_2.h.n - only_2;
+    has_kmer_1 = false;
+  } else if(plan.strategy == KM_PLAN_TREE) {
+    const uint8_t *code = use_ktcmp ? nt2bits_kt : nt2bits;
+    size_t n_keys;
+    uint64_t *keys = load_keys(is_set ? &set_2 : NULL, mat_2, kmer_2, has_kmer_2, ksize, code, &line_2, &line_2_size, &n_keys);
+    if(!is_set) { qsort(keys, n_keys, sizeof(uint64_t), cmp_key); }
+    size_t n = 0;
+    for(size_t i=0; i<n_keys; ++i) {
+      if(n == 0 || keys[i] != keys[n-1]) { keys[n++] = keys[i]; }
+    }
+    km_stree_t tree;
+    km_stree_build(&tree, keys, n);
+    free(keys);
+    uint8_t *hits = (uint8_t *)calloc(n ? n : 1, 1);
+
+    // the first row of <matrix_1> is already read
+    char *lines[DIFF_BATCH] = { NULL };
+    size_t sizes[DIFF_BATCH] = { 0 }, rank[DIFF_BATCH];
+    uint64_t batch[DIFF_BATCH];
+    lines[0] = line_1;
+    sizes[0] = line_1_size;
+    line_1 = NULL;
+    line_1_size = 0;
+    bool more = has_kmer_1 && km_pack(kmer_1, ksize, code, &batch[0]);
+    while(more) {
+      size_t n_batch = 1;
+      while(n_batch < DIFF_BATCH && (more = next_kmer_and_line(kmer_1, ksize, &lines[n_batch], &sizes[n_batch], mat_1) && km_pack(kmer_1, ksize, code, &batch[n_batch]))) { ++n_batch; }
+      km_stree_find_batch(&tree, batch, n_batch, rank);
+      for(size_t i=0; i<n_batch; ++i) {
+        if(rank[i] != SIZE_MAX) {
+          hits[rank[i]] = 1;
+          ++shared;
+        } else {
+          fputs(lines[i],outfile);
+          fputc('\n',outfile);
+          ++only_1;
+        }
+      }
+      if(more) { more = next_kmer_and_line(kmer_1, ksize, &lines[0], &sizes[0], mat_1) && km_pack(kmer_1, ksize, code, &batch[0]); }
+    }
+    only_2 = n;
+    for(size_t i=0; i<n; ++i) { only_2 -= hits[i]; }
+    for(size_t i=0; i<DIFF_BATCH; ++i) { free(lines[i]); }
+    free(hits);
+    km_stree_free(&tree);
+    has_kmer_1 = has_kmer_2 = false;
+  } else if(plan.strategy == KM_PLAN_HASH || plan.strategy == KM_PLAN_BLOOM) {
+    const uint8_t *code = use_ktcmp ? nt2bits_kt : nt2bits;
+    size_t n_keys;
+    uint64_t key, *keys = load_keys(is_set ? &set_2 : NULL, mat_2, kmer_2, has_kmer_2, ksize, code, &line_2, &line_2_size, &n_keys);
+    km_keyset_t set;
+    km_keyset_init(&set, n_keys, true);
+    for(size_t i=0; i<n_keys; ++i) { km_keyset_add(&set, keys[i]); }
+    km_bloom_t bloom = { NULL, 0 };
+    bool use_bloom = plan.strategy == KM_PLAN_BLOOM;
+    if(use_bloom) {
+      km_bloom_init(&bloom, n_keys);
+      for(size_t i=0; i<n_keys; ++i) { km_bloom_add(&bloom, keys[i]); }
+    }
+    free(keys);
+
+    for(; has_kmer_1 && km_pack(kmer_1, ksize, code, &key); has_kmer_1 = next_kmer_and_line(kmer_1, ksize, &line_1, &line_1_size, mat_1)) {
+      if((!use_bloom || km_bloom_may_have(&bloom, key)) && km_keyset_has(&set, key)) {
+        ++shared;
+      } else {
+        fputs(line_1,outfile);
+        fputc('\n',outfile);
+        ++only_1;
+      }
+    }
+    only_2 = set.n - km_keyset_hits(&set);
+    has_kmer_1 = has_kmer_2 = false;
+    km_keyset_free(&set);
+    if(use_bloom) { km_bloom_free(&bloom); }
+  }
 
   while(has_kmer_1 && has_kmer_2){
     int ret_cmp = use_ktcmp ? ktcmp(kmer_1,kmer_2) : strcmp(kmer_1,kmer_2);
     if(ret_cmp == 0) {
+      if(both_file) {
+        fputs(line_1,both_file);
+        fputc(' ',both_file);
+        fputs(first_column(line_2),both_file);
+        fputc('\n',both_file);
+      }
+      ++shared;
       has_kmer_1 = next_kmer_and_line(kmer_1, ksize, &line_1, &line_1_size, mat_1);
       has_kmer_2 = next_kmer_and_line(kmer_2, ksize, &line_2, &line_2_size, mat_2);
     } else if(ret_cmp < 0) {
       fputs(line_1,outfile);
+      fputc('\n',outfile);
+      ++only_1;
       has_kmer_1 = next_kmer_and_line(kmer_1, ksize, &line_1, &line_1_size, mat_1);
     } else { // ret_cmp > 0
+      if(only_2_file) {
+        fputs(line_2,only_2_file);
+        fputc('\n',only_2_file);
+      }
+      ++only_2;
       has_kmer_2 = next_kmer_and_line(kmer_2, ksize, &line_2, &line_2_size, mat_2);
     }
-    fputc('\n',outfile);
   }
 
   while(has_kmer_1) {
-    fputs(kmer_1,outfile);
-    fputc(' ',outfile);
-    fputs(first_column(line_1),outfile);
-    for(int i=0; i<n_sample_2; ++i){ fputs(" 0",outfile); }
+    fputs(line_1,outfile);
     fputc('\n',outfile);
+    ++only_1;
     has_kmer_1 = next_kmer_and_line(kmer_1, ksize, &line_1, &line_1_size, mat_1);
   }
 
+  // without the split, the rest of <matrix_2> cannot remove anything: it is not
+  // read, and its k-mers are not counted
+  bool only_2_counted = !has_kmer_2 || only_2_file;
+  while(has_kmer_2 && only_2_file) {
+    fputs(line_2,only_2_file);
+    fputc('\n',only_2_file);
+    ++only_2;
+    has_kmer_2 = next_kmer_and_line(kmer_2, ksize, &line_2, &line_2_size, mat_2);
+  }
+
+  fprintf(stderr, "[info] %lu\tk-mers only in 1st matrix\n", only_1);
+  if(only_2_counted) { fprintf(stderr, "[info] %lu\tk-mers only in 2nd matrix\n", only_2); }
+  fprintf(stderr, "[info] %lu\tk-mers in both matrices\n", shared);
+
   free(kmer_1);
   free(kmer_2);
   free(line_1);
   free(line_2);
   fclose(mat_1);
-  fclose(mat_2);
+  if(mat_2){ fclose(mat_2); } else { km_ef_unmap(&set_2); }
   if(outfile != stdout){ fclose(outfile); }
+  if(only_2_file){ fclose(only_2_file); }
+  if(both_file){ fclose(both_file); }
 
   return 0;
 }
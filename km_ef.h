@@ -0,0 +1,354 @@
+#ifndef KM_EF_H
+#define KM_EF_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+// Sorted sets of distinct packed k-mers (k <= 32) in Elias-Fano encoding,
+// saved as .kef files (see km_set).
+//
+// Each of the n keys of the universe [0, 4^k) is split into its l low bits,
+// stored verbatim, and its high bits, stored in unary: key i sets bit
+// (key >> l) + i of the high part, which has n + (4^k >> l) bits. With
+// l = 2k - bits(n), a set takes about l + 2 bits per key (l = 62 - 30 = 32,
+// so 34 bits, for a billion 31-mers, instead of 32 bytes of text). A sample
+// of the position following every KM_EF_SAMPLE-th zero of the high part lets
+// a search jump to the keys with given high bits without scanning the part
+// before them.
+//
+// The file (header, low part, high part, samples) is mapped read-only: a
+// streamed set is paged in as it is read and stays in the page cache.
+
+#define KM_EF_EXT ".kef"
+#define KM_EF_SAMPLE_BITS 10
+#define KM_EF_SAMPLE (1ULL << KM_EF_SAMPLE_BITS)
+
+static const char km_ef_magic[8] = { 'K', 'M', 'E', 'F', 'S', '0', '1', 0 };
+
+typedef struct {
+  char magic[8];
+  uint32_t ksize;
+  uint32_t kmtricks;
+  uint64_t n;            // keys
+  uint64_t low_bits;
+  uint64_t low_words;    // one more than needed, as a key may be read with the next word
+  uint64_t high_words;
+  uint64_t n_samples;
+} km_ef_header_t;
+
+typedef struct {
+  km_ef_header_t h;
+  const uint64_t *low, *high, *samples;
+  void *map;
+  size_t map_size;
+} km_ef_t;
+
+// Largest high part of a key (the high parts of the keys are in [0, max]).
+static inline uint64_t km_ef_high_max(int ksize, int low_bits) {
+  uint64_t max_key = ksize >= 32 ? UINT64_MAX : (1ULL << 2*ksize) - 1;
+  return max_key >> low_bits;
+}
+
+// Fills the header of a set of n keys.
+static void km_ef_header(km_ef_header_t *h, int ksize, bool kmtricks, uint64_t n) {
+  memset(h, 0, sizeof(*h));
+  memcpy(h->magic, km_ef_magic, 8);
+  h->ksize = ksize;
+  h->kmtricks = kmtricks;
+  h->n = n;
+  int n_bits = n ? 64 - __builtin_clzll(n) : 0;
+  h->low_bits = 2*ksize > n_bits ? 2*ksize - n_bits : 0;
+  if(h->low_bits > 63) { h->low_bits = 63; }
+  uint64_t high_max = km_ef_high_max(ksize, h->low_bits);
+  h->low_words = (n*h->low_bits + 63)/64 + 1;
+  h->high_words = (n + high_max + 1 + 63)/64;
+  h->n_samples = (high_max >> KM_EF_SAMPLE_BITS) + 1;
+}
+
+static inline size_t km_ef_file_size(const km_ef_header_t *h) {
+  return sizeof(*h) + (h->low_words + h->high_words + h->n_samples)*sizeof(uint64_t);
+}
+
+// --- writer, keys added in increasing order
+
+// one part of the file, written through a buffer
+typedef struct {
+  uint64_t off;          // of the part in the file
+  uint64_t *buf;
+  size_t n_buf;
+  uint64_t word;         // being filled
+  uint64_t n_words;      // words completed
+} km_ef_part_t;
+
+#define KM_EF_BUF_WORDS 4096
+
+typedef struct {
+  km_ef_header_t h;
+  int fd;
+  bool failed;
+  km_ef_part_t low, high, samples;
+  uint64_t i;            // keys added
+  uint64_t last;
+  uint64_t next_sample;  // high part reached by the next sample
+} km_ef_writer_t;
+
+static void km_ef_flush(km_ef_writer_t *w, km_ef_part_t *part) {
+  size_t len = part->n_buf*sizeof(uint64_t), done = 0;
+  uint64_t off = part->off + (part->n_words - part->n_buf)*sizeof(uint64_t);
+  while(done < len && !w->failed) {
+    ssize_t r = pwrite(w->fd, (const char *)part->buf + done, len - done, off + done);
+    if(r < 0 && errno == EINTR) { continue; }
+    if(r <= 0) { w->failed = true; }
+    else { done += r; }
+  }
+  part->n_buf = 0;
+}
+
+// Completes the current word of part.
+static inline void km_ef_push(km_ef_writer_t *w, km_ef_part_t *part) {
+  part->buf[part->n_buf++] = part->word;
+  part->word = 0;
+  ++part->n_words;
+  if(part->n_buf == KM_EF_BUF_WORDS) { km_ef_flush(w, part); }
+}
+
+static void km_ef_part_init(km_ef_part_t *part, uint64_t off) {
+  memset(part, 0, sizeof(*part));
+  part->off = off;
+  part->buf = (uint64_t *)malloc(KM_EF_BUF_WORDS*sizeof(uint64_t));
+}
+
+// Creates the set file at path for n keys. Returns false if it cannot be created.
+static bool km_ef_create(km_ef_writer_t *w, const char *path, int ksize, bool kmtricks, uint64_t n) {
+  memset(w, 0, sizeof(*w));
+  km_ef_header(&w->h, ksize, kmtricks, n);
+  w->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if(w->fd < 0) { return false; }
+  // zero-filled, the words never pushed (the tail of the parts) stay zero
+  if(ftruncate(w->fd, km_ef_file_size(&w->h)) != 0 || pwrite(w->fd, &w->h, sizeof(w->h), 0) != (ssize_t)sizeof(w->h)) {
+    close(w->fd);
+    unlink(path);
+    return false;
+  }
+  km_ef_part_init(&w->low, sizeof(w->h));
+  km_ef_part_init(&w->high, w->low.off + w->h.low_words*sizeof(uint64_t));
+  km_ef_part_init(&w->samples, w->high.off + w->h.high_words*sizeof(uint64_t));
+  return true;
+}
+
+// Adds key, which must be greater than the keys added before. Returns false
+// if it is not, or if more keys than announced are added.
+static bool km_ef_add(km_ef_writer_t *w, uint64_t key) {
+  if(w->i == w->h.n || (w->i > 0 && key <= w->last)) { return false; }
+  int l = w->h.low_bits;
+  if(l > 0) {
+    uint64_t low = key & ((1ULL << l) - 1), bit = w->i*l;
+    int o = bit & 63;
+    w->low.word |= low << o;
+    if(o + l >= 64) {
+      km_ef_push(w, &w->low);
+      if(o + l > 64) { w->low.word = low >> (64 - o); }
+    }
+  }
+  uint64_t high = key >> l, pos = high + w->i;
+  while(pos/64 > w->high.n_words) { km_ef_push(w, &w->high); }
+  w->high.word |= 1ULL << (pos & 63);
+  // position after the first j*KM_EF_SAMPLE zeros, for the samples j up to high
+  while(w->next_sample <= high) {
+    w->samples.word = w->next_sample + w->i;
+    km_ef_push(w, &w->samples);
+    w->next_sample += KM_EF_SAMPLE;
+  }
+  w->last = key;
+  ++w->i;
+  return true;
+}
+
+// Writes the end of the set and closes the file. Returns false on write error
+// or if fewer keys than announced were added.
+static bool km_ef_close(km_ef_writer_t *w) {
+  bool complete = w->i == w->h.n;
+  if(w->low.word) { km_ef_push(w, &w->low); }
+  if(w->high.word) { km_ef_push(w, &w->high); }
+  for(uint64_t j = w->samples.n_words; j < w->h.n_samples; ++j) {
+    w->samples.word = j*KM_EF_SAMPLE + w->i;
+    km_ef_push(w, &w->samples);
+  }
+  km_ef_flush(w, &w->low);
+  km_ef_flush(w, &w->high);
+  km_ef_flush(w, &w->samples);
+  free(w->low.buf);
+  free(w->high.buf);
+  free(w->samples.buf);
+  bool ok = !w->failed && complete;
+  ok &= close(w->fd) == 0;
+  return ok;
+}
+
+// --- reader
+
+// Tells if the file at path starts as a set.
+static bool km_ef_is_set(const char *path) {
+  int fd = strcmp(path, "-") ? open(path, O_RDONLY) : -1;
+  if(fd < 0) { return false; }
+  char magic[8];
+  bool ok = pread(fd, magic, 8, 0) == 8 && memcmp(magic, km_ef_magic, 8) == 0;
+  close(fd);
+  return ok;
+}
+
+// Maps the set at path. Returns 0 on success, 1 if the file cannot be
+// opened, 2 if it is not a valid set (*err gives why).
+static int km_ef_open(km_ef_t *ef, const char *path, const char **err) {
+  memset(ef, 0, sizeof(*ef));
+  int fd = open(path, O_RDONLY);
+  struct stat st;
+  if(fd < 0 || fstat(fd, &st) != 0) {
+    if(fd >= 0) { close(fd); }
+    return 1;
+  }
+  km_ef_header_t h;
+  if(pread(fd, &h, sizeof(h), 0) != (ssize_t)sizeof(h) || memcmp(h.magic, km_ef_magic, 8) != 0) {
+    *err = "not a k-mer set";
+  } else {
+    km_ef_header_t expect;
+    if(h.ksize > 0 && h.ksize <= 32) { km_ef_header(&expect, h.ksize, h.kmtricks, h.n); }
+    if(h.ksize == 0 || h.ksize > 32 || memcmp(&h, &expect, sizeof(h)) != 0) {
+      *err = "invalid header";
+    } else if((uint64_t)st.st_size != km_ef_file_size(&h)) {
+      *err = "truncated file";
+    } else if((ef->map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0)) == MAP_FAILED) {
+      ef->map = NULL;
+      *err = strerror(errno);
+    }
+  }
+  close(fd);
+  if(ef->map == NULL) { return 2; }
+  ef->h = h;
+  ef->map_size = st.st_size;
+  ef->low = (const uint64_t *)((const char *)ef->map + sizeof(h));
+  ef->high = ef->low + h.low_words;
+  ef->samples = ef->high + h.high_words;
+  return 0;
+}
+
+// Tells why the set cannot stand for k-mers of ksize in the given order of
+// nucleotides, or returns NULL if it can.
+static const char *km_ef_check(const km_ef_t *ef, int ksize, bool kmtricks) {
+  if(ef->h.ksize != (uint32_t)ksize) { return "other size of k-mers (see -k)"; }
+  if(ef->h.kmtricks != kmtricks) { return "other order of nucleotides (see -z)"; }
+  return NULL;
+}
+
+static void km_ef_unmap(km_ef_t *ef) {
+  if(ef->map) { munmap(ef->map, ef->map_size); }
+}
+
+static inline uint64_t km_ef_low(const km_ef_t *ef, uint64_t i) {
+  int l = ef->h.low_bits;
+  if(l == 0) { return 0; }
+  uint64_t bit = i*l;
+  int o = bit & 63;
+  const uint64_t *w = ef->low + bit/64;
+  uint64_t v = w[0] >> o;
+  if(o + l > 64) { v |= w[1] << (64 - o); }
+  return v & ((1ULL << l) - 1);
+}
+
+// first set bit of the high part at or after pos (there must be one)
+static inline uint64_t km_ef_next_one(const km_ef_t *ef, uint64_t pos) {
+  uint64_t w = pos/64, word = ef->high[w] & (~0ULL << (pos & 63));
+  while(word == 0) { word = ef->high[++w]; }
+  return w*64 + __builtin_ctzll(word);
+}
+
+// Cursor over the keys in increasing order.
+typedef struct {
+  const km_ef_t *ef;
+  uint64_t i;            // rank of the current key, n at the end
+  uint64_t pos;          // position of its bit in the high part
+  uint64_t key;
+} km_ef_cursor_t;
+
+static inline void km_ef_set_key(km_ef_cursor_t *c) {
+  c->key = ((c->pos - c->i) << c->ef->h.low_bits) | km_ef_low(c->ef, c->i);
+}
+
+// Positions c on the first key. Returns false if the set is empty.
+static bool km_ef_begin(km_ef_cursor_t *c, const km_ef_t *ef) {
+  c->ef = ef;
+  c->i = c->pos = c->key = 0;
+  if(ef->h.n == 0) { return false; }
+  c->pos = km_ef_next_one(ef, 0);
+  km_ef_set_key(c);
+  return true;
+}
+
+// Moves c to the next key. Returns false at the end.
+static inline bool km_ef_next(km_ef_cursor_t *c) {
+  if(c->i >= c->ef->h.n || ++c->i == c->ef->h.n) { return false; }
+  c->pos = km_ef_next_one(c->ef, c->pos + 1);
+  km_ef_set_key(c);
+  return true;
+}
+
+// Moves c forward to the first key >= x (successor), the current one if it
+// is. Returns false if there is none. Keys with greater high bits than the
+// current one are reached through the samples and by counting the zeros of
+// the high part, without decoding the keys in between.
+static bool km_ef_next_geq(km_ef_cursor_t *c, uint64_t x) {
+  const km_ef_t *ef = c->ef;
+  if(c->i >= ef->h.n) { return false; }
+  if(c->key >= x) { return true; }
+  uint64_t high = x >> ef->h.low_bits;
+  if(high > c->pos - c->i) {
+    // position after the first high zeros, from the current position or a sample
+    uint64_t pos = c->pos, zeros = c->pos - c->i;
+    uint64_t j = high >> KM_EF_SAMPLE_BITS;
+    if(j*KM_EF_SAMPLE > zeros) {
+      pos = ef->samples[j];
+      zeros = j*KM_EF_SAMPLE;
+    }
+    uint64_t left = high - zeros;
+    if(left > 0) {
+      uint64_t w = pos/64, word = ~ef->high[w] & (~0ULL << (pos & 63));
+      uint64_t cnt = __builtin_popcountll(word);
+      while(cnt < left) {
+        left -= cnt;
+        word = ~ef->high[++w];
+        cnt = __builtin_popcountll(word);
+      }
+      for(uint64_t t=1; t<left; ++t) { word &= word - 1; }
+      pos = w*64 + __builtin_ctzll(word) + 1;
+    }
+    c->i = pos - high; // ones before pos
+    if(c->i >= ef->h.n) { return false; }
+    c->pos = km_ef_next_one(ef, pos);
+    km_ef_set_key(c);
+  }
+  while(c->key < x) {
+    if(!km_ef_next(c)) { return false; }
+  }
+  return true;
+}
+
+// Decodes all the keys, in increasing order.
+static uint64_t *km_ef_decode(const km_ef_t *ef, size_t *n) {
+  uint64_t *keys = (uint64_t *)malloc((ef->h.n ? ef->h.n : 1)*sizeof(uint64_t));
+  km_ef_cursor_t c;
+  size_t i = 0;
+  for(bool ok = km_ef_begin(&c, ef); ok; ok = km_ef_next(&c)) { keys[i++] = c.key; }
+  *n = i;
+  return keys;
+}
+
+#endif
@@ -0,0 +1,197 @@
+#ifndef KM_ESTIMATE_H
+#define KM_ESTIMATE_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <math.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+// Estimates of the output of a run from a sample of blocks of its input
+// (--estimate). The matrix is cut in blocks of KM_ESTIMATE_BLOCK_BYTES bytes,
+// a simple random sample of them is read with pread (in increasing offsets),
+// and each row is counted in the block where it starts. A total over the file
+// is then estimated from its ratio to the bytes of the sampled blocks, with a
+// 95% confidence interval from the variance between blocks (normal
+// approximation, finite population correction). The whole file is read when
+// it has few blocks.
+
+#define KM_OPT_ESTIMATE 260
+#define KM_ESTIMATE_BLOCKS 256
+#define KM_ESTIMATE_BLOCK_BYTES (64UL<<10)
+
+static inline uint64_t km_estimate_now_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec*1000000000ULL + ts.tv_nsec;
+}
+
+// --- lines of a file read with pread
+
+typedef struct {
+  int fd;
+  uint64_t size;
+  char *buf;
+  size_t cap;
+  uint64_t buf_off;  // file offset of buf
+  size_t len;        // bytes in buf
+  uint64_t off;      // offset of the next line
+} km_preader_t;
+
+static void km_preader_init(km_preader_t *r, int fd, uint64_t size) {
+  memset(r, 0, sizeof(*r));
+  r->fd = fd;
+  r->size = size;
+  r->cap = KM_ESTIMATE_BLOCK_BYTES;
+  r->buf = (char *)malloc(r->cap);
+}
+
+static void km_preader_free(km_preader_t *r) { free(r->buf); }
+
+static inline void km_preader_seek(km_preader_t *r, uint64_t off) { r->off = off; }
+
+// Reads the line at the reader offset into *line (len excludes the newline),
+// sets *line_off to its offset and moves to the next line. Returns false at the
+// end of the file or on read error. The line is valid until the next call.
+static bool km_preader_line(km_preader_t *r, const char **line, size_t *len, uint64_t *line_off) {
+  if(r->off >= r->size) { return false; }
+  if(r->off < r->buf_off || r->off > r->buf_off + r->len) { r->buf_off = r->off; r->len = 0; }
+  for(;;) {
+    size_t beg = r->off - r->buf_off;
+    const char *nl = (const char *)memchr(r->buf + beg, '\n', r->len - beg);
+    bool eof = r->buf_off + r->len >= r->size;
+    if(nl || eof) {
+      size_t end = nl ? (size_t)(nl - r->buf) : r->len;
+      *line = r->buf + beg;
+      *len = end - beg;
+      *line_off = r->off;
+      r->off = r->buf_off + end + (nl != NULL);
+      return true;
+    }
+    // keep the partial line, grow the buffer if it fills it
+    memmove(r->buf, r->buf + beg, r->len - beg);
+    r->buf_off += beg;
+    r->len -= beg;
+    if(r->len == r->cap) {
+      r->cap *= 2;
+      r->buf = (char *)realloc(r->buf, r->cap);
+    }
+    ssize_t n = pread(r->fd, r->buf + r->len, r->cap - r->len, r->buf_off + r->len);
+    if(n < 0 && errno == EINTR) { continue; }
+    if(n <= 0) { return false; }
+    r->len += n;
+  }
+}
+
+// Offset of the first line starting at or after off.
+static uint64_t km_preader_line_start(km_preader_t *r, uint64_t off) {
+  if(off == 0) { return 0; }
+  const char *line;
+  size_t len;
+  uint64_t line_off;
+  km_preader_seek(r, off - 1);
+  if(!km_preader_line(r, &line, &len, &line_off)) { return r->size; }
+  return r->off;
+}
+
+// --- simple random sample of n blocks out of N (Knuth's selection sampling)
+
+typedef struct {
+  uint64_t N, n;       // blocks, blocks to sample
+  uint64_t seen, taken;
+  uint64_t rng;
+} km_sampling_t;
+
+static void km_sampling_init(km_sampling_t *s, uint64_t N, uint64_t n, uint64_t seed) {
+  s->N = N;
+  s->n = n < N ? n : N;
+  s->seen = s->taken = 0;
+  s->rng = seed;
+}
+
+static inline double km_sampling_uniform(km_sampling_t *s) {
+  uint64_t z = (s->rng += 0x9E3779B97F4A7C15ULL); // splitmix64
+  z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+  z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+  return ((z ^ (z >> 31)) >> 11) * 0x1.0p-53;
+}
+
+// Sets *block to the next sampled block, in increasing order. Returns false
+// when all have been given.
+static bool km_sampling_next(km_sampling_t *s, uint64_t *block) {
+  while(s->taken < s->n) {
+    uint64_t b = s->seen++;
+    if((s->N - b)*km_sampling_uniform(s) < s->n - s->taken) {
+      ++s->taken;
+      *block = b;
+      return true;
+    }
+  }
+  return false;
+}
+
+// --- totals and confidence intervals
+
+// sums over the sampled blocks of a quantity y and of the block sizes x
+typedef struct {
+  double y, yy, x, xx, xy;
+} km_est_t;
+
+static inline void km_est_add(km_est_t *e, double y, double x) {
+  e->y += y;
+  e->yy += y*y;
+  e->x += x;
+  e->xx += x*x;
+  e->xy += x*y;
+}
+
+// Total over the N blocks (size bytes) from the n sampled ones, and the
+// half-width of its 95% confidence interval. The ratio estimator (y per byte
+// times size) accounts for the last, shorter, block.
+static double km_est_total(const km_est_t *e, uint64_t n, uint64_t N, uint64_t size, double *half) {
+  *half = 0;
+  if(n == 0 || e->x == 0) { return 0; }
+  double r = e->y / e->x;
+  if(n > 1 && n < N) {
+    double s2 = (e->yy - 2*r*e->xy + r*r*e->xx) / (n - 1);
+    if(s2 < 0) { s2 = 0; }
+    *half = 1.96 * N * sqrt((1.0 - (double)n/N) * s2 / n);
+  }
+  return r * size;
+}
+
+// Prints "[info] estimate: <what> <total> [<low>, <high>]" with prec decimals.
+static void km_est_print(FILE *out, const char *what, double total, double half, int prec) {
+  double low = total - half > 0 ? total - half : 0;
+  fprintf(out, "[info] estimate: %.*f\t[%.*f, %.*f]\t%s\n", prec, total, prec, low, prec, total + half, what);
+}
+
+// Opens path for sampling: a text matrix in a regular file. Returns the file
+// descriptor and its size, or -1 (*err gives why).
+static int km_estimate_open(const char *path, uint64_t *size, const char **err) {
+  struct stat st;
+  int fd = open(path, O_RDONLY);
+  if(fd < 0 || fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+    if(fd >= 0) { close(fd); }
+    *err = "not a regular file";
+    return -1;
+  }
+  char magic[8] = {0};
+  uint32_t cont = 0xFFFFFFFFU;
+  if(pread(fd, magic, 8, 0) == 8 && (memcmp(magic, "ARROW1", 6) == 0 || memcmp(magic, &cont, 4) == 0)) {
+    close(fd);
+    *err = "Arrow input not supported";
+    return -1;
+  }
+  *size = st.st_size;
+  return fd;
+}
+
+#endif
@@ -6,6 +6,8 @@
 #include <stdbool.h>
 #include <string.h>
 
+#include "km_chunk.h"
+
 static const int isnuc[256] = {
       0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,
       0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,
@@ -25,21 +27,91 @@ static const int isnuc[256] = {
       0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0
 };
 
+// Returns the length of the k-mer at the beginning of line if valid, 0 otherwise.
+size_t valid_kmer(const char *line, size_t len) {
+  const char *p = line, *end = line + len;
+  while(p < end && (*p == ' ' || *p == '\t')) { ++p; }
+  const char *kmer = p;
+  while(p < end && isnuc[(unsigned char)*p]) { ++p; }
+  if(p == kmer || (p < end && *p != ' ' && *p != '\t')) { return 0; }
+  return p - kmer;
+}
+
+void count_chunk(km_chunk_t *chunk, void *arg) {
+  size_t pos = 0, len;
+  char *line;
+  while(km_chunk_next_line(chunk, &pos, &line, &len)) {
+    if(len > 0 && valid_kmer(line, len)) { ++chunk->n_records; }
+  }
+}
+
+void fasta_chunk(km_chunk_t *chunk, void *arg) {
+  size_t pos = 0, len, line_num = 0, kmer_count = chunk->first_record;
+  char *line;
+  char header[32];
+  while(km_chunk_next_line(chunk, &pos, &line, &len)) {
+    ++line_num;
+
+    if(len == 0) { // skip empty lines
+      continue;
+    }
+
+    size_t kmer_len = valid_kmer(line, len);
+    if(kmer_len) {
+      const char *kmer = line;
+      while(*kmer == ' ' || *kmer == '\t') { ++kmer; }
+      km_chunk_write(chunk, header, snprintf(header, sizeof(header), ">%zu\n", ++kmer_count));
+      km_chunk_write(chunk, kmer, kmer_len);
+      km_chunk_write(chunk, "\n", 1);
+    } else {
+      const char *kmer = line, *end = line + len;
+      while(kmer < end && (*kmer == ' ' || *kmer == '\t')) { ++kmer; }
+      const char *kmer_end = kmer;
+      while(kmer_end < end && *kmer_end != ' ' && *kmer_end != '\t') { ++kmer_end; }
+      km_chunk_warn(chunk, "[warning] invalid k-mer at line %zu: %.*s\n", line_num, kmer, kmer_end - kmer);
+    }
+  }
+}
+
 
 int main(int argc, char **argv) {
 
-  char *out_fname = NULL;
+  int n_threads = 1;
+  int numa_policy = KM_NUMA_NONE;
+  char *out_fname = NULL, *metrics_fname = NULL, *trace_fname = NULL;
   bool help_opt = false;
 
+  static struct option long_opts[] = {
+    {"metrics", required_argument, NULL, KM_OPT_METRICS},
+    {"trace", required_argument, NULL, KM_OPT_TRACE},
+    {NULL, 0, NULL, 0}
+  };
+
   int c;
-  while ((c = getopt(argc, argv, "o:h")) != -1) {
+  while ((c = getopt_long(argc, argv, "o:P:t:h", long_opts, NULL)) != -1) {
     switch (c) {
       case 'o':
         out_fname = optarg;
         break;
+      case 'P':
+        numa_policy = km_numa_policy(optarg);
+        if(numa_policy < 0) {
+          fprintf(stderr, "[error] unknown NUMA placement \"%s\"\n", optarg);
+          return 1;
+        }
+        break;
+      case 't':
+        n_threads = km_pool_threads(optarg);
+        break;
       case 'h':
         help_opt = true;
         break;
+      case KM_OPT_METRICS:
+        metrics_fname = optarg;
+        break;
+      case KM_OPT_TRACE:
+        trace_fname = optarg;
+        break;
       case '?':
         return 1;
       default:
@@ -55,6 +127,10 @@ int main(int argc, char **argv) {
     
     fprintf(stdout, "Options:\n");
     fprintf(stdout, "  -o FILE  output FASTA file of k-mers to FILE [stdout]\n");
+    fprintf(stdout, "  -P STR   NUMA placement of threads and buffers: none, local, interleave [none]\n");
+    fprintf(stdout, "  -t INT   number of threads, 0 for all CPUs [1]\n");
+    fprintf(stdout, "      --metrics FILE  write run metrics (stage times, CPU counters) as JSON to FILE\n");
+    fprintf(stdout, "      --trace FILE    write a timeline of the threads in Chrome trace format to FILE\n");
     fprintf(stdout, "  -h       print this help message\n");
     return 0;
   }
@@ -72,41 +148,35 @@ int main(int argc, char **argv) {
     return 1;
   }
 
-  char *line = NULL;
-  size_t line_size=0, line_num=0, kmer_count=0;
-  
-  ssize_t ch_read = getline(&line, &line_size, fp);
-  while(ch_read >= 0) {
-    ++line_num;
-
-    if(ch_read == 0 || line[0]=='\n') { // skip empty lines
-      continue;
-    }
-
-    bool valid_kmer = true;    
-    char *kmer = strtok(line," \t\n");
-    if(kmer == NULL){ 
-      valid_kmer = false;
-    }
-    else 
-    {
-      while(*kmer && isnuc[(int)*kmer]) { ++kmer; }
-      valid_kmer = *kmer == '\0';
-    }
+  if(metrics_fname) { km_metrics_init("km_fasta"); }
+  if(trace_fname) { km_trace_init(); }
 
-    if(valid_kmer) {
-      fprintf(outfile, ">%zu\n%s\n", ++kmer_count, line);
-    } else {
-      fprintf(stderr,"[warning] invalid k-mer at line %zu: %s\n", line_num, line);
-    }
+  km_numa_t *numa = n_threads > 1 ? km_numa_init(numa_policy) : NULL;
+  km_pool_t *pool = n_threads > 1 ? km_pool_create(n_threads, numa) : NULL;
+  // records are numbered from the per-chunk counts of valid k-mers, as a serial run would
+  km_chunk_engine_t eng = { .pool = pool, .count = count_chunk, .format = fasta_chunk };
+  km_chunk_engine_init(&eng, fileno(fp), outfile);
 
-    ch_read = getline(&line, &line_size, fp);
+  int ret = km_chunk_run(&eng, outfile, false);
+  if(ret) {
+    fprintf(stderr,"[error] cannot write output\n");
   }
 
-  fprintf(stderr, "[info] %zu k-mers outputted.\n", kmer_count);
-  free(line);
+  fprintf(stderr, "[info] %zu k-mers outputted.\n", eng.n_records);
+  if(km_metrics_write(metrics_fname, pool ? km_pool_json : NULL, pool)) {
+    fprintf(stderr,"[error] cannot write metrics file \"%s\"\n",metrics_fname);
+  }
+  if(km_trace_write(trace_fname, "km_fasta")) {
+    fprintf(stderr,"[error] cannot write trace file \"%s\"\n",trace_fname);
+  }
+  km_chunk_engine_free(&eng);
+  if(pool) {
+    if(metrics_fname) { km_pool_report(pool, stderr); }
+    km_pool_destroy(pool);
+  }
+  km_numa_free(numa);
   if(fp != stdin) { fclose(fp); }
   if(outfile != stdout){ fclose(outfile); }
 
-  return 0;
+  return ret;
 }
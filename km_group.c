@@ -0,0 +1,412 @@
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "km_kernels.h"
+#include "km_chunk.h"
+
+// Aggregation of the columns of a matrix by groups of samples. Each row is
+// parsed into its count vector, which is then gathered group by group: group g
+// holds the samples idx[seg[g]..seg[g+1]). Groups of consecutive samples are
+// summed over contiguous counts, which the compiler vectorizes.
+
+typedef enum { AGG_SUM, AGG_MEAN, AGG_MAX, AGG_COUNT, N_AGG } agg_t;
+static const char *agg_names[N_AGG] = { "sum", "mean", "max", "count" };
+
+typedef struct {
+  char **names;
+  size_t n_groups, cap;
+  uint32_t **samples;     // 0-based samples of each group, while reading the mapping
+  size_t *n_samples, *samples_cap;
+  // gather lists
+  uint32_t *idx;
+  size_t *seg;
+  bool *contiguous;
+  uint32_t max_sample;    // 1-based, columns needed
+} groups_t;
+
+typedef struct {
+  const groups_t *groups;
+  agg_t agg;
+  uint32_t min_abund;
+  int decimals;
+  size_t n_samples;       // columns of the matrix
+} group_job_t;
+
+// --- mapping
+
+size_t group_id(groups_t *gr, const char *name) {
+  for(size_t g=0; g<gr->n_groups; ++g) {
+    if(strcmp(gr->names[g], name) == 0) { return g; }
+  }
+  if(gr->n_groups == gr->cap) {
+    gr->cap = gr->cap ? 2*gr->cap : 16;
+    gr->names = (char **)realloc(gr->names, gr->cap*sizeof(char *));
+    gr->samples = (uint32_t **)realloc(gr->samples, gr->cap*sizeof(uint32_t *));
+    gr->n_samples = (size_t *)realloc(gr->n_samples, gr->cap*sizeof(size_t));
+    gr->samples_cap = (size_t *)realloc(gr->samples_cap, gr->cap*sizeof(size_t));
+  }
+  size_t g = gr->n_groups++;
+  gr->names[g] = strdup(name);
+  gr->samples[g] = NULL;
+  gr->n_samples[g] = gr->samples_cap[g] = 0;
+  return g;
+}
+
+// Reads the mapping: one "SAMPLE GROUP" pair per line, SAMPLE being a 1-based
+// column or a range FIRST:LAST. Groups are output in order of first appearance.
+// Returns 0, or the line number of the first invalid line.
+size_t read_groups(FILE *fp, groups_t *gr) {
+  memset(gr, 0, sizeof(*gr));
+  char *line = NULL;
+  size_t line_size = 0, line_num = 0, bad = 0;
+  while(bad == 0 && getline(&line, &line_size, fp) >= 0) {
+    ++line_num;
+    char *p = line;
+    while(*p == ' ' || *p == '\t') { ++p; }
+    if(*p == '\n' || *p == '\0' || *p == '#') { continue; }
+    char *end;
+    long first = strtol(p, &end, 10), last = first;
+    if(*end == ':') { last = strtol(end + 1, &end, 10); }
+    char *name = end;
+    while(*name == ' ' || *name == '\t') { ++name; }
+    size_t name_len = strcspn(name, " \t\r\n");
+    if(end == p || name == end || name_len == 0 || first < 1 || last < first || last > UINT32_MAX) { bad = line_num; break; }
+    name[name_len] = '\0';
+    size_t g = group_id(gr, name);
+    for(long s=first; s<=last; ++s) {
+      if(gr->n_samples[g] == gr->samples_cap[g]) {
+        gr->samples_cap[g] = gr->samples_cap[g] ? 2*gr->samples_cap[g] : 16;
+        gr->samples[g] = (uint32_t *)realloc(gr->samples[g], gr->samples_cap[g]*sizeof(uint32_t));
+      }
+      gr->samples[g][gr->n_samples[g]++] = s - 1;
+    }
+    if(last > gr->max_sample) { gr->max_sample = last; }
+  }
+  free(line);
+  if(bad) { return bad; }
+
+  size_t total = 0;
+  for(size_t g=0; g<gr->n_groups; ++g) { total += gr->n_samples[g]; }
+  gr->idx = (uint32_t *)malloc((total ? total : 1)*sizeof(uint32_t));
+  gr->seg = (size_t *)malloc((gr->n_groups + 1)*sizeof(size_t));
+  gr->contiguous = (bool *)malloc((gr->n_groups ? gr->n_groups : 1)*sizeof(bool));
+  gr->seg[0] = 0;
+  for(size_t g=0; g<gr->n_groups; ++g) {
+    memcpy(gr->idx + gr->seg[g], gr->samples[g], gr->n_samples[g]*sizeof(uint32_t));
+    gr->seg[g+1] = gr->seg[g] + gr->n_samples[g];
+    gr->contiguous[g] = true;
+    for(size_t j=1; j<gr->n_samples[g]; ++j) {
+      if(gr->samples[g][j] != gr->samples[g][0] + j) { gr->contiguous[g] = false; }
+    }
+    free(gr->samples[g]);
+  }
+  free(gr->samples);
+  free(gr->samples_cap);
+  gr->samples = NULL;
+  gr->samples_cap = NULL;
+  return 0;
+}
+
+void free_groups(groups_t *gr) {
+  for(size_t g=0; g<gr->n_groups; ++g) {
+    free(gr->names[g]);
+    if(gr->samples) { free(gr->samples[g]); }
+  }
+  free(gr->samples);
+  free(gr->samples_cap);
+  free(gr->names);
+  free(gr->n_samples);
+  free(gr->idx);
+  free(gr->seg);
+  free(gr->contiguous);
+}
+
+// --- kernels
+
+static inline uint64_t sum_range(const uint32_t *c, size_t n) {
+  uint64_t s = 0;
+  for(size_t j=0; j<n; ++j) { s += c[j]; }
+  return s;
+}
+
+static inline uint64_t sum_gather(const uint32_t *c, const uint32_t *idx, size_t n) {
+  uint64_t s0 = 0, s1 = 0, s2 = 0, s3 = 0;
+  size_t j = 0;
+  for(; j+4<=n; j+=4) {
+    s0 += c[idx[j]];
+    s1 += c[idx[j+1]];
+    s2 += c[idx[j+2]];
+    s3 += c[idx[j+3]];
+  }
+  for(; j<n; ++j) { s0 += c[idx[j]]; }
+  return s0 + s1 + s2 + s3;
+}
+
+static inline uint64_t max_range(const uint32_t *c, size_t n) {
+  uint32_t m = 0;
+  for(size_t j=0; j<n; ++j) { m = c[j] > m ? c[j] : m; }
+  return m;
+}
+
+static inline uint64_t max_gather(const uint32_t *c, const uint32_t *idx, size_t n) {
+  uint32_t m = 0;
+  for(size_t j=0; j<n; ++j) { m = c[idx[j]] > m ? c[idx[j]] : m; }
+  return m;
+}
+
+static inline uint64_t count_range(const uint32_t *c, size_t n, uint32_t min_abund) {
+  uint64_t k = 0;
+  for(size_t j=0; j<n; ++j) { k += c[j] >= min_abund; }
+  return k;
+}
+
+static inline uint64_t count_gather(const uint32_t *c, const uint32_t *idx, size_t n, uint32_t min_abund) {
+  uint64_t k = 0;
+  for(size_t j=0; j<n; ++j) { k += c[idx[j]] >= min_abund; }
+  return k;
+}
+
+// Aggregates the counts of a row into out (one value per group; for the mean,
+// the sum).
+void aggregate(const group_job_t *job, const uint32_t *counts, uint64_t *out) {
+  const groups_t *gr = job->groups;
+  for(size_t g=0; g<gr->n_groups; ++g) {
+    const uint32_t *idx = gr->idx + gr->seg[g];
+    size_t n = gr->seg[g+1] - gr->seg[g];
+    const uint32_t *c = counts + idx[0];
+    switch(job->agg) {
+      case AGG_SUM:
+      case AGG_MEAN:
+        out[g] = gr->contiguous[g] ? sum_range(c, n) : sum_gather(counts, idx, n);
+        break;
+      case AGG_MAX:
+        out[g] = gr->contiguous[g] ? max_range(c, n) : max_gather(counts, idx, n);
+        break;
+      default:
+        out[g] = gr->contiguous[g] ? count_range(c, n, job->min_abund) : count_gather(counts, idx, n, job->min_abund);
+        break;
+    }
+  }
+}
+
+// --- chunks
+
+void group_chunk(km_chunk_t *chunk, void *arg) {
+  const group_job_t *job = (const group_job_t *)arg;
+  const groups_t *gr = job->groups;
+  size_t n_cols = job->n_samples > gr->max_sample ? job->n_samples : gr->max_sample;
+  uint32_t *counts = (uint32_t *)malloc((n_cols ? n_cols : 1)*sizeof(uint32_t));
+  uint64_t *values = (uint64_t *)malloc((gr->n_groups ? gr->n_groups : 1)*sizeof(uint64_t));
+  size_t pos = 0, len;
+  char *line;
+  while(km_chunk_next_line(chunk, &pos, &line, &len)) {
+    const char *end = line + len;
+    const char *p = km_skip_kmer(line, end);
+    if(p == line || km_isblank(p[-1])) { continue; } // skip empty lines
+    ++chunk->n_records;
+    km_parse_counts(p, end, counts, n_cols);
+    aggregate(job, counts, values);
+
+    // k-mer, then one value per group (at most 20 digits, or a mean with decimals)
+    size_t kmer_len = p - line;
+    km_chunk_reserve(&chunk->out, &chunk->out_cap, chunk->out_len + kmer_len + gr->n_groups*(24 + job->decimals) + 1);
+    char *o = chunk->out + chunk->out_len;
+    memcpy(o, line, kmer_len);
+    o += kmer_len;
+    for(size_t g=0; g<gr->n_groups; ++g) {
+      *o++ = ' ';
+      if(job->agg != AGG_MEAN) {
+        o = km_arrow_utoa(o, values[g]);
+      } else {
+        uint64_t n = gr->seg[g+1] - gr->seg[g];
+        if(job->decimals == 0) { o = km_arrow_utoa(o, (values[g] + n/2) / n); }
+        else { o += sprintf(o, "%.*f", job->decimals, (double)values[g] / n); }
+      }
+    }
+    *o++ = '\n';
+    chunk->out_len = o - chunk->out;
+    ++chunk->n_kept;
+  }
+  free(counts);
+  free(values);
+}
+
+
+int main(int argc, char **argv) {
+
+  int n_threads = 1, decimals = 0;
+  int numa_policy = KM_NUMA_NONE;
+  long min_abund = 1;
+  int agg = AGG_SUM;
+  char *out_fname = NULL, *metrics_fname = NULL, *trace_fname = NULL;
+  bool verbose_opt = false, help_opt = false;
+
+  static struct option long_opts[] = {
+    {"metrics", required_argument, NULL, KM_OPT_METRICS},
+    {"trace", required_argument, NULL, KM_OPT_TRACE},
+    {NULL, 0, NULL, 0}
+  };
+
+  int c;
+  while ((c = getopt_long(argc, argv, "a:d:f:o:P:t:vh", long_opts, NULL)) != -1) {
+    switch (c) {
+      case 'a':
+        min_abund = strtol(optarg, NULL, 10);
+        break;
+      case 'd':
+        decimals = strtol(optarg, NULL, 10);
+        break;
+      case 'f':
+        for(agg = 0; agg < N_AGG && strcmp(optarg, agg_names[agg]); ++agg) {}
+        if(agg == N_AGG) {
+          fprintf(stderr, "Unknown aggregation \"%s\"\n", optarg);
+          return 1;
+        }
+        break;
+      case 'o':
+        out_fname = optarg;
+        break;
+      case 'P':
+        numa_policy = km_numa_policy(optarg);
+        if(numa_policy < 0) {
+          fprintf(stderr, "Unknown NUMA placement \"%s\"\n", optarg);
+          return 1;
+        }
+        break;
+      case 't':
+        n_threads = km_pool_threads(optarg);
+        break;
+      case 'v':
+        verbose_opt = true;
+        break;
+      case 'h':
+        help_opt = true;
+        break;
+      case KM_OPT_METRICS:
+        metrics_fname = optarg;
+        break;
+      case KM_OPT_TRACE:
+        trace_fname = optarg;
+        break;
+      case '?':
+        return 1;
+      default:
+        abort();
+    }
+  }
+
+  if(min_abund < 0 || min_abund > UINT32_MAX) {
+    fprintf(stderr, "Invalid min abundance: %ld\n", min_abund);
+    return 1;
+  }
+  if(decimals < 0 || decimals > 9) {
+    fprintf(stderr, "-d must be in the [0,9] interval\n");
+    return 1;
+  }
+
+  if(argc-optind != 2 || help_opt) {
+    fprintf(stdout, "Usage: km_group [options] <matrix> <groups>\n\n");
+    fprintf(stdout, "Collapse the samples of a matrix into groups (replicates, conditions): each\n");
+    fprintf(stdout, "row becomes the k-mer followed by one value per group. <groups> maps samples\n");
+    fprintf(stdout, "to groups with one \"SAMPLE GROUP\" pair per line, SAMPLE being a 1-based column\n");
+    fprintf(stdout, "or a range FIRST:LAST. Groups are output in order of first appearance, and\n");
+    fprintf(stdout, "unmapped samples are dropped. The matrix may be text or Arrow IPC (detected).\n\n");
+    fprintf(stdout, "Options:\n");
+    fprintf(stdout, "  -f STR   aggregation: sum, mean, max, count (samples >= -a) [sum]\n");
+    fprintf(stdout, "  -a INT   min abundance to define a k-mer as present in a sample, for count [1]\n");
+    fprintf(stdout, "  -d INT   decimals of the means, 0 for integers (rounded) [0]\n");
+    fprintf(stdout, "  -o FILE  write output matrix to FILE [stdout]\n");
+    fprintf(stdout, "  -P STR   NUMA placement of threads and buffers: none, local, interleave [none]\n");
+    fprintf(stdout, "  -t INT   number of threads, 0 for all CPUs [1]\n");
+    fprintf(stdout, "  -v       verbose output\n");
+    fprintf(stdout, "      --metrics FILE  write run metrics (stage times, CPU counters) as JSON to FILE\n");
+    fprintf(stdout, "      --trace FILE    write a timeline of the threads in Chrome trace format to FILE\n");
+    fprintf(stdout, "  -h       print this help message\n");
+    return 0;
+  }
+
+  FILE *groupfile = fopen(argv[optind+1],"r");
+  if(groupfile == NULL) {
+    fprintf(stderr,"Cannot open file \"%s\"\n",argv[optind+1]);
+    return 1;
+  }
+  groups_t groups;
+  size_t bad = read_groups(groupfile, &groups);
+  fclose(groupfile);
+  if(bad || groups.n_groups == 0) {
+    if(bad) { fprintf(stderr,"Invalid line %lu of \"%s\", expected SAMPLE GROUP\n",bad,argv[optind+1]); }
+    else { fprintf(stderr,"No group in \"%s\"\n",argv[optind+1]); }
+    free_groups(&groups);
+    return 1;
+  }
+
+  FILE *matfile = km_arrow_fopen(argv[optind], 0, false);
+  if(matfile == NULL) {
+    fprintf(stderr,"Cannot open file \"%s\"\n",argv[optind]);
+    free_groups(&groups);
+    return 1;
+  }
+
+  FILE *outfile = out_fname ? fopen(out_fname,"w") : stdout;
+  if(outfile != stdout && outfile == NULL) {
+    fprintf(stderr,"Cannot open output file \"%s\"\n",out_fname);
+    fclose(matfile);
+    free_groups(&groups);
+    return 1;
+  }
+
+  if(metrics_fname) { km_metrics_init("km_group"); }
+  if(trace_fname) { km_trace_init(); }
+
+  km_numa_t *numa = n_threads > 1 ? km_numa_init(numa_policy) : NULL;
+  km_pool_t *pool = n_threads > 1 ? km_pool_create(n_threads, numa) : NULL;
+  group_job_t job = { .groups = &groups, .agg = (agg_t)agg, .min_abund = (uint32_t)min_abund, .decimals = decimals };
+  km_chunk_engine_t eng = { .pool = pool, .format = group_chunk, .arg = &job };
+  km_chunk_engine_init(&eng, fileno(matfile), outfile);
+
+  // the number of samples is given by the first row
+  size_t first_len;
+  const char *first = km_chunk_peek_line(&eng, &first_len);
+  km_row_stats_t first_st = {0,0,0};
+  km_row_stats(km_skip_kmer(first, first + first_len), first + first_len, 1, &first_st);
+  job.n_samples = first_st.n_values;
+  if(groups.max_sample > job.n_samples) {
+    fprintf(stderr, "[warning] the groups refer to sample %u, the matrix has %lu samples (missing counts read as 0)\n", groups.max_sample, job.n_samples);
+  }
+  for(size_t g=0; g<groups.n_groups; ++g) {
+    fprintf(stderr, "[info] group %lu\t%s\t%lu samples\n", g+1, groups.names[g], groups.seg[g+1] - groups.seg[g]);
+  }
+
+  int ret = km_chunk_run(&eng, outfile, verbose_opt);
+  if(ret) {
+    fprintf(stderr,"Cannot write output\n");
+  }
+
+  fprintf(stderr, "[info] %lu\tsamples\n", job.n_samples);
+  fprintf(stderr, "[info] %lu\tgroups\n", groups.n_groups);
+  fprintf(stderr, "[info] %lu\tk-mers\n", eng.n_records);
+
+  if(km_metrics_write(metrics_fname, pool ? km_pool_json : NULL, pool)) {
+    fprintf(stderr,"Cannot write metrics file \"%s\"\n",metrics_fname);
+  }
+  if(km_trace_write(trace_fname, "km_group")) {
+    fprintf(stderr,"Cannot write trace file \"%s\"\n",trace_fname);
+  }
+  km_chunk_engine_free(&eng);
+  if(pool) {
+    if(verbose_opt || metrics_fname) { km_pool_report(pool, stderr); }
+    km_pool_destroy(pool);
+  }
+  km_numa_free(numa);
+  free_groups(&groups);
+  if(matfile != stdin){ fclose(matfile); }
+  if(outfile != stdout){ fclose(outfile); }
+
+  return ret;
+}
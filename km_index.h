@@ -0,0 +1,406 @@
+#ifndef KM_INDEX_H
+#define KM_INDEX_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "km_kernels.h"
+
+// Learned index of a sorted text matrix (k <= 32), saved as <matrix>.kmi.
+//
+// The index is a linear spline from the packed key of a row to its file
+// offset: knots are chosen while scanning the matrix (greedy spline corridor,
+// as in RadixSpline) so that interpolating between two knots predicts the
+// offset of every row in between within max_error bytes. A radix table on the
+// top bits of the key, rebuilt when the index is loaded, narrows the search of
+// the knots to a few entries. A key is found by reading the window of
+// 2*max_error bytes (plus a row) around its prediction with pread and scanning
+// it. Lookups of increasing keys go forward: a window overlapping the last
+// one read extends it with a growing read-ahead, and the scan resumes at the
+// row where the previous lookup stopped, so a dense sorted batch reads the
+// matrix sequentially. With uniform keys, the knots take a few MB per billion
+// rows.
+//
+// The index records the size and modification time of the matrix, and is
+// rebuilt when they do not match.
+
+#define KM_INDEX_ERROR 4096
+#define KM_INDEX_WINDOW (2*KM_INDEX_ERROR)
+#define KM_INDEX_AHEAD_MAX (1UL<<20)
+#define KM_INDEX_EXT ".kmi"
+
+static const char km_index_magic[8] = { 'K', 'M', 'I', 'D', 'X', '0', '2', 0 };
+
+typedef struct {
+  char magic[8];
+  uint32_t ksize;
+  uint32_t kmtricks;
+  uint64_t n_samples;
+  uint64_t n_rows;
+  uint64_t max_error;    // bytes between a row and its predicted offset
+  uint64_t max_line;     // longest row, newline excluded
+  uint64_t n_knots;
+  uint64_t mat_size;     // size of the matrix indexed
+  int64_t mat_mtime_ns;  // and its modification time
+} km_index_header_t;
+
+typedef struct {
+  uint64_t key;
+  uint64_t off;
+} km_index_entry_t;
+
+typedef struct {
+  km_index_header_t h;
+  km_index_entry_t *knots;
+  uint32_t *radix;       // knots of the keys with top bits i start at radix[i]
+  int radix_bits, radix_shift;
+  int fd;                // matrix
+  const uint8_t *code;
+  // window cache of the lookups
+  char *buf;
+  uint64_t buf_off;
+  size_t buf_len, buf_cap;
+  size_t ahead;          // read-ahead of the next forward read
+  size_t n_reads;        // windows read
+  // where the last lookup stopped: first row after last_key
+  bool resume;
+  uint64_t last_key, resume_off;
+} km_index_t;
+
+static inline int64_t km_index_mtime(const struct stat *st) {
+  return (int64_t)st->st_mtim.tv_sec * 1000000000 + st->st_mtim.tv_nsec;
+}
+
+// --- spline
+
+typedef struct {
+  size_t cap;
+  bool open;              // base and prev set, bounds valid
+  km_index_entry_t base, prev;
+  double lower, upper;    // slopes from base that keep the points within the error
+} km_spline_t;
+
+static void km_index_add(km_index_t *idx, size_t *cap, uint64_t key, uint64_t off) {
+  if(idx->h.n_knots == *cap) {
+    *cap = *cap ? 2*(*cap) : 1024;
+    idx->knots = (km_index_entry_t *)realloc(idx->knots, *cap*sizeof(km_index_entry_t));
+  }
+  idx->knots[idx->h.n_knots++] = (km_index_entry_t){ key, off };
+}
+
+// Offset of key predicted by the segment from knot a to knot b.
+static inline double km_index_interp(const km_index_entry_t *a, const km_index_entry_t *b, uint64_t key) {
+  if(b->key == a->key) { return a->off; }
+  return a->off + (double)(key - a->key) * ((double)b->off - (double)a->off) / (double)(b->key - a->key);
+}
+
+// Adds the row (key, off), keys being increasing.
+static void km_spline_add(km_index_t *idx, km_spline_t *sp, uint64_t key, uint64_t off) {
+  double err = idx->h.max_error;
+  if(idx->h.n_knots == 0) {
+    km_index_add(idx, &sp->cap, key, off);
+    sp->base = (km_index_entry_t){ key, off };
+    sp->open = false;
+    return;
+  }
+  double dx = (double)(key - sp->base.key), dy = (double)off - (double)sp->base.off;
+  if(sp->open) {
+    double slope = dy / dx;
+    if(slope <= sp->upper && slope >= sp->lower) {
+      double up = (dy + err) / dx, low = (dy - err) / dx;
+      if(up < sp->upper) { sp->upper = up; }
+      if(low > sp->lower) { sp->lower = low; }
+      sp->prev = (km_index_entry_t){ key, off };
+      return;
+    }
+    // out of the corridor: the previous row ends the segment
+    km_index_add(idx, &sp->cap, sp->prev.key, sp->prev.off);
+    sp->base = sp->prev;
+    dx = (double)(key - sp->base.key);
+    dy = (double)off - (double)sp->base.off;
+  }
+  sp->upper = (dy + err) / dx;
+  sp->lower = (dy - err) / dx;
+  sp->prev = (km_index_entry_t){ key, off };
+  sp->open = true;
+}
+
+static void km_spline_end(km_index_t *idx, km_spline_t *sp) {
+  if(sp->open) { km_index_add(idx, &sp->cap, sp->prev.key, sp->prev.off); }
+}
+
+// Radix table over the knots, about two slots per knot.
+static void km_index_radix(km_index_t *idx) {
+  uint64_t n = idx->h.n_knots;
+  int bits = 1;
+  while(bits < 24 && (1ULL << bits) < 2*n) { ++bits; }
+  uint64_t span = n ? idx->knots[n-1].key - idx->knots[0].key : 0;
+  int span_bits = 0;
+  while(span_bits < 64 && (span >> span_bits)) { ++span_bits; }
+  idx->radix_shift = span_bits > bits ? span_bits - bits : 0;
+  idx->radix_bits = bits;
+  size_t slots = (1UL << bits) + 1;
+  idx->radix = (uint32_t *)malloc(slots*sizeof(uint32_t));
+  size_t k = 0;
+  for(size_t r=0; r<slots; ++r) {
+    while(k < n && ((idx->knots[k].key - idx->knots[0].key) >> idx->radix_shift) < r) { ++k; }
+    idx->radix[r] = k;
+  }
+}
+
+// Builds the index of the matrix open on idx->fd with one scan. Returns NULL
+// on success, else an error message (row not packable or not sorted).
+static const char *km_index_build(km_index_t *idx, size_t max_error) {
+  size_t buf_cap = 4UL<<20, len = 0;
+  char *buf = (char *)malloc(buf_cap);
+  uint64_t off = 0, prev = 0;
+  const char *err = NULL;
+  bool eof = false;
+  km_spline_t sp = { 0 };
+  idx->h.max_error = max_error;
+  idx->h.n_rows = idx->h.n_knots = idx->h.max_line = 0;
+  if(lseek(idx->fd, 0, SEEK_SET) != 0) { free(buf); return "cannot seek in the matrix"; }
+  while(!eof && err == NULL) {
+    ssize_t r = read(idx->fd, buf + len, buf_cap - len);
+    if(r < 0 && errno == EINTR) { continue; }
+    if(r <= 0) { eof = true; } else { len += r; }
+    size_t pos = 0;
+    while(err == NULL) {
+      char *nl = (char *)memchr(buf + pos, '\n', len - pos);
+      if(nl == NULL && !eof) { break; }
+      size_t line_len = nl ? (size_t)(nl - (buf + pos)) : len - pos;
+      if(line_len == 0) { if(nl == NULL) { break; } ++pos; ++off; continue; }
+      const char *line = buf + pos;
+      uint64_t key;
+      if(line_len < idx->h.ksize || !km_pack(line, idx->h.ksize, idx->code, &key)) {
+        err = "row without a valid k-mer";
+      } else if(idx->h.n_rows > 0 && key <= prev) {
+        err = "k-mers not sorted (see -z)";
+      } else {
+        if(idx->h.n_rows == 0) {
+          km_row_stats_t st = {0,0,0};
+          km_row_stats(km_skip_kmer(line, line + line_len), line + line_len, 1, &st);
+          idx->h.n_samples = st.n_values;
+        }
+        km_spline_add(idx, &sp, key, off);
+        if(line_len > idx->h.max_line) { idx->h.max_line = line_len; }
+        prev = key;
+        ++idx->h.n_rows;
+      }
+      size_t adv = line_len + (nl != NULL);
+      pos += adv;
+      off += adv;
+      if(nl == NULL) { break; }
+    }
+    memmove(buf, buf + pos, len - pos);
+    len -= pos;
+    if(len == buf_cap) {
+      buf_cap *= 2;
+      buf = (char *)realloc(buf, buf_cap);
+    }
+  }
+  free(buf);
+  km_spline_end(idx, &sp);
+  idx->h.mat_size = off;
+  return err;
+}
+
+static bool km_index_write(const km_index_t *idx, const char *path) {
+  FILE *fp = fopen(path, "wb");
+  if(fp == NULL) { return false; }
+  bool ok = fwrite(&idx->h, sizeof(idx->h), 1, fp) == 1
+    && fwrite(idx->knots, sizeof(km_index_entry_t), idx->h.n_knots, fp) == idx->h.n_knots;
+  ok &= fclose(fp) == 0;
+  if(!ok) { unlink(path); }
+  return ok;
+}
+
+// Loads the index at path if it matches the matrix (st) and the parameters.
+static bool km_index_read(km_index_t *idx, const char *path, const struct stat *st) {
+  FILE *fp = fopen(path, "rb");
+  if(fp == NULL) { return false; }
+  km_index_header_t h;
+  bool ok = fread(&h, sizeof(h), 1, fp) == 1 && memcmp(h.magic, km_index_magic, 8) == 0
+    && h.ksize == idx->h.ksize && h.kmtricks == idx->h.kmtricks
+    && h.mat_size == (uint64_t)st->st_size && h.mat_mtime_ns == km_index_mtime(st);
+  if(ok) {
+    idx->knots = (km_index_entry_t *)malloc((h.n_knots ? h.n_knots : 1)*sizeof(km_index_entry_t));
+    ok = fread(idx->knots, sizeof(km_index_entry_t), h.n_knots, fp) == h.n_knots;
+    if(ok) { idx->h = h; } else { free(idx->knots); idx->knots = NULL; }
+  }
+  fclose(fp);
+  return ok;
+}
+
+// Opens the index of the matrix at mat_path: loads <index_path> (by default
+// <mat_path>.kmi) if up to date, else builds it and tries to save it. Returns
+// 0 on success, 1 if the matrix cannot be opened or is not a regular file,
+// 2 if it cannot be indexed (*err gives why). *built tells if it was built.
+static int km_index_open(km_index_t *idx, const char *mat_path, const char *index_path, int ksize, bool kmtricks, const char **err, bool *built) {
+  memset(idx, 0, sizeof(*idx));
+  memcpy(idx->h.magic, km_index_magic, 8);
+  idx->h.ksize = ksize;
+  idx->h.kmtricks = kmtricks;
+  idx->code = kmtricks ? nt2bits_kt : nt2bits;
+  *built = false;
+  idx->fd = open(mat_path, O_RDONLY);
+  struct stat st;
+  if(idx->fd < 0 || fstat(idx->fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+    if(idx->fd >= 0) { close(idx->fd); }
+    return 1;
+  }
+
+  char *path = NULL;
+  if(index_path == NULL) {
+    path = (char *)malloc(strlen(mat_path) + sizeof(KM_INDEX_EXT));
+    sprintf(path, "%s%s", mat_path, KM_INDEX_EXT);
+    index_path = path;
+  }
+  if(!km_index_read(idx, index_path, &st)) {
+    *err = km_index_build(idx, KM_INDEX_ERROR);
+    if(*err) { free(path); free(idx->knots); close(idx->fd); return 2; }
+    idx->h.mat_mtime_ns = km_index_mtime(&st);
+    *built = true;
+    km_index_write(idx, index_path); // best effort, e.g. read-only directory
+  }
+  free(path);
+  km_index_radix(idx);
+  return 0;
+}
+
+static void km_index_close(km_index_t *idx) {
+  close(idx->fd);
+  free(idx->knots);
+  free(idx->radix);
+  free(idx->buf);
+}
+
+// Makes the cache cover the bytes [beg,end) of the matrix. When the range
+// starts within the cache (increasing keys), the bytes already read are kept
+// and the read goes on from the end of the cache, further ahead each time up
+// to KM_INDEX_AHEAD_MAX; a range elsewhere resets the read-ahead.
+static bool km_index_load(km_index_t *idx, uint64_t beg, uint64_t end) {
+  uint64_t cache_end = idx->buf_off + idx->buf_len;
+  if(idx->buf_len && beg >= idx->buf_off && end <= cache_end) { return true; }
+  size_t keep = 0;
+  if(idx->buf_len && beg >= idx->buf_off && beg < cache_end) {
+    keep = cache_end - beg;
+    idx->ahead = 2*idx->ahead > KM_INDEX_WINDOW ? 2*idx->ahead : KM_INDEX_WINDOW;
+    if(idx->ahead > KM_INDEX_AHEAD_MAX) { idx->ahead = KM_INDEX_AHEAD_MAX; }
+  } else {
+    idx->ahead = 0;
+  }
+  uint64_t stop = end + idx->ahead < idx->h.mat_size ? end + idx->ahead : idx->h.mat_size;
+  if(stop < end) { stop = end; }
+  size_t len = stop - beg;
+  if(keep) { memmove(idx->buf, idx->buf + (beg - idx->buf_off), keep); }
+  if(idx->buf_cap < len) {
+    idx->buf_cap = len;
+    idx->buf = (char *)realloc(idx->buf, len);
+  }
+  for(size_t done = keep; done < len; ) {
+    ssize_t r = pread(idx->fd, idx->buf + done, len - done, beg + done);
+    if(r < 0 && errno == EINTR) { continue; }
+    if(r <= 0) { idx->buf_len = 0; return false; }
+    done += r;
+  }
+  idx->buf_off = beg;
+  idx->buf_len = len;
+  ++idx->n_reads;
+  return true;
+}
+
+// Predicted offset of the row of key, between the first and the last knots.
+static inline double km_index_predict(const km_index_t *idx, uint64_t key) {
+  uint64_t r = (key - idx->knots[0].key) >> idx->radix_shift;
+  // last knot whose key is <= key, among those of the radix slot
+  size_t lo = idx->radix[r] > 0 ? idx->radix[r] - 1 : 0, hi = idx->radix[r+1];
+  if(hi >= idx->h.n_knots) { hi = idx->h.n_knots - 1; }
+  while(lo < hi) {
+    size_t mid = lo + (hi - lo + 1)/2;
+    if(idx->knots[mid].key <= key) { lo = mid; } else { hi = mid - 1; }
+  }
+  if(lo + 1 == idx->h.n_knots) { return idx->knots[lo].off; }
+  return km_index_interp(&idx->knots[lo], &idx->knots[lo+1], key);
+}
+
+// Finds the row of key. Returns a pointer to the row and sets *end to its end
+// (newline excluded), or returns NULL if the key is absent (or on read error).
+// The pointers are valid until the next lookup.
+static const char *km_index_find(km_index_t *idx, uint64_t key, const char **end) {
+  if(idx->h.n_knots == 0 || key < idx->knots[0].key || key > idx->knots[idx->h.n_knots-1].key) { return NULL; }
+  // the row starts in [pred - max_error, pred + max_error] (one more byte for
+  // rounding); one byte before, for the newline ending the previous row
+  double pred = km_index_predict(idx, key);
+  double lo = pred - idx->h.max_error - 2, hi = pred + idx->h.max_error + 1;
+  uint64_t beg = lo > 0 ? (uint64_t)lo : 0;
+  uint64_t last = hi < (double)idx->h.mat_size ? (uint64_t)hi : idx->h.mat_size;
+  uint64_t win_end = last + idx->h.max_line + 1 < idx->h.mat_size ? last + idx->h.max_line + 1 : idx->h.mat_size;
+  // a larger key is after the row where the previous lookup stopped
+  bool resume = idx->resume && key > idx->last_key && idx->resume_off >= beg;
+  if(resume && idx->resume_off > last) { return NULL; }
+  if(beg >= win_end || !km_index_load(idx, beg, win_end)) { idx->resume = false; return NULL; }
+  const char *p = idx->buf + (beg - idx->buf_off), *buf_end = idx->buf + idx->buf_len;
+  const char *p_last = idx->buf + (last - idx->buf_off);
+  if(resume) {
+    p = idx->buf + (idx->resume_off - idx->buf_off);
+  } else if(beg > 0) {
+    p = (const char *)memchr(p, '\n', buf_end - p);
+    if(p == NULL) { idx->resume = false; return NULL; }
+    ++p;
+  }
+  const char *row = NULL;
+  while(p < buf_end && p <= p_last) {
+    const char *nl = (const char *)memchr(p, '\n', buf_end - p);
+    const char *line_end = nl ? nl : buf_end;
+    uint64_t k;
+    if(line_end - p >= idx->h.ksize && km_pack(p, idx->h.ksize, idx->code, &k)) {
+      if(k == key) {
+        *end = line_end;
+        row = p;
+        p = line_end + 1;
+        break;
+      }
+      if(k > key) { break; }
+    }
+    p = line_end + 1;
+  }
+  idx->resume = true;
+  idx->last_key = key;
+  idx->resume_off = idx->buf_off + (p - idx->buf);
+  return row;
+}
+
+// Same as km_index_find, returning a pointer to the counts of the row.
+static const char *km_index_lookup(km_index_t *idx, uint64_t key, const char **end) {
+  const char *row = km_index_find(idx, key, end);
+  return row ? km_skip_kmer(row, *end) : NULL;
+}
+
+// Tells if <mat_path>.kmi is an up-to-date index of the matrix for ksize and
+// the nucleotide order, without loading it.
+static bool km_index_fresh(const char *mat_path, int ksize, bool kmtricks) {
+  struct stat st;
+  if(stat(mat_path, &st) != 0) { return false; }
+  char *path = (char *)malloc(strlen(mat_path) + sizeof(KM_INDEX_EXT));
+  sprintf(path, "%s%s", mat_path, KM_INDEX_EXT);
+  FILE *fp = fopen(path, "rb");
+  free(path);
+  if(fp == NULL) { return false; }
+  km_index_header_t h;
+  bool ok = fread(&h, sizeof(h), 1, fp) == 1 && memcmp(h.magic, km_index_magic, 8) == 0
+    && h.ksize == (uint32_t)ksize && h.kmtricks == kmtricks
+    && h.mat_size == (uint64_t)st.st_size && h.mat_mtime_ns == km_index_mtime(&st);
+  fclose(fp);
+  return ok;
+}
+
+#endif
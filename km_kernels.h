@@ -0,0 +1,214 @@
+#ifndef KM_KERNELS_H
+#define KM_KERNELS_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+
+// 2-bit codes of nucleotides in lexicographic order (A<C<G<T), 4 for anything else
+static const uint8_t nt2bits[256] = {
+  4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4,
+  4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4,
+  4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4,
+  4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4,
+  4, 0, 4, 1, 4, 4, 4, 2, 4, 4, 4, 4, 4, 4, 4, 4,
+  4, 4, 4, 4, 3, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4,
+  4, 0, 4, 1, 4, 4, 4, 2, 4, 4, 4, 4, 4, 4, 4, 4,
+  4, 4, 4, 4, 3, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4,
+  4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4,
+  4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4,
+  4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4,
+  4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4,
+  4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4,
+  4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4,
+  4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4,
+  4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4
+};
+
+// 2-bit codes of nucleotides in kmtricks order (A<C<T<G), 4 for anything else
+static const uint8_t nt2bits_kt[256] = {
+  4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4,
+  4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4,
+  4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4,
+  4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4,
+  4, 0, 4, 1, 4, 4, 4, 3, 4, 4, 4, 4, 4, 4, 4, 4,
+  4, 4, 4, 4, 2, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4,
+  4, 0, 4, 1, 4, 4, 4, 3, 4, 4, 4, 4, 4, 4, 4, 4,
+  4, 4, 4, 4, 2, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4,
+  4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4,
+  4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4,
+  4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4,
+  4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4,
+  4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4,
+  4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4,
+  4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4,
+  4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4
+};
+
+// Packs the first ksize (<= 32) nucleotides of str into key, so that comparing
+// two keys gives the same result as comparing the k-mers with the order of code.
+static inline bool km_pack(const char *str, int ksize, const uint8_t *code, uint64_t *key) {
+  uint64_t k = 0;
+  for(int i=0; i<ksize; i++) {
+    uint8_t b = code[(unsigned char)str[i]];
+    if(b > 3) { return false; }
+    k = (k << 2) | b;
+  }
+  *key = k;
+  return true;
+}
+
+// Writes to out (len-ksize+1 slots) the canonical keys of the k-mers of seq,
+// i.e. the smaller of the keys of the k-mer and of its reverse complement,
+// skipping the k-mers with non-ACGT characters. Returns the number of keys.
+static inline size_t km_canonical_keys(const char *seq, size_t len, int ksize, const uint8_t *code, uint64_t *out) {
+  // complement of a code: A<->T and C<->G, i.e. 3-x in lexicographic order, x^2 in kmtricks order
+  uint64_t comp_xor = code == nt2bits_kt ? 2 : 3;
+  uint64_t mask = ksize == 32 ? UINT64_MAX : (1ULL << (2*ksize)) - 1;
+  uint64_t fwd = 0, rev = 0;
+  size_t n = 0;
+  int valid = 0; // length of the current run of nucleotides
+  for(size_t i=0; i<len; ++i) {
+    uint8_t b = code[(unsigned char)seq[i]];
+    if(b > 3) { valid = 0; continue; }
+    fwd = ((fwd << 2) | b) & mask;
+    rev = (rev >> 2) | ((uint64_t)(b ^ comp_xor) << (2*(ksize-1)));
+    if(++valid >= ksize) { out[n++] = fwd < rev ? fwd : rev; }
+  }
+  return n;
+}
+
+// counts of a matrix row (or of a segment of it)
+typedef struct {
+  size_t n_values, n_zeros, n_present;
+} km_row_stats_t;
+
+static inline bool km_isblank(char c) { return c == ' ' || c == '\t' || c == '\n'; }
+
+// Returns the position of the first count of a matrix line, i.e. after the k-mer.
+static inline const char *km_skip_kmer(const char *p, const char *end) {
+  while(p < end && km_isblank(*p)) { ++p; }
+  while(p < end && !km_isblank(*p)) { ++p; }
+  return p;
+}
+
+// Parses the counts in [p,end) and adds to st the number of values, of zeros and
+// of values >= min_abund. Values are parsed as strtol would (garbage reads as 0).
+static inline void km_row_stats(const char *p, const char *end, long min_abund, km_row_stats_t *st) {
+  size_t n_values = 0, n_zeros = 0, n_present = 0;
+  while(p < end) {
+    while(p < end && km_isblank(*p)) { ++p; }
+    if(p == end) { break; }
+    bool neg = false;
+    if(*p == '-' || *p == '+') { neg = (*p == '-'); ++p; }
+    long val = 0;
+    while(p < end && (unsigned char)(*p - '0') < 10) { val = val*10 + (*p - '0'); ++p; }
+    while(p < end && !km_isblank(*p)) { ++p; }
+    if(neg) { val = -val; }
+    ++n_values;
+    if(val == 0) { ++n_zeros; } else if(val >= min_abund) { ++n_present; }
+  }
+  st->n_values += n_values;
+  st->n_zeros += n_zeros;
+  st->n_present += n_present;
+}
+
+// Parses the first n counts of [p,end) into counts, the missing ones being 0.
+// Values are read as their leading digits (garbage and negative values read as
+// 0) and saturate at UINT32_MAX. Returns the number of values found.
+static inline size_t km_parse_counts(const char *p, const char *end, uint32_t *counts, size_t n) {
+  size_t i = 0;
+  while(i < n) {
+    while(p < end && km_isblank(*p)) { ++p; }
+    if(p == end) { break; }
+    uint64_t val = 0;
+    while(p < end && (unsigned char)(*p - '0') < 10) { if(val <= UINT32_MAX) { val = val*10 + (*p - '0'); } ++p; }
+    while(p < end && !km_isblank(*p)) { ++p; }
+    counts[i++] = val > UINT32_MAX ? UINT32_MAX : (uint32_t)val;
+  }
+  size_t n_found = i;
+  for(; i < n; ++i) { counts[i] = 0; }
+  return n_found;
+}
+
+// Splits [beg,end) into n_seg segments of about the same size whose boundaries
+// fall on blanks, so that no value is cut. Segment i is [bounds[i],bounds[i+1]).
+static inline void km_row_split(const char *beg, const char *end, int n_seg, const char **bounds) {
+  size_t len = end - beg;
+  bounds[0] = beg;
+  for(int i=1; i<n_seg; ++i) {
+    const char *p = beg + len*i/n_seg;
+    if(p < bounds[i-1]) { p = bounds[i-1]; }
+    while(p < end && !km_isblank(*p)) { ++p; }
+    bounds[i] = p;
+  }
+  bounds[n_seg] = end;
+}
+
+// SWAR helpers over 8 bytes: per-byte 0x80 where the byte of x is zero (exact,
+// no false positive from borrows), and broadcast of a byte.
+#define KM_ONES 0x0101010101010101ULL
+#define KM_HIGHS 0x8080808080808080ULL
+static inline uint64_t km_zero_bytes(uint64_t x) {
+  uint64_t y = (x & ~KM_HIGHS) + ~KM_HIGHS;
+  return ~(y | x | ~KM_HIGHS);
+}
+
+// Returns true if the first k characters of s are nucleotides (ACGTN, either
+// case), as a loop over isnuc would, checking 8 characters at a time.
+static inline bool km_is_kmer(const char *s, int k) {
+  int i = 0;
+  for(; i+8 <= k; i += 8) {
+    uint64_t x;
+    memcpy(&x, s+i, 8);
+    x &= ~(0x20*KM_ONES); // upper case
+    uint64_t ok = km_zero_bytes(x ^ ('A'*KM_ONES)) | km_zero_bytes(x ^ ('C'*KM_ONES))
+                | km_zero_bytes(x ^ ('G'*KM_ONES)) | km_zero_bytes(x ^ ('T'*KM_ONES))
+                | km_zero_bytes(x ^ ('N'*KM_ONES));
+    if(ok != KM_HIGHS) { return false; }
+  }
+  for(; i<k; ++i) {
+    char c = s[i] & ~0x20;
+    if(c != 'A' && c != 'C' && c != 'G' && c != 'T' && c != 'N') { return false; }
+  }
+  return true;
+}
+
+// Complement of 8 nucleotides (ACGTN, either case): C and G have bit 1 set and
+// swap with ^0x04, A and T swap with ^0x15, N (bit 3 set) is left unchanged.
+static inline uint64_t km_comp8(uint64_t x) {
+  uint64_t b1 = (x >> 1) & KM_ONES, b3 = (x >> 3) & KM_ONES;
+  return x ^ (((b1 & ~b3) << 2) | ((b1 ^ KM_ONES) * 0x15));
+}
+
+// Reverse complements the first k characters of s in place, 8 from each end at
+// a time. s must hold only nucleotides (see km_is_kmer); gives the same result
+// as swapping through rctable. Assumes a little-endian CPU.
+static inline void km_revcomp(char *s, int k) {
+  int i = 0, j = k;
+  for(; j-i >= 16; i += 8, j -= 8) {
+    uint64_t lo, hi;
+    memcpy(&lo, s+i, 8);
+    memcpy(&hi, s+j-8, 8);
+    lo = km_comp8(__builtin_bswap64(lo));
+    hi = km_comp8(__builtin_bswap64(hi));
+    memcpy(s+i, &hi, 8);
+    memcpy(s+j-8, &lo, 8);
+  }
+  int n = j-i;
+  if(n > 8) { // two overlapping words, which agree on their common characters
+    uint64_t lo, hi;
+    memcpy(&lo, s+i, 8);
+    memcpy(&hi, s+j-8, 8);
+    memcpy(s+i, &(uint64_t){ km_comp8(__builtin_bswap64(hi)) }, 8);
+    memcpy(s+j-8, &(uint64_t){ km_comp8(__builtin_bswap64(lo)) }, 8);
+  } else if(n > 0) {
+    uint64_t mid = 0;
+    memcpy(&mid, s+i, n);
+    mid = km_comp8(__builtin_bswap64(mid)) >> (8*(8-n));
+    memcpy(s+i, &mid, n);
+  }
+}
+
+#endif
@@ -6,6 +6,9 @@
 #include <stdbool.h>
 #include <string.h>
 
+#include "km_arrow.h"
+#include "km_estimate.h"
+
 static const int isnuc[256] = {
       0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,
       0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,
@@ -84,15 +87,184 @@ char * first_column(char *line) {
   return line;
 }
 
+// --- estimate of the merge from blocks sampled in both matrices
+
+typedef struct {
+  const char *path;
+  int fd;
+  uint64_t size;
+  km_preader_t rd;
+  size_t n_samples;
+} est_input_t;
+
+// Reads the next row with a k-mer; sets *cols to its counts.
+bool est_next_row(est_input_t *in, int ksize, const char **line, size_t *len, const char **cols, uint64_t *off) {
+  while(km_preader_line(&in->rd, line, len, off)) {
+    if(*len < ksize) { continue; }
+    const char *p = *line + ksize, *end = *line + *len;
+    while(p < end && *p != ' ' && *p != '\t') { ++p; }
+    while(p < end && (*p == ' ' || *p == '\t')) { ++p; }
+    *cols = p;
+    return true;
+  }
+  return false;
+}
+
+int est_cmp(const char *k1, const char *k2, int ksize, bool use_ktcmp, char *buf_1, char *buf_2) {
+  memcpy(buf_1, k1, ksize);
+  memcpy(buf_2, k2, ksize);
+  return use_ktcmp ? ktcmp(buf_1, buf_2) : strcmp(buf_1, buf_2);
+}
+
+// Offset of the first row of the sorted matrix whose k-mer is >= kmer, by a
+// binary search on bytes.
+uint64_t est_lower_bound(est_input_t *in, const char *kmer, int ksize, bool use_ktcmp, char *buf_1, char *buf_2) {
+  uint64_t lo = 0, hi = in->size;
+  const char *line, *cols;
+  size_t len;
+  uint64_t off;
+  while(lo < hi) {
+    uint64_t mid = lo + (hi - lo)/2;
+    km_preader_seek(&in->rd, km_preader_line_start(&in->rd, mid));
+    if(!est_next_row(in, ksize, &line, &len, &cols, &off) || off >= hi) { hi = mid; continue; }
+    if(est_cmp(line, kmer, ksize, use_ktcmp, buf_1, buf_2) < 0) { lo = off + 1; } else { hi = off; }
+  }
+  return km_preader_line_start(&in->rd, lo);
+}
+
+// Output rows and bytes (text) of the merge, estimated as the rows of the 1st
+// matrix (minus those shared, found by a search of each sampled block in the
+// 2nd matrix) plus the rows of the 2nd matrix.
+int estimate_merge(const char *path_1, const char *path_2, int ksize, bool use_ktcmp, long n_blocks) {
+  est_input_t in[2] = { { .path = path_1 }, { .path = path_2 } };
+  char *buf_1 = (char *)calloc(ksize+1,1), *buf_2 = (char *)calloc(ksize+1,1);
+  for(int i=0; i<2; ++i) {
+    const char *err;
+    in[i].fd = km_estimate_open(in[i].path, &in[i].size, &err);
+    if(in[i].fd < 0) {
+      fprintf(stderr,"Cannot estimate from \"%s\": %s\n",in[i].path,err);
+      if(i == 1) { km_preader_free(&in[0].rd); close(in[0].fd); }
+      free(buf_1);
+      free(buf_2);
+      return 1;
+    }
+    km_preader_init(&in[i].rd, in[i].fd, in[i].size);
+    const char *line;
+    size_t len;
+    uint64_t off;
+    if(km_preader_line(&in[i].rd, &line, &len, &off)) {
+      char *row = strndup(line, len);
+      in[i].n_samples = samples_number(row);
+      free(row);
+    }
+  }
+  size_t n_1 = in[0].n_samples, n_2 = in[1].n_samples;
+
+  // the runtime is timed on the sampled rows, written as the merge would to /dev/null
+  FILE *sink = fopen("/dev/null", "w");
+  uint64_t B = KM_ESTIMATE_BLOCK_BYTES, N[2], n[2], b;
+  km_est_t rows[2] = {{0}}, bytes[2] = {{0}}, ns[2] = {{0}}, shared = {0};
+  for(int i=0; i<2; ++i) {
+    est_input_t *mat = &in[i], *other = &in[1];
+    N[i] = (mat->size + B - 1)/B;
+    km_sampling_t smp;
+    km_sampling_init(&smp, N[i], n_blocks, i ? 0x6b6d5f6d65726732ULL : 0x6b6d5f6d65726731ULL);
+    while(km_sampling_next(&smp, &b)) {
+      uint64_t t0 = km_estimate_now_ns(), search_ns = 0;
+      uint64_t block_end = (b+1)*B < mat->size ? (b+1)*B : mat->size;
+      double n_rows = 0, n_bytes = 0, n_shared = 0;
+      const char *line, *cols, *line_2 = NULL, *cols_2 = NULL;
+      size_t len, len_2 = 0;
+      uint64_t off, off_2;
+      bool searched = false, has_2 = true;
+      km_preader_seek(&mat->rd, km_preader_line_start(&mat->rd, b*B));
+      while(est_next_row(mat, ksize, &line, &len, &cols, &off) && off < block_end) {
+        size_t c = line + len - cols;
+        ++n_rows;
+        if(i == 1) {
+          n_bytes += ksize + 2*n_1 + 1 + c + 1;
+          fwrite(line, 1, ksize, sink);
+          for(size_t z=0; z<n_1; ++z) { fputs(" 0", sink); }
+          fputc(' ', sink);
+          fwrite(cols, 1, c, sink);
+          fputc('\n', sink);
+          continue;
+        }
+        if(!searched) { // rows of the 2nd matrix from the first k-mer of the block
+          uint64_t t = km_estimate_now_ns();
+          km_preader_seek(&other->rd, est_lower_bound(other, line, ksize, use_ktcmp, buf_1, buf_2));
+          has_2 = est_next_row(other, ksize, &line_2, &len_2, &cols_2, &off_2);
+          search_ns += km_estimate_now_ns() - t;
+          searched = true;
+        }
+        // the line of the 1st matrix is in its reader buffer, untouched by the other reader
+        int cmp = -1;
+        while(has_2 && (cmp = est_cmp(line, line_2, ksize, use_ktcmp, buf_1, buf_2)) > 0) {
+          has_2 = est_next_row(other, ksize, &line_2, &len_2, &cols_2, &off_2);
+        }
+        fwrite(line, 1, len, sink);
+        if(has_2 && cmp == 0) {
+          size_t c_2 = line_2 + len_2 - cols_2;
+          ++n_shared;
+          n_bytes += (ksize + 1 + c + 1 + c_2 + 1) - (ksize + 2*n_1 + 1 + c_2 + 1);
+          fputc(' ', sink);
+          fwrite(cols_2, 1, c_2, sink);
+        } else {
+          n_bytes += ksize + 1 + c + 2*n_2 + 1;
+          for(size_t z=0; z<n_2; ++z) { fputs(" 0", sink); }
+        }
+        fputc('\n', sink);
+      }
+      double x = block_end - b*B;
+      km_est_add(&rows[i], n_rows - n_shared, x);
+      km_est_add(&bytes[i], n_bytes, x);
+      fflush(sink);
+      km_est_add(&ns[i], km_estimate_now_ns() - t0 - search_ns, x);
+      if(i == 0) { km_est_add(&shared, n_shared, x); }
+    }
+    n[i] = smp.n;
+  }
+
+  fprintf(stderr, "[info] estimate: %lu of %lu and %lu of %lu blocks of %lu bytes read\n", n[0], N[0], n[1], N[1], B);
+  fprintf(stderr, "[info] samples in 1st matrix: %lu\n", n_1);
+  fprintf(stderr, "[info] samples in 2nd matrix: %lu\n", n_2);
+  double total[2], half[2];
+  for(int i=0; i<2; ++i) { total[i] = km_est_total(&rows[i], n[i], N[i], in[i].size, &half[i]); }
+  km_est_print(stderr, "output k-mers", total[0] + total[1], sqrt(half[0]*half[0] + half[1]*half[1]), 0);
+  total[0] = km_est_total(&shared, n[0], N[0], in[0].size, &half[0]);
+  km_est_print(stderr, "k-mers in both matrices", total[0], half[0], 0);
+  for(int i=0; i<2; ++i) { total[i] = km_est_total(&bytes[i], n[i], N[i], in[i].size, &half[i]); }
+  km_est_print(stderr, "output bytes (text)", total[0] + total[1], sqrt(half[0]*half[0] + half[1]*half[1]), 0);
+  for(int i=0; i<2; ++i) { total[i] = km_est_total(&ns[i], n[i], N[i], in[i].size, &half[i]); }
+  km_est_print(stderr, "seconds", (total[0] + total[1])*1e-9, sqrt(half[0]*half[0] + half[1]*half[1])*1e-9, 2);
+
+  for(int i=0; i<2; ++i) {
+    km_preader_free(&in[i].rd);
+    close(in[i].fd);
+  }
+  fclose(sink);
+  free(buf_1);
+  free(buf_2);
+  return 0;
+}
+
 
 int main(int argc, char **argv) {
 
   int ksize = 31;
+  int format = KM_FORMAT_TEXT;
+  long estimate_blocks = 0;
   char *out_fname = NULL;
   bool use_ktcmp = false, help_opt = false;
 
+  static struct option long_opts[] = {
+    {"format", required_argument, NULL, KM_OPT_FORMAT},
+    {"estimate", optional_argument, NULL, KM_OPT_ESTIMATE},
+    {NULL, 0, NULL, 0}
+  };
+
   int c;
-  while ((c = getopt(argc, argv, "k:o:h")) != -1) {
+  while ((c = getopt_long(argc, argv, "k:o:zh", long_opts, NULL)) != -1) {
     switch (c) {
       case 'k':
         ksize = strtol(optarg, NULL, 10);
@@ -106,6 +278,20 @@ int main(int argc, char **argv) {
       case 'h':
         help_opt = true;
         break;
+      case KM_OPT_FORMAT:
+        format = km_format(optarg);
+        if(format < 0) {
+          fprintf(stderr, "Unknown output format \"%s\"\n", optarg);
+          return 1;
+        }
+        break;
+      case KM_OPT_ESTIMATE:
+        estimate_blocks = optarg ? strtol(optarg, NULL, 10) : KM_ESTIMATE_BLOCKS;
+        if(estimate_blocks <= 0) {
+          fprintf(stderr, "--estimate needs a positive number of blocks\n");
+          return 1;
+        }
+        break;
       case '?':
         return 1;
       default:
@@ -118,24 +304,37 @@ int main(int argc, char **argv) {
     return 1;
   }
 
+  if(format != KM_FORMAT_TEXT && ksize > 32) {
+    fprintf(stderr, "Arrow output requires k <= 32\n");
+    return 1;
+  }
+
   if(argc-optind != 2 || help_opt) {
     fprintf(stdout, "Usage: km_merge [options] <matrix_1> <matrix_2>\n\n");
-    fprintf(stdout, "Merge two input kmer-sorted matrices.\n\n");
+    fprintf(stdout, "Merge two input kmer-sorted matrices.\n");
+    fprintf(stdout, "Input matrices may be text or Arrow IPC files or streams (detected).\n\n");
     fprintf(stdout, "Options:\n");
     fprintf(stdout, "  -k INT   size of k-mers of input matrices [31]\n");
     fprintf(stdout, "  -o FILE  write output matrix to FILE [stdout]\n");
     fprintf(stdout, "  -z       use kmtricks order of nucleotides: A<C<T<G\n");
+    fprintf(stdout, "      --format STR  output format: text, arrow (IPC file), arrow-stream (IPC stream) [text]\n");
+    fprintf(stdout, "      --estimate[=INT] only estimate the output k-mers, size and runtime (95%% intervals)\n");
+    fprintf(stdout, "                    from INT sampled blocks of 64 KiB of each text matrix [256]\n");
     fprintf(stdout, "  -h       print this help message\n");
     return 0;
   }
 
-  FILE *mat_1 = fopen(argv[optind],"r");
+  if(estimate_blocks) {
+    return estimate_merge(argv[optind], argv[optind+1], ksize, use_ktcmp, estimate_blocks);
+  }
+
+  FILE *mat_1 = km_arrow_fopen(argv[optind], ksize, use_ktcmp);
   if(mat_1 == NULL) {
     fprintf(stderr,"Cannot open file \"%s\"\n",argv[optind]);
     return 1;
   }
 
-  FILE *mat_2 = fopen(argv[optind+1],"r");
+  FILE *mat_2 = km_arrow_fopen(argv[optind+1], ksize, use_ktcmp);
   if(mat_2 == NULL) {
     fprintf(stderr,"Cannot open file \"%s\"\n",argv[optind+1]);
     fclose(mat_1); 
@@ -149,6 +348,8 @@ int main(int argc, char **argv) {
     fclose(mat_2);
     return 1;
   }
+  km_arrow_out_t arrow_out;
+  FILE *textfile = km_arrow_out_open(&arrow_out, outfile, format, ksize, use_ktcmp);
 
   char *kmer_1 = (char *)calloc(ksize+1,1);
   char *kmer_2 = (char *)calloc(ksize+1,1);
@@ -163,47 +364,47 @@ int main(int argc, char **argv) {
   size_t n_sample_2 = has_kmer_2 ? samples_number(line_2) : 0;
   fprintf(stderr,"[info] samples in 2nd matrix: %lu\n", n_sample_2);
 
-  while(has_kmer_1 && has_kmer_2){
+  while(has_kmer_1 && has_kmer_2 && !ferror(textfile)){
     int ret_cmp = use_ktcmp ? ktcmp(kmer_1,kmer_2) : strcmp(kmer_1,kmer_2);
     if(ret_cmp == 0) {
-      fputs(kmer_1,outfile);
-      fputc(' ',outfile);
-      fputs(first_column(line_1),outfile);
-      fputc(' ',outfile);
-      fputs(first_column(line_2),outfile);
+      fputs(kmer_1,textfile);
+      fputc(' ',textfile);
+      fputs(first_column(line_1),textfile);
+      fputc(' ',textfile);
+      fputs(first_column(line_2),textfile);
       has_kmer_1 = next_kmer_and_line(kmer_1, ksize, &line_1, &line_1_size, mat_1);
       has_kmer_2 = next_kmer_and_line(kmer_2, ksize, &line_2, &line_2_size, mat_2);
     } else if(ret_cmp < 0) {
-      fputs(kmer_1,outfile);
-      fputc(' ',outfile);
-      fputs(first_column(line_1),outfile);
-      for(int i=0; i<n_sample_2; ++i){ fputs(" 0",outfile); }
+      fputs(kmer_1,textfile);
+      fputc(' ',textfile);
+      fputs(first_column(line_1),textfile);
+      for(int i=0; i<n_sample_2; ++i){ fputs(" 0",textfile); }
       has_kmer_1 = next_kmer_and_line(kmer_1, ksize, &line_1, &line_1_size, mat_1);
     } else { // ret_cmp > 0
-      fputs(kmer_2,outfile);
-      for(int i=0; i<n_sample_1; ++i){ fputs(" 0",outfile); }
-      fputc(' ',outfile);
-      fputs(first_column(line_2),outfile);
+      fputs(kmer_2,textfile);
+      for(int i=0; i<n_sample_1; ++i){ fputs(" 0",textfile); }
+      fputc(' ',textfile);
+      fputs(first_column(line_2),textfile);
       has_kmer_2 = next_kmer_and_line(kmer_2, ksize, &line_2, &line_2_size, mat_2);
     }
-    fputc('\n',outfile);
+    fputc('\n',textfile);
   }
 
-  while(has_kmer_1) {
-    fputs(kmer_1,outfile);
-    fputc(' ',outfile);
-    fputs(first_column(line_1),outfile);
-    for(int i=0; i<n_sample_2; ++i){ fputs(" 0",outfile); }
-    fputc('\n',outfile);
+  while(has_kmer_1 && !ferror(textfile)) {
+    fputs(kmer_1,textfile);
+    fputc(' ',textfile);
+    fputs(first_column(line_1),textfile);
+    for(int i=0; i<n_sample_2; ++i){ fputs(" 0",textfile); }
+    fputc('\n',textfile);
     has_kmer_1 = next_kmer_and_line(kmer_1, ksize, &line_1, &line_1_size, mat_1);
   }
 
-  while(has_kmer_2) {
-    fputs(kmer_2,outfile);
-    for(int i=0; i<n_sample_1; ++i){ fputs(" 0",outfile); }
-    fputc(' ',outfile);
-    fputs(first_column(line_2),outfile);
-    fputc('\n',outfile);
+  while(has_kmer_2 && !ferror(textfile)) {
+    fputs(kmer_2,textfile);
+    for(int i=0; i<n_sample_1; ++i){ fputs(" 0",textfile); }
+    fputc(' ',textfile);
+    fputs(first_column(line_2),textfile);
+    fputc('\n',textfile);
     has_kmer_2 = next_kmer_and_line(kmer_2, ksize, &line_2, &line_2_size, mat_2);
   }
 
@@ -213,7 +414,11 @@ int main(int argc, char **argv) {
   free(line_2);
   fclose(mat_1);
   fclose(mat_2);
+  int ret = km_arrow_out_close(&arrow_out);
+  if(ret) {
+    fprintf(stderr,"[error] cannot write output\n");
+  }
   if(outfile != stdout){ fclose(outfile); }
 
-  return 0;
+  return ret;
 }
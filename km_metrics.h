@@ -0,0 +1,228 @@
+#ifndef KM_METRICS_H
+#define KM_METRICS_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+// Optional run metrics written as JSON (--metrics FILE): wall time and, for each
+// instrumented stage, the number of calls, the time spent in it summed over the
+// threads and, when perf_event_open is allowed, the hardware counters of the
+// threads while in the stage (cycles, instructions, cache and branch misses).
+// Stages may nest in a thread: the time and counters of a stage exclude those
+// of the stages nested in it, and its waits for other threads (km_pool_wait),
+// so that each interval is counted once. When the counters cannot be opened (no PMU, perf_event_paranoid, seccomp),
+// only the times are reported and the JSON says why.
+
+#define KM_OPT_METRICS 256
+
+typedef enum { KM_STAGE_LOAD, KM_STAGE_READ, KM_STAGE_COUNT, KM_STAGE_PROCESS, KM_STAGE_WRITE, KM_N_STAGES } km_stage_t;
+static const char *km_stage_name[KM_N_STAGES] = { "load", "read", "count", "process", "write" };
+
+#define KM_N_COUNTERS 6
+static const char *km_counter_name[KM_N_COUNTERS] = {
+  "cycles", "instructions", "cache_references", "cache_misses", "branches", "branch_misses"
+};
+static const uint64_t km_counter_config[KM_N_COUNTERS] = {
+  PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS, PERF_COUNT_HW_CACHE_REFERENCES,
+  PERF_COUNT_HW_CACHE_MISSES, PERF_COUNT_HW_BRANCH_INSTRUCTIONS, PERF_COUNT_HW_BRANCH_MISSES
+};
+
+typedef struct {
+  atomic_uint_fast64_t calls, time_ns;
+  atomic_uint_fast64_t counters[KM_N_COUNTERS];
+} km_stage_stats_t;
+
+// counters of a thread, closed when the metrics are written
+typedef struct km_perf_group_s {
+  int fds[KM_N_COUNTERS];
+  struct km_perf_group_s *next;
+} km_perf_group_t;
+
+typedef struct {
+  const char *tool;
+  uint64_t start_ns;
+  atomic_bool perf_ok;     // false once a thread failed to open its counters
+  char perf_error[128];
+  km_stage_stats_t stages[KM_N_STAGES];
+  _Atomic(km_perf_group_t *) perf_groups;
+} km_metrics_t;
+
+// NULL when metrics are not requested, stages then cost nothing
+static km_metrics_t *km_metrics = NULL;
+
+// counters of the calling thread, opened on its first stage
+static __thread int km_perf_fd = -2;
+
+typedef struct {
+  uint64_t ns;
+  uint64_t counters[KM_N_COUNTERS];
+  int depth;               // stages open in the thread when it began
+} km_stage_mark_t;
+
+// time and counters spent in the nested stages and waits of each stage open
+// in the calling thread, by depth
+#define KM_STAGE_DEPTH 8
+typedef struct {
+  uint64_t ns;
+  uint64_t counters[KM_N_COUNTERS];
+} km_stage_inner_t;
+static __thread km_stage_inner_t km_stage_inner[KM_STAGE_DEPTH];
+static __thread int km_stage_depth = 0;
+
+static inline uint64_t km_metrics_now_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec*1000000000ULL + ts.tv_nsec;
+}
+
+static void km_metrics_init(const char *tool) {
+  km_metrics = (km_metrics_t *)calloc(1, sizeof(km_metrics_t));
+  km_metrics->tool = tool;
+  km_metrics->start_ns = km_metrics_now_ns();
+  atomic_init(&km_metrics->perf_ok, true);
+  atomic_init(&km_metrics->perf_groups, NULL);
+}
+
+// Opens the counters of the calling thread as one group led by the cycles.
+static int km_perf_open() {
+  km_perf_group_t *g = (km_perf_group_t *)malloc(sizeof(km_perf_group_t));
+  int leader = -1;
+  for(int i=0; i<KM_N_COUNTERS; ++i) {
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.config = km_counter_config[i];
+    attr.read_format = PERF_FORMAT_GROUP;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    int fd = syscall(SYS_perf_event_open, &attr, 0, -1, leader, 0);
+    if(fd < 0) {
+      if(atomic_exchange(&km_metrics->perf_ok, false)) {
+        snprintf(km_metrics->perf_error, sizeof(km_metrics->perf_error), "perf_event_open: %s", strerror(errno));
+      }
+      for(int j=0; j<i; ++j) { close(g->fds[j]); }
+      free(g);
+      return -1;
+    }
+    g->fds[i] = fd;
+    if(leader < 0) { leader = fd; }
+  }
+  g->next = atomic_load(&km_metrics->perf_groups);
+  while(!atomic_compare_exchange_weak(&km_metrics->perf_groups, &g->next, g)) {}
+  return leader;
+}
+
+// Closes the counters of all threads and frees the metrics, after which stages
+// are no longer measured.
+static void km_metrics_free() {
+  if(km_metrics == NULL) { return; }
+  km_perf_group_t *g = atomic_load(&km_metrics->perf_groups);
+  while(g) {
+    km_perf_group_t *next = g->next;
+    for(int i=0; i<KM_N_COUNTERS; ++i) { close(g->fds[i]); }
+    free(g);
+    g = next;
+  }
+  free(km_metrics);
+  km_metrics = NULL;
+}
+
+static inline void km_perf_read(uint64_t *counters) {
+  if(km_perf_fd == -2) { km_perf_fd = km_perf_open(); }
+  uint64_t buf[1+KM_N_COUNTERS];
+  if(km_perf_fd < 0 || read(km_perf_fd, buf, sizeof(buf)) != sizeof(buf)) {
+    memset(counters, 0, KM_N_COUNTERS*sizeof(uint64_t));
+    return;
+  }
+  memcpy(counters, buf+1, KM_N_COUNTERS*sizeof(uint64_t));
+}
+
+static inline void km_stage_begin(km_stage_mark_t *mark) {
+  if(km_metrics == NULL) { return; }
+  km_perf_read(mark->counters);
+  mark->ns = km_metrics_now_ns();
+  mark->depth = km_stage_depth++;
+  if(mark->depth < KM_STAGE_DEPTH) { memset(&km_stage_inner[mark->depth], 0, sizeof(km_stage_inner_t)); }
+}
+
+// Ends the innermost stage of the thread, begun with mark.
+static inline void km_stage_end(km_stage_t stage, km_stage_mark_t *mark) {
+  if(km_metrics == NULL) { return; }
+  uint64_t ns = km_metrics_now_ns(), counters[KM_N_COUNTERS];
+  km_perf_read(counters);
+  km_stage_inner_t none = { 0, {0} }, *inner = mark->depth < KM_STAGE_DEPTH ? &km_stage_inner[mark->depth] : &none;
+  km_stage_stats_t *st = &km_metrics->stages[stage];
+  atomic_fetch_add(&st->calls, 1);
+  atomic_fetch_add(&st->time_ns, ns - mark->ns - inner->ns);
+  for(int i=0; i<KM_N_COUNTERS; ++i) { atomic_fetch_add(&st->counters[i], counters[i] - mark->counters[i] - inner->counters[i]); }
+  km_stage_depth = mark->depth;
+  if(mark->depth > 0 && mark->depth <= KM_STAGE_DEPTH) {
+    km_stage_inner_t *outer = &km_stage_inner[mark->depth-1];
+    outer->ns += ns - mark->ns;
+    for(int i=0; i<KM_N_COUNTERS; ++i) { outer->counters[i] += counters[i] - mark->counters[i]; }
+  }
+}
+
+// Excludes a wait of ns for other threads from the stage open in the thread.
+static inline void km_stage_wait(uint64_t ns) {
+  if(km_metrics && km_stage_depth > 0 && km_stage_depth <= KM_STAGE_DEPTH) { km_stage_inner[km_stage_depth-1].ns += ns; }
+}
+
+// Writes the metrics to fname, then closes the counters and frees the metrics
+// (see km_metrics_free): it ends the measured run, once all threads are idle.
+// extra, if not NULL, is called to add members to the top-level object (each
+// starting with ",\n").
+static int km_metrics_write(const char *fname, void (*extra)(FILE *, void *), void *arg) {
+  if(km_metrics == NULL) { return 0; }
+  FILE *fp = fopen(fname, "w");
+  if(fp == NULL) {
+    km_metrics_free();
+    return 1;
+  }
+  bool perf_ok = atomic_load(&km_metrics->perf_ok);
+  fprintf(fp, "{\n  \"tool\": \"%s\",\n", km_metrics->tool);
+  fprintf(fp, "  \"wall_time_s\": %.6f,\n", (km_metrics_now_ns() - km_metrics->start_ns)/1e9);
+  fprintf(fp, "  \"perf_counters\": %s,\n", perf_ok ? "true" : "false");
+  if(!perf_ok) { fprintf(fp, "  \"perf_error\": \"%s\",\n", km_metrics->perf_error); }
+  fprintf(fp, "  \"stages\": {");
+  bool first = true;
+  for(int s=0; s<KM_N_STAGES; ++s) {
+    km_stage_stats_t *st = &km_metrics->stages[s];
+    uint64_t calls = atomic_load(&st->calls);
+    if(calls == 0) { continue; }
+    fprintf(fp, "%s\n    \"%s\": {\"calls\": %lu, \"time_s\": %.6f", first ? "" : ",", km_stage_name[s], (unsigned long)calls, atomic_load(&st->time_ns)/1e9);
+    first = false;
+    for(int i=0; i<KM_N_COUNTERS; ++i) {
+      if(perf_ok) {
+        fprintf(fp, ", \"%s\": %lu", km_counter_name[i], (unsigned long)atomic_load(&st->counters[i]));
+      } else {
+        fprintf(fp, ", \"%s\": null", km_counter_name[i]);
+      }
+    }
+    uint64_t cycles = atomic_load(&st->counters[0]), instructions = atomic_load(&st->counters[1]);
+    if(perf_ok && cycles) {
+      fprintf(fp, ", \"ipc\": %.3f", (double)instructions/cycles);
+    } else {
+      fprintf(fp, ", \"ipc\": null");
+    }
+    fprintf(fp, "}");
+  }
+  fprintf(fp, "\n  }");
+  if(extra) { extra(fp, arg); }
+  fprintf(fp, "\n}\n");
+  fclose(fp);
+  km_metrics_free();
+  return 0;
+}
+
+#endif
@@ -0,0 +1,171 @@
+#ifndef KM_NUMA_H
+#define KM_NUMA_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+// NUMA placement of the pool workers and of the buffers they consume, through
+// the raw sched_setaffinity and mbind system calls (no libnuma needed). Every
+// call degrades to a no-op when the kernel or the container does not allow it.
+//
+// Policies (-P):
+//   none        no placement
+//   local       workers pinned to the CPUs of a node, input chunks allocated on
+//               the node of the worker processing them, output staged there
+//   interleave  local, and large read-only structures interleaved over nodes
+
+#define KM_NUMA_MAX_NODES 1024
+#define KM_NUMA_MASK_WORDS (KM_NUMA_MAX_NODES/(8*sizeof(unsigned long)))
+#define KM_MPOL_PREFERRED 1
+#define KM_MPOL_INTERLEAVE 3
+#define KM_MPOL_MF_MOVE (1<<1)
+
+typedef enum { KM_NUMA_NONE, KM_NUMA_LOCAL, KM_NUMA_INTERLEAVE } km_numa_policy_t;
+
+typedef struct {
+  km_numa_policy_t policy;
+  int n_nodes;
+  int *node_id;              // system id of each node
+  unsigned long **cpus;      // CPU mask of each node
+  size_t cpu_words;
+} km_numa_t;
+
+// Parses the argument of -P, returns -1 on unknown policy.
+static inline int km_numa_policy(const char *arg) {
+  if(strcmp(arg,"none") == 0) { return KM_NUMA_NONE; }
+  if(strcmp(arg,"local") == 0) { return KM_NUMA_LOCAL; }
+  if(strcmp(arg,"interleave") == 0) { return KM_NUMA_INTERLEAVE; }
+  return -1;
+}
+
+// Parses a sysfs CPU list such as "0-3,8-11" into mask.
+static void km_numa_parse_cpus(const char *list, unsigned long *mask, size_t words) {
+  const char *p = list;
+  while(*p && *p != '\n') {
+    char *end;
+    long first = strtol(p, &end, 10), last = first;
+    if(end == p) { break; }
+    if(*end == '-') { p = end+1; last = strtol(p, &end, 10); }
+    for(long c=first; c<=last && c < (long)(8*sizeof(unsigned long)*words); ++c) {
+      mask[c / (8*sizeof(unsigned long))] |= 1UL << (c % (8*sizeof(unsigned long)));
+    }
+    p = (*end == ',') ? end+1 : end;
+  }
+}
+
+// Discovers the nodes with CPUs. Returns NULL for policy none.
+static km_numa_t *km_numa_init(km_numa_policy_t policy) {
+  if(policy == KM_NUMA_NONE) { return NULL; }
+  km_numa_t *numa = (km_numa_t *)calloc(1, sizeof(km_numa_t));
+  numa->policy = policy;
+  numa->cpu_words = (sysconf(_SC_NPROCESSORS_CONF) + 8*sizeof(unsigned long) - 1) / (8*sizeof(unsigned long));
+  if(numa->cpu_words == 0) { numa->cpu_words = 1; }
+  numa->node_id = (int *)malloc(KM_NUMA_MAX_NODES*sizeof(int));
+  numa->cpus = (unsigned long **)malloc(KM_NUMA_MAX_NODES*sizeof(unsigned long *));
+
+  char path[64], list[4096];
+  for(int id=0; id<KM_NUMA_MAX_NODES; ++id) {
+    snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", id);
+    FILE *fp = fopen(path, "r");
+    if(fp == NULL) { continue; }
+    bool has_cpus = fgets(list, sizeof(list), fp) != NULL && list[0] != '\n';
+    fclose(fp);
+    if(!has_cpus) { continue; }
+    int n = numa->n_nodes++;
+    numa->node_id[n] = id;
+    numa->cpus[n] = (unsigned long *)calloc(numa->cpu_words, sizeof(unsigned long));
+    km_numa_parse_cpus(list, numa->cpus[n], numa->cpu_words);
+  }
+  if(numa->n_nodes == 0) { // no sysfs: a single node with every CPU
+    numa->n_nodes = 1;
+    numa->node_id[0] = 0;
+    numa->cpus[0] = (unsigned long *)malloc(numa->cpu_words*sizeof(unsigned long));
+    memset(numa->cpus[0], 0xff, numa->cpu_words*sizeof(unsigned long));
+  }
+  return numa;
+}
+
+static void km_numa_free(km_numa_t *numa) {
+  if(numa == NULL) { return; }
+  for(int n=0; n<numa->n_nodes; ++n) { free(numa->cpus[n]); }
+  free(numa->cpus);
+  free(numa->node_id);
+  free(numa);
+}
+
+// Pins the calling thread to the CPUs of node n.
+static void km_numa_pin(km_numa_t *numa, int n) {
+  if(numa == NULL) { return; }
+  syscall(SYS_sched_setaffinity, 0, numa->cpu_words*sizeof(unsigned long), numa->cpus[n]);
+}
+
+// Returns the CPU mask of the calling thread, to give to km_numa_unpin (NULL
+// if it cannot be read).
+static unsigned long *km_numa_affinity(km_numa_t *numa) {
+  if(numa == NULL) { return NULL; }
+  unsigned long *cpus = (unsigned long *)calloc(numa->cpu_words, sizeof(unsigned long));
+  if(syscall(SYS_sched_getaffinity, 0, numa->cpu_words*sizeof(unsigned long), cpus) < 0) {
+    free(cpus);
+    return NULL;
+  }
+  return cpus;
+}
+
+// Restores the CPU mask of km_numa_affinity and frees it.
+static void km_numa_unpin(km_numa_t *numa, unsigned long *cpus) {
+  if(numa == NULL || cpus == NULL) { return; }
+  syscall(SYS_sched_setaffinity, 0, numa->cpu_words*sizeof(unsigned long), cpus);
+  free(cpus);
+}
+
+static int km_numa_mbind(void *addr, size_t len, int mode, const unsigned long *nodes, unsigned flags) {
+  return syscall(SYS_mbind, addr, len, mode, nodes, KM_NUMA_MAX_NODES+1, flags);
+}
+
+// Allocates size bytes whose pages are placed on node n when first touched,
+// whichever thread touches them.
+static void *km_numa_alloc(km_numa_t *numa, size_t size, int n) {
+  void *p = mmap(NULL, size, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+  if(p == MAP_FAILED) { return NULL; }
+  unsigned long nodes[KM_NUMA_MASK_WORDS] = {0};
+  int id = numa->node_id[n];
+  nodes[id / (8*sizeof(unsigned long))] |= 1UL << (id % (8*sizeof(unsigned long)));
+  km_numa_mbind(p, size, KM_MPOL_PREFERRED, nodes, 0);
+  return p;
+}
+
+static void km_numa_release(void *p, size_t size) {
+  if(p) { munmap(p, size); }
+}
+
+// Resizes a buffer of km_numa_alloc, or of malloc when numa is NULL.
+static void *km_numa_realloc(km_numa_t *numa, void *p, size_t old_size, size_t size, int n) {
+  if(numa == NULL) { return realloc(p, size); }
+  void *q = km_numa_alloc(numa, size, n);
+  if(q == NULL) { return NULL; } // p is left as is, as with realloc
+  if(p) { memcpy(q, p, old_size < size ? old_size : size); }
+  km_numa_release(p, old_size);
+  return q;
+}
+
+// Spreads the pages of a large read-only structure over all nodes (interleave
+// policy only), moving the pages already touched.
+static void km_numa_interleave(km_numa_t *numa, void *p, size_t size) {
+  if(numa == NULL || numa->policy != KM_NUMA_INTERLEAVE || numa->n_nodes < 2) { return; }
+  size_t page = sysconf(_SC_PAGESIZE);
+  size_t beg = ((size_t)p + page-1) / page * page, end = ((size_t)p + size) / page * page;
+  if(end <= beg) { return; }
+  unsigned long nodes[KM_NUMA_MASK_WORDS] = {0};
+  for(int n=0; n<numa->n_nodes; ++n) {
+    int id = numa->node_id[n];
+    nodes[id / (8*sizeof(unsigned long))] |= 1UL << (id % (8*sizeof(unsigned long)));
+  }
+  km_numa_mbind((void *)beg, end-beg, KM_MPOL_INTERLEAVE, nodes, KM_MPOL_MF_MOVE);
+}
+
+#endif
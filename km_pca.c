@@ -0,0 +1,484 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <stdbool.h>
+#include <string.h>
+#include <math.h>
+
+#include "km_kernels.h"
+#include "km_chunk.h"
+
+// Principal components of the samples by randomized subspace iteration
+// (Halko, Martinsson and Tropp). With A the k-mers x samples matrix (rows
+// transformed and centered), each pass over the matrix computes Z = A'A Q for
+// the current n x r basis Q: a tile X of TILE_ROWS rows gives T = X Q, then
+// Z += X' T. Z is orthonormalized into the basis of the next pass, and after
+// the last pass the r x r matrix Q'Z is diagonalized (Rayleigh-Ritz). Memory
+// is a few n x r matrices, whatever the number of rows. The partial Z of each
+// chunk is summed in input order, so that the result does not depend on the
+// number of threads.
+
+#define TILE_ROWS 64
+#define R_PAD 4  // the basis is padded to a multiple of the vector width
+
+typedef enum { TR_LOG, TR_PRESENCE, TR_RAW, N_TR } transform_t;
+static const char *transform_names[N_TR] = { "log", "presence", "raw" };
+
+typedef struct {
+  transform_t transform;
+  uint32_t min_abund;
+  size_t n;              // samples
+  size_t r, stride;      // basis size, padded
+  double *q;             // n x stride basis
+  double *z;             // n x stride, A'A Q
+  double total;          // sum of the squares of the centered rows
+  uint64_t n_rows, n_constant;
+} pca_job_t;
+
+typedef struct {
+  double *z;
+  double total;
+  uint64_t n_constant;
+} pca_part_t;
+
+// --- dense linear algebra (small matrices, row-major)
+
+static inline uint64_t pca_rand(uint64_t *s) {
+  uint64_t z = (*s += 0x9E3779B97F4A7C15ULL); // splitmix64
+  z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+  z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+  return z ^ (z >> 31);
+}
+
+// standard normal, Box-Muller
+double pca_gauss(uint64_t *s) {
+  double u = ((pca_rand(s) >> 11) + 0.5) * 0x1.0p-53, v = (pca_rand(s) >> 11) * 0x1.0p-53;
+  return sqrt(-2*log(u)) * cos(2*M_PI*v);
+}
+
+// Orthonormalizes the r columns of the n x stride matrix a (modified
+// Gram-Schmidt, twice for stability). Columns that vanish are replaced by
+// random ones. Returns their number.
+size_t orthonormalize(double *a, size_t n, size_t r, size_t stride, uint64_t *seed) {
+  size_t n_random = 0;
+  for(size_t j=0; j<r; ++j) {
+    double norm0 = 0;
+    for(size_t s=0; s<n; ++s) { norm0 += a[s*stride+j]*a[s*stride+j]; }
+    for(int retry=0; ; ++retry) {
+      for(int twice=0; twice<2; ++twice) {
+        for(size_t i=0; i<j; ++i) {
+          double d = 0;
+          for(size_t s=0; s<n; ++s) { d += a[s*stride+i]*a[s*stride+j]; }
+          for(size_t s=0; s<n; ++s) { a[s*stride+j] -= d*a[s*stride+i]; }
+        }
+      }
+      double norm = 0;
+      for(size_t s=0; s<n; ++s) { norm += a[s*stride+j]*a[s*stride+j]; }
+      if(norm > 1e-20*norm0 && norm > 0) {
+        norm = 1/sqrt(norm);
+        for(size_t s=0; s<n; ++s) { a[s*stride+j] *= norm; }
+        break;
+      }
+      if(retry == 0) { ++n_random; }
+      norm0 = 0;
+      for(size_t s=0; s<n; ++s) { a[s*stride+j] = pca_gauss(seed); norm0 += a[s*stride+j]*a[s*stride+j]; }
+    }
+  }
+  return n_random;
+}
+
+// Eigen-decomposition of the symmetric r x r matrix m (cyclic Jacobi): on
+// return the diagonal of m holds the eigenvalues and the columns of w the
+// eigenvectors.
+void jacobi_eigen(double *m, double *w, size_t r) {
+  for(size_t i=0; i<r; ++i) {
+    for(size_t j=0; j<r; ++j) { w[i*r+j] = i == j; }
+  }
+  for(int sweep=0; sweep<100; ++sweep) {
+    double off = 0, diag = 0;
+    for(size_t i=0; i<r; ++i) {
+      diag += m[i*r+i]*m[i*r+i];
+      for(size_t j=i+1; j<r; ++j) { off += m[i*r+j]*m[i*r+j]; }
+    }
+    if(off <= 1e-30*diag) { break; }
+    for(size_t p=0; p<r; ++p) {
+      for(size_t q=p+1; q<r; ++q) {
+        if(m[p*r+q] == 0) { continue; }
+        double theta = (m[q*r+q] - m[p*r+p]) / (2*m[p*r+q]);
+        double t = (theta >= 0 ? 1 : -1) / (fabs(theta) + sqrt(theta*theta + 1));
+        double c = 1/sqrt(t*t + 1), s = t*c;
+        for(size_t k=0; k<r; ++k) {
+          double mkp = m[k*r+p], mkq = m[k*r+q];
+          m[k*r+p] = c*mkp - s*mkq;
+          m[k*r+q] = s*mkp + c*mkq;
+        }
+        for(size_t k=0; k<r; ++k) {
+          double mpk = m[p*r+k], mqk = m[q*r+k];
+          m[p*r+k] = c*mpk - s*mqk;
+          m[q*r+k] = s*mpk + c*mqk;
+        }
+        for(size_t k=0; k<r; ++k) {
+          double wkp = w[k*r+p], wkq = w[k*r+q];
+          w[k*r+p] = c*wkp - s*wkq;
+          w[k*r+q] = s*wkp + c*wkq;
+        }
+      }
+    }
+  }
+}
+
+// --- pass over the matrix
+
+// z (n x stride) += x' (x q), x being rows x n and q n x stride
+void tile_update(const double *restrict x, size_t rows, size_t n, const double *restrict q, size_t stride, double *restrict t, double *restrict z) {
+  memset(t, 0, rows*stride*sizeof(double));
+  for(size_t i=0; i<rows; ++i) {
+    const double *xi = x + i*n;
+    double *ti = t + i*stride;
+    for(size_t s=0; s<n; ++s) {
+      const double xs = xi[s];
+      const double *qs = q + s*stride;
+      for(size_t j=0; j<stride; ++j) { ti[j] += xs * qs[j]; }
+    }
+  }
+  for(size_t s=0; s<n; ++s) {
+    double *zs = z + s*stride;
+    for(size_t i=0; i<rows; ++i) {
+      const double xs = x[i*n+s];
+      const double *ti = t + i*stride;
+      for(size_t j=0; j<stride; ++j) { zs[j] += xs * ti[j]; }
+    }
+  }
+}
+
+void pca_chunk(km_chunk_t *chunk, void *arg) {
+  const pca_job_t *job = (const pca_job_t *)arg;
+  pca_part_t *part = (pca_part_t *)chunk->state;
+  size_t n = job->n;
+  memset(part->z, 0, n*job->stride*sizeof(double));
+  part->total = 0;
+  part->n_constant = 0;
+  uint32_t *counts = (uint32_t *)malloc(n*sizeof(uint32_t));
+  double *x = (double *)malloc(TILE_ROWS*n*sizeof(double));
+  double *t = (double *)malloc(TILE_ROWS*job->stride*sizeof(double));
+  size_t rows = 0, pos = 0, len;
+  char *line;
+  while(km_chunk_next_line(chunk, &pos, &line, &len)) {
+    const char *end = line + len;
+    const char *p = km_skip_kmer(line, end);
+    if(p == line || km_isblank(p[-1])) { continue; } // skip empty lines
+    ++chunk->n_records;
+    km_parse_counts(p, end, counts, n);
+    double *xi = x + rows*n, sum = 0, ss = 0;
+    for(size_t s=0; s<n; ++s) {
+      switch(job->transform) {
+        case TR_LOG: xi[s] = log1p((double)counts[s]); break;
+        case TR_PRESENCE: xi[s] = counts[s] >= job->min_abund; break;
+        default: xi[s] = counts[s]; break;
+      }
+      sum += xi[s];
+    }
+    double mean = sum / n;
+    for(size_t s=0; s<n; ++s) { xi[s] -= mean; ss += xi[s]*xi[s]; }
+    if(ss <= 1e-12*(sum*sum/n + 1)) { ++part->n_constant; continue; }
+    part->total += ss;
+    if(++rows == TILE_ROWS) {
+      tile_update(x, rows, n, job->q, job->stride, t, part->z);
+      rows = 0;
+    }
+  }
+  if(rows) { tile_update(x, rows, n, job->q, job->stride, t, part->z); }
+  free(counts);
+  free(x);
+  free(t);
+}
+
+void collect_chunk(km_chunk_t *chunk, void *arg) {
+  pca_job_t *job = (pca_job_t *)arg;
+  const pca_part_t *part = (const pca_part_t *)chunk->state;
+  for(size_t i=0; i<job->n*job->stride; ++i) { job->z[i] += part->z[i]; }
+  job->total += part->total;
+  job->n_rows += chunk->n_records;
+  job->n_constant += part->n_constant;
+}
+
+// Random orthonormal basis of job->r vectors, once the number of samples is
+// known.
+void init_basis(pca_job_t *job, size_t n_comp, size_t oversampling, uint64_t *seed) {
+  size_t n = job->n;
+  job->r = n_comp + oversampling < n ? n_comp + oversampling : n;
+  job->stride = (job->r + R_PAD - 1) / R_PAD * R_PAD;
+  job->q = (double *)calloc(n*job->stride, sizeof(double));
+  job->z = (double *)calloc(n*job->stride, sizeof(double));
+  for(size_t s=0; s<n; ++s) {
+    for(size_t j=0; j<job->r; ++j) { job->q[s*job->stride+j] = pca_gauss(seed); }
+  }
+  orthonormalize(job->q, n, job->r, job->stride, seed);
+}
+
+// Computes job->z = A'A job->q in one pass over the matrix at path; on the
+// first pass, reads the number of samples and draws the basis. Returns 0, 1
+// if the matrix cannot be opened, 2 if it has no sample.
+int run_pass(pca_job_t *job, const char *path, size_t n_comp, size_t oversampling, uint64_t *seed, km_pool_t *pool, bool verbose) {
+  FILE *matfile = km_arrow_fopen(path, 0, false);
+  if(matfile == NULL) { return 1; }
+  km_chunk_engine_t eng = { .pool = pool, .format = pca_chunk, .collect = collect_chunk, .arg = job };
+  km_chunk_engine_init(&eng, fileno(matfile), NULL);
+  if(job->q == NULL) {
+    // the number of samples is given by the first row
+    size_t first_len;
+    const char *first = km_chunk_peek_line(&eng, &first_len);
+    km_row_stats_t first_st = {0,0,0};
+    km_row_stats(km_skip_kmer(first, first + first_len), first + first_len, 1, &first_st);
+    job->n = first_st.n_values;
+    if(job->n) { init_basis(job, n_comp, oversampling, seed); }
+  }
+  int ret = job->n ? 0 : 2;
+  if(ret == 0) {
+    memset(job->z, 0, job->n*job->stride*sizeof(double));
+    job->total = 0;
+    job->n_rows = job->n_constant = 0;
+    pca_part_t *parts = (pca_part_t *)calloc(eng.n_chunks, sizeof(pca_part_t));
+    for(size_t i=0; i<eng.n_chunks; ++i) {
+      parts[i].z = (double *)malloc(job->n*job->stride*sizeof(double));
+      eng.chunks[i].state = &parts[i];
+    }
+    km_chunk_run(&eng, NULL, verbose);
+    for(size_t i=0; i<eng.n_chunks; ++i) { free(parts[i].z); }
+    free(parts);
+  } else {
+    // drain the input (an Arrow conversion writes all of it)
+    char buf[1<<16];
+    while(read(fileno(matfile), buf, sizeof(buf)) > 0) {}
+  }
+  km_chunk_engine_free(&eng);
+  if(matfile != stdin){ fclose(matfile); }
+  return ret;
+}
+
+
+int main(int argc, char **argv) {
+
+  int n_threads = 1;
+  int numa_policy = KM_NUMA_NONE;
+  long n_comp = 10, n_passes = 4, oversampling = 10, min_abund = 1;
+  uint64_t seed = 42;
+  int transform = TR_LOG;
+  char *out_fname = NULL, *metrics_fname = NULL, *trace_fname = NULL;
+  bool verbose_opt = false, help_opt = false;
+
+  static struct option long_opts[] = {
+    {"metrics", required_argument, NULL, KM_OPT_METRICS},
+    {"trace", required_argument, NULL, KM_OPT_TRACE},
+    {NULL, 0, NULL, 0}
+  };
+
+  int c;
+  while ((c = getopt_long(argc, argv, "a:k:n:o:p:P:s:t:T:vh", long_opts, NULL)) != -1) {
+    switch (c) {
+      case 'a':
+        min_abund = strtol(optarg, NULL, 10);
+        break;
+      case 'k':
+        n_comp = strtol(optarg, NULL, 10);
+        break;
+      case 'n':
+        oversampling = strtol(optarg, NULL, 10);
+        break;
+      case 'o':
+        out_fname = optarg;
+        break;
+      case 'p':
+        n_passes = strtol(optarg, NULL, 10);
+        break;
+      case 'P':
+        numa_policy = km_numa_policy(optarg);
+        if(numa_policy < 0) {
+          fprintf(stderr, "Unknown NUMA placement \"%s\"\n", optarg);
+          return 1;
+        }
+        break;
+      case 's':
+        seed = strtoull(optarg, NULL, 10);
+        break;
+      case 't':
+        n_threads = km_pool_threads(optarg);
+        break;
+      case 'T':
+        for(transform = 0; transform < N_TR && strcmp(optarg, transform_names[transform]); ++transform) {}
+        if(transform == N_TR) {
+          fprintf(stderr, "Unknown transform \"%s\"\n", optarg);
+          return 1;
+        }
+        break;
+      case 'v':
+        verbose_opt = true;
+        break;
+      case 'h':
+        help_opt = true;
+        break;
+      case KM_OPT_METRICS:
+        metrics_fname = optarg;
+        break;
+      case KM_OPT_TRACE:
+        trace_fname = optarg;
+        break;
+      case '?':
+        return 1;
+      default:
+        abort();
+    }
+  }
+
+  if(min_abund < 0 || min_abund > UINT32_MAX) {
+    fprintf(stderr, "Invalid min abundance: %ld\n", min_abund);
+    return 1;
+  }
+  if(n_comp < 1 || n_comp > 1000 || oversampling < 0 || oversampling > 1000) {
+    fprintf(stderr, "-k must be in the [1,1000] interval, -n in the [0,1000] interval\n");
+    return 1;
+  }
+  if(n_passes < 1 || n_passes > 100) {
+    fprintf(stderr, "-p must be in the [1,100] interval\n");
+    return 1;
+  }
+
+  if(argc-optind != 1 || help_opt) {
+    fprintf(stdout, "Usage: km_pca [options] <matrix>\n\n");
+    fprintf(stdout, "Principal components of the samples of a matrix, by randomized subspace\n");
+    fprintf(stdout, "iteration: each pass over the matrix multiplies a basis of k+n vectors by\n");
+    fprintf(stdout, "A'A, A being the k-mers x samples matrix with transformed and centered rows,\n");
+    fprintf(stdout, "in memory proportional to the number of samples. Output lines are a 1-based\n");
+    fprintf(stdout, "sample and its coordinates on the components (tab-separated); the variance\n");
+    fprintf(stdout, "of each component is reported on stderr. The matrix may be text or Arrow IPC\n");
+    fprintf(stdout, "(detected), in a file as it is read -p times.\n\n");
+    fprintf(stdout, "Options:\n");
+    fprintf(stdout, "  -k INT   number of components [10]\n");
+    fprintf(stdout, "  -T STR   transform of the counts: log (log(1+count)), presence (count >= -a), raw [log]\n");
+    fprintf(stdout, "  -a INT   min abundance to define a k-mer as present in a sample [1]\n");
+    fprintf(stdout, "  -p INT   number of passes over the matrix [4]\n");
+    fprintf(stdout, "  -n INT   oversampling, extra vectors of the basis [10]\n");
+    fprintf(stdout, "  -s INT   seed of the random basis [42]\n");
+    fprintf(stdout, "  -o FILE  write output to FILE [stdout]\n");
+    fprintf(stdout, "  -P STR   NUMA placement of threads and buffers: none, local, interleave [none]\n");
+    fprintf(stdout, "  -t INT   number of threads, 0 for all CPUs [1]\n");
+    fprintf(stdout, "  -v       verbose output\n");
+    fprintf(stdout, "      --metrics FILE  write run metrics (stage times, CPU counters) as JSON to FILE\n");
+    fprintf(stdout, "      --trace FILE    write a timeline of the threads in Chrome trace format to FILE\n");
+    fprintf(stdout, "  -h       print this help message\n");
+    return 0;
+  }
+
+  const char *mat_fname = argv[optind];
+  if(strcmp(mat_fname, "-") == 0) {
+    fprintf(stderr,"The matrix is read several times, it cannot be stdin\n");
+    return 1;
+  }
+
+  FILE *outfile = out_fname ? fopen(out_fname,"w") : stdout;
+  if(outfile != stdout && outfile == NULL) {
+    fprintf(stderr,"Cannot open output file \"%s\"\n",out_fname);
+    return 1;
+  }
+
+  if(metrics_fname) { km_metrics_init("km_pca"); }
+  if(trace_fname) { km_trace_init(); }
+
+  km_numa_t *numa = n_threads > 1 ? km_numa_init(numa_policy) : NULL;
+  km_pool_t *pool = n_threads > 1 ? km_pool_create(n_threads, numa) : NULL;
+  pca_job_t job = { .transform = (transform_t)transform, .min_abund = (uint32_t)min_abund };
+
+  int ret = 0;
+  for(long pass=0; pass<n_passes; ++pass) {
+    ret = run_pass(&job, mat_fname, n_comp, oversampling, &seed, pool, verbose_opt);
+    if(ret) {
+      if(ret == 1) { fprintf(stderr,"Cannot open file \"%s\"\n",mat_fname); }
+      else { fprintf(stderr,"No sample in \"%s\"\n",mat_fname); }
+      break;
+    }
+    if(verbose_opt) { fprintf(stderr, "[info] pass %ld done\n", pass+1); }
+    if(pass + 1 < n_passes) {
+      memcpy(job.q, job.z, job.n*job.stride*sizeof(double));
+      orthonormalize(job.q, job.n, job.r, job.stride, &seed);
+    }
+  }
+
+  size_t n = job.n, k = n_comp < (long)n ? (size_t)n_comp : n;
+  if(ret == 0) {
+    // Rayleigh-Ritz: eigenvectors of Q'A'AQ, back to the samples
+    size_t r = job.r;
+    double *m = (double *)malloc(r*r*sizeof(double));
+    double *w = (double *)malloc(r*r*sizeof(double));
+    for(size_t i=0; i<r; ++i) {
+      for(size_t j=0; j<r; ++j) {
+        double d = 0;
+        for(size_t s=0; s<n; ++s) { d += job.q[s*job.stride+i]*job.z[s*job.stride+j]; }
+        m[i*r+j] = d;
+      }
+    }
+    for(size_t i=0; i<r; ++i) {
+      for(size_t j=0; j<i; ++j) { m[i*r+j] = m[j*r+i] = (m[i*r+j] + m[j*r+i]) / 2; }
+    }
+    jacobi_eigen(m, w, r);
+    size_t *order = (size_t *)malloc(r*sizeof(size_t));
+    for(size_t i=0; i<r; ++i) {
+      size_t j = i;
+      while(j > 0 && m[order[j-1]*r+order[j-1]] < m[i*r+i]) { order[j] = order[j-1]; --j; }
+      order[j] = i;
+    }
+
+    // components: V = Q W, signed so that their largest coordinate is positive
+    double *v = (double *)malloc(n*k*sizeof(double));
+    for(size_t c=0; c<k; ++c) {
+      size_t e = order[c];
+      double big = 0;
+      for(size_t s=0; s<n; ++s) {
+        double d = 0;
+        for(size_t i=0; i<r; ++i) { d += job.q[s*job.stride+i]*w[i*r+e]; }
+        v[s*k+c] = d;
+        if(fabs(d) > fabs(big)) { big = d; }
+      }
+      if(big < 0) {
+        for(size_t s=0; s<n; ++s) { v[s*k+c] = -v[s*k+c]; }
+      }
+      double ev = m[e*r+e] > 0 ? m[e*r+e] : 0;
+      fprintf(stderr, "[info] PC%lu\t%.6g\teigenvalue\t%.2f%%\tof the variance\n", c+1, ev, job.total > 0 ? 100*ev/job.total : 0);
+    }
+    for(size_t s=0; s<n && ret == 0; ++s) {
+      fprintf(outfile, "%lu", s+1);
+      for(size_t c=0; c<k; ++c) { fprintf(outfile, "\t%.6f", v[s*k+c]); }
+      if(fprintf(outfile, "\n") < 0) { ret = 1; }
+    }
+    if(fflush(outfile) != 0) { ret = 1; }
+    if(ret) {
+      fprintf(stderr,"Cannot write output\n");
+    }
+    free(m);
+    free(w);
+    free(order);
+    free(v);
+
+    fprintf(stderr, "[info] %lu\tsamples\n", n);
+    fprintf(stderr, "[info] %lu\tk-mers\n", job.n_rows);
+    fprintf(stderr, "[info] %lu\tconstant k-mers\n", job.n_constant);
+  }
+
+  if(km_metrics_write(metrics_fname, pool ? km_pool_json : NULL, pool)) {
+    fprintf(stderr,"Cannot write metrics file \"%s\"\n",metrics_fname);
+  }
+  if(km_trace_write(trace_fname, "km_pca")) {
+    fprintf(stderr,"Cannot write trace file \"%s\"\n",trace_fname);
+  }
+  if(pool) {
+    if(verbose_opt || metrics_fname) { km_pool_report(pool, stderr); }
+    km_pool_destroy(pool);
+  }
+  km_numa_free(numa);
+  free(job.q);
+  free(job.z);
+  if(outfile != stdout){ fclose(outfile); }
+
+  return ret;
+}
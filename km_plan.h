@@ -0,0 +1,356 @@
+#ifndef KM_PLAN_H
+#define KM_PLAN_H
+
+#include <stdio.h>
+#include <math.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "km_kernels.h"
+#include "km_index.h"
+#include "km_stree.h"
+#include "km_ef.h"
+
+// Strategy planner of the tools matching the k-mers of a matrix against the
+// k-mers of another one (km_select, km_diff).
+//
+// One side is "built" (the selection, the k-mers removed) and the other one is
+// "probed" (the matrix filtered, output in its order). The candidate strategies:
+//   merge  two-cursor merge of the sorted inputs
+//   hash   built side loaded in a hash set, probed side streamed (any order)
+//   bloom  same, with a cache-resident Bloom filter in front of the hash set
+//   tree   built side sorted in a static search tree, probed by batches of rows
+//   index  built side looked up in the .kmi index of the probed side (km_search)
+// The planner samples a few blocks of each input (size, estimated rows,
+// sortedness, Arrow format), checks for an index, then costs the feasible
+// strategies and picks the cheapest. --plan forces one.
+
+#define KM_OPT_PLAN 259
+
+typedef enum { KM_PLAN_AUTO = -1, KM_PLAN_MERGE, KM_PLAN_HASH, KM_PLAN_BLOOM, KM_PLAN_INDEX, KM_PLAN_TREE, KM_PLAN_N } km_plan_strategy_t;
+
+static const char *km_plan_names[KM_PLAN_N] = { "merge", "hash", "bloom", "index", "tree" };
+
+// Parses the argument of --plan, returns -2 on unknown strategy.
+static inline int km_plan_strategy(const char *arg) {
+  if(strcmp(arg, "auto") == 0) { return KM_PLAN_AUTO; }
+  for(int i=0; i<KM_PLAN_N; ++i) { if(strcmp(arg, km_plan_names[i]) == 0) { return i; } }
+  return -2;
+}
+
+// --- statistics of an input
+
+#define KM_PLAN_SAMPLES 16
+#define KM_PLAN_SAMPLE_BYTES (64UL<<10)
+
+typedef struct {
+  const char *path;
+  bool regular;     // regular file, sampled
+  bool arrow;       // Arrow IPC, converted to text while read
+  bool set;         // k-mer set (.kef), sorted
+  bool sorted;      // sampled rows in increasing order (assumed if not sampled)
+  bool has_index;   // up-to-date .kmi index
+  uint64_t bytes;
+  double rows;      // estimated from the mean length of the sampled lines
+} km_plan_input_t;
+
+// Samples up to KM_PLAN_SAMPLES blocks spread over the file (the whole file
+// if small) without moving its offset.
+static void km_plan_stats(km_plan_input_t *in, const char *path, int ksize, bool kmtricks) {
+  memset(in, 0, sizeof(*in));
+  in->path = path;
+  in->sorted = true;
+  struct stat st;
+  int fd = strcmp(path, "-") ? open(path, O_RDONLY) : -1;
+  if(fd < 0 || fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+    if(fd >= 0) { close(fd); }
+    return;
+  }
+  in->regular = true;
+  in->bytes = st.st_size;
+  char magic[8] = {0};
+  if(pread(fd, magic, 8, 0) == 8) {
+    uint32_t cont = 0xFFFFFFFFU;
+    in->arrow = memcmp(magic, "ARROW1", 6) == 0 || memcmp(magic, &cont, 4) == 0;
+  }
+  km_ef_header_t set;
+  if(memcmp(magic, km_ef_magic, 8) == 0 && pread(fd, &set, sizeof(set), 0) == (ssize_t)sizeof(set)) {
+    in->set = true;
+    in->rows = set.n;
+    close(fd);
+    return;
+  }
+  if(in->arrow) {
+    in->rows = in->bytes / (8.0 + 4.0); // at least a key and a count per row
+    close(fd);
+    return;
+  }
+  in->has_index = ksize <= 32 && km_index_fresh(path, ksize, kmtricks);
+
+  const uint8_t *code = kmtricks ? nt2bits_kt : nt2bits;
+  int n_samples = in->bytes <= KM_PLAN_SAMPLES*KM_PLAN_SAMPLE_BYTES ? 1 : KM_PLAN_SAMPLES;
+  size_t sample_bytes = n_samples == 1 ? in->bytes : KM_PLAN_SAMPLE_BYTES;
+  char *buf = (char *)malloc(sample_bytes + 1);
+  uint64_t n_lines = 0, line_bytes = 0;
+  uint64_t prev = 0;
+  bool has_prev = false;
+  for(int s=0; s<n_samples; ++s) {
+    off_t off = n_samples == 1 ? 0 : (off_t)((in->bytes - sample_bytes) * s / (n_samples - 1));
+    ssize_t len = pread(fd, buf, sample_bytes, off);
+    if(len <= 0) { break; }
+    const char *p = buf, *end = buf + len;
+    if(off > 0) { // skip the partial first line
+      const char *nl = (const char *)memchr(p, '\n', end - p);
+      p = nl ? nl+1 : end;
+    }
+    while(p < end) {
+      const char *nl = (const char *)memchr(p, '\n', end - p);
+      if(nl == NULL && off + len < (off_t)in->bytes) { break; } // partial last line
+      const char *e = nl ? nl : end;
+      if(e > p) {
+        ++n_lines;
+        line_bytes += e - p + 1;
+        // sortedness, with packed keys when they fit (else the 32 first nucleotides)
+        uint64_t key;
+        int k = ksize <= 32 ? ksize : 32;
+        if(e - p >= k && km_pack(p, k, code, &key)) {
+          if(has_prev && key < prev) { in->sorted = false; }
+          prev = key;
+          has_prev = true;
+        }
+      }
+      p = e + 1;
+    }
+  }
+  free(buf);
+  close(fd);
+  in->rows = n_lines ? in->bytes / ((double)line_bytes / n_lines) : 0;
+}
+
+// --- cost model, in estimated nanoseconds
+
+// per byte read and split in lines, per row of the merge (parse and compare),
+// per key inserted in or probed against a hash set (in cache or not), per
+// Bloom filter test, per window read by an index lookup, per key sorted (times
+// log2 of the keys), per batched search tree lookup (in cache or not) and per
+// key of a k-mer set decoded or skipped by the merge
+#define KM_COST_BYTE 0.25
+#define KM_COST_MERGE_ROW 25.0
+#define KM_COST_INSERT 20.0
+#define KM_COST_PROBE_CACHED 12.0
+#define KM_COST_PROBE_MEMORY 80.0
+#define KM_COST_BLOOM 6.0
+#define KM_COST_WINDOW 25000.0
+#define KM_COST_SORT 3.0
+#define KM_COST_TREE_CACHED 15.0
+#define KM_COST_TREE_MEMORY 40.0
+#define KM_COST_SET_KEY 2.0
+// hash sets and search trees up to this size are assumed to stay in cache
+#define KM_PLAN_CACHE_BYTES (8UL<<20)
+
+typedef struct {
+  int strategy;
+  bool forced;
+  bool feasible[KM_PLAN_N];
+  double cost[KM_PLAN_N];
+  char why[256];
+} km_plan_t;
+
+// Chooses the strategy for the inputs (build side, probe side). allow_index
+// tells if the operation can use the index (only rows present in both sides
+// are output); order_needed if the output requires both inputs sorted (e.g. a
+// three-way split). forced is KM_PLAN_AUTO or a strategy, taken even if not
+// deemed feasible, except when it cannot produce the output (k > 32 for the
+// packed strategies, order needed, index not usable): merge is used instead.
+static void km_plan_choose(km_plan_t *plan, const km_plan_input_t *build, const km_plan_input_t *probe, int ksize, bool allow_index, bool order_needed, int forced) {
+  memset(plan, 0, sizeof(*plan));
+  bool packed = ksize <= 32;
+  double rows_build = build->rows, rows_probe = probe->rows;
+  double read = KM_COST_BYTE * (build->bytes + probe->bytes);
+  double set_bytes = 2*8*rows_build, tree_bytes = 8*rows_build*(KM_STREE_B+1)/KM_STREE_B;
+  double fpr = 0.05; // of the blocked Bloom filter, with 8 bits per key
+  double hit = rows_probe > 0 ? (rows_build < rows_probe ? rows_build / rows_probe : 1.0) : 1.0;
+
+  plan->feasible[KM_PLAN_MERGE] = build->sorted && probe->sorted;
+  plan->cost[KM_PLAN_MERGE] = read + (build->set ? KM_COST_SET_KEY : KM_COST_MERGE_ROW) * rows_build + KM_COST_MERGE_ROW * rows_probe;
+
+  plan->feasible[KM_PLAN_HASH] = packed && !order_needed && build->regular && probe->regular;
+  bool cached = set_bytes <= KM_PLAN_CACHE_BYTES;
+  plan->cost[KM_PLAN_HASH] = read + KM_COST_INSERT * rows_build + (cached ? KM_COST_PROBE_CACHED : KM_COST_PROBE_MEMORY) * rows_probe;
+
+  plan->feasible[KM_PLAN_BLOOM] = plan->feasible[KM_PLAN_HASH] && !cached;
+  plan->cost[KM_PLAN_BLOOM] = read + (KM_COST_INSERT + KM_COST_BLOOM) * rows_build
+    + (KM_COST_BLOOM + (hit + fpr) * KM_COST_PROBE_MEMORY) * rows_probe;
+
+  plan->feasible[KM_PLAN_INDEX] = packed && allow_index && !order_needed && probe->has_index && build->regular;
+  // the sorted lookups go forward (km_index_find): a window overlapping the
+  // previous one extends the last read, so only the keys far from the previous
+  // one cost a window read; the windows touched are read once, and a lookup
+  // scans the rows from the previous one or from the start of its window
+  double windows = probe->bytes / (double)KM_INDEX_WINDOW;
+  double per_window = windows > 0 ? rows_build / windows : 0;
+  double touched = 1.0 - exp(-per_window);
+  double scan = windows > 0 ? 0.5 * rows_probe / windows : 0;
+  if(rows_build > 0 && rows_probe / rows_build < scan) { scan = rows_probe / rows_build; }
+  plan->cost[KM_PLAN_INDEX] = KM_COST_BYTE * (build->bytes + touched * probe->bytes) + KM_COST_INSERT * rows_build
+    + KM_COST_WINDOW * (rows_build * exp(-per_window) + 1) + KM_COST_MERGE_ROW * scan * rows_build;
+
+  // the sort is skipped (keys only deduplicated) when the built side is sorted
+  plan->feasible[KM_PLAN_TREE] = plan->feasible[KM_PLAN_HASH];
+  double sort = build->sorted ? 1.0 : KM_COST_SORT * (rows_build > 2 ? log2(rows_build) : 1.0);
+  plan->cost[KM_PLAN_TREE] = read + sort * rows_build
+    + (tree_bytes <= KM_PLAN_CACHE_BYTES ? KM_COST_TREE_CACHED : KM_COST_TREE_MEMORY) * rows_probe;
+
+  if(forced != KM_PLAN_AUTO) {
+    plan->strategy = forced;
+    plan->forced = true;
+    if(!packed && forced != KM_PLAN_MERGE) {
+      plan->strategy = KM_PLAN_MERGE;
+      snprintf(plan->why, sizeof(plan->why), "%s requires k <= 32, merge used instead", km_plan_names[forced]);
+    } else if(forced != KM_PLAN_MERGE && order_needed) {
+      plan->strategy = KM_PLAN_MERGE;
+      snprintf(plan->why, sizeof(plan->why), "the output requires the merge, %s not applicable", km_plan_names[forced]);
+    } else if(forced == KM_PLAN_INDEX && !allow_index) {
+      plan->strategy = KM_PLAN_MERGE;
+      snprintf(plan->why, sizeof(plan->why), "index not applicable, merge used instead");
+    } else {
+      snprintf(plan->why, sizeof(plan->why), "forced by --plan%s", plan->feasible[forced] ? "" : ", although not deemed feasible");
+    }
+    return;
+  }
+
+  plan->strategy = -1;
+  for(int i=0; i<KM_PLAN_N; ++i) {
+    if(plan->feasible[i] && (plan->strategy < 0 || plan->cost[i] < plan->cost[plan->strategy])) { plan->strategy = i; }
+  }
+  if(plan->strategy < 0) {
+    // e.g. unsorted inputs from a pipe: merge is the only streaming strategy
+    plan->strategy = KM_PLAN_MERGE;
+    snprintf(plan->why, sizeof(plan->why), "no other strategy applies%s", build->sorted && probe->sorted ? "" : ", but the inputs do not look sorted");
+  } else if(!(build->sorted && probe->sorted) && plan->strategy != KM_PLAN_MERGE) {
+    snprintf(plan->why, sizeof(plan->why), "\"%s\" does not look sorted", build->sorted ? probe->path : build->path);
+  } else if(order_needed) {
+    snprintf(plan->why, sizeof(plan->why), "the output requires the merge");
+  } else if(!build->regular || !probe->regular) {
+    snprintf(plan->why, sizeof(plan->why), "input not a regular file, only the merge streams both sides");
+  } else {
+    snprintf(plan->why, sizeof(plan->why), "lowest estimated cost");
+  }
+}
+
+// Logs the plan and the statistics it is based on.
+static void km_plan_log(const km_plan_t *plan, const km_plan_input_t *build, const km_plan_input_t *probe, FILE *out) {
+  const km_plan_input_t *in[2] = { build, probe };
+  for(int i=0; i<2; ++i) {
+    if(in[i]->regular) {
+      fprintf(out, "[info] plan: \"%s\": %lu bytes, ~%.0f rows%s%s%s\n", in[i]->path, in[i]->bytes, in[i]->rows,
+        in[i]->arrow ? ", Arrow" : in[i]->set ? ", k-mer set" : in[i]->sorted ? ", sorted" : ", not sorted", in[i]->has_index ? ", indexed" : "", i == 0 ? " (built)" : " (probed)");
+    } else {
+      fprintf(out, "[info] plan: \"%s\": not a regular file, not sampled\n", in[i]->path);
+    }
+  }
+  fprintf(out, "[info] plan: %s (%s); estimated costs:", km_plan_names[plan->strategy], plan->why);
+  for(int i=0; i<KM_PLAN_N; ++i) {
+    if(plan->feasible[i]) { fprintf(out, " %s %.3gs", km_plan_names[i], plan->cost[i]*1e-9); }
+  }
+  fputc('\n', out);
+}
+
+// --- hash set and Bloom filter of packed keys
+
+typedef struct {
+  uint64_t *keys;    // KM_KEYSET_EMPTY for empty slots
+  uint8_t *hits;     // optional, per slot: key probed and found
+  uint64_t mask;
+  int shift;
+  size_t n;
+  bool has_empty;    // the key equal to KM_KEYSET_EMPTY (T...T for k = 32)
+  bool empty_hit;
+} km_keyset_t;
+
+#define KM_KEYSET_EMPTY UINT64_MAX
+
+static inline uint64_t km_keyset_hash(uint64_t key) { return key * 0x9E3779B97F4A7C15ULL; }
+
+static void km_keyset_init(km_keyset_t *set, size_t n_keys, bool track_hits) {
+  size_t cap = 16;
+  int bits = 4;
+  while(cap < 2*n_keys) { cap *= 2; ++bits; }
+  set->keys = (uint64_t *)malloc(cap*sizeof(uint64_t));
+  memset(set->keys, 0xFF, cap*sizeof(uint64_t));
+  set->hits = track_hits ? (uint8_t *)calloc(cap, 1) : NULL;
+  set->mask = cap - 1;
+  set->shift = 64 - bits;
+  set->n = 0;
+  set->has_empty = set->empty_hit = false;
+}
+
+static void km_keyset_free(km_keyset_t *set) {
+  free(set->keys);
+  free(set->hits);
+}
+
+// Inserts key, the set must have been sized for it.
+static void km_keyset_add(km_keyset_t *set, uint64_t key) {
+  if(key == KM_KEYSET_EMPTY) { set->n += !set->has_empty; set->has_empty = true; return; }
+  for(uint64_t i = km_keyset_hash(key) >> set->shift; ; i = (i+1) & set->mask) {
+    if(set->keys[i] == key) { return; }
+    if(set->keys[i] == KM_KEYSET_EMPTY) { set->keys[i] = key; ++set->n; return; }
+  }
+}
+
+// Tells if key is in the set, and records it as hit when tracking hits.
+static inline bool km_keyset_has(km_keyset_t *set, uint64_t key) {
+  if(key == KM_KEYSET_EMPTY) { if(set->hits) { set->empty_hit |= set->has_empty; } return set->has_empty; }
+  for(uint64_t i = km_keyset_hash(key) >> set->shift; ; i = (i+1) & set->mask) {
+    if(set->keys[i] == key) { if(set->hits) { set->hits[i] = 1; } return true; }
+    if(set->keys[i] == KM_KEYSET_EMPTY) { return false; }
+  }
+}
+
+// number of distinct keys of the set that were hit
+static size_t km_keyset_hits(const km_keyset_t *set) {
+  size_t n = set->empty_hit;
+  for(uint64_t i=0; set->hits && i<=set->mask; ++i) { n += set->hits[i]; }
+  return n;
+}
+
+// Blocked Bloom filter: 3 bits in one 64-bit word per key, about 8 bits per key.
+typedef struct {
+  uint64_t *words;
+  int shift;
+} km_bloom_t;
+
+static void km_bloom_init(km_bloom_t *bf, size_t n_keys) {
+  size_t n_words = 1;
+  int bits = 0;
+  while(n_words*64 < 8*n_keys) { n_words *= 2; ++bits; }
+  bf->words = (uint64_t *)calloc(n_words, sizeof(uint64_t));
+  bf->shift = 64 - bits;
+}
+
+static inline uint64_t km_bloom_bits(uint64_t h) {
+  return (1ULL << (h & 63)) | (1ULL << ((h >> 6) & 63)) | (1ULL << ((h >> 12) & 63));
+}
+
+static inline void km_bloom_add(km_bloom_t *bf, uint64_t key) {
+  uint64_t h = km_keyset_hash(key ^ 0x5851F42D4C957F2DULL);
+  bf->words[bf->shift == 64 ? 0 : h >> bf->shift] |= km_bloom_bits(h);
+}
+
+static inline bool km_bloom_may_have(const km_bloom_t *bf, uint64_t key) {
+  uint64_t h = km_keyset_hash(key ^ 0x5851F42D4C957F2DULL);
+  uint64_t b = km_bloom_bits(h);
+  return (bf->words[bf->shift == 64 ? 0 : h >> bf->shift] & b) == b;
+}
+
+static void km_bloom_free(km_bloom_t *bf) { free(bf->words); }
+
+#endif
@@ -0,0 +1,321 @@
+#ifndef KM_POOL_H
+#define KM_POOL_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <unistd.h>
+#include <sched.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "km_numa.h"
+#include "km_metrics.h"
+
+// Work-stealing task pool shared by all tools.
+//
+// Each worker owns a deque: it pushes and pops its own tasks at the bottom
+// (LIFO, cache-warm) while idle workers steal from the top of the others (FIFO,
+// oldest and usually largest tasks). The thread creating the pool is worker 0
+// and runs tasks while it waits for a group, as does any worker waiting for a
+// nested group, so nested stages share the same threads instead of
+// oversubscribing the node.
+//
+// With a NUMA placement, workers are spread in contiguous blocks over the nodes
+// and pinned there, steal from workers of their own node first, and tasks can be
+// queued on a given node (e.g. next to the buffer they read).
+
+typedef void (*km_task_fn)(void *arg);
+
+// tasks to wait for together
+typedef struct {
+  atomic_size_t pending;
+} km_group_t;
+
+typedef struct {
+  km_task_fn fn;
+  void *arg;
+  km_group_t *group;
+  uint64_t submit_ns;
+} km_task_t;
+
+typedef struct {
+  pthread_mutex_t lock;
+  km_task_t *tasks;
+  size_t top, bottom, cap; // tasks in [top,bottom) modulo cap
+  // metrics
+  size_t n_tasks, n_steals;
+  uint64_t wait_ns, idle_ns;
+  _Atomic uint64_t idle_since; // start of the idle period of a sleeping worker, 0 if awake
+  unsigned seed;
+} km_deque_t;
+
+typedef struct {
+  int n_threads;
+  km_numa_t *numa;
+  int *node;               // node of each worker
+  unsigned long *caller_cpus; // CPU mask of the calling thread before it was pinned
+  atomic_uint next_worker; // round-robin among the workers of a node
+  km_deque_t *deques;
+  pthread_t *threads;
+  atomic_size_t n_queued;
+  pthread_mutex_t sleep_lock;
+  pthread_cond_t sleep_cond;
+  atomic_int n_sleeping;
+  bool stop;
+} km_pool_t;
+
+static __thread int km_pool_self = 0;
+
+static inline uint64_t km_now_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec*1000000000ULL + ts.tv_nsec;
+}
+
+// Number of online CPUs, the number of threads of -t 0.
+static inline int km_pool_cpus() {
+  long n = sysconf(_SC_NPROCESSORS_ONLN);
+  return n > 0 ? n : 1;
+}
+
+// Parses the argument of -t: a number of threads, 0 for all online CPUs.
+static inline int km_pool_threads(const char *arg) {
+  int n = strtol(arg, NULL, 10);
+  return n > 0 ? n : km_pool_cpus();
+}
+
+static inline void km_group_init(km_group_t *group) {
+  atomic_init(&group->pending, 0);
+}
+
+static void km_deque_push(km_deque_t *dq, km_task_t task) {
+  pthread_mutex_lock(&dq->lock);
+  if(dq->bottom - dq->top == dq->cap) {
+    size_t cap = dq->cap ? 2*dq->cap : 64;
+    km_task_t *tasks = (km_task_t *)malloc(cap*sizeof(km_task_t));
+    for(size_t i=dq->top; i<dq->bottom; ++i) { tasks[i-dq->top] = dq->tasks[i % dq->cap]; }
+    free(dq->tasks);
+    dq->tasks = tasks;
+    dq->bottom -= dq->top;
+    dq->top = 0;
+    dq->cap = cap;
+  }
+  dq->tasks[dq->bottom++ % dq->cap] = task;
+  pthread_mutex_unlock(&dq->lock);
+}
+
+static bool km_deque_pop(km_deque_t *dq, km_task_t *task, bool steal) {
+  bool found = false;
+  pthread_mutex_lock(&dq->lock);
+  if(dq->bottom > dq->top) {
+    *task = steal ? dq->tasks[dq->top++ % dq->cap] : dq->tasks[--dq->bottom % dq->cap];
+    found = true;
+  }
+  pthread_mutex_unlock(&dq->lock);
+  return found;
+}
+
+// Takes a task from the calling worker's deque, or steals one from another worker.
+static bool km_pool_take(km_pool_t *pool, int self, km_task_t *task) {
+  km_deque_t *own = &pool->deques[self];
+  if(atomic_load(&pool->n_queued) == 0) { return false; }
+  if(km_deque_pop(own, task, false)) { return true; }
+  int n = pool->n_threads;
+  int start = rand_r(&own->seed) % n;
+  for(int same_node=1; same_node>=0; --same_node) {
+    for(int i=0; i<n; ++i) {
+      int victim = (start + i) % n;
+      if(victim == self || (pool->node[victim] == pool->node[self]) != same_node) { continue; }
+      if(km_deque_pop(&pool->deques[victim], task, true)) {
+        ++own->n_steals;
+        return true;
+      }
+    }
+  }
+  return false;
+}
+
+static void km_pool_exec(km_pool_t *pool, int self, km_task_t *task) {
+  km_deque_t *own = &pool->deques[self];
+  atomic_fetch_sub(&pool->n_queued, 1);
+  own->wait_ns += km_now_ns() - task->submit_ns;
+  ++own->n_tasks;
+  task->fn(task->arg);
+  atomic_fetch_sub(&task->group->pending, 1);
+}
+
+typedef struct {
+  km_pool_t *pool;
+  int self;
+} km_worker_arg_t;
+
+static void *km_pool_worker(void *arg) {
+  km_pool_t *pool = ((km_worker_arg_t *)arg)->pool;
+  int self = ((km_worker_arg_t *)arg)->self;
+  free(arg);
+  km_pool_self = self;
+  km_numa_pin(pool->numa, pool->node[self]);
+  km_deque_t *own = &pool->deques[self];
+  km_task_t task;
+  while(true) {
+    if(km_pool_take(pool, self, &task)) {
+      km_pool_exec(pool, self, &task);
+      continue;
+    }
+    uint64_t idle_start = km_now_ns();
+    atomic_store(&own->idle_since, idle_start);
+    // announced before checking the queue, so that a concurrent submit sees it
+    pthread_mutex_lock(&pool->sleep_lock);
+    atomic_fetch_add(&pool->n_sleeping, 1);
+    while(!pool->stop && atomic_load(&pool->n_queued) == 0) {
+      pthread_cond_wait(&pool->sleep_cond, &pool->sleep_lock);
+    }
+    atomic_fetch_sub(&pool->n_sleeping, 1);
+    bool stop = pool->stop;
+    pthread_mutex_unlock(&pool->sleep_lock);
+    own->idle_ns += km_now_ns() - idle_start;
+    atomic_store(&own->idle_since, 0);
+    if(stop) { break; }
+  }
+  return NULL;
+}
+
+// Creates a pool of n_threads workers, the calling thread being one of them.
+// numa may be NULL for no placement, else the calling thread is pinned to node
+// 0 until km_pool_destroy, which restores its CPU mask.
+static km_pool_t *km_pool_create(int n_threads, km_numa_t *numa) {
+  km_pool_t *pool = (km_pool_t *)calloc(1, sizeof(km_pool_t));
+  pool->n_threads = n_threads > 0 ? n_threads : 1;
+  pool->numa = numa;
+  pool->node = (int *)calloc(pool->n_threads, sizeof(int));
+  for(int i=0; numa && i<pool->n_threads; ++i) { pool->node[i] = (long)i * numa->n_nodes / pool->n_threads; }
+  atomic_init(&pool->next_worker, 0);
+  pool->deques = (km_deque_t *)calloc(pool->n_threads, sizeof(km_deque_t));
+  pool->threads = (pthread_t *)calloc(pool->n_threads, sizeof(pthread_t));
+  atomic_init(&pool->n_queued, 0);
+  atomic_init(&pool->n_sleeping, 0);
+  pthread_mutex_init(&pool->sleep_lock, NULL);
+  pthread_cond_init(&pool->sleep_cond, NULL);
+  for(int i=0; i<pool->n_threads; ++i) {
+    pthread_mutex_init(&pool->deques[i].lock, NULL);
+    atomic_init(&pool->deques[i].idle_since, 0);
+    pool->deques[i].seed = i+1;
+  }
+  km_pool_self = 0;
+  pool->caller_cpus = km_numa_affinity(numa);
+  km_numa_pin(numa, 0);
+  for(int i=1; i<pool->n_threads; ++i) {
+    km_worker_arg_t *arg = (km_worker_arg_t *)malloc(sizeof(km_worker_arg_t));
+    *arg = (km_worker_arg_t){ pool, i };
+    pthread_create(&pool->threads[i], NULL, km_pool_worker, arg);
+  }
+  return pool;
+}
+
+// Queues fn(arg) on a worker of node n (any node without NUMA placement).
+static void km_pool_submit_on(km_pool_t *pool, km_group_t *group, int n, km_task_fn fn, void *arg) {
+  int self = km_pool_self;
+  if(pool->numa && pool->node[self] != n) {
+    int first = 0, count = 0;
+    for(int i=0; i<pool->n_threads; ++i) {
+      if(pool->node[i] == n) { if(count++ == 0) { first = i; } }
+    }
+    if(count > 0) {
+      self = first + atomic_fetch_add(&pool->next_worker, 1) % count;
+    }
+  }
+  atomic_fetch_add(&group->pending, 1);
+  atomic_fetch_add(&pool->n_queued, 1);
+  km_deque_push(&pool->deques[self], (km_task_t){ fn, arg, group, km_now_ns() });
+  if(atomic_load(&pool->n_sleeping) > 0) {
+    pthread_mutex_lock(&pool->sleep_lock);
+    pthread_cond_signal(&pool->sleep_cond);
+    pthread_mutex_unlock(&pool->sleep_lock);
+  }
+}
+
+// Queues fn(arg) on the calling worker's deque as part of group.
+static void km_pool_submit(km_pool_t *pool, km_group_t *group, km_task_fn fn, void *arg) {
+  km_pool_submit_on(pool, group, pool->node[km_pool_self], fn, arg);
+}
+
+// Runs tasks until all the tasks of group are done.
+static void km_pool_wait(km_pool_t *pool, km_group_t *group) {
+  int self = km_pool_self;
+  km_deque_t *own = &pool->deques[self];
+  km_task_t task;
+  while(atomic_load(&group->pending) > 0) {
+    if(km_pool_take(pool, self, &task)) {
+      km_pool_exec(pool, self, &task);
+    } else {
+      uint64_t idle_start = km_now_ns();
+      sched_yield();
+      uint64_t idle = km_now_ns() - idle_start;
+      own->idle_ns += idle;
+      km_stage_wait(idle);
+    }
+  }
+}
+
+typedef struct {
+  size_t n_tasks, n_steals;
+  uint64_t wait_ns, idle_ns;
+} km_pool_stats_t;
+
+// Task-level metrics summed over the workers. The idle time includes the
+// current idle period of the sleeping workers, which is not closed until they
+// wake up (at km_pool_destroy for the last one).
+static km_pool_stats_t km_pool_stats(km_pool_t *pool) {
+  km_pool_stats_t st = {0,0,0,0};
+  uint64_t now = km_now_ns();
+  for(int i=0; i<pool->n_threads; ++i) {
+    st.n_tasks += pool->deques[i].n_tasks;
+    st.n_steals += pool->deques[i].n_steals;
+    st.wait_ns += pool->deques[i].wait_ns;
+    st.idle_ns += pool->deques[i].idle_ns;
+    uint64_t since = atomic_load(&pool->deques[i].idle_since);
+    if(since && since < now) { st.idle_ns += now - since; }
+  }
+  return st;
+}
+
+static void km_pool_report(km_pool_t *pool, FILE *stream) {
+  km_pool_stats_t st = km_pool_stats(pool);
+  fprintf(stream, "[info] %d\tthreads\n", pool->n_threads);
+  if(pool->numa) { fprintf(stream, "[info] %d\tNUMA nodes\n", pool->numa->n_nodes); }
+  fprintf(stream, "[info] %zu\ttasks, %zu stolen\n", st.n_tasks, st.n_steals);
+  fprintf(stream, "[info] %.3f\tms mean task queue wait\n", st.n_tasks ? st.wait_ns/1e6/st.n_tasks : 0.0);
+  fprintf(stream, "[info] %.3f\ts idle time of all threads\n", st.idle_ns/1e9);
+}
+
+// Writes the metrics as a "pool" member of a JSON object (see km_metrics_write).
+static void km_pool_json(FILE *fp, void *arg) {
+  km_pool_t *pool = (km_pool_t *)arg;
+  km_pool_stats_t st = km_pool_stats(pool);
+  fprintf(fp, ",\n  \"pool\": {\"threads\": %d, \"numa_nodes\": %d, \"tasks\": %zu, \"steals\": %zu, \"queue_wait_s\": %.6f, \"idle_s\": %.6f}",
+          pool->n_threads, pool->numa ? pool->numa->n_nodes : 1, st.n_tasks, st.n_steals, st.wait_ns/1e9, st.idle_ns/1e9);
+}
+
+static void km_pool_destroy(km_pool_t *pool) {
+  pthread_mutex_lock(&pool->sleep_lock);
+  pool->stop = true;
+  pthread_cond_broadcast(&pool->sleep_cond);
+  pthread_mutex_unlock(&pool->sleep_lock);
+  for(int i=1; i<pool->n_threads; ++i) { pthread_join(pool->threads[i], NULL); }
+  km_numa_unpin(pool->numa, pool->caller_cpus);
+  for(int i=0; i<pool->n_threads; ++i) {
+    pthread_mutex_destroy(&pool->deques[i].lock);
+    free(pool->deques[i].tasks);
+  }
+  pthread_mutex_destroy(&pool->sleep_lock);
+  pthread_cond_destroy(&pool->sleep_cond);
+  free(pool->deques);
+  free(pool->threads);
+  free(pool->node);
+  free(pool);
+}
+
+#endif
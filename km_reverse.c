@@ -6,53 +6,60 @@
 #include <stdbool.h>
 #include <string.h>
 
-static const unsigned char rctable[256] = {
-      0,   1,   2,   3,   4,   5,   6,   7,   8,   9,  10,  11,  12,  13,  14,  15,
-     16,  17,  18,  19,  20,  21,  22,  23,  24,  25,  26,  27,  28,  29,  30,  31,
-     32,  33,  34,  35,  36,  37,  38,  39,  40,  41,  42,  43,  44,  45,  46,  47,
-     48,  49,  50,  51,  52,  53,  54,  55,  56,  57,  58,  59,  60,  61,  62,  63,
-     64, 'T',  66, 'G',  68,  69,  70, 'C',  72,  73,  74,  75,  76,  77, 'N',  79,
-     80,  81,  82,  83, 'A',  85,  86,  87,  88,  89,  90,  91,  92,  93,  94,  95,
-     96, 't',  98, 'g', 100, 101, 102, 'c', 104, 105, 106, 107, 108, 109, 'n', 111,
-    112, 113, 114, 115, 'a', 117, 118, 119, 120, 121, 122, 123, 124, 125, 126, 127,
-    128, 129, 130, 131, 132, 133, 134, 135, 136, 137, 138, 139, 140, 141, 142, 143,
-    144, 145, 146, 147, 148, 149, 150, 151, 152, 153, 154, 155, 156, 157, 158, 159,
-    160, 161, 162, 163, 164, 165, 166, 167, 168, 169, 170, 171, 172, 173, 174, 175,
-    176, 177, 178, 179, 180, 181, 182, 183, 184, 185, 186, 187, 188, 189, 190, 191,
-    192, 193, 194, 195, 196, 197, 198, 199, 200, 201, 202, 203, 204, 205, 206, 207,
-    208, 209, 210, 211, 212, 213, 214, 215, 216, 217, 218, 219, 220, 221, 222, 223,
-    224, 225, 226, 227, 228, 229, 230, 231, 232, 233, 234, 235, 236, 237, 238, 239,
-    240, 241, 242, 243, 244, 245, 246, 247, 248, 249, 250, 251, 252, 253, 254, 255
-};
-
-static const int isnuc[256] = {
-      0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,
-      0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,
-      0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,
-      0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,
-      0,   1,   0,   1,   0,   0,   0,   1,   0,   0,   0,   0,   0,   0,   1,   0,
-      0,   0,   0,   0,   1,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,
-      0,   1,   0,   1,   0,   0,   0,   1,   0,   0,   0,   0,   0,   0,   1,   0,
-      0,   0,   0,   0,   1,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,
-      0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,
-      0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,
-      0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,
-      0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,
-      0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,
-      0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,
-      0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,
-      0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0
-};
+#include "km_kernels.h"
+#include "km_chunk.h"
+
+typedef struct {
+  int ksize;
+  char short_fmt[64];
+} reverse_t;
+
+void reverse_chunk(km_chunk_t *chunk, void *arg) {
+  const reverse_t *rev = (const reverse_t *)arg;
+  int ksize = rev->ksize;
+  size_t pos = 0, len, line_num = 0;
+  char *line;
+  while(km_chunk_next_line(chunk, &pos, &line, &len)) {
+    ++line_num;
+    bool has_nl = line + len < chunk->data + chunk->len;
+
+    // empty line
+    if(len == 0) {
+      continue;
+    }
+
+    if(len + has_nl < (size_t)ksize) {
+      km_chunk_error(chunk, rev->short_fmt, line_num, line, 0);
+      return;
+    }
+
+    if(!km_is_kmer(line, ksize)) {
+      km_chunk_error(chunk, "[error] invalid k-mer at line %zu: %.*s\n", line_num, line, len);
+      return;
+    }
+
+    km_revcomp(line, ksize);
+
+    km_chunk_write(chunk, line, len + has_nl);
+  }
+}
 
 
 int main(int argc, char **argv) {
 
-  int ksize = 31;
-  char *out_fname = NULL;
+  int ksize = 31, n_threads = 1;
+  int numa_policy = KM_NUMA_NONE;
+  char *out_fname = NULL, *metrics_fname = NULL, *trace_fname = NULL;
   bool help_opt = false;
 
+  static struct option long_opts[] = {
+    {"metrics", required_argument, NULL, KM_OPT_METRICS},
+    {"trace", required_argument, NULL, KM_OPT_TRACE},
+    {NULL, 0, NULL, 0}
+  };
+
   int c;
-  while ((c = getopt(argc, argv, "k:o:h")) != -1) {
+  while ((c = getopt_long(argc, argv, "k:o:P:t:h", long_opts, NULL)) != -1) {
     switch (c) {
       case 'k':
         ksize = strtol(optarg, NULL, 10);
@@ -60,9 +67,25 @@ int main(int argc, char **argv) {
       case 'o':
         out_fname = optarg;
         break;
+      case 'P':
+        numa_policy = km_numa_policy(optarg);
+        if(numa_policy < 0) {
+          fprintf(stderr, "[error] unknown NUMA placement \"%s\"\n", optarg);
+          return 1;
+        }
+        break;
+      case 't':
+        n_threads = km_pool_threads(optarg);
+        break;
       case 'h':
         help_opt = true;
         break;
+      case KM_OPT_METRICS:
+        metrics_fname = optarg;
+        break;
+      case KM_OPT_TRACE:
+        trace_fname = optarg;
+        break;
       case '?':
         return 1;
       default:
@@ -81,6 +104,10 @@ int main(int argc, char **argv) {
     fprintf(stdout, "Options:\n");
     fprintf(stdout, "  -k INT   k-mer size [31]\n");
     fprintf(stdout, "  -o FILE  output reverse-complement matrix to FILE [stdout]\n");
+    fprintf(stdout, "  -P STR   NUMA placement of threads and buffers: none, local, interleave [none]\n");
+    fprintf(stdout, "  -t INT   number of threads, 0 for all CPUs [1]\n");
+    fprintf(stdout, "      --metrics FILE  write run metrics (stage times, CPU counters) as JSON to FILE\n");
+    fprintf(stdout, "      --trace FILE    write a timeline of the threads in Chrome trace format to FILE\n");
     fprintf(stdout, "  -h       print this help message\n");
     return 0;
   }
@@ -98,52 +125,37 @@ int main(int argc, char **argv) {
     return 1;
   }
 
-  char *kmer = (char *)calloc(ksize+1,1);
-  char *line = NULL;
-  size_t line_size=0, line_num=0;
-
-  ssize_t ch_read = getline(&line, &line_size, infile);
-  while(ch_read >= 0) {
-    ++line_num;
-    
-    // empty line
-    if(ch_read == 0 || line[0]=='\n') { 
-      continue; 
-    }
-    
-    if(ch_read < ksize) {
-      fprintf(stderr,"[error] cannot read a k-mer of size %d at line %zu\n", ksize, line_num);
-      free(kmer); free(line);
-      if(infile != stdin){ fclose(infile); }
-      if(outfile != stdout){ fclose(outfile); }
-      return 2;
-    }
-
-    for(int i=0; i<=ksize/2; ++i) {
-      kmer[i] = rctable[(int)line[ksize-i-1]];
-      kmer[ksize-i-1] = rctable[(int)line[i]];
-      if(!isnuc[(int)line[ksize-i-1]] || !isnuc[(int)line[i]]) {
-        fprintf(stderr,"[error] invalid k-mer at line %zu: %s\n", line_num, line);
-        free(kmer); free(line);
-        if(infile != stdin){ fclose(infile); }
-        if(outfile != stdout){ fclose(outfile); }
-        return 2;
-      }
-    }
-
-    for(int i=0; i<ksize; ++i) {
-      line[i] = kmer[i];
-    }
-
-    fputs(line, outfile);
-    //fputc('\n', outfile);
-    ch_read = getline(&line, &line_size, infile);
+  if(metrics_fname) { km_metrics_init("km_reverse"); }
+  if(trace_fname) { km_trace_init(); }
+
+  reverse_t rev = { .ksize = ksize };
+  snprintf(rev.short_fmt, sizeof(rev.short_fmt), "[error] cannot read a k-mer of size %d at line %%zu%%.*s\n", ksize);
+  km_numa_t *numa = n_threads > 1 ? km_numa_init(numa_policy) : NULL;
+  km_pool_t *pool = n_threads > 1 ? km_pool_create(n_threads, numa) : NULL;
+  km_chunk_engine_t eng = { .pool = pool, .format = reverse_chunk, .arg = &rev };
+  km_chunk_engine_init(&eng, fileno(infile), outfile);
+
+  int ret = km_chunk_run(&eng, outfile, false);
+  if(ret == 1) {
+    fprintf(stderr,"[error] cannot write output\n");
+  } else if(ret == 0) {
+    fprintf(stderr,"[info] %zu lines processed successfully\n", eng.n_lines);
   }
 
-  fprintf(stderr,"[info] %zu lines processed successfully\n", line_num);
-  free(kmer); free(line);
+  if(km_metrics_write(metrics_fname, pool ? km_pool_json : NULL, pool)) {
+    fprintf(stderr,"[error] cannot write metrics file \"%s\"\n",metrics_fname);
+  }
+  if(km_trace_write(trace_fname, "km_reverse")) {
+    fprintf(stderr,"[error] cannot write trace file \"%s\"\n",trace_fname);
+  }
+  km_chunk_engine_free(&eng);
+  if(pool) {
+    if(metrics_fname) { km_pool_report(pool, stderr); }
+    km_pool_destroy(pool);
+  }
+  km_numa_free(numa);
   if(infile != stdin){ fclose(infile); }
   if(outfile != stdout){ fclose(outfile); }
 
-  return 0;
+  return ret;
 }
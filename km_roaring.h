@@ -0,0 +1,230 @@
+#ifndef KM_ROARING_H
+#define KM_ROARING_H
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+
+// Compressed bitmaps of 32-bit row IDs, in the manner of Roaring: IDs are
+// grouped by their high 16 bits into containers holding the low 16 bits, as a
+// sorted array when there are at most KM_ROARING_ARRAY_MAX of them, else as a
+// bitmap of 2^16 bits. Set operations work container by container, so that
+// sparse and dense regions both stay cheap. (No run containers.)
+
+#define KM_ROARING_ARRAY_MAX 4096
+#define KM_ROARING_WORDS 1024
+enum { KM_ROARING_ARRAY, KM_ROARING_BITMAP };
+
+typedef struct {
+  uint16_t key;   // high 16 bits of the IDs
+  uint16_t type;
+  uint32_t card;  // number of IDs
+  void *data;     // uint16_t[card] or uint64_t[KM_ROARING_WORDS]
+} km_container_t;
+
+typedef struct {
+  km_container_t *c;
+  size_t n, cap;
+  bool owned;     // data of the containers allocated (else borrowed, e.g. from a file)
+} km_roaring_t;
+
+static inline void km_roaring_init(km_roaring_t *r) {
+  memset(r, 0, sizeof(*r));
+  r->owned = true;
+}
+
+static void km_roaring_free(km_roaring_t *r) {
+  if(r->owned) {
+    for(size_t i=0; i<r->n; ++i) { free(r->c[i].data); }
+  }
+  free(r->c);
+  memset(r, 0, sizeof(*r));
+}
+
+static inline size_t km_container_bytes(const km_container_t *c) {
+  return c->type == KM_ROARING_ARRAY ? c->card*sizeof(uint16_t) : KM_ROARING_WORDS*sizeof(uint64_t);
+}
+
+static km_container_t *km_roaring_push(km_roaring_t *r, uint16_t key, uint16_t type, uint32_t card, void *data) {
+  if(r->n == r->cap) {
+    r->cap = r->cap ? 2*r->cap : 16;
+    r->c = (km_container_t *)realloc(r->c, r->cap*sizeof(km_container_t));
+  }
+  r->c[r->n] = (km_container_t){ key, type, card, data };
+  return &r->c[r->n++];
+}
+
+static inline uint64_t km_roaring_card(const km_roaring_t *r) {
+  uint64_t card = 0;
+  for(size_t i=0; i<r->n; ++i) { card += r->c[i].card; }
+  return card;
+}
+
+// Appends id, greater than all the IDs of r. Arrays grow by doubling and
+// become bitmaps beyond KM_ROARING_ARRAY_MAX IDs.
+static void km_roaring_append(km_roaring_t *r, uint32_t id) {
+  uint16_t key = id >> 16, low = id & 0xFFFF;
+  km_container_t *c = r->n ? &r->c[r->n-1] : NULL;
+  if(c == NULL || c->key != key) { c = km_roaring_push(r, key, KM_ROARING_ARRAY, 0, NULL); }
+  if(c->type == KM_ROARING_BITMAP) {
+    ((uint64_t *)c->data)[low/64] |= 1ULL << (low%64);
+    ++c->card;
+    return;
+  }
+  if(c->card == KM_ROARING_ARRAY_MAX) {
+    uint64_t *bits = (uint64_t *)calloc(KM_ROARING_WORDS, sizeof(uint64_t));
+    const uint16_t *a = (const uint16_t *)c->data;
+    for(uint32_t i=0; i<c->card; ++i) { bits[a[i]/64] |= 1ULL << (a[i]%64); }
+    bits[low/64] |= 1ULL << (low%64);
+    free(c->data);
+    c->data = bits;
+    c->type = KM_ROARING_BITMAP;
+    ++c->card;
+    return;
+  }
+  if(c->card == 0 || (c->card >= 4 && (c->card & (c->card - 1)) == 0)) { // 4, then doubling
+    c->data = realloc(c->data, (c->card ? 2*c->card : 4)*sizeof(uint16_t));
+  }
+  ((uint16_t *)c->data)[c->card++] = low;
+}
+
+// Makes a container of the result of an operation: an array if it holds at
+// most KM_ROARING_ARRAY_MAX IDs, else a copy of bits. Empty results are dropped.
+static void km_roaring_push_bits(km_roaring_t *r, uint16_t key, const uint64_t *bits) {
+  uint32_t card = 0;
+  for(int w=0; w<KM_ROARING_WORDS; ++w) { card += __builtin_popcountll(bits[w]); }
+  if(card == 0) { return; }
+  if(card > KM_ROARING_ARRAY_MAX) {
+    uint64_t *copy = (uint64_t *)malloc(KM_ROARING_WORDS*sizeof(uint64_t));
+    memcpy(copy, bits, KM_ROARING_WORDS*sizeof(uint64_t));
+    km_roaring_push(r, key, KM_ROARING_BITMAP, card, copy);
+    return;
+  }
+  uint16_t *a = (uint16_t *)malloc(card*sizeof(uint16_t));
+  uint32_t n = 0;
+  for(int w=0; w<KM_ROARING_WORDS; ++w) {
+    for(uint64_t x = bits[w]; x; x &= x-1) { a[n++] = w*64 + __builtin_ctzll(x); }
+  }
+  km_roaring_push(r, key, KM_ROARING_ARRAY, card, a);
+}
+
+static void km_roaring_push_array(km_roaring_t *r, uint16_t key, const uint16_t *a, uint32_t card) {
+  if(card == 0) { return; }
+  uint16_t *copy = (uint16_t *)malloc(card*sizeof(uint16_t));
+  memcpy(copy, a, card*sizeof(uint16_t));
+  km_roaring_push(r, key, KM_ROARING_ARRAY, card, copy);
+}
+
+// bits of a container (into tmp for an array)
+static const uint64_t *km_container_bits(const km_container_t *c, uint64_t *tmp) {
+  if(c->type == KM_ROARING_BITMAP) { return (const uint64_t *)c->data; }
+  memset(tmp, 0, KM_ROARING_WORDS*sizeof(uint64_t));
+  const uint16_t *a = (const uint16_t *)c->data;
+  for(uint32_t i=0; i<c->card; ++i) { tmp[a[i]/64] |= 1ULL << (a[i]%64); }
+  return tmp;
+}
+
+static inline bool km_container_has(const km_container_t *c, uint16_t low) {
+  if(c->type == KM_ROARING_BITMAP) { return (((const uint64_t *)c->data)[low/64] >> (low%64)) & 1; }
+  const uint16_t *a = (const uint16_t *)c->data;
+  uint32_t lo = 0, hi = c->card;
+  while(lo < hi) {
+    uint32_t mid = (lo + hi)/2;
+    if(a[mid] < low) { lo = mid+1; } else { hi = mid; }
+  }
+  return lo < c->card && a[lo] == low;
+}
+
+typedef enum { KM_ROARING_AND, KM_ROARING_OR, KM_ROARING_ANDNOT, KM_ROARING_XOR } km_roaring_op_t;
+
+// Combines two containers of the same key into out: arrays by merging (or
+// probing when the other side is a bitmap), bitmaps word by word.
+static void km_container_op(km_roaring_t *out, const km_container_t *a, const km_container_t *b, km_roaring_op_t op, uint64_t *tmp_a, uint64_t *tmp_b) {
+  uint16_t key = a->key;
+  if(a->type == KM_ROARING_ARRAY && (op == KM_ROARING_AND || op == KM_ROARING_ANDNOT) && (b->type == KM_ROARING_BITMAP || op == KM_ROARING_ANDNOT)) {
+    // filter the array of a by b
+    const uint16_t *x = (const uint16_t *)a->data;
+    uint16_t *res = (uint16_t *)malloc(a->card*sizeof(uint16_t));
+    uint32_t n = 0;
+    for(uint32_t i=0; i<a->card; ++i) {
+      if(km_container_has(b, x[i]) == (op == KM_ROARING_AND)) { res[n++] = x[i]; }
+    }
+    if(n) { km_roaring_push(out, key, KM_ROARING_ARRAY, n, res); } else { free(res); }
+    return;
+  }
+  if(op == KM_ROARING_AND && b->type == KM_ROARING_ARRAY && a->type == KM_ROARING_BITMAP) {
+    km_container_op(out, b, a, op, tmp_b, tmp_a);
+    return;
+  }
+  if(a->type == KM_ROARING_ARRAY && b->type == KM_ROARING_ARRAY && (op == KM_ROARING_AND || a->card + b->card <= KM_ROARING_ARRAY_MAX)) {
+    // merge of two sorted arrays
+    const uint16_t *x = (const uint16_t *)a->data, *y = (const uint16_t *)b->data;
+    uint16_t *res = (uint16_t *)malloc((a->card + b->card)*sizeof(uint16_t));
+    uint32_t i = 0, j = 0, n = 0;
+    while(i < a->card && j < b->card) {
+      if(x[i] < y[j]) { if(op != KM_ROARING_AND) { res[n++] = x[i]; } ++i; }
+      else if(x[i] > y[j]) { if(op != KM_ROARING_AND) { res[n++] = y[j]; } ++j; }
+      else { if(op != KM_ROARING_XOR) { res[n++] = x[i]; } ++i; ++j; }
+    }
+    if(op != KM_ROARING_AND) {
+      while(i < a->card) { res[n++] = x[i++]; }
+      while(j < b->card) { res[n++] = y[j++]; }
+    }
+    if(n) { km_roaring_push(out, key, KM_ROARING_ARRAY, n, res); } else { free(res); }
+    return;
+  }
+  const uint64_t *x = km_container_bits(a, tmp_a), *y = km_container_bits(b, tmp_b);
+  uint64_t res[KM_ROARING_WORDS];
+  switch(op) {
+    case KM_ROARING_AND:    for(int w=0; w<KM_ROARING_WORDS; ++w) { res[w] = x[w] & y[w]; } break;
+    case KM_ROARING_OR:     for(int w=0; w<KM_ROARING_WORDS; ++w) { res[w] = x[w] | y[w]; } break;
+    case KM_ROARING_ANDNOT: for(int w=0; w<KM_ROARING_WORDS; ++w) { res[w] = x[w] & ~y[w]; } break;
+    case KM_ROARING_XOR:    for(int w=0; w<KM_ROARING_WORDS; ++w) { res[w] = x[w] ^ y[w]; } break;
+  }
+  km_roaring_push_bits(out, key, res);
+}
+
+static void km_roaring_copy_container(km_roaring_t *out, const km_container_t *c) {
+  if(c->type == KM_ROARING_ARRAY) { km_roaring_push_array(out, c->key, (const uint16_t *)c->data, c->card); }
+  else { km_roaring_push_bits(out, c->key, (const uint64_t *)c->data); }
+}
+
+// out = a op b, by a merge of the containers of a and b by key.
+static void km_roaring_op(km_roaring_t *out, const km_roaring_t *a, const km_roaring_t *b, km_roaring_op_t op) {
+  km_roaring_init(out);
+  uint64_t *tmp = (uint64_t *)malloc(2*KM_ROARING_WORDS*sizeof(uint64_t));
+  size_t i = 0, j = 0;
+  while(i < a->n || j < b->n) {
+    int cmp = i == a->n ? 1 : j == b->n ? -1 : (int)a->c[i].key - (int)b->c[j].key;
+    if(cmp == 0) {
+      km_container_op(out, &a->c[i++], &b->c[j++], op, tmp, tmp + KM_ROARING_WORDS);
+    } else if(cmp < 0) {
+      if(op != KM_ROARING_AND) { km_roaring_copy_container(out, &a->c[i]); }
+      ++i;
+    } else {
+      if(op == KM_ROARING_OR || op == KM_ROARING_XOR) { km_roaring_copy_container(out, &b->c[j]); }
+      ++j;
+    }
+  }
+  free(tmp);
+}
+
+// Calls f(id, arg) on the IDs of r in increasing order.
+static void km_roaring_foreach(const km_roaring_t *r, void (*f)(uint32_t id, void *arg), void *arg) {
+  for(size_t i=0; i<r->n; ++i) {
+    const km_container_t *c = &r->c[i];
+    uint32_t high = (uint32_t)c->key << 16;
+    if(c->type == KM_ROARING_ARRAY) {
+      const uint16_t *a = (const uint16_t *)c->data;
+      for(uint32_t j=0; j<c->card; ++j) { f(high | a[j], arg); }
+    } else {
+      const uint64_t *bits = (const uint64_t *)c->data;
+      for(int w=0; w<KM_ROARING_WORDS; ++w) {
+        for(uint64_t x = bits[w]; x; x &= x-1) { f(high | (w*64 + __builtin_ctzll(x)), arg); }
+      }
+    }
+  }
+}
+
+#endif
@@ -0,0 +1,266 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "km_kernels.h"
+#include "km_index.h"
+
+// queries are searched by batches whose presence bit-matrices take about this much memory
+#define SEARCH_BATCH_BYTES (256UL<<20)
+
+// query sequence and its presence bit-matrix: one bitset of its k-mers per
+// sample, so that the k-mers of a sample are counted by popcount
+typedef struct {
+  char *name;
+  size_t n_kmers;
+  size_t words;    // 64-bit words per sample
+  uint64_t *bits;  // n_samples * words
+} query_t;
+
+// distinct canonical k-mer of a query
+typedef struct {
+  uint64_t key;
+  uint32_t query;  // in the batch
+  uint32_t kmer;   // in the query
+} query_kmer_t;
+
+typedef struct {
+  query_t *queries;
+  size_t n_queries, cap;
+  query_kmer_t *kmers;
+  size_t n_kmers, kmers_cap;
+  size_t bytes;
+} batch_t;
+
+int cmp_key(const void *a, const void *b) {
+  uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+  return (x > y) - (x < y);
+}
+
+int cmp_query_kmer(const void *a, const void *b) {
+  return cmp_key(&((const query_kmer_t *)a)->key, &((const query_kmer_t *)b)->key);
+}
+
+// Reads the next FASTA record of stream into *name and *seq (sequence lines
+// concatenated). Returns false at the end of the file.
+bool next_record(FILE *stream, char **line, size_t *line_size, bool *has_line, char **name, char **seq, size_t *seq_len, size_t *seq_cap) {
+  ssize_t len;
+  if(!*has_line && (len = getline(line, line_size, stream)) < 0) { return false; }
+  *has_line = false;
+  while((*line)[0] != '>') { // sequence before any header
+    if((len = getline(line, line_size, stream)) < 0) { return false; }
+  }
+  char *beg = *line + 1, *end = beg;
+  while(*end && *end != ' ' && *end != '\t' && *end != '\n' && *end != '\r') { ++end; }
+  *name = strndup(beg, end - beg);
+  *seq_len = 0;
+  while((len = getline(line, line_size, stream)) >= 0) {
+    if((*line)[0] == '>') { *has_line = true; break; }
+    while(len > 0 && ((*line)[len-1] == '\n' || (*line)[len-1] == '\r')) { --len; }
+    if(*seq_len + len > *seq_cap) {
+      *seq_cap = 2*(*seq_len + len);
+      *seq = (char *)realloc(*seq, *seq_cap);
+    }
+    memcpy(*seq + *seq_len, *line, len);
+    *seq_len += len;
+  }
+  return true;
+}
+
+// Looks up all the k-mers of the batch in one pass of increasing keys, fills the
+// bit-matrices and reports the samples containing at least theta of each query.
+void search_batch(batch_t *batch, km_index_t *idx, long min_abund, double theta, FILE *outfile, size_t *n_found) {
+  size_t n_samples = idx->h.n_samples;
+  uint32_t *counts = (uint32_t *)malloc((n_samples ? n_samples : 1)*sizeof(uint32_t));
+  qsort(batch->kmers, batch->n_kmers, sizeof(query_kmer_t), cmp_query_kmer);
+  for(size_t i=0, j; i<batch->n_kmers; i = j) {
+    uint64_t key = batch->kmers[i].key;
+    for(j = i+1; j<batch->n_kmers && batch->kmers[j].key == key; ++j) {}
+    const char *end, *row = km_index_lookup(idx, key, &end);
+    if(row == NULL) { continue; }
+    ++*n_found;
+    km_parse_counts(row, end, counts, n_samples);
+    for(size_t e=i; e<j; ++e) {
+      query_t *q = &batch->queries[batch->kmers[e].query];
+      uint64_t *bits = q->bits + batch->kmers[e].kmer/64, bit = 1ULL << (batch->kmers[e].kmer%64);
+      for(size_t s=0; s<n_samples; ++s) {
+        if(counts[s] >= min_abund) { bits[s*q->words] |= bit; }
+      }
+    }
+  }
+  free(counts);
+
+  for(size_t i=0; i<batch->n_queries; ++i) {
+    query_t *q = &batch->queries[i];
+    for(size_t s=0; s<n_samples && q->n_kmers; ++s) {
+      size_t hits = 0;
+      for(size_t w=0; w<q->words; ++w) { hits += __builtin_popcountll(q->bits[s*q->words + w]); }
+      double frac = (double)hits/q->n_kmers;
+      if(frac >= theta) { fprintf(outfile, "%s\t%zu\t%zu\t%zu\t%.4f\n", q->name, s+1, hits, q->n_kmers, frac); }
+    }
+    free(q->name);
+    free(q->bits);
+  }
+  batch->n_queries = batch->n_kmers = batch->bytes = 0;
+}
+
+
+int main(int argc, char **argv) {
+
+  int ksize = 31;
+  long min_abund = 1;
+  double theta = 0.8;
+  char *out_fname = NULL, *index_fname = NULL;
+  bool use_ktcmp = false, help_opt = false;
+
+  int c;
+  while ((c = getopt(argc, argv, "a:i:k:o:T:zh")) != -1) {
+    switch (c) {
+      case 'a':
+        min_abund = strtol(optarg, NULL, 10);
+        break;
+      case 'i':
+        index_fname = optarg;
+        break;
+      case 'k':
+        ksize = strtol(optarg, NULL, 10);
+        break;
+      case 'o':
+        out_fname = optarg;
+        break;
+      case 'T':
+        theta = atof(optarg);
+        break;
+      case 'z':
+        use_ktcmp = true;
+        break;
+      case 'h':
+        help_opt = true;
+        break;
+      case '?':
+        return 1;
+      default:
+        abort();
+    }
+  }
+
+  if(ksize <= 0 || ksize > 32) {
+    fprintf(stderr, "Invalid value of k: %d (the index requires k <= 32)\n",ksize);
+    return 1;
+  }
+  if(theta < 0 || theta > 1) {
+    fprintf(stderr, "-T must be in the [0,1] interval\n");
+    return 1;
+  }
+
+  if(argc-optind != 2 || help_opt) {
+    fprintf(stdout, "Usage: km_search [options] <matrix> <queries.fa>\n\n");
+    fprintf(stdout, "Report the samples of <matrix> containing at least a fraction of the k-mers\n");
+    fprintf(stdout, "of each query sequence. The matrix must be sorted, with canonical k-mers.\n");
+    fprintf(stdout, "Its sparse index is built on first use and saved to <matrix>.kmi.\n");
+    fprintf(stdout, "Output lines: query, sample (1-based), k-mers found, query k-mers, fraction.\n\n");
+    fprintf(stdout, "Options:\n");
+    fprintf(stdout, "  -k INT    size of k-mers of the matrix (<= 32) [31]\n");
+    fprintf(stdout, "  -a INT    min abundance to define a k-mer as present in a sample [1]\n");
+    fprintf(stdout, "  -T FLOAT  min fraction of the query k-mers present in a sample [0.8]\n");
+    fprintf(stdout, "  -i FILE   index of the matrix [<matrix>.kmi]\n");
+    fprintf(stdout, "  -o FILE   write results to FILE [stdout]\n");
+    fprintf(stdout, "  -z        use kmtricks order of nucleotides: A<C<T<G\n");
+    fprintf(stdout, "  -h        print this help message\n");
+    return 0;
+  }
+
+  km_index_t idx;
+  const char *err = NULL;
+  bool built;
+  int ret = km_index_open(&idx, argv[optind], index_fname, ksize, use_ktcmp, &err, &built);
+  if(ret == 1) {
+    fprintf(stderr,"Cannot open file \"%s\" (the matrix must be a regular file)\n",argv[optind]);
+    return 1;
+  }
+  if(ret == 2) {
+    fprintf(stderr,"Cannot index matrix \"%s\": %s\n",argv[optind],err);
+    return 1;
+  }
+  fprintf(stderr, "[info] %s index: %lu rows, %lu samples, %lu knots\n", built ? "built" : "loaded", idx.h.n_rows, idx.h.n_samples, idx.h.n_knots);
+
+  FILE *queryfile = strcmp(argv[optind+1],"-") ? fopen(argv[optind+1],"r") : stdin;
+  if(queryfile == NULL) {
+    fprintf(stderr,"Cannot open file \"%s\"\n",argv[optind+1]);
+    km_index_close(&idx);
+    return 1;
+  }
+
+  FILE *outfile = out_fname ? fopen(out_fname,"w") : stdout;
+  if(outfile != stdout && outfile == NULL) {
+    fprintf(stderr,"Cannot open output file \"%s\"\n",out_fname);
+    if(queryfile != stdin) { fclose(queryfile); }
+    km_index_close(&idx);
+    return 1;
+  }
+
+  const uint8_t *code = use_ktcmp ? nt2bits_kt : nt2bits;
+  batch_t batch = { NULL, 0, 0, NULL, 0, 0, 0 };
+  char *line = NULL, *name, *seq = NULL;
+  size_t line_size = 0, seq_len, seq_cap = 0, keys_cap = 0;
+  uint64_t *keys = NULL;
+  bool has_line = false;
+  size_t n_queries = 0, n_kmers = 0, n_found = 0;
+  while(next_record(queryfile, &line, &line_size, &has_line, &name, &seq, &seq_len, &seq_cap)) {
+    // distinct canonical k-mers of the query
+    if(seq_len + 1 > keys_cap) {
+      keys_cap = seq_len + 1;
+      keys = (uint64_t *)realloc(keys, keys_cap*sizeof(uint64_t));
+    }
+    size_t n = km_canonical_keys(seq, seq_len, ksize, code, keys);
+    qsort(keys, n, sizeof(uint64_t), cmp_key);
+    size_t n_distinct = 0;
+    for(size_t i=0; i<n; ++i) {
+      if(n_distinct == 0 || keys[i] != keys[n_distinct-1]) { keys[n_distinct++] = keys[i]; }
+    }
+    if(n_distinct == 0) { fprintf(stderr, "[info] query \"%s\" has no k-mer\n", name); }
+
+    query_t q = { name, n_distinct, (n_distinct + 63)/64, NULL };
+    size_t bytes = idx.h.n_samples*q.words*sizeof(uint64_t);
+    if(batch.n_queries > 0 && batch.bytes + bytes > SEARCH_BATCH_BYTES) {
+      search_batch(&batch, &idx, min_abund, theta, outfile, &n_found);
+    }
+    q.bits = (uint64_t *)calloc(bytes ? bytes : 1, 1);
+    if(batch.n_queries == batch.cap) {
+      batch.cap = batch.cap ? 2*batch.cap : 64;
+      batch.queries = (query_t *)realloc(batch.queries, batch.cap*sizeof(query_t));
+    }
+    if(batch.n_kmers + n_distinct > batch.kmers_cap) {
+      batch.kmers_cap = 2*(batch.n_kmers + n_distinct);
+      batch.kmers = (query_kmer_t *)realloc(batch.kmers, batch.kmers_cap*sizeof(query_kmer_t));
+    }
+    for(size_t i=0; i<n_distinct; ++i) {
+      batch.kmers[batch.n_kmers++] = (query_kmer_t){ keys[i], (uint32_t)batch.n_queries, (uint32_t)i };
+    }
+    batch.queries[batch.n_queries++] = q;
+    batch.bytes += bytes;
+    ++n_queries;
+    n_kmers += n_distinct;
+  }
+  search_batch(&batch, &idx, min_abund, theta, outfile, &n_found);
+
+  fprintf(stderr, "[info] %lu\tqueries\n", n_queries);
+  fprintf(stderr, "[info] %lu\tdistinct query k-mers\n", n_kmers);
+  fprintf(stderr, "[info] %lu\tk-mers found in the matrix\n", n_found);
+  fprintf(stderr, "[info] %lu\twindows read\n", idx.n_reads);
+
+  free(keys);
+  free(seq);
+  free(line);
+  free(batch.queries);
+  free(batch.kmers);
+  km_index_close(&idx);
+  if(queryfile != stdin) { fclose(queryfile); }
+  if(outfile != stdout) { fclose(outfile); }
+
+  return 0;
+}
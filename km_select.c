@@ -7,6 +7,12 @@
 #include <stdbool.h>
 #include <string.h>
 
+#include "km_kernels.h"
+#include "km_pool.h"
+#include "km_metrics.h"
+#include "km_trace.h"
+#include "km_arrow.h"
+#include "km_plan.h"
 
 char* next_kmer(char *kmer, int ksize, FILE *stream) {
 
@@ -26,17 +32,22 @@ char* next_kmer(char *kmer, int ksize, FILE *stream) {
   return kmer;
 }
 
-bool next_kmer_and_line(char *kmer, int ksize, char **line, size_t *line_size, FILE *stream) {
+// Reads the next row with a valid k-mer, skipping (and counting in *n_invalid)
+// the other rows, blank lines aside.
+bool next_kmer_and_line(char *kmer, int ksize, char **line, size_t *line_size, FILE *stream, size_t *n_invalid) {
 
-  if(getline(line, line_size, stream) < ksize) { return false; }
-
-  // read first ksize characters in buf
-  for(int i=0; i<ksize; i++) {
-    if(!isalpha((*line)[i])) { return false; }
-    kmer[i] = (*line)[i];
+  ssize_t len;
+  while((len = getline(line, line_size, stream)) >= 0) {
+    int i = 0;
+    if(len >= ksize) {
+      // read first ksize characters in buf
+      for(; i<ksize && nt2bits[(unsigned char)(*line)[i]] <= 3; i++) { kmer[i] = (*line)[i]; }
+    }
+    if(i == ksize) { return true; }
+    if(len > 1 || (*line)[0] != '\n') { ++*n_invalid; }
   }
 
-  return true;
+  return false;
 }
 
 const int n2kt[256] = {
@@ -56,14 +67,256 @@ int ktcmp(const char *k1, const char *k2) {
 }
 
 
+// selection k-mers packed in memory, shared read-only by all targets: sorted
+// for the merge, in a hash set (behind a Bloom filter) for the hash strategies,
+// or in a static search tree
+typedef struct {
+  uint64_t *keys;
+  size_t n_keys;
+  km_keyset_t *set;
+  km_bloom_t *bloom;
+  km_stree_t *tree;
+  const uint8_t *code;
+  int ksize;
+  bool kmtricks;
+  bool do_select;
+  int format;
+  const char *suffix;
+} select_job_t;
+
+// one target matrix, selected by a task of the pool
+typedef struct {
+  select_job_t *job;
+  const char *mat_fname;
+  long index;
+  size_t tot_kmers, kept_kmers, invalid_kmers;
+  int status;
+} select_target_t;
+
+int cmp_key(const void *a, const void *b) {
+  uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+  return (x > y) - (x < y);
+}
+
+// selection k-mers: matrix or list read as text, or mapped k-mer set
+typedef struct {
+  FILE *file;
+  km_ef_t set;
+  bool is_set;
+} selection_t;
+
+// Opens the selection at path, returns false (error reported) if it cannot be.
+bool open_selection(selection_t *sel, const char *path, int ksize, bool kmtricks) {
+  sel->file = NULL;
+  sel->is_set = km_ef_is_set(path);
+  if(!sel->is_set) {
+    sel->file = km_arrow_fopen(path, ksize, kmtricks);
+    if(sel->file == NULL) { fprintf(stderr,"Cannot open file \"%s\"\n",path); }
+    return sel->file != NULL;
+  }
+  const char *err = NULL;
+  int ret = km_ef_open(&sel->set, path, &err);
+  if(ret == 0 && (err = km_ef_check(&sel->set, ksize, kmtricks)) != NULL) {
+    km_ef_unmap(&sel->set);
+    ret = 2;
+  }
+  if(ret == 1) { fprintf(stderr,"Cannot open file \"%s\"\n",path); }
+  if(ret == 2) { fprintf(stderr,"Cannot read set \"%s\": %s\n",path,err); }
+  return ret == 0;
+}
+
+void close_selection(selection_t *sel) {
+  if(sel->is_set) { km_ef_unmap(&sel->set); }
+  else { fclose(sel->file); }
+}
+
+// Loads the packed keys of the selection, sorted and distinct if sorted (or
+// if the selection is a set).
+uint64_t *load_selection(selection_t *sel, int ksize, const uint8_t *code, bool sorted, size_t *n_keys) {
+  if(sel->is_set) { return km_ef_decode(&sel->set, n_keys); }
+  FILE *selfile = sel->file;
+  size_t n = 0, cap = 1<<16;
+  uint64_t *keys = (uint64_t *)malloc(cap*sizeof(uint64_t));
+  char *kmer = (char *)calloc(ksize+1,1);
+  while(next_kmer(kmer, ksize, selfile)) {
+    uint64_t key;
+    if(!km_pack(kmer, ksize, code, &key)) { break; }
+    if(sorted && n > 0 && key <= keys[n-1]) { continue; } // not sorted or duplicated, the two-cursor merge would skip it anyway
+    if(n == cap) {
+      cap *= 2;
+      keys = (uint64_t *)realloc(keys, cap*sizeof(uint64_t));
+    }
+    keys[n++] = key;
+  }
+  free(kmer);
+  *n_keys = n;
+  return keys;
+}
+
+// Builds the hash set (and Bloom filter) of the selection for the hash
+// strategies, or its search tree, which replaces the keys.
+void build_sets(select_job_t *job, int strategy) {
+  job->set = NULL;
+  job->bloom = NULL;
+  job->tree = NULL;
+  if(strategy == KM_PLAN_TREE) {
+    qsort(job->keys, job->n_keys, sizeof(uint64_t), cmp_key);
+    size_t n = 0;
+    for(size_t i=0; i<job->n_keys; ++i) {
+      if(n == 0 || job->keys[i] != job->keys[n-1]) { job->keys[n++] = job->keys[i]; }
+    }
+    job->tree = (km_stree_t *)malloc(sizeof(km_stree_t));
+    km_stree_build(job->tree, job->keys, n);
+    free(job->keys);
+    job->keys = NULL;
+    job->n_keys = n;
+    return;
+  }
+  if(strategy != KM_PLAN_HASH && strategy != KM_PLAN_BLOOM) { return; }
+  job->set = (km_keyset_t *)malloc(sizeof(km_keyset_t));
+  km_keyset_init(job->set, job->n_keys, false);
+  for(size_t i=0; i<job->n_keys; ++i) { km_keyset_add(job->set, job->keys[i]); }
+  if(strategy == KM_PLAN_BLOOM) {
+    job->bloom = (km_bloom_t *)malloc(sizeof(km_bloom_t));
+    km_bloom_init(job->bloom, job->n_keys);
+    for(size_t i=0; i<job->n_keys; ++i) { km_bloom_add(job->bloom, job->keys[i]); }
+  }
+}
+
+void free_sets(select_job_t *job) {
+  if(job->set) { km_keyset_free(job->set); free(job->set); }
+  if(job->bloom) { km_bloom_free(job->bloom); free(job->bloom); }
+  if(job->tree) { km_stree_free(job->tree); free(job->tree); }
+}
+
+// Reads the next row of stream with a valid k-mer and packs its key. The other
+// rows are skipped and counted in *n_invalid (blank lines aside). Returns false
+// at the end of the stream.
+bool next_packed_line(char **line, size_t *line_size, FILE *stream, int ksize, const uint8_t *code, uint64_t *key, size_t *n_invalid) {
+  ssize_t len;
+  while((len = getline(line, line_size, stream)) >= 0) {
+    if(len >= ksize && km_pack(*line, ksize, code, key)) { return true; }
+    if(len > 1 || (*line)[0] != '\n') { ++*n_invalid; }
+  }
+  return false;
+}
+
+// rows looked up at once in the search tree
+#define SELECT_BATCH 256
+
+// Same as select_rows, with lookups in the search tree by batches of rows.
+void select_rows_tree(const select_job_t *job, FILE *matfile, FILE *outfile, size_t *tot, size_t *kept, size_t *invalid) {
+  char *lines[SELECT_BATCH] = { NULL };
+  size_t sizes[SELECT_BATCH] = { 0 }, rank[SELECT_BATCH];
+  uint64_t keys[SELECT_BATCH];
+  size_t tot_kmers = 0, kept_kmers = 0;
+  bool more = true;
+  while(more) {
+    size_t n = 0;
+    while(n < SELECT_BATCH && (more = next_packed_line(&lines[n], &sizes[n], matfile, job->ksize, job->code, &keys[n], invalid))) { ++n; }
+    km_stree_find_batch(job->tree, keys, n, rank);
+    for(size_t i=0; i<n; ++i) {
+      if((rank[i] != SIZE_MAX) == job->do_select) { fputs(lines[i],outfile); kept_kmers++; }
+    }
+    tot_kmers += n;
+  }
+  for(size_t i=0; i<SELECT_BATCH; ++i) { free(lines[i]); }
+  *tot = tot_kmers;
+  *kept = kept_kmers;
+}
+
+// Selects the rows of matfile by a merge with the sorted keys, by probing the
+// hash set or the search tree. Rows without a valid k-mer are skipped and
+// counted in *invalid.
+void select_rows(const select_job_t *job, FILE *matfile, FILE *outfile, size_t *tot, size_t *kept, size_t *invalid) {
+  *invalid = 0;
+  if(job->tree) {
+    select_rows_tree(job, matfile, outfile, tot, kept, invalid);
+    return;
+  }
+  const uint64_t *keys = job->keys;
+  size_t n_keys = job->n_keys, i = 0;
+  char *line = NULL;
+  size_t line_size = 0, tot_kmers = 0, kept_kmers = 0;
+  uint64_t key;
+  while(next_packed_line(&line, &line_size, matfile, job->ksize, job->code, &key, invalid)) {
+    ++tot_kmers;
+    bool found;
+    if(job->set) {
+      found = (job->bloom == NULL || km_bloom_may_have(job->bloom, key)) && km_keyset_has(job->set, key);
+    } else {
+      while(i < n_keys && keys[i] < key) { ++i; }
+      found = i < n_keys && keys[i] == key;
+      if(found) { ++i; }
+    }
+    if(found == job->do_select) { fputs(line,outfile); kept_kmers++; }
+  }
+  free(line);
+  *tot = tot_kmers;
+  *kept = kept_kmers;
+}
+
+int select_target(select_job_t *job, select_target_t *target) {
+  const char *mat_fname = target->mat_fname;
+  FILE *matfile = km_arrow_fopen(mat_fname, job->ksize, job->kmtricks);
+  if(matfile == NULL) {
+    fprintf(stderr,"Cannot open file \"%s\"\n",mat_fname);
+    return 1;
+  }
+
+  size_t fname_size = strlen(mat_fname) + strlen(job->suffix) + 1;
+  char *out_fname = (char *)malloc(fname_size);
+  snprintf(out_fname, fname_size, "%s%s", mat_fname, job->suffix);
+  FILE *outfile = fopen(out_fname,"w");
+  if(outfile == NULL) {
+    fprintf(stderr,"Cannot open output file \"%s\"\n",out_fname);
+    free(out_fname);
+    fclose(matfile);
+    return 1;
+  }
+  km_arrow_out_t arrow_out;
+  FILE *textfile = km_arrow_out_open(&arrow_out, outfile, job->format, job->ksize, job->kmtricks);
+
+  select_rows(job, matfile, textfile, &target->tot_kmers, &target->kept_kmers, &target->invalid_kmers);
+  int ret = km_arrow_out_close(&arrow_out);
+  if(fclose(outfile) != 0 && ret == 0) { ret = 1; }
+  if(ret) { fprintf(stderr,"Cannot write output file \"%s\"\n",out_fname); }
+  free(out_fname);
+  fclose(matfile);
+  return ret ? 1 : 0;
+}
+
+void select_task(void *arg) {
+  select_target_t *target = (select_target_t *)arg;
+  km_stage_mark_t mark;
+  km_stage_begin(&mark);
+  uint64_t trace = km_trace_begin();
+  target->status = select_target(target->job, target);
+  km_stage_end(KM_STAGE_PROCESS, &mark);
+  km_trace_end("process", trace, target->index);
+}
+
+
 int main(int argc, char **argv) {
 
   int ksize = 31;
-  char *out_fname = NULL;
+  int n_threads = 1;
+  int numa_policy = KM_NUMA_NONE;
+  int format = KM_FORMAT_TEXT;
+  int plan_opt = KM_PLAN_AUTO;
+  char *out_fname = NULL, *metrics_fname = NULL, *trace_fname = NULL, *suffix = ".sel";
   bool do_select = true, use_ktcmp = false, help_opt = false;
 
+  static struct option long_opts[] = {
+    {"metrics", required_argument, NULL, KM_OPT_METRICS},
+    {"trace", required_argument, NULL, KM_OPT_TRACE},
+    {"format", required_argument, NULL, KM_OPT_FORMAT},
+    {"plan", required_argument, NULL, KM_OPT_PLAN},
+    {NULL, 0, NULL, 0}
+  };
+
   int c;
-  while ((c = getopt(argc, argv, "k:o:vzh")) != -1) {
+  while ((c = getopt_long(argc, argv, "k:o:P:s:t:vzh", long_opts, NULL)) != -1) {
     switch (c) {
       case 'k':
         ksize = strtol(optarg, NULL, 10);
@@ -71,6 +324,19 @@ int main(int argc, char **argv) {
       case 'o':
         out_fname = optarg;
         break;
+      case 's':
+        suffix = optarg;
+        break;
+      case 'P':
+        numa_policy = km_numa_policy(optarg);
+        if(numa_policy < 0) {
+          fprintf(stderr, "Unknown NUMA placement \"%s\"\n", optarg);
+          return 1;
+        }
+        break;
+      case 't':
+        n_threads = km_pool_threads(optarg);
+        break;
       case 'v':
         do_select = false;
         break;
@@ -80,6 +346,26 @@ int main(int argc, char **argv) {
       case 'h':
         help_opt = true;
         break;
+      case KM_OPT_METRICS:
+        metrics_fname = optarg;
+        break;
+      case KM_OPT_TRACE:
+        trace_fname = optarg;
+        break;
+      case KM_OPT_FORMAT:
+        format = km_format(optarg);
+        if(format < 0) {
+          fprintf(stderr, "Unknown output format \"%s\"\n", optarg);
+          return 1;
+        }
+        break;
+      case KM_OPT_PLAN:
+        plan_opt = km_plan_strategy(optarg);
+        if(plan_opt < KM_PLAN_AUTO) {
+          fprintf(stderr, "Unknown plan \"%s\"\n", optarg);
+          return 1;
+        }
+        break;
       case '?':
         return 1;
       default:
@@ -92,78 +378,253 @@ int main(int argc, char **argv) {
     return 1;
   }
 
-  if(argc-optind != 2 || help_opt) {
-    fprintf(stdout, "Usage: km_select [options] <matrix_1> <matrix_2>\n\n");
+  if(format != KM_FORMAT_TEXT && ksize > 32) {
+    fprintf(stderr, "Arrow output requires k <= 32\n");
+    return 1;
+  }
+
+  if(argc-optind < 2 || help_opt) {
+    fprintf(stdout, "Usage: km_select [options] <matrix_1> <matrix_2> [<matrix_3> ...]\n\n");
     fprintf(stdout, "Select lines from <matrix_2> corresponding to k-mers belonging to <matrix_1>.\n");
-    fprintf(stdout, "Input matrices are assumed to be sorted by k-mer.\n\n");
+    fprintf(stdout, "Input matrices are assumed to be sorted by k-mer.\n");
+    fprintf(stdout, "If several matrices follow <matrix_1>, its k-mers are loaded once in memory\n");
+    fprintf(stdout, "(k <= 32) and the matrices are selected concurrently to <matrix>STR (see -s).\n");
+    fprintf(stdout, "Input matrices may be text or Arrow IPC files or streams (detected).\n");
+    fprintf(stdout, "<matrix_1> may also be a k-mer set built by km_set (detected).\n");
+    fprintf(stdout, "The strategy (merge of sorted inputs, hash set or search tree of <matrix_1>,\n");
+    fprintf(stdout, "lookups in the .kmi index of <matrix_2>) is chosen from samples of the\n");
+    fprintf(stdout, "inputs, see --plan.\n\n");
     fprintf(stdout, "Options:\n");
     fprintf(stdout, "  -k INT   size of k-mers in the input matrices [31]\n");
     fprintf(stdout, "  -o FILE  output matrix to FILE [stdout]\n");
+    fprintf(stdout, "  -s STR   suffix of output matrices when selecting from several matrices [.sel]\n");
+    fprintf(stdout, "  -P STR   NUMA placement of threads and buffers: none, local, interleave [none]\n");
+    fprintf(stdout, "  -t INT   number of threads (one matrix each), 0 for all CPUs [1]\n");
     fprintf(stdout, "  -v       select k-mers that DO NOT belong to <matrix_1>\n");
     fprintf(stdout, "  -z       use kmtricks order of nucleotides: A<C<T<G\n");
+    fprintf(stdout, "      --format STR    output format: text, arrow (IPC file), arrow-stream (IPC stream) [text]\n");
+    fprintf(stdout, "      --plan STR      strategy: auto, merge, hash, bloom, index, tree [auto]\n");
+    fprintf(stdout, "      --metrics FILE  write run metrics (stage times, CPU counters) as JSON to FILE\n");
+    fprintf(stdout, "      --trace FILE    write a timeline of the threads in Chrome trace format to FILE\n");
     fprintf(stdout, "  -h       print this help message\n");
     return 0;
   }
 
-  FILE *selfile = fopen(argv[optind],"r");
-  if(selfile == NULL) {
-    fprintf(stderr,"Cannot open file \"%s\"\n",argv[optind]);
-    return 1;
+  selection_t sel;
+  if(!open_selection(&sel, argv[optind], ksize, use_ktcmp)) { return 1; }
+
+  if(metrics_fname) { km_metrics_init("km_select"); }
+  if(trace_fname) { km_trace_init(); }
+
+  if(argc-optind > 2) {
+    if(ksize > 32) {
+      fprintf(stderr, "Selecting from several matrices requires k <= 32\n");
+      close_selection(&sel);
+      return 1;
+    }
+    if(out_fname) {
+      fprintf(stderr, "Cannot use -o when selecting from several matrices, see -s\n");
+      close_selection(&sel);
+      return 1;
+    }
+
+    // the index serves one matrix only, it is not used here
+    km_plan_input_t build, probe;
+    km_plan_stats(&build, argv[optind], ksize, use_ktcmp);
+    km_plan_stats(&probe, argv[optind+1], ksize, use_ktcmp);
+    km_plan_t plan;
+    km_plan_choose(&plan, &build, &probe, ksize, false, false, plan_opt);
+    km_plan_log(&plan, &build, &probe, stderr);
+
+    select_job_t job;
+    job.ksize = ksize;
+    job.code = use_ktcmp ? nt2bits_kt : nt2bits;
+    job.kmtricks = use_ktcmp;
+    job.format = format;
+    job.do_select = do_select;
+    job.suffix = suffix;
+    km_stage_mark_t mark;
+    km_stage_begin(&mark);
+    uint64_t trace = km_trace_begin();
+    job.keys = load_selection(&sel, ksize, job.code, plan.strategy == KM_PLAN_MERGE, &job.n_keys);
+    build_sets(&job, plan.strategy);
+    km_stage_end(KM_STAGE_LOAD, &mark);
+    km_trace_end("load", trace, -1);
+    close_selection(&sel);
+    fprintf(stderr, "[info] %lu\tselection k-mers\n", job.n_keys);
+
+    size_t n_targets = argc - optind - 1;
+    select_target_t *targets = (select_target_t *)calloc(n_targets, sizeof(select_target_t));
+    if((size_t)n_threads > n_targets) { n_threads = n_targets; }
+    km_numa_t *numa = n_threads > 1 ? km_numa_init(numa_policy) : NULL;
+    if(job.tree) {
+      km_numa_interleave(numa, job.tree->nodes, job.tree->n_nodes*KM_STREE_B*sizeof(uint64_t));
+    } else {
+      km_numa_interleave(numa, job.keys, job.n_keys*sizeof(uint64_t));
+    }
+    km_pool_t *pool = km_pool_create(n_threads, numa);
+    km_group_t group;
+    km_group_init(&group);
+    for(size_t t=0; t<n_targets; ++t) {
+      targets[t] = (select_target_t){ .job = &job, .mat_fname = argv[optind+1+t], .index = (long)t };
+      km_pool_submit(pool, &group, select_task, &targets[t]);
+    }
+    km_pool_wait(pool, &group);
+
+    int ret = 0;
+    for(size_t t=0; t<n_targets; ++t) {
+      if(targets[t].status) { ret = targets[t].status; continue; }
+      fprintf(stderr, "[info] %s: %lu\ttotal k-mers\n", targets[t].mat_fname, targets[t].tot_kmers);
+      fprintf(stderr, "[info] %s: %lu\tretained k-mers\n", targets[t].mat_fname, targets[t].kept_kmers);
+      if(targets[t].invalid_kmers) {
+        fprintf(stderr, "[warning] %s: %lu\trows without a valid k-mer skipped\n", targets[t].mat_fname, targets[t].invalid_kmers);
+      }
+    }
+    if(n_threads > 1 && metrics_fname) { km_pool_report(pool, stderr); }
+    if(km_metrics_write(metrics_fname, km_pool_json, pool)) {
+      fprintf(stderr,"Cannot write metrics file \"%s\"\n",metrics_fname);
+    }
+    if(km_trace_write(trace_fname, "km_select")) {
+      fprintf(stderr,"Cannot write trace file \"%s\"\n",trace_fname);
+    }
+
+    km_pool_destroy(pool);
+    km_numa_free(numa);
+    free(targets);
+    free_sets(&job);
+    free(job.keys);
+    return ret;
   }
 
-  FILE *matfile = fopen(argv[optind+1],"r");
+  FILE *matfile = km_arrow_fopen(argv[optind+1], ksize, use_ktcmp);
   if(matfile == NULL) {
     fprintf(stderr,"Cannot open file \"%s\"\n",argv[optind+1]);
-    fclose(selfile); 
+    close_selection(&sel);
     return 1;
   }
 
   FILE *outfile = out_fname ? fopen(out_fname,"w") : stdout;
   if(outfile != stdout && outfile == NULL) {
     fprintf(stderr,"Cannot open output file \"%s\"\n",out_fname);
-    fclose(selfile);
+    close_selection(&sel);
     fclose(matfile);
     return 1;
   }
+  km_arrow_out_t arrow_out;
+  FILE *textfile = km_arrow_out_open(&arrow_out, outfile, format, ksize, use_ktcmp);
+
+  km_plan_input_t build, probe;
+  km_plan_stats(&build, argv[optind], ksize, use_ktcmp);
+  km_plan_stats(&probe, argv[optind+1], ksize, use_ktcmp);
+  km_plan_t plan;
+  km_plan_choose(&plan, &build, &probe, ksize, do_select, false, plan_opt);
+  km_plan_log(&plan, &build, &probe, stderr);
 
-  char *sel_kmer = (char *)calloc(ksize+1,1);
-  char *mat_kmer = (char *)calloc(ksize+1,1);
   char *line = NULL;
-  size_t line_size = 0;
-
-  bool ret_sel = next_kmer(sel_kmer, ksize, selfile);
-  bool ret_mat = next_kmer_and_line(mat_kmer, ksize, &line, &line_size, matfile);
-  size_t tot_kmers = ret_mat, kept_kmers = 0;
-  while(ret_sel && ret_mat){
-    int ret_cmp = use_ktcmp ? ktcmp(sel_kmer,mat_kmer) : strcmp(sel_kmer, mat_kmer);
-    if(ret_cmp == 0) {
-      if(do_select){ fputs(line,outfile); kept_kmers++; }
-      ret_sel = next_kmer(sel_kmer, ksize, selfile);
-      ret_mat = next_kmer_and_line(mat_kmer, ksize, &line, &line_size, matfile);
-      tot_kmers += ret_mat;
-    } else if(ret_cmp < 0) {
-      ret_sel = next_kmer(sel_kmer, ksize, selfile);
-    } else { // ret_cmp > 0
-      if(!do_select){ fputs(line,outfile); kept_kmers++; }
-      ret_mat = next_kmer_and_line(mat_kmer, ksize, &line, &line_size, matfile);
+  size_t line_size = 0, tot_kmers = 0, kept_kmers = 0, invalid_kmers = 0;
+  int ret = 0;
+
+  km_stage_mark_t mark;
+  km_stage_begin(&mark);
+  uint64_t trace = km_trace_begin();
+  if(plan.strategy == KM_PLAN_HASH || plan.strategy == KM_PLAN_BLOOM || plan.strategy == KM_PLAN_TREE) {
+    select_job_t job = { .code = use_ktcmp ? nt2bits_kt : nt2bits, .ksize = ksize, .kmtricks = use_ktcmp, .do_select = do_select };
+    job.keys = load_selection(&sel, ksize, job.code, false, &job.n_keys);
+    build_sets(&job, plan.strategy);
+    select_rows(&job, matfile, textfile, &tot_kmers, &kept_kmers, &invalid_kmers);
+    free_sets(&job);
+    free(job.keys);
+  } else if(plan.strategy == KM_PLAN_INDEX) {
+    // lookups of the sorted distinct selection k-mers in the index of the matrix
+    size_t n_keys;
+    uint64_t *keys = load_selection(&sel, ksize, use_ktcmp ? nt2bits_kt : nt2bits, false, &n_keys);
+    qsort(keys, n_keys, sizeof(uint64_t), cmp_key);
+    km_index_t idx;
+    const char *err = NULL;
+    bool built;
+    int ret_idx = km_index_open(&idx, argv[optind+1], NULL, ksize, use_ktcmp, &err, &built);
+    if(ret_idx == 0) {
+      fprintf(stderr, "[info] %s index: %lu rows, %lu knots\n", built ? "built" : "loaded", idx.h.n_rows, idx.h.n_knots);
+      for(size_t i=0; i<n_keys; ++i) {
+        if(i > 0 && keys[i] == keys[i-1]) { continue; }
+        const char *end, *row = km_index_find(&idx, keys[i], &end);
+        if(row == NULL) { continue; }
+        fwrite(row, 1, end - row, textfile);
+        fputc('\n', textfile);
+        ++kept_kmers;
+      }
+      tot_kmers = idx.h.n_rows;
+      km_index_close(&idx);
+    } else {
+      fprintf(stderr, "Cannot index matrix \"%s\": %s\n", argv[optind+1], ret_idx == 1 ? "not a regular file" : err);
+      ret = 1;
+    }
+    free(keys);
+  } else if(sel.is_set) {
+    // packed merge, skipping to the key of each row in the set
+    const uint8_t *code = use_ktcmp ? nt2bits_kt : nt2bits;
+    km_ef_cursor_t cur;
+    bool has_key = km_ef_begin(&cur, &sel.set);
+    uint64_t key;
+    while(next_packed_line(&line, &line_size, matfile, ksize, code, &key, &invalid_kmers)) {
+      ++tot_kmers;
+      bool found = has_key && (has_key = km_ef_next_geq(&cur, key)) && cur.key == key;
+      if(found == do_select) { fputs(line,textfile); kept_kmers++; }
+    }
+  } else {
+    char *sel_kmer = (char *)calloc(ksize+1,1);
+    char *mat_kmer = (char *)calloc(ksize+1,1);
+    bool ret_sel = next_kmer(sel_kmer, ksize, sel.file);
+    bool ret_mat = next_kmer_and_line(mat_kmer, ksize, &line, &line_size, matfile, &invalid_kmers);
+    tot_kmers = ret_mat;
+    while(ret_sel && ret_mat){
+      int ret_cmp = use_ktcmp ? ktcmp(sel_kmer,mat_kmer) : strcmp(sel_kmer, mat_kmer);
+      if(ret_cmp == 0) {
+        if(do_select){ fputs(line,textfile); kept_kmers++; }
+        ret_sel = next_kmer(sel_kmer, ksize, sel.file);
+        ret_mat = next_kmer_and_line(mat_kmer, ksize, &line, &line_size, matfile, &invalid_kmers);
+        tot_kmers += ret_mat;
+      } else if(ret_cmp < 0) {
+        ret_sel = next_kmer(sel_kmer, ksize, sel.file);
+      } else { // ret_cmp > 0
+        if(!do_select){ fputs(line,textfile); kept_kmers++; }
+        ret_mat = next_kmer_and_line(mat_kmer, ksize, &line, &line_size, matfile, &invalid_kmers);
+        tot_kmers += ret_mat;
+      }
+    }
+
+    // output possibly remaining k-mers
+    while(ret_mat) {
+      if(!do_select) { fputs(line,textfile); kept_kmers++; }
+      ret_mat = next_kmer_and_line(mat_kmer, ksize, &line, &line_size, matfile, &invalid_kmers);
       tot_kmers += ret_mat;
     }
+    free(sel_kmer);
+    free(mat_kmer);
   }
-  
-  // output possibly remaining k-mers
-  while(ret_mat) {
-    if(!do_select) { fputs(line,outfile); kept_kmers++; }
-    ret_mat = next_kmer_and_line(mat_kmer, ksize, &line, &line_size, matfile);
-    tot_kmers += ret_mat;
+  if(km_arrow_out_close(&arrow_out)) {
+    fprintf(stderr,"Cannot write output\n");
+    ret = 1;
   }
+  km_stage_end(KM_STAGE_PROCESS, &mark);
+  km_trace_end("process", trace, -1);
 
   fprintf(stderr, "[info] %lu\ttotal k-mers\n", tot_kmers);
   fprintf(stderr, "[info] %lu\tretained k-mers\n", kept_kmers);
+  if(invalid_kmers) {
+    fprintf(stderr, "[warning] %lu\trows without a valid k-mer skipped\n", invalid_kmers);
+  }
+  if(km_metrics_write(metrics_fname, NULL, NULL)) {
+    fprintf(stderr,"Cannot write metrics file \"%s\"\n",metrics_fname);
+  }
+  if(km_trace_write(trace_fname, "km_select")) {
+    fprintf(stderr,"Cannot write trace file \"%s\"\n",trace_fname);
+  }
 
   free(line);
-  fclose(selfile);
+  close_selection(&sel);
   fclose(matfile);
   if(outfile != stdout){ fclose(outfile); }
 
-  return 0;
+  return ret;
 }
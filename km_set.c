@@ -0,0 +1,180 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "km_kernels.h"
+#include "km_arrow.h"
+#include "km_ef.h"
+
+// Reads the keys of the first column of input, in increasing order (equal
+// keys skipped). Counts them if w is NULL, else adds them to the set. Returns
+// 0 at the end of the input, else the line of the first k-mer that is invalid
+// or out of order (*err gives which).
+size_t read_keys(FILE *input, int ksize, const uint8_t *code, km_ef_writer_t *w, uint64_t *n_keys, const char **err) {
+  char *line = NULL;
+  size_t line_size = 0, line_num = 0;
+  ssize_t len;
+  uint64_t n = 0, key, last = 0;
+  *err = NULL;
+  while((len = getline(&line, &line_size, input)) >= 0) {
+    ++line_num;
+    if(len == 0 || line[0] == '\n') { continue; }
+    if(len < ksize || !km_pack(line, ksize, code, &key)) { *err = "invalid k-mer"; break; }
+    if(n > 0 && key <= last) {
+      if(key == last) { continue; }
+      *err = "k-mers not sorted";
+      break;
+    }
+    if(w && !km_ef_add(w, key)) { *err = "input changed while read"; break; }
+    last = key;
+    ++n;
+  }
+  free(line);
+  *n_keys = n;
+  return *err ? line_num : 0;
+}
+
+
+int main(int argc, char **argv) {
+
+  int ksize = 31;
+  char *out_fname = NULL;
+  bool decode_opt = false, use_ktcmp = false, help_opt = false;
+
+  int c;
+  while ((c = getopt(argc, argv, "dk:o:zh")) != -1) {
+    switch (c) {
+      case 'd':
+        decode_opt = true;
+        break;
+      case 'k':
+        ksize = strtol(optarg, NULL, 10);
+        break;
+      case 'o':
+        out_fname = optarg;
+        break;
+      case 'z':
+        use_ktcmp = true;
+        break;
+      case 'h':
+        help_opt = true;
+        break;
+      case '?':
+        return 1;
+      default:
+        abort();
+    }
+  }
+
+  if(ksize <= 0 || ksize > 32) {
+    fprintf(stderr, "Invalid value of k: %d (k-mer sets require k <= 32)\n",ksize);
+    return 1;
+  }
+
+  if(argc-optind != 1 || help_opt) {
+    fprintf(stdout, "Usage: km_set [options] <input>\n\n");
+    fprintf(stdout, "Build the compressed k-mer set of a sorted matrix or list of k-mers (first\n");
+    fprintf(stdout, "column, text or Arrow), saved to <input>.kef: the packed k-mers in Elias-Fano\n");
+    fprintf(stdout, "encoding, about 2 + log2(4^k/n) bits per k-mer. km_select and km_diff take a\n");
+    fprintf(stdout, "set wherever they take the k-mers to select or to remove.\n");
+    fprintf(stdout, "With -d, print the k-mers of the set <input> instead.\n\n");
+    fprintf(stdout, "Options:\n");
+    fprintf(stdout, "  -d       print the k-mers of a set\n");
+    fprintf(stdout, "  -k INT   size of k-mers, at most 32 [31]\n");
+    fprintf(stdout, "  -o FILE  write the set to FILE [<input>.kef], with -d the k-mers [stdout]\n");
+    fprintf(stdout, "  -z       use kmtricks order of nucleotides: A<C<T<G\n");
+    fprintf(stdout, "  -h       print this help message\n");
+    return 0;
+  }
+
+  const char *in_fname = argv[optind];
+  if(decode_opt) {
+    km_ef_t set;
+    const char *err = NULL;
+    int ret = km_ef_open(&set, in_fname, &err);
+    if(ret) {
+      if(ret == 1) { fprintf(stderr,"Cannot open file \"%s\"\n",in_fname); }
+      else { fprintf(stderr,"Cannot read set \"%s\": %s\n",in_fname,err); }
+      return 1;
+    }
+    FILE *outfile = out_fname ? fopen(out_fname,"w") : stdout;
+    if(outfile != stdout && outfile == NULL) {
+      fprintf(stderr,"Cannot open output file \"%s\"\n",out_fname);
+      km_ef_unmap(&set);
+      return 1;
+    }
+    fprintf(stderr, "[info] %lu k-mers, k = %u%s, %lu low bits\n", set.h.n, set.h.ksize, set.h.kmtricks ? ", kmtricks order" : "", set.h.low_bits);
+    const char *nuc = set.h.kmtricks ? "ACTG" : "ACGT";
+    int k = set.h.ksize;
+    char kmer[34];
+    kmer[k] = '\n';
+    km_ef_cursor_t cur;
+    for(bool ok = km_ef_begin(&cur, &set); ok; ok = km_ef_next(&cur)) {
+      uint64_t key = cur.key;
+      for(int i=k-1; i>=0; --i) { kmer[i] = nuc[key & 3]; key >>= 2; }
+      fwrite(kmer, 1, k+1, outfile);
+    }
+    km_ef_unmap(&set);
+    if(outfile != stdout && fclose(outfile) != 0) {
+      fprintf(stderr,"Cannot write output file \"%s\"\n",out_fname);
+      return 1;
+    }
+    return 0;
+  }
+
+  // the keys are counted in a first pass, the encoding depends on their number
+  struct stat st;
+  if(stat(in_fname, &st) != 0 || !S_ISREG(st.st_mode)) {
+    fprintf(stderr,"Cannot open file \"%s\" (the input must be a regular file)\n",in_fname);
+    return 1;
+  }
+  const uint8_t *code = use_ktcmp ? nt2bits_kt : nt2bits;
+  FILE *input = km_arrow_fopen(in_fname, ksize, use_ktcmp);
+  if(input == NULL) {
+    fprintf(stderr,"Cannot open file \"%s\"\n",in_fname);
+    return 1;
+  }
+  uint64_t n_keys, n_added;
+  const char *err;
+  size_t line_num = read_keys(input, ksize, code, NULL, &n_keys, &err);
+  fclose(input);
+  if(line_num) {
+    fprintf(stderr,"Cannot build the set of \"%s\": %s at line %zu\n",in_fname,err,line_num);
+    return 1;
+  }
+
+  char *path = NULL;
+  if(out_fname == NULL) {
+    path = (char *)malloc(strlen(in_fname) + sizeof(KM_EF_EXT));
+    sprintf(path, "%s%s", in_fname, KM_EF_EXT);
+    out_fname = path;
+  }
+  km_ef_writer_t w;
+  if(!km_ef_create(&w, out_fname, ksize, use_ktcmp, n_keys)) {
+    fprintf(stderr,"Cannot open output file \"%s\"\n",out_fname);
+    free(path);
+    return 1;
+  }
+  input = km_arrow_fopen(in_fname, ksize, use_ktcmp);
+  line_num = input ? read_keys(input, ksize, code, &w, &n_added, &err) : 0;
+  if(input) { fclose(input); }
+  int ret = 0;
+  if(input == NULL || line_num || n_added != n_keys) {
+    fprintf(stderr,"Cannot build the set of \"%s\": %s\n",in_fname,input == NULL ? "cannot reopen the input" : line_num ? err : "input changed while read");
+    km_ef_close(&w);
+    ret = 1;
+  } else if(!km_ef_close(&w)) {
+    fprintf(stderr,"Cannot write output file \"%s\"\n",out_fname);
+    ret = 1;
+  } else {
+    size_t bytes = km_ef_file_size(&w.h);
+    fprintf(stderr, "[info] %lu k-mers, %zu bytes (%.2f bits per k-mer)\n", n_keys, bytes, n_keys ? 8.0*bytes/n_keys : 0.0);
+  }
+  if(ret) { unlink(out_fname); }
+  free(path);
+  return ret;
+}
@@ -0,0 +1,123 @@
+#ifndef KM_STREE_H
+#define KM_STREE_H
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+
+// Static search tree (S+ tree) of sorted distinct packed keys, searched in
+// place of a binary search over the sorted array.
+//
+// The keys are the leaves, in nodes of KM_STREE_B keys (one cache line), and
+// each inner node holds the smallest key of its KM_STREE_B children but the
+// first, so that a lookup reads one cache line per level (log_9(n/8) + 1 lines
+// instead of log_2(n)) and counts the keys of the node lower than the target
+// without branches, a loop the compiler turns into vector compares when the
+// target has them (e.g. -march=x86-64-v3). Layers are stored root first and
+// missing keys are UINT64_MAX.
+//
+// Batched lookups descend KM_STREE_LANES searches level by level, prefetching
+// the node of the next level of each one, so that the misses of the lanes
+// overlap instead of being paid one after the other.
+
+#define KM_STREE_B 8
+#define KM_STREE_LANES 16
+#define KM_STREE_MAX_HEIGHT 24
+
+typedef struct {
+  uint64_t *nodes;                          // all layers, 64-byte aligned
+  size_t layer[KM_STREE_MAX_HEIGHT];        // first node of each layer, layer 0 = leaves
+  size_t n_nodes;                           // of all layers
+  int height;
+  size_t n;                                 // keys
+} km_stree_t;
+
+// number of nodes of layer h of a tree of the given leaves
+static inline size_t km_stree_layer_nodes(size_t leaves, int h) {
+  size_t n = leaves;
+  for(int i=0; i<h; ++i) { n = (n + KM_STREE_B) / (KM_STREE_B + 1); }
+  return n;
+}
+
+// Builds the tree of the n sorted distinct keys, which are copied.
+static void km_stree_build(km_stree_t *t, const uint64_t *keys, size_t n) {
+  size_t leaves = n ? (n + KM_STREE_B - 1) / KM_STREE_B : 1;
+  t->n = n;
+  t->height = 1;
+  while(km_stree_layer_nodes(leaves, t->height - 1) > 1) { ++t->height; }
+  size_t total = 0;
+  for(int h=t->height-1; h>=0; --h) {
+    t->layer[h] = total;
+    total += km_stree_layer_nodes(leaves, h);
+  }
+  t->n_nodes = total;
+  t->nodes = (uint64_t *)aligned_alloc(64, total*KM_STREE_B*sizeof(uint64_t));
+  memset(t->nodes, 0xFF, total*KM_STREE_B*sizeof(uint64_t));
+  if(n) { memcpy(t->nodes + t->layer[0]*KM_STREE_B, keys, n*sizeof(uint64_t)); }
+
+  // key j of node k of layer h: first key of the subtree of child k*(B+1)+j+1,
+  // i.e. of its leftmost leaf
+  size_t span = 1; // leaves per node of the layer below
+  for(int h=1; h<t->height; ++h) {
+    uint64_t *layer = t->nodes + t->layer[h]*KM_STREE_B;
+    size_t n_nodes = km_stree_layer_nodes(leaves, h);
+    for(size_t k=0; k<n_nodes; ++k) {
+      for(size_t j=0; j<KM_STREE_B; ++j) {
+        size_t leaf = (k*(KM_STREE_B+1) + j + 1) * span;
+        if(leaf*KM_STREE_B < n) { layer[k*KM_STREE_B + j] = keys[leaf*KM_STREE_B]; }
+      }
+    }
+    span *= KM_STREE_B + 1;
+  }
+}
+
+static void km_stree_free(km_stree_t *t) { free(t->nodes); }
+
+// keys of the node lower than key
+static inline unsigned km_stree_rank_node(const uint64_t *node, uint64_t key) {
+  unsigned r = 0;
+  for(int j=0; j<KM_STREE_B; ++j) { r += node[j] < key; }
+  return r;
+}
+
+// Rank of the first key >= key (t->n if none), as a lower bound in the sorted keys.
+static inline size_t km_stree_lower_bound(const km_stree_t *t, uint64_t key) {
+  size_t k = 0;
+  for(int h=t->height-1; h>0; --h) {
+    k = k*(KM_STREE_B+1) + km_stree_rank_node(t->nodes + (t->layer[h] + k)*KM_STREE_B, key);
+  }
+  size_t r = k*KM_STREE_B + km_stree_rank_node(t->nodes + (t->layer[0] + k)*KM_STREE_B, key);
+  return r < t->n ? r : t->n;
+}
+
+static inline bool km_stree_has(const km_stree_t *t, uint64_t key) {
+  size_t r = km_stree_lower_bound(t, key);
+  return r < t->n && t->nodes[t->layer[0]*KM_STREE_B + r] == key;
+}
+
+// Looks up the n keys, sets rank[i] to the rank of keys[i] in the tree or to
+// SIZE_MAX if absent. The lookups run KM_STREE_LANES at a time, level by level.
+static void km_stree_find_batch(const km_stree_t *t, const uint64_t *keys, size_t n, size_t *rank) {
+  const uint64_t *leaves = t->nodes + t->layer[0]*KM_STREE_B;
+  size_t k[KM_STREE_LANES];
+  for(size_t beg=0; beg<n; beg += KM_STREE_LANES) {
+    size_t lanes = n - beg < KM_STREE_LANES ? n - beg : KM_STREE_LANES;
+    const uint64_t *x = keys + beg;
+    for(size_t l=0; l<lanes; ++l) { k[l] = 0; }
+    for(int h=t->height-1; h>0; --h) {
+      const uint64_t *layer = t->nodes + t->layer[h]*KM_STREE_B;
+      const uint64_t *below = t->nodes + t->layer[h-1]*KM_STREE_B;
+      for(size_t l=0; l<lanes; ++l) {
+        k[l] = k[l]*(KM_STREE_B+1) + km_stree_rank_node(layer + k[l]*KM_STREE_B, x[l]);
+        __builtin_prefetch(below + k[l]*KM_STREE_B);
+      }
+    }
+    for(size_t l=0; l<lanes; ++l) {
+      size_t r = k[l]*KM_STREE_B + km_stree_rank_node(leaves + k[l]*KM_STREE_B, x[l]);
+      rank[beg+l] = r < t->n && leaves[r] == x[l] ? r : SIZE_MAX;
+    }
+  }
+}
+
+#endif
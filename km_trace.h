@@ -0,0 +1,127 @@
+#ifndef KM_TRACE_H
+#define KM_TRACE_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <time.h>
+
+// Optional timeline of a run (--trace FILE) in the Chrome trace event format,
+// to be opened in chrome://tracing or Perfetto. Every thread appends complete
+// events (name, begin, duration, chunk) to its own buffer without any lock;
+// buffers are linked once into a global list, written and freed at the end of
+// the run.
+
+#define KM_OPT_TRACE 257
+#define KM_TRACE_BLOCK 4096
+
+typedef struct {
+  const char *name;
+  uint64_t begin_ns, end_ns;
+  long chunk;              // chunk index, -1 if none
+} km_trace_event_t;
+
+typedef struct km_trace_buf_s {
+  int tid;
+  km_trace_event_t *events;
+  size_t n_events, cap;
+  struct km_trace_buf_s *next;
+} km_trace_buf_t;
+
+typedef struct {
+  uint64_t start_ns;
+  _Atomic(km_trace_buf_t *) bufs;
+  atomic_int n_threads;
+} km_trace_t;
+
+// NULL when no trace is requested, events then cost nothing
+static km_trace_t *km_trace = NULL;
+static __thread km_trace_buf_t *km_trace_own = NULL;
+
+static inline uint64_t km_trace_now_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec*1000000000ULL + ts.tv_nsec;
+}
+
+static km_trace_buf_t *km_trace_buf() {
+  if(km_trace_own == NULL) {
+    km_trace_buf_t *buf = (km_trace_buf_t *)calloc(1, sizeof(km_trace_buf_t));
+    buf->tid = atomic_fetch_add(&km_trace->n_threads, 1);
+    buf->next = atomic_load(&km_trace->bufs);
+    while(!atomic_compare_exchange_weak(&km_trace->bufs, &buf->next, buf)) {}
+    km_trace_own = buf;
+  }
+  return km_trace_own;
+}
+
+// Starts the trace, the calling thread being thread 0.
+static void km_trace_init() {
+  km_trace = (km_trace_t *)calloc(1, sizeof(km_trace_t));
+  km_trace->start_ns = km_trace_now_ns();
+  atomic_init(&km_trace->bufs, NULL);
+  atomic_init(&km_trace->n_threads, 0);
+  km_trace_buf();
+}
+
+static inline uint64_t km_trace_begin() {
+  return km_trace ? km_trace_now_ns() : 0;
+}
+
+// Records the event name started at begin_ns (from km_trace_begin) and ending now.
+static inline void km_trace_end(const char *name, uint64_t begin_ns, long chunk) {
+  if(km_trace == NULL) { return; }
+  uint64_t end_ns = km_trace_now_ns();
+  km_trace_buf_t *buf = km_trace_buf();
+  if(buf->n_events == buf->cap) {
+    buf->cap += KM_TRACE_BLOCK;
+    buf->events = (km_trace_event_t *)realloc(buf->events, buf->cap*sizeof(km_trace_event_t));
+  }
+  buf->events[buf->n_events++] = (km_trace_event_t){ name, begin_ns, end_ns, chunk };
+}
+
+// Frees the buffers of all threads, after which events are no longer recorded.
+static void km_trace_free() {
+  if(km_trace == NULL) { return; }
+  km_trace_buf_t *buf = atomic_load(&km_trace->bufs);
+  while(buf) {
+    km_trace_buf_t *next = buf->next;
+    free(buf->events);
+    free(buf);
+    buf = next;
+  }
+  free(km_trace);
+  km_trace = NULL;
+  km_trace_own = NULL;
+}
+
+// Writes the trace to fname, once all threads are done, then frees it (see
+// km_trace_free).
+static int km_trace_write(const char *fname, const char *tool) {
+  if(km_trace == NULL) { return 0; }
+  FILE *fp = fopen(fname, "w");
+  if(fp == NULL) {
+    km_trace_free();
+    return 1;
+  }
+  fprintf(fp, "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n");
+  fprintf(fp, "{\"name\": \"process_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": 0, \"args\": {\"name\": \"%s\"}}", tool);
+  for(km_trace_buf_t *buf = atomic_load(&km_trace->bufs); buf; buf = buf->next) {
+    fprintf(fp, ",\n{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": %d, \"args\": {\"name\": \"%s %d\"}}", buf->tid, buf->tid ? "worker" : "main", buf->tid);
+    for(size_t i=0; i<buf->n_events; ++i) {
+      km_trace_event_t *ev = &buf->events[i];
+      fprintf(fp, ",\n{\"name\": \"%s\", \"ph\": \"X\", \"pid\": 1, \"tid\": %d, \"ts\": %.3f, \"dur\": %.3f",
+              ev->name, buf->tid, (ev->begin_ns - km_trace->start_ns)/1e3, (ev->end_ns - ev->begin_ns)/1e3);
+      if(ev->chunk >= 0) { fprintf(fp, ", \"args\": {\"chunk\": %ld}", ev->chunk); }
+      fprintf(fp, "}");
+    }
+  }
+  fprintf(fp, "\n]}\n");
+  fclose(fp);
+  km_trace_free();
+  return 0;
+}
+
+#endif
@@ -0,0 +1,369 @@
+#define PY_SSIZE_T_CLEAN
+#include <Python.h>
+#include <pythread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "km_kernels.h"
+
+// C reader of k-mer matrices for the Python scripts (see km_matrix.py): rows are
+// parsed in blocks into a bytearray of packed keys (uint64) and a bytearray of
+// counts (uint32, row-major), which km_matrix.py exposes as NumPy views, so no
+// Python object is created per cell.
+
+// The counts of a block take at most this many bytes, whatever max_rows, and
+// the block grows up to it as rows are read.
+#define KM_BLOCK_BYTES (64 << 20)
+#define KM_BLOCK_FIRST_ROWS 1024
+
+typedef struct {
+  PyObject_HEAD
+  PyThread_type_lock lock; // held while the file and the line buffer are used
+  FILE *fp;
+  int ksize;
+  const uint8_t *code;
+  Py_ssize_t n_samples;   // -1 until the first row is read
+  char *line;
+  size_t line_size;
+  ssize_t line_len;       // length of the line read ahead, -1 at end of file
+  size_t line_num;
+} ReaderObject;
+
+// Parses the counts of a row into counts, returns the number of values or -1 on
+// a value that is not a non-negative integer.
+static Py_ssize_t parse_counts(const char *p, const char *end, uint32_t *counts, Py_ssize_t max) {
+  Py_ssize_t n = 0;
+  while(p < end) {
+    while(p < end && km_isblank(*p)) { ++p; }
+    if(p == end) { break; }
+    uint64_t val = 0;
+    const char *beg = p;
+    while(p < end && (unsigned char)(*p - '0') < 10) { val = val*10 + (*p - '0'); ++p; }
+    if(p == beg || (p < end && !km_isblank(*p)) || val > UINT32_MAX) { return -1; }
+    if(n < max) { counts[n] = (uint32_t)val; }
+    ++n;
+  }
+  return n;
+}
+
+static int reader_next_line(ReaderObject *self) {
+  do {
+    self->line_len = getline(&self->line, &self->line_size, self->fp);
+    ++self->line_num;
+  } while(self->line_len == 0 || (self->line_len == 1 && self->line[0] == '\n'));
+  return self->line_len >= 0;
+}
+
+// Takes the lock of the reader, releasing the GIL while waiting for another
+// thread that reads a block.
+static void reader_lock(ReaderObject *self) {
+  if(!PyThread_acquire_lock(self->lock, NOWAIT_LOCK)) {
+    Py_BEGIN_ALLOW_THREADS
+    PyThread_acquire_lock(self->lock, WAIT_LOCK);
+    Py_END_ALLOW_THREADS
+  }
+}
+
+static PyObject *Reader_new(PyTypeObject *type, PyObject *args, PyObject *kwds) {
+  ReaderObject *self = (ReaderObject *)type->tp_alloc(type, 0);
+  if(self == NULL) { return NULL; }
+  self->lock = PyThread_allocate_lock();
+  if(self->lock == NULL) {
+    Py_DECREF(self);
+    PyErr_SetString(PyExc_MemoryError, "cannot allocate the lock of the reader");
+    return NULL;
+  }
+  return (PyObject *)self;
+}
+
+static int Reader_init(ReaderObject *self, PyObject *args, PyObject *kwds) {
+  static char *kwlist[] = { "path", "ksize", "kmtricks", NULL };
+  const char *path;
+  int ksize = 31, kmtricks = 0;
+  if(!PyArg_ParseTupleAndKeywords(args, kwds, "s|ip", kwlist, &path, &ksize, &kmtricks)) { return -1; }
+  if(ksize <= 0 || ksize > 32) {
+    PyErr_Format(PyExc_ValueError, "invalid value of k: %d (packed keys require 1 <= k <= 32)", ksize);
+    return -1;
+  }
+  reader_lock(self);
+  if(self->fp) { fclose(self->fp); }
+  self->fp = fopen(path, "r");
+  if(self->fp == NULL) {
+    PyThread_release_lock(self->lock);
+    PyErr_SetFromErrnoWithFilename(PyExc_OSError, path);
+    return -1;
+  }
+  self->ksize = ksize;
+  self->code = kmtricks ? nt2bits_kt : nt2bits;
+  self->line_num = 0;
+  reader_next_line(self);
+
+  // number of samples from the first row
+  self->n_samples = 0;
+  if(self->line_len >= 0) {
+    const char *end = self->line + self->line_len;
+    self->n_samples = parse_counts(km_skip_kmer(self->line, end), end, NULL, 0);
+  }
+  PyThread_release_lock(self->lock);
+  if(self->n_samples < 0) {
+    PyErr_Format(PyExc_ValueError, "invalid count at line 1");
+    return -1;
+  }
+  return 0;
+}
+
+static void Reader_dealloc(ReaderObject *self) {
+  if(self->fp) { fclose(self->fp); }
+  free(self->line);
+  if(self->lock) { PyThread_free_lock(self->lock); }
+  Py_TYPE(self)->tp_free((PyObject *)self);
+}
+
+// Parses rows into keys and counts, from row n to at most max_rows. Returns the
+// new number of rows, sets *err on an invalid row. Called without the GIL.
+static Py_ssize_t reader_parse(ReaderObject *self, uint64_t *k, uint32_t *c, Py_ssize_t n, Py_ssize_t max_rows, const char **err) {
+  Py_ssize_t n_samples = self->n_samples;
+  while(n < max_rows && self->line_len >= 0) {
+    const char *line = self->line, *end = line + self->line_len;
+    if(self->line_len < self->ksize || !km_pack(line, self->ksize, self->code, &k[n])) {
+      *err = "invalid k-mer";
+      break;
+    }
+    const char *p = km_skip_kmer(line, end);
+    if(p - line != self->ksize) {
+      *err = "k-mer of unexpected size";
+      break;
+    }
+    Py_ssize_t n_values = parse_counts(p, end, c + n*n_samples, n_samples);
+    if(n_values != n_samples) {
+      *err = n_values < 0 ? "invalid count" : "unexpected number of counts";
+      break;
+    }
+    ++n;
+    reader_next_line(self);
+  }
+  return n;
+}
+
+// Reads up to max_rows rows, fewer if their counts would take more than
+// KM_BLOCK_BYTES. Returns (keys, counts) bytearrays, or None at the end of the
+// matrix.
+static PyObject *Reader_read_block(ReaderObject *self, PyObject *args) {
+  Py_ssize_t max_rows = 1<<16;
+  if(!PyArg_ParseTuple(args, "|n", &max_rows)) { return NULL; }
+  if(max_rows <= 0) {
+    PyErr_SetString(PyExc_ValueError, "max_rows must be positive");
+    return NULL;
+  }
+  reader_lock(self);
+  if(self->fp == NULL || self->line_len < 0) {
+    PyThread_release_lock(self->lock);
+    Py_RETURN_NONE;
+  }
+
+  Py_ssize_t n_samples = self->n_samples;
+  Py_ssize_t row_bytes = n_samples*sizeof(uint32_t);
+  if(row_bytes > 0 && max_rows > KM_BLOCK_BYTES / row_bytes) {
+    max_rows = KM_BLOCK_BYTES / row_bytes > 0 ? KM_BLOCK_BYTES / row_bytes : 1;
+  }
+  Py_ssize_t cap = max_rows < KM_BLOCK_FIRST_ROWS ? max_rows : KM_BLOCK_FIRST_ROWS;
+  PyObject *keys = PyByteArray_FromStringAndSize(NULL, cap*sizeof(uint64_t));
+  PyObject *counts = PyByteArray_FromStringAndSize(NULL, cap*row_bytes);
+  Py_ssize_t n = 0;
+  const char *err = NULL;
+  bool failed = keys == NULL || counts == NULL;
+  while(!failed) {
+    uint64_t *k = (uint64_t *)PyByteArray_AS_STRING(keys);
+    uint32_t *c = (uint32_t *)PyByteArray_AS_STRING(counts);
+    // the bytearrays are not visible to Python yet and self is locked, the
+    // GIL can be released
+    Py_BEGIN_ALLOW_THREADS
+    n = reader_parse(self, k, c, n, cap, &err);
+    Py_END_ALLOW_THREADS
+    if(err || n < cap || cap == max_rows) { break; }
+    cap = 2*cap < max_rows ? 2*cap : max_rows;
+    failed = PyByteArray_Resize(keys, cap*sizeof(uint64_t)) < 0 || PyByteArray_Resize(counts, cap*row_bytes) < 0;
+  }
+  size_t line_num = self->line_num;
+  PyThread_release_lock(self->lock);
+
+  if(err) { PyErr_Format(PyExc_ValueError, "%s at line %zu", err, line_num); }
+  if(failed || err || PyByteArray_Resize(keys, n*sizeof(uint64_t)) < 0 || PyByteArray_Resize(counts, n*row_bytes) < 0) {
+    Py_XDECREF(keys);
+    Py_XDECREF(counts);
+    return NULL;
+  }
+  return Py_BuildValue("(NN)", keys, counts);
+}
+
+static PyObject *Reader_get_n_samples(ReaderObject *self, void *closure) {
+  return PyLong_FromSsize_t(self->n_samples);
+}
+
+static PyObject *Reader_get_ksize(ReaderObject *self, void *closure) {
+  return PyLong_FromLong(self->ksize);
+}
+
+static PyMethodDef Reader_methods[] = {
+  { "read_block", (PyCFunction)Reader_read_block, METH_VARARGS,
+    "read_block(max_rows=65536) -> (keys, counts) bytearrays of uint64 and uint32, or None at the end;\n"
+    "blocks are cut to 64 MiB of counts" },
+  { NULL }
+};
+
+static PyGetSetDef Reader_getset[] = {
+  { "n_samples", (getter)Reader_get_n_samples, NULL, "number of samples (count columns)", NULL },
+  { "ksize", (getter)Reader_get_ksize, NULL, "size of the k-mers", NULL },
+  { NULL }
+};
+
+static PyTypeObject ReaderType = {
+  PyVarObject_HEAD_INIT(NULL, 0)
+  .tp_name = "_km_matrix.Reader",
+  .tp_doc = "Reader(path, ksize=31, kmtricks=False): text k-mer matrix read by blocks of rows",
+  .tp_basicsize = sizeof(ReaderObject),
+  .tp_flags = Py_TPFLAGS_DEFAULT,
+  .tp_new = Reader_new,
+  .tp_init = (initproc)Reader_init,
+  .tp_dealloc = (destructor)Reader_dealloc,
+  .tp_methods = Reader_methods,
+  .tp_getset = Reader_getset,
+};
+
+static int get_keys(PyObject *obj, Py_buffer *view, const char *name) {
+  if(PyObject_GetBuffer(obj, view, PyBUF_C_CONTIGUOUS) < 0) { return -1; }
+  if(view->len % sizeof(uint64_t)) {
+    PyErr_Format(PyExc_ValueError, "%s must be a buffer of uint64", name);
+    PyBuffer_Release(view);
+    return -1;
+  }
+  return 0;
+}
+
+// lookup(keys, queries): index of each query in the sorted keys, -1 if absent
+static PyObject *km_lookup(PyObject *module, PyObject *args) {
+  PyObject *keys_obj, *queries_obj;
+  if(!PyArg_ParseTuple(args, "OO", &keys_obj, &queries_obj)) { return NULL; }
+  Py_buffer kv, qv;
+  if(get_keys(keys_obj, &kv, "keys") < 0) { return NULL; }
+  if(get_keys(queries_obj, &qv, "queries") < 0) { PyBuffer_Release(&kv); return NULL; }
+  size_t n_keys = kv.len / sizeof(uint64_t), n_queries = qv.len / sizeof(uint64_t);
+  PyObject *res = PyByteArray_FromStringAndSize(NULL, n_queries*sizeof(int64_t));
+  if(res) {
+    const uint64_t *keys = (const uint64_t *)kv.buf, *queries = (const uint64_t *)qv.buf;
+    int64_t *idx = (int64_t *)PyByteArray_AS_STRING(res);
+    Py_BEGIN_ALLOW_THREADS
+    for(size_t i=0; i<n_queries; ++i) {
+      size_t lo = 0, hi = n_keys;
+      while(lo < hi) {
+        size_t mid = lo + (hi-lo)/2;
+        if(keys[mid] < queries[i]) { lo = mid+1; } else { hi = mid; }
+      }
+      idx[i] = lo < n_keys && keys[lo] == queries[i] ? (int64_t)lo : -1;
+    }
+    Py_END_ALLOW_THREADS
+  }
+  PyBuffer_Release(&kv);
+  PyBuffer_Release(&qv);
+  return res;
+}
+
+// sequence_keys(seq, ksize, kmtricks=False, both_strands=True): packed keys of
+// the k-mers of seq (and of its reverse complement), skipping non-ACGT windows
+static PyObject *km_sequence_keys(PyObject *module, PyObject *args, PyObject *kwds) {
+  static char *kwlist[] = { "seq", "ksize", "kmtricks", "both_strands", NULL };
+  const char *seq;
+  Py_ssize_t len;
+  int ksize, kmtricks = 0, both = 1;
+  if(!PyArg_ParseTupleAndKeywords(args, kwds, "s#i|pp", kwlist, &seq, &len, &ksize, &kmtricks, &both)) { return NULL; }
+  if(ksize <= 0 || ksize > 32) {
+    PyErr_Format(PyExc_ValueError, "invalid value of k: %d (packed keys require 1 <= k <= 32)", ksize);
+    return NULL;
+  }
+  Py_ssize_t n_win = len >= ksize ? len - ksize + 1 : 0;
+  PyObject *res = PyByteArray_FromStringAndSize(NULL, n_win*(both ? 2 : 1)*sizeof(uint64_t));
+  if(res == NULL) { return NULL; }
+  uint64_t *out = (uint64_t *)PyByteArray_AS_STRING(res);
+  const uint8_t *code = kmtricks ? nt2bits_kt : nt2bits;
+  // complement of a code: A<->T and C<->G, i.e. 3-x in lexicographic order, x^2 in kmtricks order
+  uint64_t comp_xor = kmtricks ? 2 : 3;
+  uint64_t mask = ksize == 32 ? UINT64_MAX : (1ULL << (2*ksize)) - 1;
+  uint64_t fwd = 0, rev = 0;
+  Py_ssize_t n = 0;
+  int valid = 0; // length of the current run of nucleotides
+  for(Py_ssize_t i=0; i<len; ++i) {
+    uint8_t b = code[(unsigned char)seq[i]];
+    if(b > 3) { valid = 0; continue; }
+    fwd = ((fwd << 2) | b) & mask;
+    rev = (rev >> 2) | ((uint64_t)(b ^ comp_xor) << (2*(ksize-1)));
+    if(++valid >= ksize) {
+      out[n++] = fwd;
+      if(both) { out[n++] = rev; }
+    }
+  }
+  if(PyByteArray_Resize(res, n*sizeof(uint64_t)) < 0) { Py_DECREF(res); return NULL; }
+  return res;
+}
+
+// unpack(key, ksize, kmtricks=False): k-mer of a packed key
+static PyObject *km_unpack(PyObject *module, PyObject *args, PyObject *kwds) {
+  static char *kwlist[] = { "key", "ksize", "kmtricks", NULL };
+  unsigned long long key;
+  int ksize, kmtricks = 0;
+  if(!PyArg_ParseTupleAndKeywords(args, kwds, "Ki|p", kwlist, &key, &ksize, &kmtricks)) { return NULL; }
+  if(ksize <= 0 || ksize > 32) {
+    PyErr_Format(PyExc_ValueError, "invalid value of k: %d (packed keys require 1 <= k <= 32)", ksize);
+    return NULL;
+  }
+  const char *nuc = kmtricks ? "ACTG" : "ACGT";
+  char kmer[32];
+  for(int i=ksize-1; i>=0; --i) { kmer[i] = nuc[key & 3]; key >>= 2; }
+  return PyUnicode_FromStringAndSize(kmer, ksize);
+}
+
+// pack(kmer, kmtricks=False): packed key of a k-mer
+static PyObject *km_pack_py(PyObject *module, PyObject *args, PyObject *kwds) {
+  static char *kwlist[] = { "kmer", "kmtricks", NULL };
+  const char *kmer;
+  Py_ssize_t len;
+  int kmtricks = 0;
+  if(!PyArg_ParseTupleAndKeywords(args, kwds, "s#|p", kwlist, &kmer, &len, &kmtricks)) { return NULL; }
+  uint64_t key;
+  if(len == 0 || len > 32 || !km_pack(kmer, len, kmtricks ? nt2bits_kt : nt2bits, &key)) {
+    PyErr_Format(PyExc_ValueError, "invalid k-mer \"%s\"", kmer);
+    return NULL;
+  }
+  return PyLong_FromUnsignedLongLong(key);
+}
+
+static PyMethodDef km_methods[] = {
+  { "lookup", km_lookup, METH_VARARGS,
+    "lookup(keys, queries) -> bytearray of int64: index of each query in the sorted keys, -1 if absent" },
+  { "sequence_keys", (PyCFunction)km_sequence_keys, METH_VARARGS|METH_KEYWORDS,
+    "sequence_keys(seq, ksize, kmtricks=False, both_strands=True) -> bytearray of the uint64 keys of the k-mers of seq" },
+  { "unpack", (PyCFunction)km_unpack, METH_VARARGS|METH_KEYWORDS,
+    "unpack(key, ksize, kmtricks=False) -> k-mer of a packed key" },
+  { "pack", (PyCFunction)km_pack_py, METH_VARARGS|METH_KEYWORDS,
+    "pack(kmer, kmtricks=False) -> packed key of a k-mer" },
+  { NULL }
+};
+
+static struct PyModuleDef km_module = {
+  PyModuleDef_HEAD_INIT, "_km_matrix", "C reader of k-mer matrices, see km_matrix.py", -1, km_methods
+};
+
+PyMODINIT_FUNC PyInit__km_matrix(void) {
+  if(PyType_Ready(&ReaderType) < 0) { return NULL; }
+  PyObject *m = PyModule_Create(&km_module);
+  if(m == NULL) { return NULL; }
+  Py_INCREF(&ReaderType);
+  if(PyModule_AddObject(m, "Reader", (PyObject *)&ReaderType) < 0) {
+    Py_DECREF(&ReaderType);
+    Py_DECREF(m);
+    return NULL;
+  }
+  return m;
+}
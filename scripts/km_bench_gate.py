@@ -0,0 +1,207 @@
+#!/usr/bin/env python3
+import sys, os, argparse, logging
+import json, random, platform, subprocess, tempfile, time
+
+logger = logging.getLogger()
+
+SCRIPT_DIR = os.path.dirname(os.path.abspath(__file__))
+REPO_DIR = os.path.dirname(SCRIPT_DIR)
+
+# metric -> (direction, default tolerance in percent): a 'higher' metric fails
+# when it drops by more than the tolerance, a 'lower' one when it grows by more
+METRICS = {
+    'km_merge.rows_per_s':        ('higher', 10.0),
+    'km_merge.peak_rss_kb':       ('lower', 10.0),
+    'km_basic_filter.rows_per_s': ('higher', 10.0),
+    'km_basic_filter.peak_rss_kb':('lower', 10.0),
+    'km_unitig_mean.peak_rss_kb': ('lower', 10.0),
+    'km_unitig_mean.rows_per_s':  ('higher', 15.0),
+}
+
+def init_logging():
+    global logger
+    log_formatter = logging.Formatter('[{asctime}] {levelname}: {message}', datefmt='%Y-%m-%d %H:%M:%S', style='{')
+    stream_handler = logging.StreamHandler(stream=sys.stderr)
+    stream_handler.setFormatter(log_formatter)
+    logger.setLevel(logging.INFO)
+    logger.addHandler(stream_handler)
+
+def write_matrix(path, kmers, n_samples, rng):
+    with open(path,'w') as out:
+        for kmer in kmers:
+            counts = ' '.join(str(0 if rng.random() < 0.3 else rng.randint(1,200)) for _ in range(n_samples))
+            out.write(f'{kmer} {counts}\n')
+
+def make_data(tmpdir, n_rows, n_samples, ksize, seed):
+    """Two sorted matrices of n_samples/2 columns sharing half of their k-mers,
+    whose merge has n_samples columns, and unitigs covering some of the k-mers."""
+    rng = random.Random(seed)
+    kmers = set()
+    while len(kmers) < n_rows*3//2:
+        kmers.add(''.join(rng.choice('ACGT') for _ in range(ksize)))
+    kmers = sorted(kmers)
+    shared, only = kmers[:n_rows//2], kmers[n_rows//2:]
+    kmers_1 = sorted(shared + only[:len(only)//2])
+    kmers_2 = sorted(shared + only[len(only)//2:])
+    mat_1, mat_2 = os.path.join(tmpdir,'bench_1.mat'), os.path.join(tmpdir,'bench_2.mat')
+    write_matrix(mat_1, kmers_1, n_samples//2, rng)
+    write_matrix(mat_2, kmers_2, n_samples - n_samples//2, rng)
+
+    fasta = os.path.join(tmpdir,'bench.fa')
+    with open(fasta,'w') as out:
+        for i in range(max(1, n_rows//1000)):
+            seq = ''.join(rng.choice('ACGT') for _ in range(ksize + 200))
+            out.write(f'>utg{i}\n{seq}\n')
+    return mat_1, mat_2, fasta
+
+def measure(cmd, stdout_path, repeats):
+    """Runs cmd repeats times, returns the best wall time (s) and the largest
+    peak RSS (KB) of the child, as reported by wait4. Linux carries the peak RSS
+    over exec, so it is never below the RSS of this script (see rss_floor_kb)."""
+    best, peak = None, 0
+    for _ in range(repeats):
+        with open(stdout_path,'w') as out:
+            start = time.perf_counter()
+            proc = subprocess.Popen(cmd, stdout=out, stderr=subprocess.DEVNULL)
+            _, status, rusage = os.wait4(proc.pid, 0)
+            elapsed = time.perf_counter() - start
+        proc.returncode = os.waitstatus_to_exitcode(status)
+        if proc.returncode != 0:
+            raise RuntimeError(f'{" ".join(cmd)} exited with status {proc.returncode}')
+        best = elapsed if best is None else min(best, elapsed)
+        peak = max(peak, rusage.ru_maxrss)
+    return best, peak
+
+def count_lines(path):
+    with open(path,'rb') as f:
+        return sum(1 for _ in f)
+
+def run_benchmarks(args, tmpdir):
+    logger.info(f'Generating {args.rows} rows of {args.samples} samples')
+    mat_1, mat_2, fasta = make_data(tmpdir, args.rows, args.samples, args.ksize, args.seed)
+    merged = os.path.join(tmpdir,'merged.mat')
+    results = {}
+    _, floor = measure(['true'], os.devnull, 1)
+
+    logger.info('Running km_merge')
+    cmd = [os.path.join(args.bin_dir,'km_merge'), '-k', str(args.ksize), mat_1, mat_2]
+    secs, rss = measure(cmd, merged, args.repeats)
+    rows = count_lines(merged)
+    results['km_merge.rows_per_s'] = rows/secs
+    results['km_merge.peak_rss_kb'] = rss
+
+    logger.info('Running km_basic_filter')
+    cmd = [os.path.join(args.bin_dir,'km_basic_filter'), '-a', '2', '-N', str(args.samples//2), '-t', str(args.threads), merged]
+    secs, rss = measure(cmd, os.path.join(tmpdir,'filtered.mat'), args.repeats)
+    results['km_basic_filter.rows_per_s'] = rows/secs
+    results['km_basic_filter.peak_rss_kb'] = rss
+
+    try:
+        import Bio
+        logger.info('Running km_unitig_mean')
+        cmd = [sys.executable, os.path.join(SCRIPT_DIR,'km_unitig_mean.py'), '-k', str(args.ksize),
+               '-m', merged, '-f', fasta, '-o', os.path.join(tmpdir,'unitigs.mat')]
+        secs, rss = measure(cmd, os.devnull, args.repeats)
+        results['km_unitig_mean.rows_per_s'] = rows/secs
+        results['km_unitig_mean.peak_rss_kb'] = rss
+    except ImportError:
+        logger.warning('Biopython not installed, skipping km_unitig_mean')
+    for name, value in results.items():
+        if name.endswith('peak_rss_kb') and value <= floor:
+            logger.info(f'{name} is at the floor of {floor} KB, the tool uses less memory than this script')
+    return results, floor
+
+def parse_tolerances(specs):
+    tolerances = {name: tol for name, (_, tol) in METRICS.items()}
+    for spec in specs:
+        name, sep, value = spec.partition('=')
+        if not sep or name not in METRICS:
+            raise ValueError(f'invalid tolerance "{spec}", expected METRIC=PERCENT with METRIC among {", ".join(METRICS)}')
+        tolerances[name] = float(value)
+    return tolerances
+
+def compare(baseline, current, tolerances):
+    """Prints the diff table and returns True if no metric regressed."""
+    ok = True
+    print(f'{"metric":<30} {"baseline":>14} {"current":>14} {"change":>9} {"tolerance":>10}  status')
+    for name in METRICS:
+        if name not in baseline['results'] and name not in current['results']:
+            continue
+        if name not in current['results'] or name not in baseline['results']:
+            print(f'{name:<30} {"":>14} {"":>14} {"":>9} {"":>10}  SKIPPED (missing in {"current run" if name not in current["results"] else "baseline"})')
+            continue
+        base, cur = baseline['results'][name], current['results'][name]
+        change = 100.0*(cur - base)/base if base else 0.0
+        direction, tol = METRICS[name][0], tolerances[name]
+        regressed = change < -tol if direction == 'higher' else change > tol
+        status = 'FAIL' if regressed else 'PASS'
+        ok &= not regressed
+        sign = '-' if direction == 'higher' else '+'
+        print(f'{name:<30} {base:>14.1f} {cur:>14.1f} {change:>+8.1f}% {sign+format(tol,".1f")+"%":>10}  {status}')
+    return ok
+
+
+def main(argv=None):
+    parser = argparse.ArgumentParser(description='Benchmark the tools on synthetic matrices and compare against a stored baseline')
+    parser.add_argument('-b','--baseline', dest='baseline', metavar='PATH', default='km_bench_baseline.json', help='Baseline results file [km_bench_baseline.json]')
+    parser.add_argument('-s','--save', dest='save', action='store_true', help='Save the results as the new baseline instead of comparing')
+    parser.add_argument('-o','--out', dest='out', metavar='PATH', help='Also write the results of this run to PATH')
+    parser.add_argument('-T','--tolerance', dest='tolerances', metavar='METRIC=PCT', action='append', default=[], help='Override the tolerance of a metric, in percent (repeatable)')
+    parser.add_argument('-n','--rows', dest='rows', metavar='INT', type=int, default=50000, help='Rows of the synthetic matrices [50000]')
+    parser.add_argument('-S','--samples', dest='samples', metavar='INT', type=int, default=200, help='Samples of the merged matrix [200]')
+    parser.add_argument('-k', dest='ksize', metavar='INT', type=int, default=31, help='k-mer size [31]')
+    parser.add_argument('-r','--repeats', dest='repeats', metavar='INT', type=int, default=3, help='Runs of each tool, the best time is kept [3]')
+    parser.add_argument('-t','--threads', dest='threads', metavar='INT', type=int, default=1, help='Threads of the multithreaded tools [1]')
+    parser.add_argument('--seed', dest='seed', metavar='INT', type=int, default=42, help='Seed of the synthetic data [42]')
+    parser.add_argument('--bin-dir', dest='bin_dir', metavar='PATH', default=REPO_DIR, help='Directory of the compiled tools [repository root]')
+    args = parser.parse_args(argv)
+
+    init_logging()
+
+    try:
+        tolerances = parse_tolerances(args.tolerances)
+    except ValueError as e:
+        logger.error(str(e))
+        return 1
+    for tool in ('km_merge','km_basic_filter'):
+        if not os.access(os.path.join(args.bin_dir,tool), os.X_OK):
+            logger.error(f'{tool} not found in "{args.bin_dir}", run make first.')
+            return 1
+    baseline = None
+    if not args.save:
+        if not os.path.isfile(args.baseline):
+            logger.error(f'-b/--baseline file "{args.baseline}" does not exist, create it with -s/--save.')
+            return 1
+        with open(args.baseline,'r') as f:
+            baseline = json.load(f)
+
+    params = {'rows': args.rows, 'samples': args.samples, 'ksize': args.ksize, 'repeats': args.repeats,
+              'threads': args.threads, 'seed': args.seed}
+    with tempfile.TemporaryDirectory(prefix='km_bench_') as tmpdir:
+        try:
+            results, floor = run_benchmarks(args, tmpdir)
+        except RuntimeError as e:
+            logger.error(str(e))
+            return 1
+    current = {'host': platform.node(), 'machine': platform.machine(), 'cpus': os.cpu_count(),
+               'date': time.strftime('%Y-%m-%d %H:%M:%S'), 'params': params, 'rss_floor_kb': floor, 'results': results}
+
+    if args.out:
+        with open(args.out,'w') as f:
+            json.dump(current, f, indent=2)
+    if args.save:
+        with open(args.baseline,'w') as f:
+            json.dump(current, f, indent=2)
+        logger.info(f'Baseline saved to "{args.baseline}"')
+        return 0
+
+    if baseline.get('params') != params:
+        logger.warning(f'Parameters differ from the baseline ({baseline.get("params")}), the comparison may not be meaningful')
+    if baseline.get('host') != current['host']:
+        logger.warning(f'Baseline was recorded on host "{baseline.get("host")}"')
+    ok = compare(baseline, current, tolerances)
+    print('PASS' if ok else 'FAIL')
+    return 0 if ok else 1
+
+if __name__ == "__main__":
+    sys.exit(main())
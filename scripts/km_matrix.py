@@ -0,0 +1,103 @@
+#!/usr/bin/env python3
+"""NumPy access to k-mer matrices through the C reader of _km_matrix.
+
+Build the extension with `make python` at the root of the repository.
+
+    import km_matrix
+    for keys, counts in km_matrix.MatrixReader('matrix.txt', ksize=31):
+        ...  # keys: uint64 array (n_rows,), counts: uint32 array (n_rows, n_samples)
+
+    keys, counts = km_matrix.load('matrix.txt')
+    index = km_matrix.KeyIndex(keys)
+    rows = index.lookup(km_matrix.sequence_keys(unitig, 31))  # -1 if absent
+
+Keys are the k-mers packed on 2 bits per nucleotide (k <= 32), in the order of
+the matrix: lexicographic (A<C<G<T), or kmtricks (A<C<T<G) with kmtricks=True.
+The arrays are views of the buffers filled by the C reader, without copy.
+"""
+import numpy as np
+
+import _km_matrix
+
+DEFAULT_BLOCK_ROWS = 1<<16
+
+class MatrixReader:
+    """Iterates over a text k-mer matrix by blocks of rows (at most block_rows,
+    and at most 64 MiB of counts)."""
+    def __init__(self, path, ksize=31, kmtricks=False, block_rows=DEFAULT_BLOCK_ROWS):
+        self._reader = _km_matrix.Reader(path, ksize, kmtricks)
+        self.block_rows = block_rows
+
+    @property
+    def n_samples(self):
+        return self._reader.n_samples
+
+    @property
+    def ksize(self):
+        return self._reader.ksize
+
+    def __iter__(self):
+        while True:
+            block = self._reader.read_block(self.block_rows)
+            if block is None:
+                return
+            keys, counts = block
+            if not keys:
+                return
+            yield (np.frombuffer(keys, dtype=np.uint64),
+                   np.frombuffer(counts, dtype=np.uint32).reshape(-1, self.n_samples))
+
+def load(path, ksize=31, kmtricks=False, block_rows=DEFAULT_BLOCK_ROWS):
+    """Returns the keys and the counts of a whole matrix."""
+    reader = MatrixReader(path, ksize, kmtricks, block_rows)
+    blocks = list(reader)
+    if not blocks:
+        return np.empty(0, dtype=np.uint64), np.empty((0, reader.n_samples), dtype=np.uint32)
+    if len(blocks) == 1:
+        return blocks[0]
+    return np.concatenate([b[0] for b in blocks]), np.concatenate([b[1] for b in blocks])
+
+class KeyIndex:
+    """Lookup of packed keys in the sorted keys of a matrix."""
+    def __init__(self, keys):
+        self.keys = np.ascontiguousarray(keys, dtype=np.uint64)
+
+    def lookup(self, queries):
+        """Row of each query key, -1 if absent."""
+        queries = np.ascontiguousarray(queries, dtype=np.uint64)
+        return np.frombuffer(_km_matrix.lookup(self.keys, queries), dtype=np.int64)
+
+    def contains(self, queries):
+        return self.lookup(queries) >= 0
+
+def sequence_keys(seq, ksize, kmtricks=False, both_strands=True):
+    """Keys of the k-mers of seq and, with both_strands, of its reverse
+    complement (interleaved), skipping the k-mers with non-ACGT characters."""
+    return np.frombuffer(_km_matrix.sequence_keys(seq, ksize, kmtricks, both_strands), dtype=np.uint64)
+
+def sequence_index(sequences, ksize, kmtricks=False):
+    """Index of the k-mers of several sequences, on both strands. Returns the
+    KeyIndex of their distinct keys, and for each key the number of the last
+    sequence that has it and whether an other sequence has it too."""
+    parts = [sequence_keys(seq, ksize, kmtricks) for seq in sequences]
+    if not parts:
+        return KeyIndex(np.empty(0, dtype=np.uint64)), np.empty(0, dtype=np.int64), np.empty(0, dtype=bool)
+    keys = np.concatenate(parts)
+    seq_of = np.repeat(np.arange(len(parts)), [len(p) for p in parts])
+    order = np.lexsort((seq_of, keys))
+    keys, seq_of = keys[order], seq_of[order]
+    first = np.ones(len(keys), dtype=bool)
+    first[1:] = keys[1:] != keys[:-1]
+    last = np.ones(len(keys), dtype=bool)
+    last[:-1] = first[1:]
+    return KeyIndex(keys[last]), seq_of[last], seq_of[first] != seq_of[last]
+
+def format_rows(keys, counts, ksize, kmtricks=False):
+    """Text rows of a matrix: the k-mer followed by its counts."""
+    return ''.join(f'{unpack(key, ksize, kmtricks)} {" ".join(map(str, row))}\n' for key, row in zip(keys, counts.tolist()))
+
+def pack(kmer, kmtricks=False):
+    return _km_matrix.pack(kmer, kmtricks)
+
+def unpack(key, ksize, kmtricks=False):
+    return _km_matrix.unpack(int(key), ksize, kmtricks)
@@ -1,15 +1,12 @@
 #!/usr/bin/env python3
 import sys, os, argparse, logging
-import operator
-from collections import defaultdict
+import numpy as np
 
 from Bio.SeqIO.FastaIO import SimpleFastaParser
 
-logger = logging.getLogger()
+import km_matrix
 
-RC_TABLE = str.maketrans("ACTGNactgn", "TGACNtgacn")
-def reverse_complement(seq):
-    return seq.translate(RC_TABLE)[::-1]
+logger = logging.getLogger()
 
 def init_logging():
     global logger
@@ -19,16 +16,6 @@ def init_logging():
     logger.setLevel(logging.INFO)
     logger.addHandler(stream_handler)
 
-def kmer_set(seq,k):
-    out = set()
-    for i in range(len(seq)-k+1):
-        out.add(seq[i:i+k])
-    rcseq = reverse_complement(seq)
-    for i in range(len(rcseq)-k+1):
-        out.add(rcseq[i:i+k])
-    return out
-
-
 def main(argv=None):
     parser = argparse.ArgumentParser(description='Partition a k-mer matrix according to a set of unitigs')
     parser.add_argument('-m','--mat', dest='kmat', metavar='PATH', required=True, help='Input k-mer matrix')
@@ -49,43 +36,37 @@ def main(argv=None):
     if not is_input_valid:
         return 1
 
-    seq_dict = {}
-    kmer_dict = {}
+    utg_ids = []
+    sequences = []
     with open(args.fasta,'r') as infas:
         for header, sequence in SimpleFastaParser(infas):
-            utgid = header.split()[0]
-            seq_dict[utgid] = kmer_set(sequence,args.ksize)
-            for kmer in seq_dict[utgid]:
-                assert(kmer not in kmer_dict)
-                kmer_dict[kmer] = utgid
-    logger.info(f'{len(seq_dict)} sequences processed -> {sum(len(x) for x in seq_dict.values())} kmers')
-    
+            utg_ids.append(header.split()[0])
+            sequences.append(sequence)
+    index, kmer_utg, shared = km_matrix.sequence_index(sequences, args.ksize)
+    assert(not shared.any())
+    logger.info(f'{len(utg_ids)} sequences processed -> {len(index.keys)} kmers')
+
     logger.info(f'Splitting k-mers from the matrix')
-    n_samples = None
-    n_kmers = defaultdict(int)
-    utg_dict = {}
-    with open(args.kmat,'r') as mat:
-        for line in mat:
-            kmer,col_str = line.strip().split(' ',1)
-            if kmer in kmer_dict:
-                utgid = kmer_dict[kmer]
-                n_kmers[utgid]+=1
-                cols = col_str.split()
-                if n_samples is None:
-                    n_samples = len(cols)
-                if utgid not in utg_dict:
-                    utg_dict[utgid] = [0]*n_samples
-                utg_dict[utgid] = list(map(operator.add,utg_dict[utgid],(int(x) for x in cols)))
-    
+    reader = km_matrix.MatrixReader(args.kmat, args.ksize)
+    utg_sum = np.zeros((len(utg_ids), reader.n_samples), dtype=np.int64)
+    n_kmers = np.zeros(len(utg_ids), dtype=np.int64)
+    first_row = np.full(len(utg_ids), np.iinfo(np.int64).max)  # unitigs are written in order of their first k-mer
+    n_rows = 0
+    for keys, counts in reader:
+        rows = index.lookup(keys)
+        found = np.flatnonzero(rows >= 0)
+        utg = kmer_utg[rows[found]]
+        np.add.at(utg_sum, utg, counts[found])
+        n_kmers += np.bincount(utg, minlength=len(utg_ids))
+        np.minimum.at(first_row, utg, n_rows + found)
+        n_rows += len(keys)
+
     logger.info(f'Writing utg matrix')
     with open(args.out,'w') as of:
-        for utgid, utglist in utg_dict.items():
-            of.write(f'{utgid}')
-            utg_kmers = n_kmers[utgid]
-            for s in utglist:
-                of.write(f' {round(s/utg_kmers)}')
-            of.write('\n')
-    
+        for u in sorted(np.flatnonzero(n_kmers), key=lambda u: first_row[u]):
+            utg_mean = np.rint(utg_sum[u] / n_kmers[u]).astype(np.int64)
+            of.write(f'{utg_ids[u]} {" ".join(map(str, utg_mean.tolist()))}\n')
+
     return 0
 
 if __name__ == "__main__":
@@ -1,8 +1,11 @@
 #!/usr/bin/env python3
 import sys, os, argparse, logging
+import numpy as np
 
 from Bio.SeqIO.FastaIO import SimpleFastaParser
 
+import km_matrix
+
 logger = logging.getLogger()
 
 def init_logging():
@@ -13,13 +16,6 @@ def init_logging():
     logger.setLevel(logging.INFO)
     logger.addHandler(stream_handler)
 
-RC_TABLE = str.maketrans("ACTGNactgn", "TGACNtgacn")
-def reverse_complement(seq):
-    return seq.translate(RC_TABLE)[::-1]
-
-def kmer_list(seq,k):
-    return [seq[i:i+k] for i in range(len(seq)-k+1)]
-
 
 def main(argv=None):
     parser = argparse.ArgumentParser(description='Sort k-mers in a (small!) matrix according to their position within a given unitig')
@@ -44,27 +40,22 @@ def main(argv=None):
     if not is_input_valid:
         return 1
 
-    # load matrix in a dictionary
-    krow_dict = {}
-    with open(f'{args.kmat}','r') as mf:
-        for line in mf:
-            line = line.strip()
-            if line != "":
-                kmer = line[:line.find(' ')]
-                assert(kmer not in krow_dict)
-                krow_dict[kmer] = line
-    logger.info(f'kmers loaded: {len(krow_dict)}')
+    # load matrix, rows indexed by k-mer
+    keys, counts = km_matrix.load(args.kmat, args.ksize)
+    order = np.argsort(keys, kind='stable')
+    index = km_matrix.KeyIndex(keys[order])
+    assert(not (index.keys[1:] == index.keys[:-1]).any())
+    logger.info(f'kmers loaded: {len(keys)}')
 
-    k = args.ksize
     with open(args.fasta,'r') as infas, open(args.out,'w') as out:
         for _,seq in SimpleFastaParser(infas):
-            fwd = kmer_list(seq,args.ksize)
-            rev = kmer_list(reverse_complement(seq),args.ksize)[::-1]
-            for i in range(len(fwd)):
-                assert(fwd[i] in krow_dict or rev[i] in krow_dict)
-                assert(fwd[i] not in krow_dict or rev[i] not in krow_dict)
-                out.write(krow_dict[fwd[i]] if fwd[i] in krow_dict else krow_dict[rev[i]])
-                out.write('\n')
+            # forward and reverse complement of each k-mer of seq, in order
+            kmer_keys = km_matrix.sequence_keys(seq, args.ksize)
+            assert(len(kmer_keys) == 2*(len(seq)-args.ksize+1))
+            rows = index.lookup(kmer_keys).reshape(-1, 2)
+            assert(((rows >= 0).sum(axis=1) == 1).all())
+            rows = order[rows.max(axis=1)]
+            out.write(km_matrix.format_rows(keys[rows], counts[rows], args.ksize))
 
     return 0
 
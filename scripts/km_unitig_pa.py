@@ -1,15 +1,12 @@
 #!/usr/bin/env python3
 import sys, os, argparse, logging
-import operator
-from collections import defaultdict
+import numpy as np
 
 from Bio.SeqIO.FastaIO import SimpleFastaParser
 
-logger = logging.getLogger()
+import km_matrix
 
-RC_TABLE = str.maketrans("ACTGNactgn", "TGACNtgacn")
-def reverse_complement(seq):
-    return seq.translate(RC_TABLE)[::-1]
+logger = logging.getLogger()
 
 def init_logging():
     global logger
@@ -19,11 +16,6 @@ def init_logging():
     logger.setLevel(logging.INFO)
     logger.addHandler(stream_handler)
 
-def kmer_set(seq,k):
-    fwd_kmers = set(seq[i:i+k] for i in range(len(seq)-k+1))
-    rev_kmers = set(map(reverse_complement,fwd_kmers))
-    return (fwd_kmers|rev_kmers), len(seq)-k+1
-
 
 def main(argv=None):
     parser = argparse.ArgumentParser(description='Partition a k-mer matrix according to a set of unitigs')
@@ -46,40 +38,38 @@ def main(argv=None):
     if not is_input_valid:
         return 1
 
-    utg_kmers = {}
-    utg_size = {}
-    kmer_utg = {}
+    utg_ids = []
+    sequences = []
     with open(args.fasta,'r') as infas:
         for header, sequence in SimpleFastaParser(infas):
-            utgid = header.split()[0]
-            utg_kmers[utgid],utg_size[utgid] = kmer_set(sequence,args.ksize)
-            for kmer in utg_kmers[utgid]:
-                kmer_utg[kmer] = utgid
-    logger.info(f'{len(utg_kmers)} unitig processed -> {sum(map(len,utg_kmers.values()))} kmers')
-    
+            utg_ids.append(header.split()[0])
+            sequences.append(sequence)
+    utg_size = np.array([len(seq)-args.ksize+1 for seq in sequences], dtype=np.int64)
+    index, kmer_utg, _ = km_matrix.sequence_index(sequences, args.ksize)
+    logger.info(f'{len(utg_ids)} unitig processed -> {len(index.keys)} kmers')
+
     logger.info(f'Splitting k-mers from the matrix')
-    n_samples = None
-    utg_dict = {}
-    with open(args.kmat,'r') as mat:
-        for line in mat:
-            kmer,col_str = line.strip().split(' ',1)
-            if kmer in kmer_utg:
-                utgid = kmer_utg[kmer]
-                cols = col_str.split()
-                if n_samples is None:
-                    n_samples = len(cols)
-                if utgid not in utg_dict:
-                    utg_dict[utgid] = [0]*n_samples
-                utg_dict[utgid] = list(map(operator.add,utg_dict[utgid],(int(kc>=args.min_kc) for kc in map(int,cols))))
-    
+    reader = km_matrix.MatrixReader(args.kmat, args.ksize)
+    utg_present = np.zeros((len(utg_ids), reader.n_samples), dtype=np.int64)
+    utg_seen = np.zeros(len(utg_ids), dtype=bool)
+    first_row = np.full(len(utg_ids), np.iinfo(np.int64).max)  # unitigs are written in order of their first k-mer
+    n_rows = 0
+    for keys, counts in reader:
+        rows = index.lookup(keys)
+        found = np.flatnonzero(rows >= 0)
+        utg = kmer_utg[rows[found]]
+        np.add.at(utg_present, utg, counts[found] >= args.min_kc)
+        utg_seen[utg] = True
+        np.minimum.at(first_row, utg, n_rows + found)
+        n_rows += len(keys)
+
     logger.info(f'Writing utg matrix')
     with open(args.out,'w') as of:
-        for utgid, utglist in utg_dict.items():
-            of.write(f'{utgid} ')
-            utg_n_kmers = utg_size[utgid]
-            of.write(' '.join((str(int(s==utg_n_kmers)) for s in utglist)))
+        for u in sorted(np.flatnonzero(utg_seen), key=lambda u: first_row[u]):
+            of.write(f'{utg_ids[u]} ')
+            of.write(' '.join(map(str, (utg_present[u] == utg_size[u]).astype(int).tolist())))
             of.write('\n')
-    
+
     return 0
 
 if __name__ == "__main__":
@@ -1,13 +1,12 @@
 #!/usr/bin/env python3
 import sys, os, argparse, logging
 from contextlib import ExitStack
+import numpy as np
 from Bio.SeqIO.FastaIO import SimpleFastaParser
 
-logger = logging.getLogger()
+import km_matrix
 
-RC_TABLE = str.maketrans("ACTGNactgn", "TGACNtgacn")
-def reverse_complement(seq):
-    return seq.translate(RC_TABLE)[::-1]
+logger = logging.getLogger()
 
 def init_logging():
     global logger
@@ -17,15 +16,6 @@ def init_logging():
     logger.setLevel(logging.INFO)
     logger.addHandler(stream_handler)
 
-def kmer_set(seq,k):
-    out = set()
-    for i in range(len(seq)-k+1):
-        out.add(seq[i:i+k])
-    rcseq = reverse_complement(seq)
-    for i in range(len(rcseq)-k+1):
-        out.add(rcseq[i:i+k])
-    return out
-
 
 def main(argv=None):
     parser = argparse.ArgumentParser(description='Partition a k-mer matrix according to a set of unitigs')
@@ -51,33 +41,38 @@ def main(argv=None):
         logger.error(f'-o/--out-dir {args.outdir} directory must not exist or be empty')
         return 1
 
-    seq_dict = {}
-    kmer_dict = {}
+    seq_ids = []
+    sequences = []
     with open(args.fasta,'r') as infas:
         for header, sequence in SimpleFastaParser(infas):
-            seqid = header.split()[0]
-            seq_dict[seqid] = kmer_set(sequence,args.ksize)
-            for kmer in seq_dict[seqid]:
-                assert(kmer not in kmer_dict)
-                kmer_dict[kmer] = seqid
-    logger.info(f'{len(seq_dict)} sequences processed -> {sum(len(x) for x in seq_dict.values())} kmers')
-    
+            seq_ids.append(header.split()[0])
+            sequences.append(sequence)
+    index, kmer_seq, shared = km_matrix.sequence_index(sequences, args.ksize)
+    assert(not shared.any())
+    logger.info(f'{len(seq_ids)} sequences processed -> {len(index.keys)} kmers')
+
     logger.info(f'Splitting k-mers from the matrix')
     os.makedirs(f'{args.outdir}',exist_ok=True)
     with ExitStack() as stack:
-        out_files = dict()
-        for seqid in seq_dict.keys():
-            out_files[seqid] = stack.enter_context(open(f'{args.outdir}/{seqid}.rows.mat','w'))
+        out_files = []
+        for seqid in seq_ids:
+            out_files.append(stack.enter_context(open(f'{args.outdir}/{seqid}.rows.mat','w')))
         count = 0
-        with open(args.kmat,'r') as mat:
-            for line in mat:
-                count += 1
-                kmer,cols = line.strip().split(' ',1)
-                if count % 16000000 == 0:
-                    logger.info(f'{count} million k-mers processed')
-                if kmer in kmer_dict:
-                    seqid = kmer_dict[kmer]
-                    out_files[seqid].write(f'{kmer} {cols}\n')
+        for keys, counts in km_matrix.MatrixReader(args.kmat, args.ksize):
+            if (count + len(keys)) // 16000000 > count // 16000000:
+                logger.info(f'{(count + len(keys)) // 16000000 * 16000000} million k-mers processed')
+            count += len(keys)
+            rows = index.lookup(keys)
+            found = np.flatnonzero(rows >= 0)
+            seq = kmer_seq[rows[found]]
+            # rows of each sequence, in matrix order
+            by_seq = np.argsort(seq, kind='stable')
+            found, seq = found[by_seq], seq[by_seq]
+            bounds = np.flatnonzero(np.diff(seq)) + 1
+            for part in np.split(np.arange(len(found)), bounds):
+                if len(part):
+                    r = found[part]
+                    out_files[seq[part[0]]].write(km_matrix.format_rows(keys[r], counts[r], args.ksize))
 
     return 0
 
@@ -0,0 +1,65 @@
+# Helpers sourced by the test scripts, run by tests/run.sh from a scratch
+# directory with BIN set to the directory of the tools.
+
+set -u
+
+n_failed=0
+
+fail() {
+  echo "FAIL: $*" >&2
+  n_failed=$((n_failed+1))
+}
+
+# same_file NAME EXPECTED ACTUAL
+same_file() {
+  if ! cmp -s "$2" "$3"; then
+    fail "$1 ($2 and $3 differ)"
+    diff "$2" "$3" | head -5 >&2
+  fi
+}
+
+# expect_status NAME STATUS COMMAND...
+expect_status() {
+  local name=$1 expected=$2
+  shift 2
+  "$@" > /dev/null 2> status.err
+  local status=$?
+  if [ "$status" -ne "$expected" ]; then
+    fail "$name (exit status $status, $expected expected)"
+    head -5 status.err >&2
+  fi
+}
+
+done_test() {
+  exit $((n_failed > 0))
+}
+
+# gen_kmers N K SEED: N random distinct k-mers of size K, sorted
+gen_kmers() {
+  awk -v n="$1" -v k="$2" -v seed="$3" 'BEGIN {
+    srand(seed);
+    for(i=0; i<n; ++i) {
+      s = "";
+      for(j=0; j<k; ++j) { s = s substr("ACGT", int(rand()*4)+1, 1); }
+      print s;
+    }
+  }' | LC_ALL=C sort -u
+}
+
+# gen_matrix N_SAMPLES SEED < kmers: a row of counts per k-mer, half of them 0
+gen_matrix() {
+  awk -v m="$1" -v seed="$2" 'BEGIN { srand(seed) } {
+    line = $1;
+    for(j=0; j<m; ++j) { line = line " " (rand() < 0.5 ? 0 : int(rand()*100)+1); }
+    print line;
+  }'
+}
+
+# canonical < kmers: the smaller of each k-mer and its reverse complement
+canonical() {
+  awk 'BEGIN { c["A"]="T"; c["C"]="G"; c["G"]="C"; c["T"]="A" } {
+    r = "";
+    for(i=length($1); i>0; --i) { r = r c[substr($1,i,1)]; }
+    print (r < $1 ? r : $1);
+  }'
+}
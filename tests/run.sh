@@ -0,0 +1,26 @@
+#!/usr/bin/env bash
+# Runs the tests (tests/test_*.sh, or those given) against the tools built in
+# the repository, each in its own scratch directory. Exits with 1 if any fails.
+
+TESTS_DIR=$(cd "$(dirname "$0")" && pwd)
+export BIN=$(dirname "$TESTS_DIR")
+export TESTS_DIR
+
+tests=("$@")
+[ ${#tests[@]} -eq 0 ] && tests=("$TESTS_DIR"/test_*.sh)
+
+n_failed=0
+for t in "${tests[@]}"; do
+  name=$(basename "$t" .sh)
+  t=$(cd "$(dirname "$t")" && pwd)/$name.sh
+  dir=$(mktemp -d "${TMPDIR:-/tmp}/km_$name.XXXXXX")
+  if (cd "$dir" && bash "$t" > log.txt 2>&1); then
+    echo "PASS $name"
+    rm -rf "$dir"
+  else
+    echo "FAIL $name (log in $dir/log.txt)"
+    grep "^FAIL" "$dir/log.txt" | head -10
+    n_failed=$((n_failed+1))
+  fi
+done
+[ $n_failed -eq 0 ]
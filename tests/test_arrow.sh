@@ -0,0 +1,60 @@
+# Arrow IPC output and input: a matrix written as Arrow reads back as the same
+# text, by all the tools taking Arrow input
+. "$TESTS_DIR/common.sh"
+
+gen_kmers 5000 31 1 | gen_matrix 6 1 > m.mat
+: > none.txt
+
+for fmt in arrow arrow-stream; do
+  "$BIN/km_select" --format $fmt -v none.txt m.mat > m.$fmt 2> /dev/null || fail "km_select --format $fmt"
+  "$BIN/km_select" -v none.txt m.$fmt > back.txt 2> /dev/null || fail "km_select reading $fmt"
+  same_file "km_select round trip ($fmt)" m.mat back.txt
+  "$BIN/km_select" -v none.txt - < m.$fmt > back.txt 2> /dev/null || fail "km_select reading $fmt from stdin"
+  same_file "km_select round trip ($fmt, stdin)" m.mat back.txt
+
+  "$BIN/km_basic_filter" -a 1 -n 0 -N 0 --format $fmt m.mat > f.$fmt 2> /dev/null || fail "km_basic_filter --format $fmt"
+  "$BIN/km_basic_filter" -a 1 -n 0 -N 0 f.$fmt > back.txt 2> /dev/null || fail "km_basic_filter reading $fmt"
+  same_file "km_basic_filter round trip ($fmt)" m.mat back.txt
+done
+
+# merge and diff of Arrow inputs give the text results
+head -2000 m.mat > a.mat
+tail -4000 m.mat > b.mat
+"$BIN/km_select" --format arrow -v none.txt a.mat > a.arrow 2> /dev/null
+"$BIN/km_select" --format arrow-stream -v none.txt b.mat > b.arrows 2> /dev/null
+"$BIN/km_merge" a.mat b.mat > merge.txt 2> /dev/null
+"$BIN/km_merge" a.arrow b.arrows > merge_arrow.txt 2> /dev/null || fail "km_merge of Arrow inputs"
+same_file "km_merge of Arrow inputs" merge.txt merge_arrow.txt
+"$BIN/km_merge" --format arrow a.arrow b.arrows > merge.arrow 2> /dev/null || fail "km_merge --format arrow"
+"$BIN/km_select" -v none.txt merge.arrow > back.txt 2> /dev/null
+same_file "km_merge Arrow output" merge.txt back.txt
+"$BIN/km_diff" m.mat b.mat > diff.txt 2> /dev/null
+"$BIN/km_diff" m.mat b.arrows > diff_arrow.txt 2> /dev/null || fail "km_diff of an Arrow input"
+same_file "km_diff of an Arrow input" diff.txt diff_arrow.txt
+
+# kmtricks order is kept in the schema
+gen_kmers 2000 31 2 | tr ACTG abcd | LC_ALL=C sort | tr abcd ACTG | gen_matrix 3 2 > kt.mat
+"$BIN/km_select" -z --format arrow -v none.txt kt.mat > kt.arrow 2> /dev/null || fail "km_select -z --format arrow"
+"$BIN/km_select" -z -v none.txt kt.arrow > back.txt 2> /dev/null
+same_file "round trip in kmtricks order" kt.mat back.txt
+
+# the k of the schema must match -k, tools reading only counts accept any k
+cut -c1-21,32- m.mat | LC_ALL=C sort -u -k1,1 > m21.mat
+"$BIN/km_select" -k 21 --format arrow -v none.txt m21.mat > m21.arrow 2> /dev/null || fail "km_select -k 21 --format arrow"
+expect_status "Arrow k-mers of another size" 1 "$BIN/km_select" -v none.txt m21.arrow
+expect_status "Arrow k-mers of another size (merge)" 1 "$BIN/km_merge" m21.arrow m21.arrow
+"$BIN/km_select" -k 21 -v none.txt m21.arrow > back.txt 2> /dev/null
+same_file "round trip, k = 21" m21.mat back.txt
+"$BIN/km_basic_filter" -a 1 -n 0 -N 0 m21.arrow > back.txt 2> /dev/null || fail "km_basic_filter of k = 21"
+same_file "km_basic_filter of k = 21" m21.mat back.txt
+
+# packed k-mers require k <= 32
+gen_kmers 100 40 3 | gen_matrix 2 3 > m40.mat
+expect_status "Arrow output of k = 40" 1 "$BIN/km_basic_filter" -a 1 -n 0 -N 0 --format arrow m40.mat
+
+# a closed output is a write error, not a signal
+"$BIN/km_merge" --format arrow-stream a.arrow b.arrows 2> /dev/null | head -c 10 > /dev/null
+status=${PIPESTATUS[0]}
+[ "$status" -eq 1 ] || fail "km_merge to a closed pipe (exit status $status, 1 expected)"
+
+done_test
@@ -0,0 +1,81 @@
+# km_search against a brute-force search of the query k-mers in the matrix
+. "$TESTS_DIR/common.sh"
+
+gen_kmers 30000 31 21 | canonical | LC_ALL=C sort -u | gen_matrix 8 21 > m.mat
+
+# queries: k-mers of the matrix, on either strand, and random k-mers, between
+# N (k-mers with an N are skipped)
+gen_queries() {
+  awk -v n="$1" -v per="$2" -v seed="$3" 'BEGIN { srand(seed); c["A"]="T"; c["C"]="G"; c["G"]="C"; c["T"]="A" }
+    { kmers[NR] = $1 }
+    END {
+      for(q=0; q<n; ++q) {
+        s = "";
+        for(i=0; i<per; ++i) {
+          k = kmers[int(rand()*NR)+1];
+          if(rand() < 0.5) { r = ""; for(j=length(k); j>0; --j) { r = r c[substr(k,j,1)] } k = r }
+          if(rand() < 0.2) { k = ""; for(j=0; j<31; ++j) { k = k substr("ACGT", int(rand()*4)+1, 1) } }
+          s = s (i ? "N" : "") k;
+        }
+        print ">q" q; print s;
+      }
+    }' m.mat
+}
+
+# brute force: for each query and sample, the distinct canonical query k-mers
+# with a count >= a in the sample
+search_bf() {
+  awk -v a="$1" -v theta="$2" -v k=31 'BEGIN { c["A"]="T"; c["C"]="G"; c["G"]="C"; c["T"]="A" }
+    NR == FNR { row[$1] = $0; next }
+    function report() {
+      if(name == "" || n == 0) { return }
+      for(s=1; s<=n_samples; ++s) {
+        frac = hits[s]/n;
+        if(frac >= theta) { printf "%s\t%d\t%d\t%d\t%.4f\n", name, s, hits[s], n, frac }
+      }
+    }
+    /^>/ { report(); name = substr($1, 2); n = 0; delete seen; delete hits; next }
+    {
+      for(i=1; i+k-1<=length($0); ++i) {
+        km = substr($0, i, k);
+        if(km ~ /N/) { continue }
+        r = "";
+        for(j=k; j>0; --j) { r = r c[substr(km,j,1)] }
+        if(r < km) { km = r }
+        if(km in seen) { continue }
+        seen[km]; ++n;
+        if(!(km in row)) { continue }
+        n_samples = split(row[km], cnt) - 1;
+        for(s=1; s<=n_samples; ++s) { if(cnt[s+1] >= a) { ++hits[s] } }
+      }
+    }
+    END { report() }' m.mat "$3"
+}
+
+gen_queries 300 20 22 > dense.fa
+gen_queries 5 3 23 > sparse.fa
+for q in dense sparse; do
+  for opts in "-a 1 -T 0.5" "-a 50 -T 0.3" "-a 1 -T 0"; do
+    set -- $opts
+    search_bf $2 $4 $q.fa > expected.txt
+    [ -s expected.txt ] || fail "no result expected for $opts, $q queries"
+    "$BIN/km_search" $opts m.mat $q.fa > out.txt 2> /dev/null || fail "km_search $opts $q"
+    same_file "km_search $opts, $q queries" expected.txt out.txt
+  done
+done
+[ -s m.mat.kmi ] || fail "index not saved"
+
+# the saved index is loaded, an outdated one is rebuilt
+search_bf 1 0.5 dense.fa > expected.txt
+"$BIN/km_search" -T 0.5 m.mat dense.fa > out.txt 2> /dev/null
+same_file "km_search with the saved index" expected.txt out.txt
+sed 's/ 0 / 1 /' m.mat > m2.mat && mv m2.mat m.mat
+search_bf 1 0.5 dense.fa > expected.txt
+"$BIN/km_search" -T 0.5 m.mat dense.fa > out.txt 2> /dev/null
+same_file "km_search with a rebuilt index" expected.txt out.txt
+
+expect_status "matrix not a regular file" 1 "$BIN/km_search" <(cat m.mat) dense.fa
+LC_ALL=C sort -r m.mat > unsorted.mat
+expect_status "unsorted matrix" 1 "$BIN/km_search" unsorted.mat dense.fa
+
+done_test
@@ -0,0 +1,53 @@
+# km_select against a brute-force selection, with every strategy
+. "$TESTS_DIR/common.sh"
+
+gen_kmers 20000 31 11 | gen_matrix 5 11 > m.mat
+# every third k-mer of the matrix and k-mers absent from it
+{ awk 'NR % 3 == 0 { print $1 }' m.mat; gen_kmers 500 31 12; } | LC_ALL=C sort -u > sel.txt
+# a sparse selection, for which the index is worth it
+awk 'NR % 997 == 0 { print $1 }' m.mat > sparse.txt
+
+# brute force: rows whose k-mer is (-v: is not) in the selection
+select_bf() {
+  awk -v inv="$1" 'NR == FNR { s[$1]; next } (($1 in s) != inv)' "$2" "$3"
+}
+
+for sel in sel sparse; do
+  select_bf 0 $sel.txt m.mat > expected.txt
+  select_bf 1 $sel.txt m.mat > expected_v.txt
+  for plan in auto merge hash bloom tree index; do
+    "$BIN/km_select" --plan $plan $sel.txt m.mat > out.txt 2> /dev/null || fail "km_select --plan $plan $sel"
+    same_file "km_select --plan $plan, $sel" expected.txt out.txt
+    "$BIN/km_select" -v --plan $plan $sel.txt m.mat > out.txt 2> /dev/null || fail "km_select -v --plan $plan $sel"
+    same_file "km_select -v --plan $plan, $sel" expected_v.txt out.txt
+  done
+  # selection given as a k-mer set
+  "$BIN/km_set" -o $sel.kef $sel.txt 2> /dev/null
+  "$BIN/km_select" $sel.kef m.mat > out.txt 2> /dev/null || fail "km_select of a set, $sel"
+  same_file "km_select of a set, $sel" expected.txt out.txt
+  "$BIN/km_select" -v $sel.kef m.mat > out.txt 2> /dev/null || fail "km_select -v of a set, $sel"
+  same_file "km_select -v of a set, $sel" expected_v.txt out.txt
+done
+
+# several matrices, concurrently
+select_bf 0 sel.txt m.mat > expected.txt
+head -5000 m.mat > a.mat
+tail -8000 m.mat > b.mat
+select_bf 0 sel.txt a.mat > expected_a.txt
+select_bf 0 sel.txt b.mat > expected_b.txt
+for plan in merge hash tree; do
+  "$BIN/km_select" -t 2 --plan $plan -s .sel sel.txt a.mat b.mat 2> /dev/null || fail "km_select -t 2 --plan $plan"
+  same_file "km_select -t 2 --plan $plan, 1st matrix" expected_a.txt a.mat.sel
+  same_file "km_select -t 2 --plan $plan, 2nd matrix" expected_b.txt b.mat.sel
+done
+
+# rows without a valid k-mer are skipped with a warning, not the end of input
+awk 'NR == 100 { print "ACGTNACGTACGTACGTACGTACGTACGTAC 1 2 3 4 5"; print "short" } { print }' m.mat > bad.mat
+select_bf 0 sel.txt m.mat > expected.txt
+for plan in merge hash tree; do
+  "$BIN/km_select" --plan $plan sel.txt bad.mat > out.txt 2> err.txt || fail "km_select --plan $plan, invalid rows"
+  same_file "km_select --plan $plan, invalid rows" expected.txt out.txt
+  grep -q "2.rows without a valid k-mer skipped" err.txt || fail "km_select --plan $plan, invalid rows not reported"
+done
+
+done_test
@@ -0,0 +1,29 @@
+# km_set: encoding and decoding of k-mer sets
+. "$TESTS_DIR/common.sh"
+
+for k in 31 21 32 5; do
+  gen_kmers 3000 $k $k > k$k.txt
+  "$BIN/km_set" -k $k k$k.txt 2> /dev/null || fail "km_set -k $k"
+  "$BIN/km_set" -d k$k.txt.kef > d$k.txt 2> /dev/null || fail "km_set -d -k $k"
+  same_file "decoded set, k = $k" k$k.txt d$k.txt
+done
+
+# first column of a matrix, kmtricks order (A<C<T<G)
+gen_kmers 3000 31 7 | tr ACTG abcd | LC_ALL=C sort | tr abcd ACTG > kt.txt
+gen_matrix 4 7 < kt.txt > kt.mat
+"$BIN/km_set" -z -o kt.kef kt.mat 2> /dev/null || fail "km_set -z"
+"$BIN/km_set" -d kt.kef > dkt.txt 2> /dev/null || fail "km_set -d -z"
+same_file "decoded set, kmtricks order" kt.txt dkt.txt
+
+# empty set
+: > empty.txt
+"$BIN/km_set" empty.txt 2> /dev/null || fail "km_set of an empty list"
+"$BIN/km_set" -d empty.txt.kef > dempty.txt 2> /dev/null || fail "km_set -d of an empty set"
+same_file "decoded empty set" empty.txt dempty.txt
+
+# rejected inputs
+LC_ALL=C sort -r k31.txt > unsorted.txt
+expect_status "unsorted input" 1 "$BIN/km_set" unsorted.txt
+expect_status "k > 32" 1 "$BIN/km_set" -k 33 k31.txt
+
+done_test
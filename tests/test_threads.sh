@@ -0,0 +1,51 @@
+# Chunk engine: the output with -t 8 is the output with -t 1, whatever stdout
+# is (regular file, pipe, file opened in append mode, file shared with stderr)
+. "$TESTS_DIR/common.sh"
+
+# about 20 MB: several chunks, several batches of 4 chunks with -t 1
+gen_kmers 250000 31 31 | gen_matrix 20 31 > big.mat
+awk 'NR == 1000 { print "" } { print }' big.mat > blank.mat
+
+tools=("km_basic_filter -a 1 -n 5 -N 5" "km_reverse" "km_fasta")
+for i in 0 1 2; do
+  set -- ${tools[$i]}
+  tool=$1
+  shift
+  "$BIN/$tool" -t 1 "$@" big.mat 2> /dev/null | cat > ref.txt
+  [ -s ref.txt ] || fail "$tool: no output"
+  for t in 1 8; do
+    "$BIN/$tool" -t $t "$@" big.mat > out.txt 2> /dev/null || fail "$tool -t $t"
+    same_file "$tool -t $t to a file" ref.txt out.txt
+    "$BIN/$tool" -t $t "$@" -o out_o.txt big.mat 2> /dev/null || fail "$tool -t $t -o"
+    same_file "$tool -t $t -o" ref.txt out_o.txt
+    "$BIN/$tool" -t $t "$@" big.mat 2> /dev/null | cat > out_pipe.txt
+    same_file "$tool -t $t to a pipe" ref.txt out_pipe.txt
+    echo "previous content" > out_append.txt
+    "$BIN/$tool" -t $t "$@" big.mat >> out_append.txt 2> /dev/null || fail "$tool -t $t >>"
+    { echo "previous content"; cat ref.txt; } > expected.txt
+    same_file "$tool -t $t appended to a file" expected.txt out_append.txt
+    # the messages are on lines of their own, the rows are all there
+    "$BIN/$tool" -t $t "$@" big.mat > out_shared.txt 2>&1 || fail "$tool -t $t > file 2>&1"
+    "$BIN/$tool" -t $t "$@" big.mat 2> err.txt > /dev/null
+    grep -v -F -x -f err.txt out_shared.txt > out.txt
+    same_file "$tool -t $t to a file shared with stderr" ref.txt out.txt
+  done
+done
+
+# progress messages of each batch in a file shared with the output
+"$BIN/km_basic_filter" -t 1 -a 1 -n 5 -N 5 big.mat > ref.txt 2> /dev/null
+"$BIN/km_basic_filter" -t 1 -v -a 1 -n 5 -N 5 big.mat > out_shared.txt 2>&1
+[ "$(grep -c "lines processed" out_shared.txt)" -ge 2 ] || fail "progress messages not in the shared output"
+grep -v -e "^\[info\]" -e "lines processed" out_shared.txt > out.txt
+same_file "km_basic_filter -v to a file shared with stderr" ref.txt out.txt
+
+# a blank line is skipped the same way by every thread count
+"$BIN/km_reverse" -t 1 blank.mat > ref.txt 2> /dev/null
+"$BIN/km_reverse" -t 8 blank.mat > out.txt 2> /dev/null
+same_file "km_reverse -t 8 with a blank line" ref.txt out.txt
+
+# read errors are errors, not the end of the input
+expect_status "km_reverse of a directory" 1 "$BIN/km_reverse" .
+expect_status "km_basic_filter of a directory" 1 "$BIN/km_basic_filter" -t 8 .
+
+done_test